@@ -1,14 +1,17 @@
 #include "color_conversion.h"
 #include <math.h>
+#include <string.h>
 
-#ifdef __AVX2__
+#include "cpu_dispatch.h"
+
+#if CPU_DISPATCH_X86
 #include <immintrin.h>
 #endif
 
 /** ITU-R BT.709 conversion */
 
-#if defined(__AVX512F__)
-inline static void ycbcr_to_bgr_batch(const pixel_t* src, pixel_t* dst, int n)
+#if CPU_DISPATCH_X86
+CPU_TARGET_AVX512 static void ycbcr_to_bgr_batch_avx512(const pixel_t* src, pixel_t* dst, int n)
 {
     int i = 0;
     for(i = 0; i + 16 <= n; i+=16)
@@ -169,8 +172,8 @@ inline static void ycbcr_to_bgr_batch(const pixel_t* src, pixel_t* dst, int n)
         bgr->b = (uint8_t)b;
     }
 }
-#elif defined(__AVX2__)
-inline static void ycbcr_to_bgr_batch(const pixel_t* src, pixel_t* dst, int n)
+
+CPU_TARGET_AVX2 static void ycbcr_to_bgr_batch_avx2(const pixel_t* src, pixel_t* dst, int n)
 {
     int i = 0;
     for(i = 0; i + 8 <= n; i+=8)
@@ -266,8 +269,9 @@ inline static void ycbcr_to_bgr_batch(const pixel_t* src, pixel_t* dst, int n)
         bgr->b = (uint8_t)b;
     }
 }
-#else
-inline static void ycbcr_to_bgr_batch(const pixel_t* src, pixel_t* dst, int n)
+#endif
+
+static void ycbcr_to_bgr_batch_scalar(const pixel_t* src, pixel_t* dst, int n)
 {
     for (int i = 0; i < n; i++)
     {
@@ -287,10 +291,27 @@ inline static void ycbcr_to_bgr_batch(const pixel_t* src, pixel_t* dst, int n)
         bgr->b = (uint8_t)b;
     }
 }
+
+static void ycbcr_to_bgr_batch(const pixel_t* src, pixel_t* dst, int n)
+{
+    switch (cpu_isa_get())
+    {
+#if CPU_DISPATCH_X86
+    case CPU_ISA_AVX512:
+        ycbcr_to_bgr_batch_avx512(src, dst, n);
+        return;
+    case CPU_ISA_AVX2:
+        ycbcr_to_bgr_batch_avx2(src, dst, n);
+        return;
 #endif
+    default:
+        ycbcr_to_bgr_batch_scalar(src, dst, n);
+        return;
+    }
+}
 
-#if defined(__AVX512F__)
-inline static void bgr_to_ycbcr_batch(const pixel_t* src, pixel_t* dst, int n)
+#if CPU_DISPATCH_X86
+CPU_TARGET_AVX512 static void bgr_to_ycbcr_batch_avx512(const pixel_t* src, pixel_t* dst, int n)
 {
     int i = 0;
     for(i = 0; i + 16 <= n; i+=16)
@@ -453,8 +474,8 @@ inline static void bgr_to_ycbcr_batch(const pixel_t* src, pixel_t* dst, int n)
         ycbcr->cr = (int8_t)cr;
     }
 }
-#elif defined(__AVX2__)
-inline static void bgr_to_ycbcr_batch(const pixel_t* src, pixel_t* dst, int n)
+
+CPU_TARGET_AVX2 static void bgr_to_ycbcr_batch_avx2(const pixel_t* src, pixel_t* dst, int n)
 {
     int i = 0;
     for(i = 0; i + 8 <= n; i+=8)
@@ -552,8 +573,9 @@ inline static void bgr_to_ycbcr_batch(const pixel_t* src, pixel_t* dst, int n)
         ycbcr->cr = (int8_t)cr;
     }
 }
-#else
-inline static void bgr_to_ycbcr_batch(const pixel_t* src, pixel_t* dst, int n)
+#endif
+
+static void bgr_to_ycbcr_batch_scalar(const pixel_t* src, pixel_t* dst, int n)
 {
     for (int i = 0; i < n; i++)
     {
@@ -574,7 +596,172 @@ inline static void bgr_to_ycbcr_batch(const pixel_t* src, pixel_t* dst, int n)
         ycbcr->cr = (int8_t)cr;
     }
 }
+
+static void bgr_to_ycbcr_batch(const pixel_t* src, pixel_t* dst, int n)
+{
+    switch (cpu_isa_get())
+    {
+#if CPU_DISPATCH_X86
+    case CPU_ISA_AVX512:
+        bgr_to_ycbcr_batch_avx512(src, dst, n);
+        return;
+    case CPU_ISA_AVX2:
+        bgr_to_ycbcr_batch_avx2(src, dst, n);
+        return;
 #endif
+    default:
+        bgr_to_ycbcr_batch_scalar(src, dst, n);
+        return;
+    }
+}
+
+/**
+ * Same math as the packed kernels, written so that every target vectorizes it:
+ * nearbyintf rounds half to even like the AVX kernels, and the clamps are plain compares.
+ */
+CPU_KERNEL_BODY void planar_bgr_to_ycbcr_body(const uint8_t* restrict b_plane, const uint8_t* restrict g_plane, const uint8_t* restrict r_plane,
+    uint8_t* restrict y_plane, uint8_t* restrict cb_plane, uint8_t* restrict cr_plane, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        float b = b_plane[i];
+        float g = g_plane[i];
+        float r = r_plane[i];
+        float y = nearbyintf(0.2126f * r + 0.7152f * g + 0.0722f * b);
+        y = y < 255.0f ? y : 255.0f;
+        y = y > 0.0f ? y : 0.0f;
+        float cb = nearbyintf(-0.1146f * r - 0.3854f * g + 0.5000f * b);
+        cb = cb < 127.0f ? cb : 127.0f;
+        cb = cb > -128.0f ? cb : -128.0f;
+        float cr = nearbyintf(0.5000f * r - 0.4542f * g - 0.0458f * b);
+        cr = cr < 127.0f ? cr : 127.0f;
+        cr = cr > -128.0f ? cr : -128.0f;
+        y_plane[i] = (uint8_t)(int)y;
+        cb_plane[i] = (uint8_t)(int8_t)(int)cb;
+        cr_plane[i] = (uint8_t)(int8_t)(int)cr;
+    }
+}
+
+CPU_KERNEL_BODY void planar_ycbcr_to_bgr_body(const uint8_t* restrict y_plane, const uint8_t* restrict cb_plane, const uint8_t* restrict cr_plane,
+    uint8_t* restrict b_plane, uint8_t* restrict g_plane, uint8_t* restrict r_plane, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        float y = y_plane[i];
+        float cb = (int8_t)cb_plane[i];
+        float cr = (int8_t)cr_plane[i];
+        float r = nearbyintf(y + 1.5748f * cr);
+        r = r < 255.0f ? r : 255.0f;
+        r = r > 0.0f ? r : 0.0f;
+        float g = nearbyintf(y - 0.1873f * cb - 0.4681f * cr);
+        g = g < 255.0f ? g : 255.0f;
+        g = g > 0.0f ? g : 0.0f;
+        float b = nearbyintf(y + 1.8556f * cb);
+        b = b < 255.0f ? b : 255.0f;
+        b = b > 0.0f ? b : 0.0f;
+        b_plane[i] = (uint8_t)(int)b;
+        g_plane[i] = (uint8_t)(int)g;
+        r_plane[i] = (uint8_t)(int)r;
+    }
+}
+
+/**
+ * In place conversion aliases src and dst plane by plane, which the restrict bodies do not allow.
+ * So the planes go through a small stack buffer, one cache friendly chunk at a time.
+ */
+#define PLANAR_CHUNK 1024
+
+typedef void (*planar_kernel_t)(const uint8_t*, const uint8_t*, const uint8_t*, uint8_t*, uint8_t*, uint8_t*, size_t);
+
+static void planar_bgr_to_ycbcr_scalar(const uint8_t* p0, const uint8_t* p1, const uint8_t* p2, uint8_t* q0, uint8_t* q1, uint8_t* q2, size_t n)
+{
+    planar_bgr_to_ycbcr_body(p0, p1, p2, q0, q1, q2, n);
+}
+
+static void planar_ycbcr_to_bgr_scalar(const uint8_t* p0, const uint8_t* p1, const uint8_t* p2, uint8_t* q0, uint8_t* q1, uint8_t* q2, size_t n)
+{
+    planar_ycbcr_to_bgr_body(p0, p1, p2, q0, q1, q2, n);
+}
+
+#if CPU_DISPATCH_X86
+CPU_TARGET_AVX2 static void planar_bgr_to_ycbcr_avx2(const uint8_t* p0, const uint8_t* p1, const uint8_t* p2, uint8_t* q0, uint8_t* q1, uint8_t* q2, size_t n)
+{
+    planar_bgr_to_ycbcr_body(p0, p1, p2, q0, q1, q2, n);
+}
+
+CPU_TARGET_AVX2 static void planar_ycbcr_to_bgr_avx2(const uint8_t* p0, const uint8_t* p1, const uint8_t* p2, uint8_t* q0, uint8_t* q1, uint8_t* q2, size_t n)
+{
+    planar_ycbcr_to_bgr_body(p0, p1, p2, q0, q1, q2, n);
+}
+
+CPU_TARGET_AVX512 static void planar_bgr_to_ycbcr_avx512(const uint8_t* p0, const uint8_t* p1, const uint8_t* p2, uint8_t* q0, uint8_t* q1, uint8_t* q2, size_t n)
+{
+    planar_bgr_to_ycbcr_body(p0, p1, p2, q0, q1, q2, n);
+}
+
+CPU_TARGET_AVX512 static void planar_ycbcr_to_bgr_avx512(const uint8_t* p0, const uint8_t* p1, const uint8_t* p2, uint8_t* q0, uint8_t* q1, uint8_t* q2, size_t n)
+{
+    planar_ycbcr_to_bgr_body(p0, p1, p2, q0, q1, q2, n);
+}
+#endif
+
+static void planar_convert(const planar_image_t* src, planar_image_t* dst, planar_kernel_t kernel)
+{
+    size_t n = src->stride * src->height;
+    if (src != dst)
+    {
+        kernel(src->planes[0], src->planes[1], src->planes[2], dst->planes[0], dst->planes[1], dst->planes[2], n);
+        return;
+    }
+    /** In place, the kernels take restrict planes */
+    _Alignas(PLANAR_IMAGE_ALIGN) uint8_t chunk[3][PLANAR_CHUNK];
+    for (size_t i = 0; i < n; i += PLANAR_CHUNK)
+    {
+        size_t count = n - i < PLANAR_CHUNK ? n - i : PLANAR_CHUNK;
+        kernel(src->planes[0] + i, src->planes[1] + i, src->planes[2] + i, chunk[0], chunk[1], chunk[2], count);
+        memcpy(dst->planes[0] + i, chunk[0], count);
+        memcpy(dst->planes[1] + i, chunk[1], count);
+        memcpy(dst->planes[2] + i, chunk[2], count);
+    }
+}
+
+void planar_bgr_to_ycbcr(const planar_image_t* bgr, planar_image_t* ycbcr)
+{
+    switch (cpu_isa_get())
+    {
+#if CPU_DISPATCH_X86
+    case CPU_ISA_AVX512:
+        planar_convert(bgr, ycbcr, planar_bgr_to_ycbcr_avx512);
+        break;
+    case CPU_ISA_AVX2:
+        planar_convert(bgr, ycbcr, planar_bgr_to_ycbcr_avx2);
+        break;
+#endif
+    default:
+        planar_convert(bgr, ycbcr, planar_bgr_to_ycbcr_scalar);
+        break;
+    }
+    ycbcr->color_space = COLOR_SPACE_YCBCR;
+}
+
+void planar_ycbcr_to_bgr(const planar_image_t* ycbcr, planar_image_t* bgr)
+{
+    switch (cpu_isa_get())
+    {
+#if CPU_DISPATCH_X86
+    case CPU_ISA_AVX512:
+        planar_convert(ycbcr, bgr, planar_ycbcr_to_bgr_avx512);
+        break;
+    case CPU_ISA_AVX2:
+        planar_convert(ycbcr, bgr, planar_ycbcr_to_bgr_avx2);
+        break;
+#endif
+    default:
+        planar_convert(ycbcr, bgr, planar_ycbcr_to_bgr_scalar);
+        break;
+    }
+    bgr->color_space = COLOR_SPACE_BGR;
+}
 
 void bgr_image_to_ycbcr(const image_t* bgr, image_t* ycbcr)
 {
@@ -9,6 +9,13 @@ extern "C" {
 void bgr_image_to_ycbcr(const image_t* bgr, image_t* ycbcr);
 void ycbcr_image_to_bgr(const image_t* ycbcr, image_t* bgr);
 
+/**
+ * Planar versions. Every plane is a flat array, so these are straight vector loops without shuffles.
+ * The padding is converted too. src and dst may be the same image.
+ */
+void planar_bgr_to_ycbcr(const planar_image_t* bgr, planar_image_t* ycbcr);
+void planar_ycbcr_to_bgr(const planar_image_t* ycbcr, planar_image_t* bgr);
+
 void palette_bgr_to_ycbcr(const color_palette_image_t* src, color_palette_image_t* dst);
 void palette_ycbcr_to_bgr(const color_palette_image_t* src, color_palette_image_t* dst);
 
@@ -2,6 +2,8 @@
 
 #define FRAME_COMPRESSION_NONE 0
 #define FRAME_COMPRESSION_K_MEANS 1
+/** Only the changed tiles of each frame, as raw rgb565 windows */
+#define FRAME_COMPRESSION_TILE_DELTA 2
 
 #ifndef FRAME_COMPRESSION
 #define FRAME_COMPRESSION FRAME_COMPRESSION_NONE
@@ -0,0 +1,91 @@
+#include "cpu_dispatch.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+
+/** -1 until the first query */
+static _Atomic int selected_isa = -1;
+
+static const char* isa_names[CPU_ISA_COUNT] = {
+    [CPU_ISA_SCALAR] = "scalar",
+    [CPU_ISA_AVX2] = "avx2",
+    [CPU_ISA_AVX512] = "avx512",
+};
+
+cpu_isa_t cpu_isa_detect(void)
+{
+#if CPU_DISPATCH_X86
+    /** Also checks that the OS saves the wider registers */
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")
+        && __builtin_cpu_supports("avx512bw")
+        && __builtin_cpu_supports("avx512vbmi")
+        && __builtin_cpu_supports("bmi2"))
+    {
+        return CPU_ISA_AVX512;
+    }
+    if (__builtin_cpu_supports("avx2"))
+    {
+        return CPU_ISA_AVX2;
+    }
+#endif
+    return CPU_ISA_SCALAR;
+}
+
+cpu_isa_t cpu_isa_get(void)
+{
+    int isa = atomic_load_explicit(&selected_isa, memory_order_relaxed);
+    if (isa >= 0)
+    {
+        return (cpu_isa_t)isa;
+    }
+    isa = cpu_isa_detect();
+    const char* forced = getenv(CPU_ISA_ENV);
+    if (forced)
+    {
+        int forced_isa = cpu_isa_from_name(forced);
+        if (forced_isa >= 0 && forced_isa < isa)
+        {
+            isa = forced_isa;
+        }
+    }
+    /** Racing threads all come to the same answer */
+    atomic_store_explicit(&selected_isa, isa, memory_order_relaxed);
+    return (cpu_isa_t)isa;
+}
+
+cpu_isa_t cpu_isa_force(cpu_isa_t isa)
+{
+    cpu_isa_t detected = cpu_isa_detect();
+    if ((int)isa < 0 || isa > detected)
+    {
+        isa = detected;
+    }
+    atomic_store_explicit(&selected_isa, isa, memory_order_relaxed);
+    return isa;
+}
+
+const char* cpu_isa_name(cpu_isa_t isa)
+{
+    if ((int)isa < 0 || isa >= CPU_ISA_COUNT)
+    {
+        return "unknown";
+    }
+    return isa_names[isa];
+}
+
+int cpu_isa_from_name(const char* name)
+{
+    if (!name)
+    {
+        return -1;
+    }
+    for (int i = 0; i < CPU_ISA_COUNT; i++)
+    {
+        if (strcmp(name, isa_names[i]) == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
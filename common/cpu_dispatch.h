@@ -0,0 +1,52 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Runtime selection of the SIMD kernels.
+ * Every kernel is built for each ISA level with a target attribute, so the binary does not need -march.
+ * The level is detected once with cpuid. Set USB_SCREEN_ISA=scalar|avx2|avx512 to cap it.
+ */
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CPU_DISPATCH_X86 1
+#else
+#define CPU_DISPATCH_X86 0
+#endif
+
+#if CPU_DISPATCH_X86
+#define CPU_TARGET_AVX2 __attribute__((target("avx2")))
+#define CPU_TARGET_AVX512 __attribute__((target("avx2,bmi2,avx512f,avx512bw,avx512vbmi")))
+#endif
+/** For a generic kernel body that gets compiled once per target */
+#define CPU_KERNEL_BODY static inline __attribute__((always_inline))
+
+#define CPU_ISA_ENV "USB_SCREEN_ISA"
+
+typedef enum
+{
+    CPU_ISA_SCALAR,
+    CPU_ISA_AVX2,
+    /** AVX512 F, BW and VBMI, and BMI2 which all of those CPUs have */
+    CPU_ISA_AVX512,
+    CPU_ISA_COUNT,
+} cpu_isa_t;
+
+/** The best level this CPU and OS support */
+cpu_isa_t cpu_isa_detect(void);
+/** The level the kernels use */
+cpu_isa_t cpu_isa_get(void);
+/**
+ * Overrides the level, e.g. for benchmarks. Levels the CPU lacks are clamped to what it has.
+ * Returns the level in effect.
+ */
+cpu_isa_t cpu_isa_force(cpu_isa_t isa);
+const char* cpu_isa_name(cpu_isa_t isa);
+/** Returns -1 for an unknown name */
+int cpu_isa_from_name(const char* name);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,176 @@
+#include "frame_hash.h"
+#include <string.h>
+#include "cpu_dispatch.h"
+
+#if CPU_DISPATCH_X86
+#include <immintrin.h>
+#endif
+
+#define HASH_LANES 8
+#define HASH_STRIPE_SIZE (HASH_LANES * sizeof(uint64_t))
+#define HASH_STRIPES_PER_BLOCK 16
+#define HASH_PRIME32 0x9E3779B1u
+#define HASH_PRIME64 0x9E3779B185EBCA87ull
+
+/** Per lane keys. Odd halves keep the lane multiplies from collapsing. */
+static const uint64_t hash_keys[HASH_LANES] = {
+    0xBE4BA423396CFEB8ull, 0x1CAD21F72C81017Cull, 0xDB979083E96DD4DEull, 0x1F67B3B7A4A44072ull,
+    0x78E5C0CC4EE679CBull, 0x2172FFCC7DD05A82ull, 0x8E2443F7744608B8ull, 0x4C263A81E69035E0ull,
+};
+
+static void accumulate(uint64_t* acc, const uint8_t* data, size_t n_stripes);
+
+uint64_t frame_hash(const void* data, size_t size, uint64_t seed)
+{
+    uint64_t acc[HASH_LANES];
+    for (int i = 0; i < HASH_LANES; i++)
+    {
+        acc[i] = hash_keys[i] + seed;
+    }
+    const uint8_t* bytes = (const uint8_t*)data;
+    size_t n_stripes = size / HASH_STRIPE_SIZE;
+    accumulate(acc, bytes, n_stripes);
+    /** The last partial stripe is zero padded. The size is mixed in below, so padding is not ambiguous. */
+    size_t tail = size - n_stripes * HASH_STRIPE_SIZE;
+    if (tail != 0)
+    {
+        uint8_t last[HASH_STRIPE_SIZE] = { 0 };
+        memcpy(last, bytes + n_stripes * HASH_STRIPE_SIZE, tail);
+        accumulate(acc, last, 1);
+    }
+
+    uint64_t hash = size * HASH_PRIME64 ^ seed;
+    for (int i = 0; i < HASH_LANES; i += 2)
+    {
+        __uint128_t product = (__uint128_t)(acc[i] ^ hash_keys[HASH_LANES - 1 - i]) * (acc[i + 1] ^ hash_keys[HASH_LANES - 2 - i]);
+        hash += (uint64_t)product ^ (uint64_t)(product >> 64);
+    }
+    hash ^= hash >> 37;
+    hash *= 0x165667919E3779F9ull;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+/** Every lane also takes its neighbour's data, so a product of 0 loses nothing */
+static inline void accumulate_stripes(uint64_t* restrict acc, const uint8_t* restrict data, size_t n_stripes)
+{
+    for (size_t s = 0; s < n_stripes; s++)
+    {
+        uint64_t values[HASH_LANES];
+        memcpy(values, data + s * HASH_STRIPE_SIZE, sizeof(values));
+        for (int i = 0; i < HASH_LANES; i++)
+        {
+            uint64_t keyed = values[i] ^ hash_keys[i];
+            acc[i ^ 1] += values[i];
+            acc[i] += (keyed & 0xFFFFFFFFu) * (keyed >> 32);
+        }
+    }
+}
+
+static inline void scramble(uint64_t* acc)
+{
+    for (int i = 0; i < HASH_LANES; i++)
+    {
+        acc[i] ^= acc[i] >> 47;
+        acc[i] ^= hash_keys[i];
+        acc[i] *= HASH_PRIME32;
+    }
+}
+
+/** Scrambles after every full block, so no lane carries unmixed sums for long */
+static void accumulate_scalar(uint64_t* acc, const uint8_t* data, size_t n_stripes)
+{
+    uint64_t lanes[HASH_LANES];
+    memcpy(lanes, acc, sizeof(lanes));
+    for (; n_stripes >= HASH_STRIPES_PER_BLOCK; n_stripes -= HASH_STRIPES_PER_BLOCK)
+    {
+        accumulate_stripes(lanes, data, HASH_STRIPES_PER_BLOCK);
+        scramble(lanes);
+        data += HASH_STRIPES_PER_BLOCK * HASH_STRIPE_SIZE;
+    }
+    accumulate_stripes(lanes, data, n_stripes);
+    memcpy(acc, lanes, sizeof(lanes));
+}
+
+#if CPU_DISPATCH_X86
+/**
+ * The lanes as two vectors of 4. Neighbour lanes are swapped within each vector,
+ * and 64 bit times 32 bit multiplies are done as two 32x32 bit ones.
+ */
+CPU_TARGET_AVX2 static void accumulate_avx2(uint64_t* acc, const uint8_t* data, size_t n_stripes)
+{
+    __m256i lanes[2], keys[2];
+    for (int v = 0; v < 2; v++)
+    {
+        lanes[v] = _mm256_loadu_si256((const __m256i*)acc + v);
+        keys[v] = _mm256_loadu_si256((const __m256i*)hash_keys + v);
+    }
+    const __m256i prime = _mm256_set1_epi32(HASH_PRIME32);
+    for (size_t s = 0; s < n_stripes; s++)
+    {
+        for (int v = 0; v < 2; v++)
+        {
+            __m256i values = _mm256_loadu_si256((const __m256i*)(data + s * HASH_STRIPE_SIZE) + v);
+            __m256i keyed = _mm256_xor_si256(values, keys[v]);
+            __m256i product = _mm256_mul_epu32(keyed, _mm256_srli_epi64(keyed, 32));
+            lanes[v] = _mm256_add_epi64(lanes[v], _mm256_shuffle_epi32(values, _MM_SHUFFLE(1, 0, 3, 2)));
+            lanes[v] = _mm256_add_epi64(lanes[v], product);
+        }
+        if ((s + 1) % HASH_STRIPES_PER_BLOCK == 0)
+        {
+            for (int v = 0; v < 2; v++)
+            {
+                __m256i mixed = _mm256_xor_si256(_mm256_xor_si256(lanes[v], _mm256_srli_epi64(lanes[v], 47)), keys[v]);
+                __m256i high = _mm256_slli_epi64(_mm256_mul_epu32(_mm256_srli_epi64(mixed, 32), prime), 32);
+                lanes[v] = _mm256_add_epi64(_mm256_mul_epu32(mixed, prime), high);
+            }
+        }
+    }
+    for (int v = 0; v < 2; v++)
+    {
+        _mm256_storeu_si256((__m256i*)acc + v, lanes[v]);
+    }
+}
+
+/** All 8 lanes in one vector, otherwise the same as AVX2 */
+CPU_TARGET_AVX512 static void accumulate_avx512(uint64_t* acc, const uint8_t* data, size_t n_stripes)
+{
+    __m512i lanes = _mm512_loadu_si512(acc);
+    const __m512i keys = _mm512_loadu_si512(hash_keys);
+    const __m512i prime = _mm512_set1_epi32(HASH_PRIME32);
+    for (size_t s = 0; s < n_stripes; s++)
+    {
+        __m512i values = _mm512_loadu_si512(data + s * HASH_STRIPE_SIZE);
+        __m512i keyed = _mm512_xor_si512(values, keys);
+        __m512i product = _mm512_mul_epu32(keyed, _mm512_srli_epi64(keyed, 32));
+        lanes = _mm512_add_epi64(lanes, _mm512_shuffle_epi32(values, _MM_PERM_BADC));
+        lanes = _mm512_add_epi64(lanes, product);
+        if ((s + 1) % HASH_STRIPES_PER_BLOCK == 0)
+        {
+            /** acc ^ (acc >> 47) ^ key */
+            __m512i mixed = _mm512_ternarylogic_epi64(lanes, _mm512_srli_epi64(lanes, 47), keys, 0x96);
+            __m512i high = _mm512_slli_epi64(_mm512_mul_epu32(_mm512_srli_epi64(mixed, 32), prime), 32);
+            lanes = _mm512_add_epi64(_mm512_mul_epu32(mixed, prime), high);
+        }
+    }
+    _mm512_storeu_si512(acc, lanes);
+}
+#endif
+
+static void accumulate(uint64_t* acc, const uint8_t* data, size_t n_stripes)
+{
+    switch (cpu_isa_get())
+    {
+#if CPU_DISPATCH_X86
+    case CPU_ISA_AVX512:
+        accumulate_avx512(acc, data, n_stripes);
+        return;
+    case CPU_ISA_AVX2:
+        accumulate_avx2(acc, data, n_stripes);
+        return;
+#endif
+    default:
+        accumulate_scalar(acc, data, n_stripes);
+        return;
+    }
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * Fast non-cryptographic 64 bit hash for telling frames apart.
+ * Same construction as the long input path of XXH3: 8 lanes of 32x32 bit multiplies over
+ * 64 byte stripes, scrambled every 1 KiB, folded with 128 bit multiplies. The values differ
+ * from XXH3, only equality matters.
+ * The result is the same at every ISA level.
+ */
+uint64_t frame_hash(const void* data, size_t size, uint64_t seed);
+
+#ifdef __cplusplus
+}
+#endif
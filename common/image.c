@@ -1,6 +1,37 @@
 #include "image.h"
 #include <stdlib.h>
 #include <string.h>
+#include <stdbool.h>
+#include "cpu_dispatch.h"
+
+#if CPU_DISPATCH_X86
+#include <immintrin.h>
+#endif
+
+/**
+ * Indexes are packed LSB first, the way lcd_draw_image reads them.
+ * 8 pixels of b bits are exactly b bytes, so whole groups of 8 are packed without crossing
+ * into a neighbour's byte. Each width gets its own loop with constant shifts.
+ */
+#define PACK_GROUP_PIXELS 8
+/** Pixels per block of the generic RGB565 loop, a multiple of the 4 pixel dither period */
+#define RGB565_BLOCK_PIXELS 64
+
+static int max_index(const uint8_t* indexes, size_t n);
+static void pack_groups(const uint8_t* indexes, size_t n_groups, uint8_t* dst, int bits);
+static void pack_bits(const uint8_t* indexes, size_t n, uint8_t* dst, int bits);
+static void rgb565_row(const uint8_t* src, uint16_t* dst, size_t n, const uint8_t* dither, bool big_endian);
+
+/**
+ * 4x4 Bayer matrix halved: 0 to 7, half a step of the 5 bit channels on average.
+ * Green has 6 bits and takes it halved again.
+ */
+static const uint8_t rgb565_dither[4][4] = {
+    { 0, 4, 1, 5 },
+    { 6, 2, 7, 3 },
+    { 1, 5, 0, 4 },
+    { 7, 3, 6, 2 },
+};
 
 image_t* image_new(size_t width, size_t height)
 {
@@ -33,8 +64,102 @@ void image_free(image_t* image)
     }
 }
 
+planar_image_t* planar_image_new(size_t width, size_t height)
+{
+    planar_image_t* image = (planar_image_t*)malloc(sizeof(planar_image_t));
+    if (!image)
+    {
+        return NULL;
+    }
+    image->width = width;
+    image->height = height;
+    image->stride = (width + PLANAR_IMAGE_ALIGN - 1) & ~(size_t)(PLANAR_IMAGE_ALIGN - 1);
+    image->color_space = COLOR_SPACE_BGR;
+    size_t plane_size = image->stride * height;
+    /** All three planes in one block, each one starts on a cache line since the stride does */
+    uint8_t* block = (uint8_t*)aligned_alloc(PLANAR_IMAGE_ALIGN, 3 * plane_size > 0 ? 3 * plane_size : PLANAR_IMAGE_ALIGN);
+    if (!block)
+    {
+        free(image);
+        return NULL;
+    }
+    memset(block, 0, 3 * plane_size);
+    for (int i = 0; i < 3; i++)
+    {
+        image->planes[i] = block + i * plane_size;
+    }
+    return image;
+}
+
+void planar_image_free(planar_image_t* image)
+{
+    if (image)
+    {
+        free(image->planes[0]);
+        free(image);
+    }
+}
+
+int image_to_planar(const image_t* src, planar_image_t* dst)
+{
+    if (!src || !dst)
+    {
+        return -1;
+    }
+    if (src->width != dst->width || src->height != dst->height)
+    {
+        return -1;
+    }
+    for (size_t y = 0; y < src->height; y++)
+    {
+        const uint8_t* pixel = (const uint8_t*)&src->pixels[y * src->width];
+        uint8_t* plane_0 = dst->planes[0] + y * dst->stride;
+        uint8_t* plane_1 = dst->planes[1] + y * dst->stride;
+        uint8_t* plane_2 = dst->planes[2] + y * dst->stride;
+        for (size_t x = 0; x < src->width; x++)
+        {
+            plane_0[x] = pixel[3 * x];
+            plane_1[x] = pixel[3 * x + 1];
+            plane_2[x] = pixel[3 * x + 2];
+        }
+    }
+    dst->color_space = src->color_space;
+    return 0;
+}
+
+int planar_to_image(const planar_image_t* src, image_t* dst)
+{
+    if (!src || !dst)
+    {
+        return -1;
+    }
+    if (src->width != dst->width || src->height != dst->height)
+    {
+        return -1;
+    }
+    for (size_t y = 0; y < src->height; y++)
+    {
+        uint8_t* pixel = (uint8_t*)&dst->pixels[y * dst->width];
+        const uint8_t* plane_0 = src->planes[0] + y * src->stride;
+        const uint8_t* plane_1 = src->planes[1] + y * src->stride;
+        const uint8_t* plane_2 = src->planes[2] + y * src->stride;
+        for (size_t x = 0; x < src->width; x++)
+        {
+            pixel[3 * x] = plane_0[x];
+            pixel[3 * x + 1] = plane_1[x];
+            pixel[3 * x + 2] = plane_2[x];
+        }
+    }
+    dst->color_space = src->color_space;
+    return 0;
+}
+
 color_palette_image_t* color_palette_image_new(int k, int width, int height)
 {
+    if (k < 1 || k > COLOR_PALETTE_MAX_K)
+    {
+        return NULL;
+    }
     color_palette_image_t* image = malloc(sizeof(color_palette_image_t));
     if (!image)
     {
@@ -50,7 +175,7 @@ color_palette_image_t* color_palette_image_new(int k, int width, int height)
         free(image);
         return NULL;
     }
-    image->pixel_indexs = malloc(width * height * sizeof(uint32_t));
+    image->pixel_indexs = malloc(width * height * sizeof(uint8_t));
     if (!image->pixel_indexs)
     {
         free(image->color_palettes);
@@ -82,15 +207,54 @@ int paint_color_palette_image(const color_palette_image_t* src, image_t* dst)
     {
         return -1;
     }
-    for (size_t i = 0; i < dst->width * dst->height; i++)
+    size_t n_pixels = dst->width * dst->height;
+    if (n_pixels > 0 && max_index(src->pixel_indexs, n_pixels) >= src->k)
+    {
+        return -1;
+    }
+    for (size_t i = 0; i < n_pixels; i++)
+    {
+        dst->pixels[i].ycbcr = src->color_palettes[src->pixel_indexs[i]].ycbcr;
+    }
+    return 0;
+}
+
+int paint_color_palette_planar(const color_palette_image_t* src, planar_image_t* dst)
+{
+    if (!src || !dst)
     {
-        int index = src->pixel_indexs[i];
-        if (index < 0 || index >= src->k)
+        return -1;
+    }
+    if (src->height != dst->height || src->width != dst->width)
+    {
+        return -1;
+    }
+    if (src->width * src->height > 0 && max_index(src->pixel_indexs, src->width * src->height) >= src->k)
+    {
+        return -1;
+    }
+    /** One table per plane, so every plane is a plain lookup */
+    uint8_t palettes[3][COLOR_PALETTE_MAX_K];
+    for (int i = 0; i < src->k; i++)
+    {
+        const uint8_t* color = (const uint8_t*)&src->color_palettes[i];
+        palettes[0][i] = color[0];
+        palettes[1][i] = color[1];
+        palettes[2][i] = color[2];
+    }
+    for (size_t y = 0; y < dst->height; y++)
+    {
+        const uint8_t* indexes = &src->pixel_indexs[y * dst->width];
+        for (int c = 0; c < 3; c++)
         {
-            return -1;
+            uint8_t* plane = dst->planes[c] + y * dst->stride;
+            for (size_t x = 0; x < dst->width; x++)
+            {
+                plane[x] = palettes[c][indexes[x]];
+            }
         }
-        dst->pixels[i].ycbcr = src->color_palettes[index].ycbcr;
     }
+    dst->color_space = src->color_space;
     return 0;
 }
 
@@ -142,7 +306,11 @@ int pack_color_palette_image(const color_palette_image_t* src, packed_color_pale
     {
         return -1;
     }
-    memset(dst->data, 0, dst->size);
+    size_t n_pixels = src->width * src->height;
+    if (n_pixels > 0 && max_index(src->pixel_indexs, n_pixels) >= src->k)
+    {
+        return -1;
+    }
     for (int i = 0; i < src->k; i++)
     {
         uint16_t rgb565 = ((int)src->color_palettes[i].bgr.b >> 3)
@@ -151,20 +319,162 @@ int pack_color_palette_image(const color_palette_image_t* src, packed_color_pale
         memcpy(dst->data + i * 2, &rgb565, 2);
     }
     uint8_t* pos = dst->data + src->k * 2;
-    uint8_t bit_pos = 0;
     int bits_per_pixel = 0;
     for (int k = src->k - 1; k != 0; k >>= 1)
     {
         bits_per_pixel++;
     }
-    for (size_t i = 0; i < src->width * src->height; i++)
+    if (bits_per_pixel == 0)
     {
-        int index = src->pixel_indexs[i];
-        if (index < 0 || index >= src->k)
+        return 0;
+    }
+    size_t n_groups = n_pixels / PACK_GROUP_PIXELS;
+    pack_groups(src->pixel_indexs, n_groups, pos, bits_per_pixel);
+    /** The rest, bit by bit */
+    pos += n_groups * bits_per_pixel;
+    pack_bits(src->pixel_indexs + n_groups * PACK_GROUP_PIXELS, n_pixels - n_groups * PACK_GROUP_PIXELS, pos, bits_per_pixel);
+    return 0;
+}
+
+CPU_KERNEL_BODY int max_index_body(const uint8_t* indexes, size_t n)
+{
+    uint8_t max = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        max = indexes[i] > max ? indexes[i] : max;
+    }
+    return max;
+}
+
+/** bits is a constant at every call, so the shifts and the store size are too */
+CPU_KERNEL_BODY void pack_groups_body(const uint8_t* restrict indexes, size_t n_groups, uint8_t* restrict dst, int bits)
+{
+    for (size_t g = 0; g < n_groups; g++)
+    {
+        const uint8_t* group = indexes + g * PACK_GROUP_PIXELS;
+        uint64_t packed = 0;
+        for (int i = 0; i < PACK_GROUP_PIXELS; i++)
         {
-            return -1;
+            packed |= (uint64_t)group[i] << (i * bits);
         }
-        int remaining_bits = bits_per_pixel;
+        /** Little endian, the first pixel lands in the low bits of the first byte */
+        memcpy(dst + g * bits, &packed, bits);
+    }
+}
+
+CPU_KERNEL_BODY void pack_groups_width(const uint8_t* indexes, size_t n_groups, uint8_t* dst, int bits)
+{
+    switch (bits)
+    {
+    case 1: pack_groups_body(indexes, n_groups, dst, 1); break;
+    case 2: pack_groups_body(indexes, n_groups, dst, 2); break;
+    case 3: pack_groups_body(indexes, n_groups, dst, 3); break;
+    case 4: pack_groups_body(indexes, n_groups, dst, 4); break;
+    case 5: pack_groups_body(indexes, n_groups, dst, 5); break;
+    case 6: pack_groups_body(indexes, n_groups, dst, 6); break;
+    case 7: pack_groups_body(indexes, n_groups, dst, 7); break;
+    default: pack_groups_body(indexes, n_groups, dst, 8); break;
+    }
+}
+
+static int max_index_scalar(const uint8_t* indexes, size_t n)
+{
+    return max_index_body(indexes, n);
+}
+
+static void pack_groups_scalar(const uint8_t* indexes, size_t n_groups, uint8_t* dst, int bits)
+{
+    pack_groups_width(indexes, n_groups, dst, bits);
+}
+
+#if CPU_DISPATCH_X86
+CPU_TARGET_AVX2 static int max_index_avx2(const uint8_t* indexes, size_t n)
+{
+    return max_index_body(indexes, n);
+}
+
+CPU_TARGET_AVX2 static void pack_groups_avx2(const uint8_t* indexes, size_t n_groups, uint8_t* dst, int bits)
+{
+    pack_groups_width(indexes, n_groups, dst, bits);
+}
+
+CPU_TARGET_AVX512 static int max_index_avx512(const uint8_t* indexes, size_t n)
+{
+    return max_index_body(indexes, n);
+}
+
+/** A group is 8 index bytes, PEXT drops the unused high bits of each byte in one go */
+__attribute__((always_inline)) CPU_TARGET_AVX512 static inline void pack_groups_pext_body(const uint8_t* restrict indexes, size_t n_groups, uint8_t* restrict dst, int bits)
+{
+    const uint64_t mask = 0x0101010101010101ull * ((1u << bits) - 1);
+    for (size_t g = 0; g < n_groups; g++)
+    {
+        uint64_t group;
+        memcpy(&group, indexes + g * PACK_GROUP_PIXELS, sizeof(group));
+        group = _pext_u64(group, mask);
+        memcpy(dst + g * bits, &group, bits);
+    }
+}
+
+CPU_TARGET_AVX512 static void pack_groups_avx512(const uint8_t* indexes, size_t n_groups, uint8_t* dst, int bits)
+{
+    switch (bits)
+    {
+    case 1: pack_groups_pext_body(indexes, n_groups, dst, 1); break;
+    case 2: pack_groups_pext_body(indexes, n_groups, dst, 2); break;
+    case 3: pack_groups_pext_body(indexes, n_groups, dst, 3); break;
+    case 4: pack_groups_pext_body(indexes, n_groups, dst, 4); break;
+    case 5: pack_groups_pext_body(indexes, n_groups, dst, 5); break;
+    case 6: pack_groups_pext_body(indexes, n_groups, dst, 6); break;
+    case 7: pack_groups_pext_body(indexes, n_groups, dst, 7); break;
+    default: pack_groups_body(indexes, n_groups, dst, 8); break;
+    }
+}
+#endif
+
+static int max_index(const uint8_t* indexes, size_t n)
+{
+    switch (cpu_isa_get())
+    {
+#if CPU_DISPATCH_X86
+    case CPU_ISA_AVX512:
+        return max_index_avx512(indexes, n);
+    case CPU_ISA_AVX2:
+        return max_index_avx2(indexes, n);
+#endif
+    default:
+        return max_index_scalar(indexes, n);
+    }
+}
+
+static void pack_groups(const uint8_t* indexes, size_t n_groups, uint8_t* dst, int bits)
+{
+    switch (cpu_isa_get())
+    {
+#if CPU_DISPATCH_X86
+    case CPU_ISA_AVX512:
+        pack_groups_avx512(indexes, n_groups, dst, bits);
+        return;
+    case CPU_ISA_AVX2:
+        pack_groups_avx2(indexes, n_groups, dst, bits);
+        return;
+#endif
+    default:
+        pack_groups_scalar(indexes, n_groups, dst, bits);
+        return;
+    }
+}
+
+/** Any width, one chunk per byte boundary. Only the bytes it writes to are cleared. */
+static void pack_bits(const uint8_t* indexes, size_t n, uint8_t* dst, int bits)
+{
+    memset(dst, 0, (n * bits + 7) / 8);
+    uint8_t* pos = dst;
+    uint8_t bit_pos = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        uint32_t index = indexes[i];
+        int remaining_bits = bits;
         while (remaining_bits > 0)
         {
             int bits_to_write = remaining_bits < 8 - bit_pos ? remaining_bits : 8 - bit_pos;
@@ -179,7 +489,6 @@ int pack_color_palette_image(const color_palette_image_t* src, packed_color_pale
             }
         }
     }
-    return 0;
 }
 
 rgb565_image_t* rgb565_image_new(size_t size)
@@ -210,6 +519,11 @@ void rgb565_image_free(rgb565_image_t* image)
 }
 
 int bgr_image_to_rgb565(const image_t* src, rgb565_image_t* dst)
+{
+    return bgr_image_to_rgb565_ex(src, dst, 0);
+}
+
+int bgr_image_to_rgb565_ex(const image_t* src, rgb565_image_t* dst, unsigned flags)
 {
     if (!src || !dst)
     {
@@ -219,11 +533,167 @@ int bgr_image_to_rgb565(const image_t* src, rgb565_image_t* dst)
     {
         return -1;
     }
-    for (size_t i = 0; i < src->width * src->height; i++)
+    bool big_endian = flags & RGB565_BIG_ENDIAN;
+    for (size_t y = 0; y < src->height; y++)
     {
-        dst->pixels[i].r = src->pixels[i].bgr.r >> 3;
-        dst->pixels[i].g = src->pixels[i].bgr.g >> 2;
-        dst->pixels[i].b = src->pixels[i].bgr.b >> 3;
+        const uint8_t* dither = flags & RGB565_DITHER ? rgb565_dither[y & 3] : NULL;
+        rgb565_row((const uint8_t*)(src->pixels + y * src->width), (uint16_t*)(dst->pixels + y * src->width),
+            src->width, dither, big_endian);
     }
     return 0;
 }
+
+CPU_KERNEL_BODY uint16_t rgb565_pixel(const uint8_t* src, uint32_t d, bool big_endian)
+{
+    uint32_t b = src[0] + d;
+    uint32_t g = src[1] + (d >> 1);
+    uint32_t r = src[2] + d;
+    b = b > 255 ? 255 : b;
+    g = g > 255 ? 255 : g;
+    r = r > 255 ? 255 : r;
+    uint16_t pixel = (uint16_t)((r >> 3) << 11 | (g >> 2) << 5 | b >> 3);
+    return big_endian ? __builtin_bswap16(pixel) : pixel;
+}
+
+/**
+ * dither holds the offsets of 4 pixels and starts over at pixel 0, so vector kernels hand
+ * their tails over at a multiple of 4 pixels. The offsets are spread over a block first,
+ * so the pixel loop reads them like any other array and vectorizes.
+ * NULL does not dither, and with a constant NULL the clamps fold away.
+ */
+CPU_KERNEL_BODY void rgb565_row_body(const uint8_t* restrict src, uint16_t* restrict dst, size_t n, const uint8_t* dither, bool big_endian)
+{
+    uint8_t offsets[RGB565_BLOCK_PIXELS];
+    for (int i = 0; i < RGB565_BLOCK_PIXELS; i++)
+    {
+        offsets[i] = dither ? dither[i & 3] : 0;
+    }
+    for (size_t start = 0; start < n; start += RGB565_BLOCK_PIXELS)
+    {
+        size_t count = n - start < RGB565_BLOCK_PIXELS ? n - start : RGB565_BLOCK_PIXELS;
+        const uint8_t* block = src + start * 3;
+        for (size_t i = 0; i < count; i++)
+        {
+            dst[start + i] = rgb565_pixel(block + i * 3, dither ? offsets[i] : 0, big_endian);
+        }
+    }
+}
+
+/** Every combination gets its own loop */
+static void rgb565_row_scalar(const uint8_t* src, uint16_t* dst, size_t n, const uint8_t* dither, bool big_endian)
+{
+    if (dither)
+    {
+        big_endian ? rgb565_row_body(src, dst, n, dither, true) : rgb565_row_body(src, dst, n, dither, false);
+    }
+    else
+    {
+        big_endian ? rgb565_row_body(src, dst, n, NULL, true) : rgb565_row_body(src, dst, n, NULL, false);
+    }
+}
+
+#if CPU_DISPATCH_X86
+/**
+ * 16 pixels, 48 bytes. Each 128 bit lane takes 8 pixels from two overlapping loads:
+ * pixels 0 to 4 lie in the first 16 bytes, pixels 5 to 7 in the 16 bytes from byte 8.
+ * Every channel is shuffled into 16 bit lanes with a zero high byte.
+ */
+CPU_TARGET_AVX2 static void rgb565_row_avx2(const uint8_t* src, uint16_t* dst, size_t n, const uint8_t* dither, bool big_endian)
+{
+    const char z = -128;
+    const __m256i b_low = _mm256_broadcastsi128_si256(_mm_setr_epi8(0, z, 3, z, 6, z, 9, z, 12, z, z, z, z, z, z, z));
+    const __m256i g_low = _mm256_broadcastsi128_si256(_mm_setr_epi8(1, z, 4, z, 7, z, 10, z, 13, z, z, z, z, z, z, z));
+    const __m256i r_low = _mm256_broadcastsi128_si256(_mm_setr_epi8(2, z, 5, z, 8, z, 11, z, 14, z, z, z, z, z, z, z));
+    const __m256i b_high = _mm256_broadcastsi128_si256(_mm_setr_epi8(z, z, z, z, z, z, z, z, z, z, 7, z, 10, z, 13, z));
+    const __m256i g_high = _mm256_broadcastsi128_si256(_mm_setr_epi8(z, z, z, z, z, z, z, z, z, z, 8, z, 11, z, 14, z));
+    const __m256i r_high = _mm256_broadcastsi128_si256(_mm_setr_epi8(z, z, z, z, z, z, z, z, z, z, 9, z, 12, z, 15, z));
+    uint64_t offsets = dither ? dither[0] | (uint64_t)dither[1] << 16 | (uint64_t)dither[2] << 32 | (uint64_t)dither[3] << 48 : 0;
+    const __m256i d_rb = _mm256_set1_epi64x((long long)offsets);
+    const __m256i d_g = _mm256_srli_epi16(d_rb, 1);
+    const __m256i max = _mm256_set1_epi16(255);
+    const __m256i r_mask = _mm256_set1_epi16((short)0xF800);
+    const __m256i g_mask = _mm256_set1_epi16(0x07E0);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        const uint8_t* p = src + i * 3;
+        __m256i low = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)p)),
+            _mm_loadu_si128((const __m128i*)(p + 24)), 1);
+        __m256i high = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)(p + 8))),
+            _mm_loadu_si128((const __m128i*)(p + 32)), 1);
+        __m256i b = _mm256_or_si256(_mm256_shuffle_epi8(low, b_low), _mm256_shuffle_epi8(high, b_high));
+        __m256i g = _mm256_or_si256(_mm256_shuffle_epi8(low, g_low), _mm256_shuffle_epi8(high, g_high));
+        __m256i r = _mm256_or_si256(_mm256_shuffle_epi8(low, r_low), _mm256_shuffle_epi8(high, r_high));
+        b = _mm256_min_epu16(_mm256_add_epi16(b, d_rb), max);
+        g = _mm256_min_epu16(_mm256_add_epi16(g, d_g), max);
+        r = _mm256_min_epu16(_mm256_add_epi16(r, d_rb), max);
+        __m256i pixel = _mm256_or_si256(
+            _mm256_or_si256(_mm256_and_si256(_mm256_slli_epi16(r, 8), r_mask), _mm256_and_si256(_mm256_slli_epi16(g, 3), g_mask)),
+            _mm256_srli_epi16(b, 3));
+        if (big_endian)
+        {
+            pixel = _mm256_or_si256(_mm256_slli_epi16(pixel, 8), _mm256_srli_epi16(pixel, 8));
+        }
+        _mm256_storeu_si256((__m256i*)(dst + i), pixel);
+    }
+    rgb565_row_body(src + i * 3, dst + i, n - i, dither, big_endian);
+}
+
+/** 32 pixels, 96 bytes. VBMI picks each channel out of both loads into 16 bit lanes at once. */
+CPU_TARGET_AVX512 static void rgb565_row_avx512(const uint8_t* src, uint16_t* dst, size_t n, const uint8_t* dither, bool big_endian)
+{
+    /** Index 3 * lane of the low byte of every 16 bit lane, the high bytes are masked to zero */
+    const __m512i b_index = _mm512_mullo_epi16(_mm512_set_epi16(
+        31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17, 16,
+        15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0), _mm512_set1_epi16(3));
+    const __m512i g_index = _mm512_add_epi16(b_index, _mm512_set1_epi16(1));
+    const __m512i r_index = _mm512_add_epi16(b_index, _mm512_set1_epi16(2));
+    const __mmask64 low_bytes = 0x5555555555555555ull;
+    uint64_t offsets = dither ? dither[0] | (uint64_t)dither[1] << 16 | (uint64_t)dither[2] << 32 | (uint64_t)dither[3] << 48 : 0;
+    const __m512i d_rb = _mm512_set1_epi64((long long)offsets);
+    const __m512i d_g = _mm512_srli_epi16(d_rb, 1);
+    const __m512i max = _mm512_set1_epi16(255);
+    const __m512i r_mask = _mm512_set1_epi16((short)0xF800);
+    const __m512i g_mask = _mm512_set1_epi16(0x07E0);
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32)
+    {
+        const uint8_t* p = src + i * 3;
+        __m512i low = _mm512_loadu_si512(p);
+        __m512i high = _mm512_maskz_loadu_epi8(0xFFFFFFFFull, p + 64);
+        __m512i b = _mm512_maskz_permutex2var_epi8(low_bytes, low, b_index, high);
+        __m512i g = _mm512_maskz_permutex2var_epi8(low_bytes, low, g_index, high);
+        __m512i r = _mm512_maskz_permutex2var_epi8(low_bytes, low, r_index, high);
+        b = _mm512_min_epu16(_mm512_add_epi16(b, d_rb), max);
+        g = _mm512_min_epu16(_mm512_add_epi16(g, d_g), max);
+        r = _mm512_min_epu16(_mm512_add_epi16(r, d_rb), max);
+        /** r high bits | g middle bits | b >> 3 */
+        __m512i pixel = _mm512_ternarylogic_epi32(_mm512_slli_epi16(r, 8), r_mask, _mm512_srli_epi16(b, 3), 0xEA);
+        pixel = _mm512_ternarylogic_epi32(_mm512_slli_epi16(g, 3), g_mask, pixel, 0xEA);
+        if (big_endian)
+        {
+            pixel = _mm512_or_si512(_mm512_slli_epi16(pixel, 8), _mm512_srli_epi16(pixel, 8));
+        }
+        _mm512_storeu_si512(dst + i, pixel);
+    }
+    rgb565_row_body(src + i * 3, dst + i, n - i, dither, big_endian);
+}
+#endif
+
+static void rgb565_row(const uint8_t* src, uint16_t* dst, size_t n, const uint8_t* dither, bool big_endian)
+{
+    switch (cpu_isa_get())
+    {
+#if CPU_DISPATCH_X86
+    case CPU_ISA_AVX512:
+        rgb565_row_avx512(src, dst, n, dither, big_endian);
+        return;
+    case CPU_ISA_AVX2:
+        rgb565_row_avx2(src, dst, n, dither, big_endian);
+        return;
+#endif
+    default:
+        rgb565_row_scalar(src, dst, n, dither, big_endian);
+        return;
+    }
+}
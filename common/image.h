@@ -41,12 +41,34 @@ typedef struct
     int color_space;
 } image_t;
 
+/** Rows of every plane start on a cache line. The stride is the width rounded up to this. */
+#define PLANAR_IMAGE_ALIGN 64
+
+/**
+ * One plane per channel: B, G, R or Y, Cb, Cr depending on color_space.
+ * Cb and Cr hold int8_t values, like ycbcr_pixel_t.
+ * The padding at the end of the rows is zeroed on allocation. Kernels may load whole vectors
+ * across it, but never count it as pixels.
+ */
+typedef struct
+{
+    uint8_t* planes[3];
+    size_t width;
+    size_t height;
+    size_t stride;
+    int color_space;
+} planar_image_t;
+
+/** Indexes are bytes, so a palette has at most this many colors */
+#define COLOR_PALETTE_MAX_K 256
+
 typedef struct
 {
     pixel_t* color_palettes;
+    /** 1 to COLOR_PALETTE_MAX_K */
     int k;
     int color_space;
-    uint32_t* pixel_indexs;
+    uint8_t* pixel_indexs;
     size_t width;
     size_t height;
 } color_palette_image_t;
@@ -73,10 +95,17 @@ typedef struct
 image_t* image_new(size_t width, size_t height);
 void image_free(image_t* image);
 
+planar_image_t* planar_image_new(size_t width, size_t height);
+void planar_image_free(planar_image_t* image);
+/** Layout changes only, the color space is kept. Return -1 if the sizes differ. */
+int image_to_planar(const image_t* src, planar_image_t* dst);
+int planar_to_image(const planar_image_t* src, image_t* dst);
+
 color_palette_image_t* color_palette_image_new(int k, int width, int height);
 void color_palette_image_free(color_palette_image_t* image);
 
 int paint_color_palette_image(const color_palette_image_t* src, image_t* dst);
+int paint_color_palette_planar(const color_palette_image_t* src, planar_image_t* dst);
 
 packed_color_palette_image_t* packed_color_palette_image_new(int k, int width, int height);
 void packed_color_palette_image_free(packed_color_palette_image_t* image);
@@ -86,7 +115,19 @@ int pack_color_palette_image(const color_palette_image_t* src, packed_color_pale
 rgb565_image_t* rgb565_image_new(size_t size);
 void rgb565_image_free(rgb565_image_t* image);
 
+/**
+ * bgr_image_to_rgb565_ex flags.
+ * RGB565_DITHER adds a 4x4 ordered dither before the channels are truncated, so gradients
+ * band less. RGB565_BIG_ENDIAN stores each pixel high byte first, the order the LCD takes
+ * when it is fed a byte stream (8 bit SPI or DMA). The rgb565_pixel_t fields do not apply
+ * to such pixels. The MCU's 16 bit SPI frames take native pixels, which is the default.
+ */
+#define RGB565_DITHER (1u << 0)
+#define RGB565_BIG_ENDIAN (1u << 1)
+
+/** Plain truncation, native byte order */
 int bgr_image_to_rgb565(const image_t* src, rgb565_image_t* dst);
+int bgr_image_to_rgb565_ex(const image_t* src, rgb565_image_t* dst, unsigned flags);
 
 #ifdef __cplusplus
 }
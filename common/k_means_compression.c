@@ -4,8 +4,13 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "cpu_dispatch.h"
+#include "color_conversion.h"
 
-#ifdef __AVX2__
+#if CPU_DISPATCH_X86
 #include <immintrin.h>
 #endif
 
@@ -15,139 +20,975 @@
  * The cache will be too large to be effective.
  * GCC 13 does a pretty descent job with auto vectorization.
  * Cost is around 100 cycle/pixel*iteration on ZEN3.
+ * UI and video frames have far fewer distinct colors than pixels.
+ * k_means_histogram_compression iterates on the occupied color bins instead, then assigns the pixels once.
+ * The inner loops are built for each ISA level and picked at runtime, see cpu_dispatch.h.
+ * k_means_parallel_compression runs the same loops on row stripes of the image, one pool thread each.
+ * Sums of integer channels are exact in double, so only the error can depend on how the stripes are reduced.
+ * After the first iterations few pixels change cluster. k_means_hamerly_compression keeps a lower bound
+ * on the distance to the second nearest center and only searches all centers when the bound fails.
+ * k_means_ctx_run_bgr converts the frame a block at a time inside the first pass over it, so the
+ * block is assigned (or binned) while it is still in L1 instead of after a separate sweep of the frame.
  */
 
+/**
+ * Centers in SoA layout, the SIMD kernels load 8 or 16 of a channel at once.
+ * Every array starts on a cache line and holds k rounded up to CENTERS_ALIGN entries.
+ */
+#define CENTERS_ALIGN 16
+#define CENTERS_PAD(k) (((size_t)(k) + CENTERS_ALIGN - 1) & ~(size_t)(CENTERS_ALIGN - 1))
+#define CENTERS_POSITIONS_SIZE(k_pad) ((k_pad) * 3 * sizeof(float))
+#define CENTERS_SUMS_SIZE(k_pad) ((k_pad) * (3 * sizeof(double) + sizeof(size_t)))
+
 typedef struct
 {
+    float* y;
+    float* cb;
+    float* cr;
+    double* y_sum;
+    double* cb_sum;
+    double* cr_sum;
+    size_t* count;
+} centers_t;
+
+#define ERROR_THRES_PER_PIXEL 0.001
+/** Seed of new contexts, any fixed value makes the encoder repeatable */
+#define K_MEANS_DEFAULT_SEED 0x5eed
+
+/**
+ * The histogram engine bins colors by the top 6 bits of Y and the top 5 bits of Cb and Cr.
+ * Each bin keeps the exact sums of its pixels. So the centers come out the same
+ * as iterating on the pixels, as long as a bin does not straddle two clusters.
+ */
+#define HISTOGRAM_Y_BITS 6
+#define HISTOGRAM_C_BITS 5
+#define HISTOGRAM_BINS (1 << (HISTOGRAM_Y_BITS + 2 * HISTOGRAM_C_BITS))
+#define HISTOGRAM_NO_POINT UINT32_MAX
+
+typedef struct
+{
+    /** Mean color of the bin */
     float y;
     float cb;
     float cr;
-    double y_sum;
-    double cb_sum;
-    double cr_sum;
-    size_t count;
-} center_t;
+    int32_t y_sum;
+    int32_t cb_sum;
+    int32_t cr_sum;
+    uint32_t count;
+} histogram_point_t;
 
-#define ERROR_THRES_PER_PIXEL 0.001
+/**
+ * Hamerly bounds. A pixel keeps its center while its distance to it is below both
+ * its lower bound and half the gap from its center to the nearest other one.
+ * The margin absorbs the float rounding of the bounds, so a pixel is only kept
+ * when the full search would have kept it too.
+ */
+#define HAMERLY_MARGIN 0.01f
+
+typedef struct
+{
+    /** Half the distance from each center to its nearest other center */
+    float* half_gap;
+    /** Per pixel, lower bound of the distance to every center but its own */
+    float* lower;
+    /** Largest move of a center in the last iteration, which center, and the second largest move */
+    float max_drift;
+    int max_drift_index;
+    float second_drift;
+} hamerly_bounds_t;
+
+/** The image being clustered. Exactly one of packed and planar is set. */
+typedef struct
+{
+    const image_t* packed;
+    const planar_image_t* planar;
+    size_t width;
+    size_t height;
+    /** If set, packed is not converted yet. The first pass converts bgr into ycbcr, which is packed. */
+    const image_t* bgr;
+    image_t* ycbcr;
+} source_t;
+
+/** Pixels converted per block of a fused first pass. Their BGR, YCbCr and indexes stay within L1. */
+#define CONVERT_BLOCK_PIXELS 1024
+
+/** Rows per stripe of the parallel engine. Stripes are the unit of work and of reduction. */
+#define STRIPE_ROWS 8
+#define POOL_MAX_THREADS 64
+#define CACHE_LINE_SIZE 64
+
+typedef struct
+{
+    /** One cache line each, workers do not share them */
+    _Alignas(CACHE_LINE_SIZE) double error;
+    /** Own sums, the positions are those of the pass */
+    centers_t centers;
+} partial_t;
 
-inline static double update_clusters(int k, center_t* centers, const image_t* image, color_palette_image_t* dst);
-#ifdef __AVX2__
-inline static double update_clusters_fast16(center_t* centers, const image_t* image, color_palette_image_t* dst);
-inline static double update_clusters_fast32(center_t* centers, const image_t* image, color_palette_image_t* dst);
+typedef struct
+{
+    k_means_pool_t* pool;
+    int index;
+} pool_worker_t;
+
+struct k_means_pool_s
+{
+    int n_threads;
+    bool deterministic;
+    pthread_t* threads;
+    pool_worker_t* workers;
+    int n_started;
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;
+    pthread_cond_t done_cond;
+    uint64_t generation;
+    int n_busy;
+    bool stop;
+    /** The current pass. Set before the generation is bumped. */
+    int k;
+    const image_t* image;
+    /** Set on a fused first pass, every stripe is converted from it into image before it is assigned */
+    const image_t* bgr;
+    color_palette_image_t* dst;
+    size_t n_stripes;
+    _Atomic size_t next_stripe;
+    partial_t* partials;
+    size_t n_partials;
+    /** Sums of all partials, k_capacity per partial */
+    void* partial_sums;
+    size_t partials_capacity;
+    int k_capacity;
+};
+
+struct k_means_ctx_s
+{
+    k_means_engine_t engine;
+    int k;
+    size_t width;
+    size_t height;
+    uint64_t random_state;
+    void* storage;
+    centers_t centers;
+    /** Hamerly only, the centers before the last move */
+    centers_t old_centers;
+    hamerly_bounds_t bounds;
+    /** Histogram only */
+    uint32_t* bins;
+    histogram_point_t* points;
+    /** Parallel only, not owned */
+    k_means_pool_t* pool;
+};
+
+static int run_once(k_means_engine_t engine, k_means_pool_t* pool, const image_t* image, int k, color_palette_image_t* dst, bool use_dst_as_hint);
+static int plain_run(k_means_ctx_t* ctx, const source_t* source, color_palette_image_t* dst, bool use_dst_as_hint);
+static int histogram_run(k_means_ctx_t* ctx, const source_t* source, color_palette_image_t* dst, bool use_dst_as_hint);
+static int hamerly_run(k_means_ctx_t* ctx, const source_t* source, color_palette_image_t* dst, bool use_dst_as_hint);
+static int parallel_run(k_means_ctx_t* ctx, const source_t* source, color_palette_image_t* dst, bool use_dst_as_hint);
+static uint32_t next_random(uint64_t* state);
+static void centers_bind(centers_t* centers, void* storage, size_t k_pad);
+static void centers_bind_sums(centers_t* centers, void* storage, size_t k_pad);
+static void copy_positions(int k, centers_t* dst, const centers_t* src);
+static void init_centers(int k, centers_t* centers, const source_t* source, const color_palette_image_t* dst, bool use_dst_as_hint, uint64_t* random_state);
+static void clear_centers(int k, centers_t* centers);
+static void move_centers(int k, centers_t* centers, const source_t* source, uint64_t* random_state);
+static void save_centers(int k, const centers_t* centers, color_palette_image_t* dst);
+static double assign_pixels(int k, centers_t* centers, const image_t* image, color_palette_image_t* dst);
+static double assign_source(int k, centers_t* centers, const source_t* source, color_palette_image_t* dst);
+static double convert_assign_pixels(int k, centers_t* centers, const image_t* bgr, image_t* ycbcr, color_palette_image_t* dst);
+static double assign_planar(int k, centers_t* centers, const planar_image_t* image, color_palette_image_t* dst);
+static ycbcr_pixel_t source_pixel(const source_t* source, size_t index);
+static inline void histogram_add(uint32_t* bins, histogram_point_t* points, size_t* n_points, uint8_t y, int8_t cb, int8_t cr);
+CPU_KERNEL_BODY double update_clusters_planar_body(int k, centers_t* centers, const planar_image_t* image, color_palette_image_t* dst);
+static size_t build_histogram(const source_t* source, uint32_t* bins, histogram_point_t* points);
+static double update_histogram_clusters(int k, centers_t* centers, const histogram_point_t* points, size_t n_points);
+CPU_KERNEL_BODY double update_histogram_clusters_body(int k, centers_t* centers, const histogram_point_t* points, size_t n_points);
+CPU_KERNEL_BODY double update_clusters_body(int k, centers_t* centers, const image_t* image, color_palette_image_t* dst);
+static double hamerly_assign_pixels(int k, centers_t* centers, hamerly_bounds_t* bounds, const image_t* image, color_palette_image_t* dst);
+static void hamerly_update_bounds(int k, const centers_t* old_centers, const centers_t* centers, hamerly_bounds_t* bounds);
+CPU_KERNEL_BODY double hamerly_assign_body(int k, centers_t* centers, hamerly_bounds_t* bounds, const image_t* image, color_palette_image_t* dst);
+static size_t pool_partials(const k_means_pool_t* pool, size_t height);
+static int pool_reserve(k_means_pool_t* pool, size_t n_partials, int k);
+static double pool_assign_pixels(k_means_pool_t* pool, int k, centers_t* centers, const image_t* image, const image_t* bgr, color_palette_image_t* dst);
+static void pool_work(k_means_pool_t* pool, int worker);
+static void* pool_main(void* ctx);
+static double update_clusters_scalar(int k, centers_t* centers, const image_t* image, color_palette_image_t* dst);
+static double update_histogram_clusters_scalar(int k, centers_t* centers, const histogram_point_t* points, size_t n_points);
+static double hamerly_assign_scalar(int k, centers_t* centers, hamerly_bounds_t* bounds, const image_t* image, color_palette_image_t* dst);
+static double update_clusters_planar_scalar(int k, centers_t* centers, const planar_image_t* image, color_palette_image_t* dst);
+#if CPU_DISPATCH_X86
+CPU_TARGET_AVX2 static double update_clusters_planar_avx2(int k, centers_t* centers, const planar_image_t* image, color_palette_image_t* dst);
+CPU_TARGET_AVX512 static double update_clusters_planar_avx512(int k, centers_t* centers, const planar_image_t* image, color_palette_image_t* dst);
+CPU_TARGET_AVX2 static double hamerly_assign_avx2(int k, centers_t* centers, hamerly_bounds_t* bounds, const image_t* image, color_palette_image_t* dst);
+CPU_TARGET_AVX512 static double hamerly_assign_avx512(int k, centers_t* centers, hamerly_bounds_t* bounds, const image_t* image, color_palette_image_t* dst);
+CPU_TARGET_AVX2 static double update_clusters_avx2(int k, centers_t* centers, const image_t* image, color_palette_image_t* dst);
+CPU_TARGET_AVX2 static double update_histogram_clusters_avx2(int k, centers_t* centers, const histogram_point_t* points, size_t n_points);
+CPU_TARGET_AVX2 static double update_clusters_fast16_avx2(centers_t* centers, const image_t* image, color_palette_image_t* dst);
+CPU_TARGET_AVX2 static double update_clusters_fast32_avx2(centers_t* centers, const image_t* image, color_palette_image_t* dst);
+CPU_TARGET_AVX512 static double update_clusters_avx512(int k, centers_t* centers, const image_t* image, color_palette_image_t* dst);
+CPU_TARGET_AVX512 static double update_histogram_clusters_avx512(int k, centers_t* centers, const histogram_point_t* points, size_t n_points);
+CPU_TARGET_AVX512 static double update_clusters_fast16_avx512(centers_t* centers, const image_t* image, color_palette_image_t* dst);
+CPU_TARGET_AVX512 static double update_clusters_fast32_avx512(centers_t* centers, const image_t* image, color_palette_image_t* dst);
 #endif
 
+k_means_ctx_t* k_means_ctx_new(k_means_engine_t engine, int k, size_t width, size_t height, k_means_pool_t* pool)
+{
+    if (engine < 0 || engine >= K_MEANS_ENGINE_COUNT || k <= 0 || k > COLOR_PALETTE_MAX_K || width == 0 || height == 0)
+    {
+        return NULL;
+    }
+    if (engine == K_MEANS_ENGINE_PARALLEL && !pool)
+    {
+        return NULL;
+    }
+    k_means_ctx_t* ctx = malloc(sizeof(k_means_ctx_t));
+    if (!ctx)
+    {
+        return NULL;
+    }
+    memset(ctx, 0, sizeof(k_means_ctx_t));
+    ctx->engine = engine;
+    ctx->k = k;
+    ctx->width = width;
+    ctx->height = height;
+    ctx->pool = pool;
+    k_means_ctx_seed(ctx, K_MEANS_DEFAULT_SEED);
+
+    /** One block for the centers, the old centers and the Hamerly gaps */
+    size_t k_pad = CENTERS_PAD(k);
+    size_t centers_size = CENTERS_POSITIONS_SIZE(k_pad) + CENTERS_SUMS_SIZE(k_pad);
+    ctx->storage = aligned_alloc(CACHE_LINE_SIZE, 2 * centers_size + k_pad * sizeof(float));
+    if (!ctx->storage)
+    {
+        goto error;
+    }
+    centers_bind(&ctx->centers, ctx->storage, k_pad);
+    centers_bind(&ctx->old_centers, (uint8_t*)ctx->storage + centers_size, k_pad);
+    ctx->bounds.half_gap = (float*)((uint8_t*)ctx->storage + 2 * centers_size);
+
+    size_t n_pixels = width * height;
+    switch (engine)
+    {
+    case K_MEANS_ENGINE_HISTOGRAM:
+        ctx->bins = (uint32_t*)malloc(HISTOGRAM_BINS * sizeof(uint32_t));
+        /** There can not be more occupied bins than pixels */
+        ctx->points = (histogram_point_t*)malloc((n_pixels < HISTOGRAM_BINS ? n_pixels : HISTOGRAM_BINS) * sizeof(histogram_point_t));
+        if (!ctx->bins || !ctx->points)
+        {
+            goto error;
+        }
+        break;
+    case K_MEANS_ENGINE_HAMERLY:
+        ctx->bounds.lower = (float*)malloc(n_pixels * sizeof(float));
+        if (!ctx->bounds.lower)
+        {
+            goto error;
+        }
+        break;
+    case K_MEANS_ENGINE_PARALLEL:
+        if (pool_reserve(pool, pool_partials(pool, height), k) != 0)
+        {
+            goto error;
+        }
+        break;
+    default:
+        break;
+    }
+    return ctx;
+error:
+    k_means_ctx_free(ctx);
+    return NULL;
+}
+
+void k_means_ctx_free(k_means_ctx_t* ctx)
+{
+    if (!ctx)
+    {
+        return;
+    }
+    free(ctx->bounds.lower);
+    free(ctx->points);
+    free(ctx->bins);
+    free(ctx->storage);
+    free(ctx);
+}
+
+void k_means_ctx_seed(k_means_ctx_t* ctx, uint64_t seed)
+{
+    ctx->random_state = seed;
+}
+
+int k_means_ctx_run(k_means_ctx_t* ctx, const image_t* image, color_palette_image_t* dst, bool use_dst_as_hint)
+{
+    if (!ctx || !image || !dst)
+    {
+        return -1;
+    }
+    if (image->width != ctx->width || image->height != ctx->height
+        || dst->width != ctx->width || dst->height != ctx->height || dst->k != ctx->k)
+    {
+        return -1;
+    }
+    source_t source = { image, NULL, image->width, image->height, NULL, NULL };
+    switch (ctx->engine)
+    {
+    case K_MEANS_ENGINE_HISTOGRAM:
+        return histogram_run(ctx, &source, dst, use_dst_as_hint);
+    case K_MEANS_ENGINE_HAMERLY:
+        return hamerly_run(ctx, &source, dst, use_dst_as_hint);
+    case K_MEANS_ENGINE_PARALLEL:
+        return parallel_run(ctx, &source, dst, use_dst_as_hint);
+    default:
+        return plain_run(ctx, &source, dst, use_dst_as_hint);
+    }
+}
+
+int k_means_ctx_run_planar(k_means_ctx_t* ctx, const planar_image_t* image, color_palette_image_t* dst, bool use_dst_as_hint)
+{
+    if (!ctx || !image || !dst)
+    {
+        return -1;
+    }
+    if (image->width != ctx->width || image->height != ctx->height
+        || dst->width != ctx->width || dst->height != ctx->height || dst->k != ctx->k)
+    {
+        return -1;
+    }
+    source_t source = { NULL, image, image->width, image->height, NULL, NULL };
+    switch (ctx->engine)
+    {
+    case K_MEANS_ENGINE_PLAIN:
+        return plain_run(ctx, &source, dst, use_dst_as_hint);
+    case K_MEANS_ENGINE_HISTOGRAM:
+        return histogram_run(ctx, &source, dst, use_dst_as_hint);
+    default:
+        return -1;
+    }
+}
+
+int k_means_ctx_run_bgr(k_means_ctx_t* ctx, const image_t* bgr, image_t* ycbcr, color_palette_image_t* dst, bool use_dst_as_hint)
+{
+    if (!ctx || !bgr || !ycbcr || !dst)
+    {
+        return -1;
+    }
+    if (bgr->width != ctx->width || bgr->height != ctx->height
+        || ycbcr->width != ctx->width || ycbcr->height != ctx->height
+        || dst->width != ctx->width || dst->height != ctx->height || dst->k != ctx->k)
+    {
+        return -1;
+    }
+    source_t source = { ycbcr, NULL, ycbcr->width, ycbcr->height, bgr, ycbcr };
+    switch (ctx->engine)
+    {
+    case K_MEANS_ENGINE_HISTOGRAM:
+        return histogram_run(ctx, &source, dst, use_dst_as_hint);
+    case K_MEANS_ENGINE_HAMERLY:
+        /** The first pass also seeds the bounds, it is not fused */
+        bgr_image_to_ycbcr(bgr, ycbcr);
+        source.bgr = NULL;
+        return hamerly_run(ctx, &source, dst, use_dst_as_hint);
+    case K_MEANS_ENGINE_PARALLEL:
+        return parallel_run(ctx, &source, dst, use_dst_as_hint);
+    default:
+        return plain_run(ctx, &source, dst, use_dst_as_hint);
+    }
+}
+
 int k_means_compression(const image_t* image, int k, color_palette_image_t* dst, bool use_dst_as_hint)
 {
-    if (!image || !dst || k <= 0)
+    return run_once(K_MEANS_ENGINE_PLAIN, NULL, image, k, dst, use_dst_as_hint);
+}
+
+int k_means_histogram_compression(const image_t* image, int k, color_palette_image_t* dst, bool use_dst_as_hint)
+{
+    return run_once(K_MEANS_ENGINE_HISTOGRAM, NULL, image, k, dst, use_dst_as_hint);
+}
+
+int k_means_hamerly_compression(const image_t* image, int k, color_palette_image_t* dst, bool use_dst_as_hint)
+{
+    return run_once(K_MEANS_ENGINE_HAMERLY, NULL, image, k, dst, use_dst_as_hint);
+}
+
+k_means_pool_t* k_means_pool_new(int n_threads, bool deterministic)
+{
+    if (n_threads <= 0)
+    {
+        long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        n_threads = n_cpus > 0 ? (int)n_cpus : 1;
+    }
+    if (n_threads > POOL_MAX_THREADS)
+    {
+        n_threads = POOL_MAX_THREADS;
+    }
+    k_means_pool_t* pool = malloc(sizeof(k_means_pool_t));
+    if (!pool)
+    {
+        return NULL;
+    }
+    memset(pool, 0, sizeof(k_means_pool_t));
+    pool->n_threads = n_threads;
+    pool->deterministic = deterministic;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_cond, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+    pool->threads = malloc(n_threads * sizeof(pthread_t));
+    pool->workers = malloc(n_threads * sizeof(pool_worker_t));
+    if (!pool->threads || !pool->workers)
+    {
+        goto error;
+    }
+    /** Worker 0 is the thread that runs the context */
+    for (int i = 1; i < n_threads; i++)
+    {
+        pool->workers[i].pool = pool;
+        pool->workers[i].index = i;
+        if (pthread_create(&pool->threads[i], NULL, pool_main, &pool->workers[i]) != 0)
+        {
+            goto error;
+        }
+        pool->n_started++;
+    }
+    return pool;
+error:
+    k_means_pool_free(pool);
+    return NULL;
+}
+
+void k_means_pool_free(k_means_pool_t* pool)
+{
+    if (!pool)
+    {
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = true;
+    pthread_cond_broadcast(&pool->work_cond);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 1; i <= pool->n_started; i++)
+    {
+        pthread_join(pool->threads[i], NULL);
+    }
+    pthread_cond_destroy(&pool->done_cond);
+    pthread_cond_destroy(&pool->work_cond);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->partials);
+    free(pool->partial_sums);
+    free(pool->workers);
+    free(pool->threads);
+    free(pool);
+}
+
+int k_means_parallel_compression(k_means_pool_t* pool, const image_t* image, int k, color_palette_image_t* dst, bool use_dst_as_hint)
+{
+    if (!pool)
+    {
+        return -1;
+    }
+    return run_once(K_MEANS_ENGINE_PARALLEL, pool, image, k, dst, use_dst_as_hint);
+}
+
+/** A context for a single call, seeded from rand() so srand still makes the one-shot API repeatable */
+static int run_once(k_means_engine_t engine, k_means_pool_t* pool, const image_t* image, int k, color_palette_image_t* dst, bool use_dst_as_hint)
+{
+    if (!image || !dst)
+    {
+        return -1;
+    }
+    k_means_ctx_t* ctx = k_means_ctx_new(engine, k, image->width, image->height, pool);
+    if (!ctx)
     {
         return -1;
     }
-    if (image->height != dst->height || image->width != dst->width || k != dst->k)
+    k_means_ctx_seed(ctx, rand());
+    int iterations = k_means_ctx_run(ctx, image, dst, use_dst_as_hint);
+    k_means_ctx_free(ctx);
+    return iterations;
+}
+
+static int plain_run(k_means_ctx_t* ctx, const source_t* source, color_palette_image_t* dst, bool use_dst_as_hint)
+{
+    int k = ctx->k;
+    centers_t* centers = &ctx->centers;
+    double last_error = INFINITY;
+    double error_thres = ERROR_THRES_PER_PIXEL * source->width * source->height;
+    init_centers(k, centers, source, dst, use_dst_as_hint, &ctx->random_state);
+    /** Converted by the first pass */
+    source_t converted = *source;
+    converted.bgr = NULL;
+    int iteration = 0;
+    for(;;)
+    {
+        clear_centers(k, centers);
+        double error = source->bgr
+            ? convert_assign_pixels(k, centers, source->bgr, source->ycbcr, dst)
+            : assign_source(k, centers, source, dst);
+        source = &converted;
+
+        /** Check for exit condition */
+        if (fabs(last_error - error) < error_thres)
+        {
+            break;
+        }
+        last_error = error;
+
+        move_centers(k, centers, source, &ctx->random_state);
+        iteration++;
+    }
+    /** Re paint the image with the new centers */
+    save_centers(k, centers, dst);
+    return iteration;
+}
+
+static int histogram_run(k_means_ctx_t* ctx, const source_t* source, color_palette_image_t* dst, bool use_dst_as_hint)
+{
+    int k = ctx->k;
+    centers_t* centers = &ctx->centers;
+    size_t n_points = build_histogram(source, ctx->bins, ctx->points);
+    /** Converted by the histogram pass */
+    source_t converted = *source;
+    converted.bgr = NULL;
+    source = &converted;
+
+    double last_error = INFINITY;
+    double error_thres = ERROR_THRES_PER_PIXEL * source->width * source->height;
+    init_centers(k, centers, source, dst, use_dst_as_hint, &ctx->random_state);
+    int iteration = 0;
+    for (;;)
+    {
+        clear_centers(k, centers);
+        double error = update_histogram_clusters(k, centers, ctx->points, n_points);
+        if (fabs(last_error - error) < error_thres)
+        {
+            break;
+        }
+        last_error = error;
+        move_centers(k, centers, source, &ctx->random_state);
+        iteration++;
+    }
+    /** One full resolution pass so every pixel gets its own nearest center */
+    clear_centers(k, centers);
+    assign_source(k, centers, source, dst);
+    save_centers(k, centers, dst);
+    return iteration;
+}
+
+static int hamerly_run(k_means_ctx_t* ctx, const source_t* source, color_palette_image_t* dst, bool use_dst_as_hint)
+{
+    int k = ctx->k;
+    centers_t* centers = &ctx->centers;
+    hamerly_bounds_t* bounds = &ctx->bounds;
+    const image_t* image = source->packed;
+    size_t n_pixels = image->width * image->height;
+    /** No bounds yet. Every pixel fails its test and gets a full search. */
+    memset(dst->pixel_indexs, 0, n_pixels * sizeof(uint8_t));
+    for (int i = 0; i < k; i++)
+    {
+        bounds->half_gap[i] = 0;
+    }
+    for (size_t i = 0; i < n_pixels; i++)
+    {
+        bounds->lower[i] = 0;
+    }
+    bounds->max_drift = INFINITY;
+    bounds->max_drift_index = -1;
+    bounds->second_drift = INFINITY;
+
+    double last_error = INFINITY;
+    double error_thres = ERROR_THRES_PER_PIXEL * n_pixels;
+    init_centers(k, centers, source, dst, use_dst_as_hint, &ctx->random_state);
+    int iteration = 0;
+    for (;;)
+    {
+        clear_centers(k, centers);
+        double error = hamerly_assign_pixels(k, centers, bounds, image, dst);
+        if (fabs(last_error - error) < error_thres)
+        {
+            break;
+        }
+        last_error = error;
+        copy_positions(k, &ctx->old_centers, centers);
+        move_centers(k, centers, source, &ctx->random_state);
+        hamerly_update_bounds(k, &ctx->old_centers, centers, bounds);
+        iteration++;
+    }
+    save_centers(k, centers, dst);
+    return iteration;
+}
+
+static int parallel_run(k_means_ctx_t* ctx, const source_t* source, color_palette_image_t* dst, bool use_dst_as_hint)
+{
+    int k = ctx->k;
+    k_means_pool_t* pool = ctx->pool;
+    centers_t* centers = &ctx->centers;
+    const image_t* image = source->packed;
+    size_t n_partials = pool_partials(pool, image->height);
+    /** Another context may have run on the pool with a larger k or image since, which is fine */
+    if (pool_reserve(pool, n_partials, k) != 0)
+    {
+        return -1;
+    }
+    pool->n_stripes = (image->height + STRIPE_ROWS - 1) / STRIPE_ROWS;
+    pool->n_partials = n_partials;
+
+    double last_error = INFINITY;
+    double error_thres = ERROR_THRES_PER_PIXEL * image->width * image->height;
+    init_centers(k, centers, source, dst, use_dst_as_hint, &ctx->random_state);
+    /** Converted by the first pass */
+    source_t converted = *source;
+    converted.bgr = NULL;
+    int iteration = 0;
+    for (;;)
+    {
+        clear_centers(k, centers);
+        double error = pool_assign_pixels(pool, k, centers, image, source->bgr, dst);
+        if (source->bgr)
+        {
+            source->ycbcr->color_space = COLOR_SPACE_YCBCR;
+            source = &converted;
+        }
+        if (fabs(last_error - error) < error_thres)
+        {
+            break;
+        }
+        last_error = error;
+        move_centers(k, centers, source, &ctx->random_state);
+        iteration++;
+    }
+    save_centers(k, centers, dst);
+    return iteration;
+}
+
+/** splitmix64, private to each context */
+static uint32_t next_random(uint64_t* state)
+{
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return (uint32_t)((z ^ (z >> 31)) >> 32);
+}
+
+/** Positions first, then the sums */
+static void centers_bind(centers_t* centers, void* storage, size_t k_pad)
+{
+    centers->y = (float*)storage;
+    centers->cb = centers->y + k_pad;
+    centers->cr = centers->cb + k_pad;
+    centers_bind_sums(centers, (uint8_t*)storage + CENTERS_POSITIONS_SIZE(k_pad), k_pad);
+}
+
+static void centers_bind_sums(centers_t* centers, void* storage, size_t k_pad)
+{
+    centers->y_sum = (double*)storage;
+    centers->cb_sum = centers->y_sum + k_pad;
+    centers->cr_sum = centers->cb_sum + k_pad;
+    centers->count = (size_t*)(centers->cr_sum + k_pad);
+}
+
+static void copy_positions(int k, centers_t* dst, const centers_t* src)
+{
+    memcpy(dst->y, src->y, k * sizeof(float));
+    memcpy(dst->cb, src->cb, k * sizeof(float));
+    memcpy(dst->cr, src->cr, k * sizeof(float));
+}
+
+static void init_centers(int k, centers_t* centers, const source_t* source, const color_palette_image_t* dst, bool use_dst_as_hint, uint64_t* random_state)
+{
+    if (use_dst_as_hint)
+    {
+        /** Use dst as hint to stabilize the frames */
+        for (int i = 0; i < k; i++)
+        {
+            centers->y[i] = dst->color_palettes[i].ycbcr.y;
+            centers->cb[i] = dst->color_palettes[i].ycbcr.cb;
+            centers->cr[i] = dst->color_palettes[i].ycbcr.cr;
+        }
+    }
+    else
+    {
+        /** Initialize the centers with random pixels from the image */
+        for (int i = 0; i < k; i++)
+        {
+            ycbcr_pixel_t pixel = source_pixel(source, next_random(random_state) % (source->width * source->height));
+            centers->y[i] = pixel.y;
+            centers->cb[i] = pixel.cb;
+            centers->cr[i] = pixel.cr;
+        }
+    }
+}
+
+/** clear center sum and counters */
+static void clear_centers(int k, centers_t* centers)
+{
+    for (int i = 0; i < k; i++)
+    {
+        centers->y_sum[i] = 0;
+        centers->cb_sum[i] = 0;
+        centers->cr_sum[i] = 0;
+        centers->count[i] = 0;
+    }
+}
+
+/** Calculate the new centers */
+static void move_centers(int k, centers_t* centers, const source_t* source, uint64_t* random_state)
+{
+    for (int i = 0; i < k; i++)
+    {
+        if (centers->count[i] != 0)
+        {
+            centers->y[i] = centers->y_sum[i] / centers->count[i];
+            centers->cb[i] = centers->cb_sum[i] / centers->count[i];
+            centers->cr[i] = centers->cr_sum[i] / centers->count[i];
+        }
+        else
+        {
+            /** 
+             * Re initialize the empty center with a random point from the dataset.
+             * Ideally we should use the farthest point from the center of the largest group. 
+             */
+            ycbcr_pixel_t random_pixel = source_pixel(source, next_random(random_state) % (source->width * source->height));
+            centers->y[i] = random_pixel.y;
+            centers->cb[i] = random_pixel.cb;
+            centers->cr[i] = random_pixel.cr;
+        }
+    }
+}
+
+static void save_centers(int k, const centers_t* centers, color_palette_image_t* dst)
+{
+    for (int i = 0; i < k; i++)
+    {
+        dst->color_palettes[i].ycbcr.y = roundf(centers->y[i]);
+        dst->color_palettes[i].ycbcr.cb = roundf(centers->cb[i]);
+        dst->color_palettes[i].ycbcr.cr = roundf(centers->cr[i]);
+    }
+}
+
+static double assign_pixels(int k, centers_t* centers, const image_t* image, color_palette_image_t* dst)
+{
+    switch (cpu_isa_get())
+    {
+#if CPU_DISPATCH_X86
+    case CPU_ISA_AVX512:
+        if (k == 32)
+        {
+            return update_clusters_fast32_avx512(centers, image, dst);
+        }
+        else if (k == 16)
+        {
+            return update_clusters_fast16_avx512(centers, image, dst);
+        }
+        return update_clusters_avx512(k, centers, image, dst);
+    case CPU_ISA_AVX2:
+        if (k == 32)
+        {
+            return update_clusters_fast32_avx2(centers, image, dst);
+        }
+        else if (k == 16)
+        {
+            return update_clusters_fast16_avx2(centers, image, dst);
+        }
+        return update_clusters_avx2(k, centers, image, dst);
+#endif
+    default:
+        return update_clusters_scalar(k, centers, image, dst);
+    }
+}
+
+static double assign_source(int k, centers_t* centers, const source_t* source, color_palette_image_t* dst)
+{
+    if (source->planar)
+    {
+        return assign_planar(k, centers, source->planar, dst);
+    }
+    return assign_pixels(k, centers, source->packed, dst);
+}
+
+/** assign_pixels on blocks of bgr, each converted into ycbcr right before */
+static double convert_assign_pixels(int k, centers_t* centers, const image_t* bgr, image_t* ycbcr, color_palette_image_t* dst)
+{
+    size_t n_pixels = bgr->width * bgr->height;
+    double error = 0;
+    for (size_t i = 0; i < n_pixels; i += CONVERT_BLOCK_PIXELS)
+    {
+        image_t bgr_block = *bgr;
+        bgr_block.pixels += i;
+        bgr_block.width = n_pixels - i < CONVERT_BLOCK_PIXELS ? n_pixels - i : CONVERT_BLOCK_PIXELS;
+        bgr_block.height = 1;
+        image_t ycbcr_block = bgr_block;
+        ycbcr_block.pixels = ycbcr->pixels + i;
+        color_palette_image_t dst_block = *dst;
+        dst_block.pixel_indexs += i;
+        dst_block.width = bgr_block.width;
+        dst_block.height = 1;
+        bgr_image_to_ycbcr(&bgr_block, &ycbcr_block);
+        error += assign_pixels(k, centers, &ycbcr_block, &dst_block);
+    }
+    ycbcr->color_space = COLOR_SPACE_YCBCR;
+    return error;
+}
+
+static double assign_planar(int k, centers_t* centers, const planar_image_t* image, color_palette_image_t* dst)
+{
+    switch (cpu_isa_get())
+    {
+#if CPU_DISPATCH_X86
+    case CPU_ISA_AVX512:
+        return update_clusters_planar_avx512(k, centers, image, dst);
+    case CPU_ISA_AVX2:
+        return update_clusters_planar_avx2(k, centers, image, dst);
+#endif
+    default:
+        return update_clusters_planar_scalar(k, centers, image, dst);
+    }
+}
+
+static ycbcr_pixel_t source_pixel(const source_t* source, size_t index)
+{
+    if (source->bgr)
+    {
+        image_t bgr = *source->bgr;
+        bgr.pixels += index;
+        bgr.width = 1;
+        bgr.height = 1;
+        pixel_t pixel;
+        image_t ycbcr = bgr;
+        ycbcr.pixels = &pixel;
+        bgr_image_to_ycbcr(&bgr, &ycbcr);
+        return pixel.ycbcr;
+    }
+    if (source->packed)
     {
-        return -1;
+        return source->packed->pixels[index].ycbcr;
     }
+    const planar_image_t* image = source->planar;
+    size_t offset = index / image->width * image->stride + index % image->width;
+    ycbcr_pixel_t pixel = { image->planes[0][offset], (int8_t)image->planes[1][offset], (int8_t)image->planes[2][offset] };
+    return pixel;
+}
 
-    double last_error = INFINITY;
-    double error_thres = ERROR_THRES_PER_PIXEL * image->width * image->height;
-    center_t* centers = (center_t*)malloc(k * sizeof(center_t));
-    if (!centers)
+static size_t build_histogram(const source_t* source, uint32_t* bins, histogram_point_t* points)
+{
+    memset(bins, 0xFF, HISTOGRAM_BINS * sizeof(uint32_t));
+    size_t n_points = 0;
+    if (source->bgr)
     {
-        return -1;
+        size_t n_pixels = source->width * source->height;
+        for (size_t i = 0; i < n_pixels; i += CONVERT_BLOCK_PIXELS)
+        {
+            image_t bgr = *source->bgr;
+            bgr.pixels += i;
+            bgr.width = n_pixels - i < CONVERT_BLOCK_PIXELS ? n_pixels - i : CONVERT_BLOCK_PIXELS;
+            bgr.height = 1;
+            image_t ycbcr = bgr;
+            ycbcr.pixels = source->ycbcr->pixels + i;
+            bgr_image_to_ycbcr(&bgr, &ycbcr);
+            for (size_t j = 0; j < ycbcr.width; j++)
+            {
+                const ycbcr_pixel_t* pixel = &ycbcr.pixels[j].ycbcr;
+                histogram_add(bins, points, &n_points, pixel->y, pixel->cb, pixel->cr);
+            }
+        }
+        source->ycbcr->color_space = COLOR_SPACE_YCBCR;
     }
-    if (use_dst_as_hint)
+    else if (source->packed)
     {
-        /** Use dst as hint to stabilize the frames */
-        for (int i = 0; i < k; i++)
+        const image_t* image = source->packed;
+        for (size_t i = 0; i < image->width * image->height; i++)
         {
-            centers[i].y = dst->color_palettes[i].ycbcr.y;
-            centers[i].cb = dst->color_palettes[i].ycbcr.cb;
-            centers[i].cr = dst->color_palettes[i].ycbcr.cr;
+            const ycbcr_pixel_t* pixel = &image->pixels[i].ycbcr;
+            histogram_add(bins, points, &n_points, pixel->y, pixel->cb, pixel->cr);
         }
     }
     else
     {
-        /** Initialize the centers with random pixels from the image */
-        for (int i = 0; i < k; i++)
+        const planar_image_t* image = source->planar;
+        for (size_t row = 0; row < image->height; row++)
         {
-            size_t index = rand() % (image->width * image->height);
-            pixel_t* pixel = &image->pixels[index];
-            centers[i].y = pixel->ycbcr.y;
-            centers[i].cb = pixel->ycbcr.cb;
-            centers[i].cr = pixel->ycbcr.cr;
+            const uint8_t* y = image->planes[0] + row * image->stride;
+            const int8_t* cb = (const int8_t*)image->planes[1] + row * image->stride;
+            const int8_t* cr = (const int8_t*)image->planes[2] + row * image->stride;
+            for (size_t x = 0; x < image->width; x++)
+            {
+                histogram_add(bins, points, &n_points, y[x], cb[x], cr[x]);
+            }
         }
     }
-    int iteration = 0;
-    for(;;)
+    for (size_t i = 0; i < n_points; i++)
     {
-        /** clear center sum and counters */
-        for (int i = 0; i < 16; i++)
-        {
-            centers[i].y_sum = 0;
-            centers[i].cb_sum = 0;
-            centers[i].cr_sum = 0;
-            centers[i].count = 0;
-        }
+        points[i].y = (float)points[i].y_sum / points[i].count;
+        points[i].cb = (float)points[i].cb_sum / points[i].count;
+        points[i].cr = (float)points[i].cr_sum / points[i].count;
+    }
+    return n_points;
+}
 
-        double error = INFINITY;
-#ifdef __AVX2__
-        if (k == 32)
-        {
-            error = update_clusters_fast32(centers, image, dst);
-        }
-        else if (k == 16)
-        {
-            error = update_clusters_fast16(centers, image, dst);
-        }
-        else
-        {
-            error = update_clusters(k, centers, image, dst);
-        }
-#else
-        error = update_clusters(k, centers, image, dst);
-#endif
+static inline void histogram_add(uint32_t* bins, histogram_point_t* points, size_t* n_points, uint8_t y, int8_t cb, int8_t cr)
+{
+    uint32_t key = ((uint32_t)(y >> (8 - HISTOGRAM_Y_BITS)) << (2 * HISTOGRAM_C_BITS))
+        | ((uint32_t)((uint8_t)(cb + 128) >> (8 - HISTOGRAM_C_BITS)) << HISTOGRAM_C_BITS)
+        | (uint32_t)((uint8_t)(cr + 128) >> (8 - HISTOGRAM_C_BITS));
+    uint32_t point_index = bins[key];
+    if (point_index == HISTOGRAM_NO_POINT)
+    {
+        point_index = (*n_points)++;
+        bins[key] = point_index;
+        memset(&points[point_index], 0, sizeof(histogram_point_t));
+    }
+    histogram_point_t* point = &points[point_index];
+    point->y_sum += y;
+    point->cb_sum += cb;
+    point->cr_sum += cr;
+    point->count++;
+}
 
-        /** Check for exit condition */
-        if (fabs(last_error - error) < error_thres)
-        {
-            break;
-        }
-        last_error = error;
+static double update_histogram_clusters(int k, centers_t* centers, const histogram_point_t* points, size_t n_points)
+{
+    switch (cpu_isa_get())
+    {
+#if CPU_DISPATCH_X86
+    case CPU_ISA_AVX512:
+        return update_histogram_clusters_avx512(k, centers, points, n_points);
+    case CPU_ISA_AVX2:
+        return update_histogram_clusters_avx2(k, centers, points, n_points);
+#endif
+    default:
+        return update_histogram_clusters_scalar(k, centers, points, n_points);
+    }
+}
 
-        /** Calculate the new centers */
-        for (int i = 0; i < k; i++)
+/** Same as update_clusters_body, with every bin weighted by its pixel count */
+CPU_KERNEL_BODY double update_histogram_clusters_body(int k, centers_t* centers, const histogram_point_t* points, size_t n_points)
+{
+    double error = 0;
+    for (size_t i = 0; i < n_points; i++)
+    {
+        /** Keep this loop simple to maximize vectorization */
+        float min_distance = INFINITY;
+        int index = 0;
+        const histogram_point_t* point = &points[i];
+        for (int j = 0; j < k; j++)
         {
-            if (centers[i].count != 0)
-            {
-                centers[i].y = centers[i].y_sum / centers[i].count;
-                centers[i].cb = centers[i].cb_sum / centers[i].count;
-                centers[i].cr = centers[i].cr_sum / centers[i].count;
-            }
-            else
+            float y_diff = point->y - centers->y[j];
+            float cb_diff = point->cb - centers->cb[j];
+            float cr_diff = point->cr - centers->cr[j];
+            float distance = y_diff * y_diff + cb_diff * cb_diff + cr_diff * cr_diff;
+            if (distance < min_distance)
             {
-                /** 
-                 * Re initialize the empty center with a random point from the dataset.
-                 * Ideally we should use the farthest point from the center of the largest group. 
-                 */
-                pixel_t random_pixel = image->pixels[rand()%(image->width * image->height)];
-                centers[i].y = random_pixel.ycbcr.y;
-                centers[i].cb = random_pixel.ycbcr.cb;
-                centers[i].cr = random_pixel.ycbcr.cr;
+                min_distance = distance;
+                index = j;
             }
         }
-        iteration++;
-    }
-    /** Re paint the image with the new centers */
-    for (int i = 0; i < k; i++)
-    {
-        dst->color_palettes[i].ycbcr.y = roundf(centers[i].y);
-        dst->color_palettes[i].ycbcr.cb = roundf(centers[i].cb);
-        dst->color_palettes[i].ycbcr.cr = roundf(centers[i].cr);
+        error += sqrtf(min_distance) * point->count;
+
+        centers->y_sum[index] += point->y_sum;
+        centers->cb_sum[index] += point->cb_sum;
+        centers->cr_sum[index] += point->cr_sum;
+        centers->count[index] += point->count;
     }
-    free(centers);
-    return iteration;
+    return error;
 }
 
-inline static double update_clusters(int k, center_t* centers, const image_t* image, color_palette_image_t* dst)
+CPU_KERNEL_BODY double update_clusters_body(int k, centers_t* centers, const image_t* image, color_palette_image_t* dst)
 {
     double error = 0;
     /** Calculate the cluster index and error for each pixel */
@@ -159,11 +1000,10 @@ inline static double update_clusters(int k, center_t* centers, const image_t* im
         ycbcr_pixel_t* pixel = &image->pixels[i].ycbcr;
         for (int j = 0; j < k; j++)
         {
-            center_t* center = &centers[j];
             float distance = sqrtf(
-                powf((float)pixel->y - center->y, 2) + 
-                powf((float)pixel->cb - center->cb, 2) + 
-                powf((float)pixel->cr - center->cr, 2));
+                powf((float)pixel->y - centers->y[j], 2) + 
+                powf((float)pixel->cb - centers->cb[j], 2) + 
+                powf((float)pixel->cr - centers->cr[j], 2));
             if (distance < min_distance)
             {
                 min_distance = distance;
@@ -173,35 +1013,367 @@ inline static double update_clusters(int k, center_t* centers, const image_t* im
         dst->pixel_indexs[i] = index;
         error += min_distance;
 
-        centers[dst->pixel_indexs[i]].y_sum += image->pixels[i].ycbcr.y;
-        centers[dst->pixel_indexs[i]].cb_sum += image->pixels[i].ycbcr.cb;
-        centers[dst->pixel_indexs[i]].cr_sum += image->pixels[i].ycbcr.cr;
-        centers[dst->pixel_indexs[i]].count++;
+        centers->y_sum[index] += image->pixels[i].ycbcr.y;
+        centers->cb_sum[index] += image->pixels[i].ycbcr.cb;
+        centers->cr_sum[index] += image->pixels[i].ycbcr.cr;
+        centers->count[index]++;
+    }
+    return error;
+}
+
+/** Same as update_clusters_body, row by row over the planes */
+CPU_KERNEL_BODY double update_clusters_planar_body(int k, centers_t* centers, const planar_image_t* image, color_palette_image_t* dst)
+{
+    double error = 0;
+    for (size_t row = 0; row < image->height; row++)
+    {
+        const uint8_t* y = image->planes[0] + row * image->stride;
+        const int8_t* cb = (const int8_t*)image->planes[1] + row * image->stride;
+        const int8_t* cr = (const int8_t*)image->planes[2] + row * image->stride;
+        uint8_t* indexs = dst->pixel_indexs + row * image->width;
+        for (size_t x = 0; x < image->width; x++)
+        {
+            float min_distance = INFINITY;
+            int index = -1;
+            for (int j = 0; j < k; j++)
+            {
+                float distance = sqrtf(
+                    powf((float)y[x] - centers->y[j], 2) +
+                    powf((float)cb[x] - centers->cb[j], 2) +
+                    powf((float)cr[x] - centers->cr[j], 2));
+                if (distance < min_distance)
+                {
+                    min_distance = distance;
+                    index = j;
+                }
+            }
+            indexs[x] = index;
+            error += min_distance;
+
+            centers->y_sum[index] += y[x];
+            centers->cb_sum[index] += cb[x];
+            centers->cr_sum[index] += cr[x];
+            centers->count[index]++;
+        }
+    }
+    return error;
+}
+
+static double hamerly_assign_pixels(int k, centers_t* centers, hamerly_bounds_t* bounds, const image_t* image, color_palette_image_t* dst)
+{
+    switch (cpu_isa_get())
+    {
+#if CPU_DISPATCH_X86
+    case CPU_ISA_AVX512:
+        return hamerly_assign_avx512(k, centers, bounds, image, dst);
+    case CPU_ISA_AVX2:
+        return hamerly_assign_avx2(k, centers, bounds, image, dst);
+#endif
+    default:
+        return hamerly_assign_scalar(k, centers, bounds, image, dst);
+    }
+}
+
+/** The drift of the centers loosens every lower bound, the new center gaps are computed from scratch */
+static void hamerly_update_bounds(int k, const centers_t* old_centers, const centers_t* centers, hamerly_bounds_t* bounds)
+{
+    bounds->max_drift = 0;
+    bounds->max_drift_index = -1;
+    bounds->second_drift = 0;
+    for (int i = 0; i < k; i++)
+    {
+        float drift = sqrtf(
+            powf(centers->y[i] - old_centers->y[i], 2) +
+            powf(centers->cb[i] - old_centers->cb[i], 2) +
+            powf(centers->cr[i] - old_centers->cr[i], 2));
+        if (drift > bounds->max_drift)
+        {
+            bounds->second_drift = bounds->max_drift;
+            bounds->max_drift = drift;
+            bounds->max_drift_index = i;
+        }
+        else if (drift > bounds->second_drift)
+        {
+            bounds->second_drift = drift;
+        }
+    }
+    for (int i = 0; i < k; i++)
+    {
+        float min_gap = INFINITY;
+        for (int j = 0; j < k; j++)
+        {
+            float gap = sqrtf(
+                powf(centers->y[i] - centers->y[j], 2) +
+                powf(centers->cb[i] - centers->cb[j], 2) +
+                powf(centers->cr[i] - centers->cr[j], 2));
+            if (j != i && gap < min_gap)
+            {
+                min_gap = gap;
+            }
+        }
+        bounds->half_gap[i] = min_gap / 2;
+    }
+}
+
+/**
+ * Same sums and error as update_clusters_body.
+ * The distance to the own center is always computed, it is the pixel's share of the error.
+ */
+CPU_KERNEL_BODY double hamerly_assign_body(int k, centers_t* centers, hamerly_bounds_t* bounds, const image_t* image, color_palette_image_t* dst)
+{
+    double error = 0;
+    for (size_t i = 0; i < image->width * image->height; i++)
+    {
+        ycbcr_pixel_t* pixel = &image->pixels[i].ycbcr;
+        int index = dst->pixel_indexs[i];
+        float lower = bounds->lower[i] - (index == bounds->max_drift_index ? bounds->second_drift : bounds->max_drift);
+        float distance = sqrtf(
+            powf((float)pixel->y - centers->y[index], 2) +
+            powf((float)pixel->cb - centers->cb[index], 2) +
+            powf((float)pixel->cr - centers->cr[index], 2));
+        if (!(distance < fmaxf(lower, bounds->half_gap[index]) - HAMERLY_MARGIN))
+        {
+            /** Full search. The runner up becomes the new lower bound. */
+            float min_distance = INFINITY;
+            float second_distance = INFINITY;
+            index = -1;
+            for (int j = 0; j < k; j++)
+            {
+                float candidate = sqrtf(
+                    powf((float)pixel->y - centers->y[j], 2) +
+                    powf((float)pixel->cb - centers->cb[j], 2) +
+                    powf((float)pixel->cr - centers->cr[j], 2));
+                if (candidate < min_distance)
+                {
+                    second_distance = min_distance;
+                    min_distance = candidate;
+                    index = j;
+                }
+                else if (candidate < second_distance)
+                {
+                    second_distance = candidate;
+                }
+            }
+            distance = min_distance;
+            lower = second_distance;
+        }
+        bounds->lower[i] = lower;
+        dst->pixel_indexs[i] = index;
+        error += distance;
+
+        centers->y_sum[index] += pixel->y;
+        centers->cb_sum[index] += pixel->cb;
+        centers->cr_sum[index] += pixel->cr;
+        centers->count[index]++;
     }
     return error;
 }
 
-#if defined(__AVX512F__)
+static size_t pool_partials(const k_means_pool_t* pool, size_t height)
+{
+    return pool->deterministic ? (height + STRIPE_ROWS - 1) / STRIPE_ROWS : (size_t)pool->n_threads;
+}
+
+static int pool_reserve(k_means_pool_t* pool, size_t n_partials, int k)
+{
+    if (n_partials <= pool->partials_capacity && k <= pool->k_capacity)
+    {
+        return 0;
+    }
+    size_t capacity = n_partials > pool->partials_capacity ? n_partials : pool->partials_capacity;
+    int k_capacity = k > pool->k_capacity ? k : pool->k_capacity;
+    /** Padded k keeps every partial on whole cache lines */
+    size_t sums_size = CENTERS_SUMS_SIZE(CENTERS_PAD(k_capacity));
+    partial_t* partials = aligned_alloc(CACHE_LINE_SIZE, capacity * sizeof(partial_t));
+    void* partial_sums = aligned_alloc(CACHE_LINE_SIZE, capacity * sums_size);
+    if (!partials || !partial_sums)
+    {
+        free(partials);
+        free(partial_sums);
+        return -1;
+    }
+    for (size_t i = 0; i < capacity; i++)
+    {
+        centers_bind_sums(&partials[i].centers, (uint8_t*)partial_sums + i * sums_size, CENTERS_PAD(k_capacity));
+    }
+    free(pool->partials);
+    free(pool->partial_sums);
+    pool->partials = partials;
+    pool->partial_sums = partial_sums;
+    pool->partials_capacity = capacity;
+    pool->k_capacity = k_capacity;
+    return 0;
+}
+
+/** assign_pixels over all stripes, then the partial sums are reduced in partial order */
+static double pool_assign_pixels(k_means_pool_t* pool, int k, centers_t* centers, const image_t* image, const image_t* bgr, color_palette_image_t* dst)
+{
+    for (size_t i = 0; i < pool->n_partials; i++)
+    {
+        partial_t* partial = &pool->partials[i];
+        partial->error = 0;
+        partial->centers.y = centers->y;
+        partial->centers.cb = centers->cb;
+        partial->centers.cr = centers->cr;
+        clear_centers(k, &partial->centers);
+    }
+    pool->k = k;
+    pool->image = image;
+    pool->bgr = bgr;
+    pool->dst = dst;
+    atomic_store_explicit(&pool->next_stripe, 0, memory_order_relaxed);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->generation++;
+    pool->n_busy = pool->n_started;
+    pthread_cond_broadcast(&pool->work_cond);
+    pthread_mutex_unlock(&pool->lock);
+    pool_work(pool, 0);
+    pthread_mutex_lock(&pool->lock);
+    while (pool->n_busy != 0)
+    {
+        pthread_cond_wait(&pool->done_cond, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    double error = 0;
+    for (size_t i = 0; i < pool->n_partials; i++)
+    {
+        const partial_t* partial = &pool->partials[i];
+        error += partial->error;
+        for (int j = 0; j < k; j++)
+        {
+            centers->y_sum[j] += partial->centers.y_sum[j];
+            centers->cb_sum[j] += partial->centers.cb_sum[j];
+            centers->cr_sum[j] += partial->centers.cr_sum[j];
+            centers->count[j] += partial->centers.count[j];
+        }
+    }
+    return error;
+}
+
+/** Takes stripes until there are none left */
+static void pool_work(k_means_pool_t* pool, int worker)
+{
+    for (;;)
+    {
+        size_t stripe = atomic_fetch_add_explicit(&pool->next_stripe, 1, memory_order_relaxed);
+        if (stripe >= pool->n_stripes)
+        {
+            return;
+        }
+        partial_t* partial = &pool->partials[pool->deterministic ? stripe : (size_t)worker];
+        size_t row = stripe * STRIPE_ROWS;
+        size_t rows = pool->image->height - row < STRIPE_ROWS ? pool->image->height - row : STRIPE_ROWS;
+        /** The kernels take whole images. A stripe is a view of the rows. */
+        image_t stripe_image = *pool->image;
+        stripe_image.pixels += row * stripe_image.width;
+        stripe_image.height = rows;
+        color_palette_image_t stripe_dst = *pool->dst;
+        stripe_dst.pixel_indexs += row * stripe_dst.width;
+        stripe_dst.height = rows;
+        if (pool->bgr)
+        {
+            image_t stripe_bgr = *pool->bgr;
+            stripe_bgr.pixels += row * stripe_bgr.width;
+            stripe_bgr.height = rows;
+            bgr_image_to_ycbcr(&stripe_bgr, &stripe_image);
+        }
+        partial->error += assign_pixels(pool->k, &partial->centers, &stripe_image, &stripe_dst);
+    }
+}
+
+static void* pool_main(void* ctx)
+{
+    pool_worker_t* worker = (pool_worker_t*)ctx;
+    k_means_pool_t* pool = worker->pool;
+    uint64_t generation = 0;
+    pthread_mutex_lock(&pool->lock);
+    for (;;)
+    {
+        while (!pool->stop && pool->generation == generation)
+        {
+            pthread_cond_wait(&pool->work_cond, &pool->lock);
+        }
+        if (pool->stop)
+        {
+            break;
+        }
+        generation = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+
+        pool_work(pool, worker->index);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->n_busy == 0)
+        {
+            pthread_cond_signal(&pool->done_cond);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+/** The generic loops, auto vectorized for each target */
+static double update_clusters_scalar(int k, centers_t* centers, const image_t* image, color_palette_image_t* dst)
+{
+    return update_clusters_body(k, centers, image, dst);
+}
+
+static double update_histogram_clusters_scalar(int k, centers_t* centers, const histogram_point_t* points, size_t n_points)
+{
+    return update_histogram_clusters_body(k, centers, points, n_points);
+}
+
+static double hamerly_assign_scalar(int k, centers_t* centers, hamerly_bounds_t* bounds, const image_t* image, color_palette_image_t* dst)
+{
+    return hamerly_assign_body(k, centers, bounds, image, dst);
+}
+
+static double update_clusters_planar_scalar(int k, centers_t* centers, const planar_image_t* image, color_palette_image_t* dst)
+{
+    return update_clusters_planar_body(k, centers, image, dst);
+}
+
+#if CPU_DISPATCH_X86
 
-inline static double update_clusters_fast16(center_t* centers, const image_t* image, color_palette_image_t* dst)
+CPU_TARGET_AVX2 static double hamerly_assign_avx2(int k, centers_t* centers, hamerly_bounds_t* bounds, const image_t* image, color_palette_image_t* dst)
+{
+    return hamerly_assign_body(k, centers, bounds, image, dst);
+}
+
+CPU_TARGET_AVX512 static double hamerly_assign_avx512(int k, centers_t* centers, hamerly_bounds_t* bounds, const image_t* image, color_palette_image_t* dst)
+{
+    return hamerly_assign_body(k, centers, bounds, image, dst);
+}
+
+CPU_TARGET_AVX2 static double update_clusters_avx2(int k, centers_t* centers, const image_t* image, color_palette_image_t* dst)
+{
+    return update_clusters_body(k, centers, image, dst);
+}
+
+CPU_TARGET_AVX2 static double update_histogram_clusters_avx2(int k, centers_t* centers, const histogram_point_t* points, size_t n_points)
+{
+    return update_histogram_clusters_body(k, centers, points, n_points);
+}
+
+CPU_TARGET_AVX512 static double update_clusters_avx512(int k, centers_t* centers, const image_t* image, color_palette_image_t* dst)
+{
+    return update_clusters_body(k, centers, image, dst);
+}
+
+CPU_TARGET_AVX512 static double update_histogram_clusters_avx512(int k, centers_t* centers, const histogram_point_t* points, size_t n_points)
+{
+    return update_histogram_clusters_body(k, centers, points, n_points);
+}
+
+CPU_TARGET_AVX512 static double update_clusters_fast16_avx512(centers_t* centers, const image_t* image, color_palette_image_t* dst)
 {
     double error = 0;
     /** prepare center vectors */
-    __m512 y_c = _mm512_set_ps(
-        centers[15].y, centers[14].y, centers[13].y, centers[12].y,
-        centers[11].y, centers[10].y, centers[9].y, centers[8].y,
-        centers[7].y, centers[6].y, centers[5].y, centers[4].y,
-        centers[3].y, centers[2].y, centers[1].y, centers[0].y);
-    __m512 cb_c = _mm512_set_ps(
-        centers[15].cb, centers[14].cb, centers[13].cb, centers[12].cb,
-        centers[11].cb, centers[10].cb, centers[9].cb, centers[8].cb,
-        centers[7].cb, centers[6].cb, centers[5].cb, centers[4].cb,
-        centers[3].cb, centers[2].cb, centers[1].cb, centers[0].cb);
-    __m512 cr_c = _mm512_set_ps(
-        centers[15].cr, centers[14].cr, centers[13].cr, centers[12].cr,
-        centers[11].cr, centers[10].cr, centers[9].cr, centers[8].cr,
-        centers[7].cr, centers[6].cr, centers[5].cr, centers[4].cr,
-        centers[3].cr, centers[2].cr, centers[1].cr, centers[0].cr);
+    __m512 y_c = _mm512_load_ps(centers->y);
+    __m512 cb_c = _mm512_load_ps(centers->cb);
+    __m512 cr_c = _mm512_load_ps(centers->cr);
 
     /** Calculate the cluster index and error for each pixel */
     for (size_t i = 0; i < image->width * image->height; i++)
@@ -228,48 +1400,24 @@ inline static double update_clusters_fast16(center_t* centers, const image_t* im
         dst->pixel_indexs[i] = index;
         error += sqrtf(min_distance);
 
-        centers[index].y_sum += image->pixels[i].ycbcr.y;
-        centers[index].cb_sum += image->pixels[i].ycbcr.cb;
-        centers[index].cr_sum += image->pixels[i].ycbcr.cr;
-        centers[index].count++;
+        centers->y_sum[index] += image->pixels[i].ycbcr.y;
+        centers->cb_sum[index] += image->pixels[i].ycbcr.cb;
+        centers->cr_sum[index] += image->pixels[i].ycbcr.cr;
+        centers->count[index]++;
     }
     return error;
 }
 
-inline static double update_clusters_fast32(center_t* centers, const image_t* image, color_palette_image_t* dst)
+CPU_TARGET_AVX512 static double update_clusters_fast32_avx512(centers_t* centers, const image_t* image, color_palette_image_t* dst)
 {
     double error = 0;
     /** prepare center vectors */
-    __m512 y_c0 = _mm512_set_ps(
-        centers[15].y, centers[14].y, centers[13].y, centers[12].y,
-        centers[11].y, centers[10].y, centers[9].y, centers[8].y,
-        centers[7].y, centers[6].y, centers[5].y, centers[4].y,
-        centers[3].y, centers[2].y, centers[1].y, centers[0].y);
-    __m512 y_c1 = _mm512_set_ps(
-        centers[31].y, centers[30].y, centers[29].y, centers[28].y,
-        centers[27].y, centers[26].y, centers[25].y, centers[24].y,
-        centers[23].y, centers[22].y, centers[21].y, centers[20].y,
-        centers[19].y, centers[18].y, centers[17].y, centers[16].y);
-    __m512 cb_c0 = _mm512_set_ps(
-        centers[15].cb, centers[14].cb, centers[13].cb, centers[12].cb,
-        centers[11].cb, centers[10].cb, centers[9].cb, centers[8].cb,
-        centers[7].cb, centers[6].cb, centers[5].cb, centers[4].cb,
-        centers[3].cb, centers[2].cb, centers[1].cb, centers[0].cb);
-    __m512 cb_c1 = _mm512_set_ps(
-        centers[31].cb, centers[30].cb, centers[29].cb, centers[28].cb,
-        centers[27].cb, centers[26].cb, centers[25].cb, centers[24].cb,
-        centers[23].cb, centers[22].cb, centers[21].cb, centers[20].cb,
-        centers[19].cb, centers[18].cb, centers[17].cb, centers[16].cb);
-    __m512 cr_c0 = _mm512_set_ps(
-        centers[15].cr, centers[14].cr, centers[13].cr, centers[12].cr,
-        centers[11].cr, centers[10].cr, centers[9].cr, centers[8].cr,
-        centers[7].cr, centers[6].cr, centers[5].cr, centers[4].cr,
-        centers[3].cr, centers[2].cr, centers[1].cr, centers[0].cr);
-    __m512 cr_c1 = _mm512_set_ps(
-        centers[31].cr, centers[30].cr, centers[29].cr, centers[28].cr,
-        centers[27].cr, centers[26].cr, centers[25].cr, centers[24].cr,
-        centers[23].cr, centers[22].cr, centers[21].cr, centers[20].cr,
-        centers[19].cr, centers[18].cr, centers[17].cr, centers[16].cr);
+    __m512 y_c0 = _mm512_load_ps(centers->y);
+    __m512 y_c1 = _mm512_load_ps(centers->y + 16);
+    __m512 cb_c0 = _mm512_load_ps(centers->cb);
+    __m512 cb_c1 = _mm512_load_ps(centers->cb + 16);
+    __m512 cr_c0 = _mm512_load_ps(centers->cr);
+    __m512 cr_c1 = _mm512_load_ps(centers->cr + 16);
 
     /** Calculate the cluster index and error for each pixel */
     for (size_t i = 0; i < image->width * image->height; i++)
@@ -315,48 +1463,25 @@ inline static double update_clusters_fast32(center_t* centers, const image_t* im
         dst->pixel_indexs[i] = index;
         error += sqrtf(min_distance);
 
-        centers[index].y_sum += image->pixels[i].ycbcr.y;
-        centers[index].cb_sum += image->pixels[i].ycbcr.cb;
-        centers[index].cr_sum += image->pixels[i].ycbcr.cr;
-        centers[index].count++;
+        centers->y_sum[index] += image->pixels[i].ycbcr.y;
+        centers->cb_sum[index] += image->pixels[i].ycbcr.cb;
+        centers->cr_sum[index] += image->pixels[i].ycbcr.cr;
+        centers->count[index]++;
     }
     return error;
 }
 
-#elif defined(__AVX2__)
-
-inline static double update_clusters_fast16(center_t* centers, const image_t* image, color_palette_image_t* dst)
+CPU_TARGET_AVX2 static double update_clusters_fast16_avx2(centers_t* centers, const image_t* image, color_palette_image_t* dst)
 {
     double error = 0;
-    /** clear center sum and counters */
-    for (int i = 0; i < 16; i++)
-    {
-        centers[i].y_sum = 0;
-        centers[i].cb_sum = 0;
-        centers[i].cr_sum = 0;
-        centers[i].count = 0;
-    }
-
     /** prepare center vectors */
     
-    __m256 y_lo = _mm256_set_ps(
-        centers[7].y, centers[6].y, centers[5].y, centers[4].y,
-        centers[3].y, centers[2].y, centers[1].y, centers[0].y);
-    __m256 y_hi = _mm256_set_ps(
-        centers[15].y, centers[14].y, centers[13].y, centers[12].y,
-        centers[11].y, centers[10].y, centers[9].y, centers[8].y);
-    __m256 cb_lo = _mm256_set_ps(
-        centers[7].cb, centers[6].cb, centers[5].cb, centers[4].cb,
-        centers[3].cb, centers[2].cb, centers[1].cb, centers[0].cb);
-    __m256 cb_hi = _mm256_set_ps(
-        centers[15].cb, centers[14].cb, centers[13].cb, centers[12].cb,
-        centers[11].cb, centers[10].cb, centers[9].cb, centers[8].cb);
-    __m256 cr_lo = _mm256_set_ps(
-        centers[7].cr, centers[6].cr, centers[5].cr, centers[4].cr,
-        centers[3].cr, centers[2].cr, centers[1].cr, centers[0].cr);
-    __m256 cr_hi = _mm256_set_ps(
-        centers[15].cr, centers[14].cr, centers[13].cr, centers[12].cr,
-        centers[11].cr, centers[10].cr, centers[9].cr, centers[8].cr);
+    __m256 y_lo = _mm256_load_ps(centers->y);
+    __m256 y_hi = _mm256_load_ps(centers->y + 8);
+    __m256 cb_lo = _mm256_load_ps(centers->cb);
+    __m256 cb_hi = _mm256_load_ps(centers->cb + 8);
+    __m256 cr_lo = _mm256_load_ps(centers->cr);
+    __m256 cr_hi = _mm256_load_ps(centers->cr + 8);
 
     /** Calculate the cluster index and error for each pixel */
     for (size_t i = 0; i < image->width * image->height; i++)
@@ -414,64 +1539,31 @@ inline static double update_clusters_fast16(center_t* centers, const image_t* im
         dst->pixel_indexs[i] = index;
         error += sqrtf(min_distance[0]);
 
-        centers[index].y_sum += image->pixels[i].ycbcr.y;
-        centers[index].cb_sum += image->pixels[i].ycbcr.cb;
-        centers[index].cr_sum += image->pixels[i].ycbcr.cr;
-        centers[index].count++;
+        centers->y_sum[index] += image->pixels[i].ycbcr.y;
+        centers->cb_sum[index] += image->pixels[i].ycbcr.cb;
+        centers->cr_sum[index] += image->pixels[i].ycbcr.cr;
+        centers->count[index]++;
     }
     return error;
 }
 
-inline static double update_clusters_fast32(center_t* centers, const image_t* image, color_palette_image_t* dst)
+CPU_TARGET_AVX2 static double update_clusters_fast32_avx2(centers_t* centers, const image_t* image, color_palette_image_t* dst)
 {
     double error = 0;
-    /** clear center sum and counters */
-    for (int i = 0; i < 32; i++)
-    {
-        centers[i].y_sum = 0;
-        centers[i].cb_sum = 0;
-        centers[i].cr_sum = 0;
-        centers[i].count = 0;
-    }
-
     /** prepare center vectors */
     
-    __m256 y_0 = _mm256_set_ps(
-        centers[7].y, centers[6].y, centers[5].y, centers[4].y,
-        centers[3].y, centers[2].y, centers[1].y, centers[0].y);
-    __m256 y_1 = _mm256_set_ps(
-        centers[15].y, centers[14].y, centers[13].y, centers[12].y,
-        centers[11].y, centers[10].y, centers[9].y, centers[8].y);
-    __m256 y_2 = _mm256_set_ps(
-        centers[23].y, centers[22].y, centers[21].y, centers[20].y,
-        centers[19].y, centers[18].y, centers[17].y, centers[16].y);
-    __m256 y_3 = _mm256_set_ps(
-        centers[31].y, centers[30].y, centers[29].y, centers[28].y,
-        centers[27].y, centers[26].y, centers[25].y, centers[24].y);
-    __m256 cb_0 = _mm256_set_ps(
-        centers[7].cb, centers[6].cb, centers[5].cb, centers[4].cb,
-        centers[3].cb, centers[2].cb, centers[1].cb, centers[0].cb);
-    __m256 cb_1 = _mm256_set_ps(
-        centers[15].cb, centers[14].cb, centers[13].cb, centers[12].cb,
-        centers[11].cb, centers[10].cb, centers[9].cb, centers[8].cb);
-    __m256 cb_2 = _mm256_set_ps(
-        centers[23].cb, centers[22].cb, centers[21].cb, centers[20].cb,
-        centers[19].cb, centers[18].cb, centers[17].cb, centers[16].cb);
-    __m256 cb_3 = _mm256_set_ps(
-        centers[31].cb, centers[30].cb, centers[29].cb, centers[28].cb,
-        centers[27].cb, centers[26].cb, centers[25].cb, centers[24].cb);
-    __m256 cr_0 = _mm256_set_ps(
-        centers[7].cr, centers[6].cr, centers[5].cr, centers[4].cr,
-        centers[3].cr, centers[2].cr, centers[1].cr, centers[0].cr);
-    __m256 cr_1 = _mm256_set_ps(
-        centers[15].cr, centers[14].cr, centers[13].cr, centers[12].cr,
-        centers[11].cr, centers[10].cr, centers[9].cr, centers[8].cr);
-    __m256 cr_2 = _mm256_set_ps(
-        centers[23].cr, centers[22].cr, centers[21].cr, centers[20].cr,
-        centers[19].cr, centers[18].cr, centers[17].cr, centers[16].cr);
-    __m256 cr_3 = _mm256_set_ps(
-        centers[31].cr, centers[30].cr, centers[29].cr, centers[28].cr,
-        centers[27].cr, centers[26].cr, centers[25].cr, centers[24].cr);
+    __m256 y_0 = _mm256_load_ps(centers->y);
+    __m256 y_1 = _mm256_load_ps(centers->y + 8);
+    __m256 y_2 = _mm256_load_ps(centers->y + 16);
+    __m256 y_3 = _mm256_load_ps(centers->y + 24);
+    __m256 cb_0 = _mm256_load_ps(centers->cb);
+    __m256 cb_1 = _mm256_load_ps(centers->cb + 8);
+    __m256 cb_2 = _mm256_load_ps(centers->cb + 16);
+    __m256 cb_3 = _mm256_load_ps(centers->cb + 24);
+    __m256 cr_0 = _mm256_load_ps(centers->cr);
+    __m256 cr_1 = _mm256_load_ps(centers->cr + 8);
+    __m256 cr_2 = _mm256_load_ps(centers->cr + 16);
+    __m256 cr_3 = _mm256_load_ps(centers->cr + 24);
 
     /** Calculate the cluster index and error for each pixel */
     for (size_t i = 0; i < image->width * image->height; i++)
@@ -567,14 +1659,131 @@ inline static double update_clusters_fast32(center_t* centers, const image_t* im
         dst->pixel_indexs[i] = index;
         error += sqrtf(min_distance[0]);
 
-        centers[index].y_sum += image->pixels[i].ycbcr.y;
-        centers[index].cb_sum += image->pixels[i].ycbcr.cb;
-        centers[index].cr_sum += image->pixels[i].ycbcr.cr;
-        centers[index].count++;
+        centers->y_sum[index] += image->pixels[i].ycbcr.y;
+        centers->cb_sum[index] += image->pixels[i].ycbcr.cb;
+        centers->cr_sum[index] += image->pixels[i].ycbcr.cr;
+        centers->count[index]++;
     }
     return error;
 }
 
-#endif
+/**
+ * Planar kernels keep one pixel per lane and walk the centers, so any k is handled.
+ * Rows are padded to PLANAR_IMAGE_ALIGN, the last vector of a row may read padding,
+ * which is only stored to the lane arrays and never accumulated.
+ * A center only replaces the best one when strictly closer, ties go to the lowest index.
+ */
+CPU_TARGET_AVX512 static double update_clusters_planar_avx512(int k, centers_t* centers, const planar_image_t* image, color_palette_image_t* dst)
+{
+    double error = 0;
+    _Alignas(64) float min_distance[16];
+    _Alignas(64) int32_t min_index[16];
+    for (size_t row = 0; row < image->height; row++)
+    {
+        const uint8_t* y_row = image->planes[0] + row * image->stride;
+        const uint8_t* cb_row = image->planes[1] + row * image->stride;
+        const uint8_t* cr_row = image->planes[2] + row * image->stride;
+        uint8_t* indexs = dst->pixel_indexs + row * image->width;
+        for (size_t x = 0; x < image->width; x += 16)
+        {
+            __m512 y = _mm512_cvtepi32_ps(_mm512_cvtepu8_epi32(_mm_load_si128((const __m128i*)(y_row + x))));
+            __m512 cb = _mm512_cvtepi32_ps(_mm512_cvtepi8_epi32(_mm_load_si128((const __m128i*)(cb_row + x))));
+            __m512 cr = _mm512_cvtepi32_ps(_mm512_cvtepi8_epi32(_mm_load_si128((const __m128i*)(cr_row + x))));
 
+            __m512 best = _mm512_set1_ps(INFINITY);
+            __m512i best_index = _mm512_setzero_si512();
+            for (int j = 0; j < k; j++)
+            {
+                __m512 y_diff = _mm512_sub_ps(y, _mm512_set1_ps(centers->y[j]));
+                __m512 cb_diff = _mm512_sub_ps(cb, _mm512_set1_ps(centers->cb[j]));
+                __m512 cr_diff = _mm512_sub_ps(cr, _mm512_set1_ps(centers->cr[j]));
+                __m512 distance = _mm512_mul_ps(y_diff, y_diff);
+                distance = _mm512_fmadd_ps(cb_diff, cb_diff, distance);
+                distance = _mm512_fmadd_ps(cr_diff, cr_diff, distance);
+                __mmask16 closer = _mm512_cmp_ps_mask(distance, best, _CMP_LT_OQ);
+                best = _mm512_mask_mov_ps(best, closer, distance);
+                best_index = _mm512_mask_mov_epi32(best_index, closer, _mm512_set1_epi32(j));
+            }
+            /** We can calculate the sqrt after we found the minimum value */
+            _mm512_store_ps(min_distance, _mm512_sqrt_ps(best));
+            _mm512_store_si512(min_index, best_index);
+
+            size_t n = image->width - x < 16 ? image->width - x : 16;
+            _mm512_mask_cvtepi32_storeu_epi8(indexs + x, (__mmask16)((1u << n) - 1), best_index);
+            for (size_t i = 0; i < n; i++)
+            {
+                int index = min_index[i];
+                error += min_distance[i];
+
+                centers->y_sum[index] += y_row[x + i];
+                centers->cb_sum[index] += (int8_t)cb_row[x + i];
+                centers->cr_sum[index] += (int8_t)cr_row[x + i];
+                centers->count[index]++;
+            }
+        }
+    }
+    return error;
+}
+
+CPU_TARGET_AVX2 static double update_clusters_planar_avx2(int k, centers_t* centers, const planar_image_t* image, color_palette_image_t* dst)
+{
+    double error = 0;
+    _Alignas(32) float min_distance[8];
+    _Alignas(32) int32_t min_index[8];
+    for (size_t row = 0; row < image->height; row++)
+    {
+        const uint8_t* y_row = image->planes[0] + row * image->stride;
+        const uint8_t* cb_row = image->planes[1] + row * image->stride;
+        const uint8_t* cr_row = image->planes[2] + row * image->stride;
+        uint8_t* indexs = dst->pixel_indexs + row * image->width;
+        for (size_t x = 0; x < image->width; x += 8)
+        {
+            __m256 y = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(y_row + x))));
+            __m256 cb = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i*)(cb_row + x))));
+            __m256 cr = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i*)(cr_row + x))));
+
+            __m256 best = _mm256_set1_ps(INFINITY);
+            __m256i best_index = _mm256_setzero_si256();
+            for (int j = 0; j < k; j++)
+            {
+                __m256 y_diff = _mm256_sub_ps(y, _mm256_set1_ps(centers->y[j]));
+                __m256 cb_diff = _mm256_sub_ps(cb, _mm256_set1_ps(centers->cb[j]));
+                __m256 cr_diff = _mm256_sub_ps(cr, _mm256_set1_ps(centers->cr[j]));
+                __m256 distance = _mm256_mul_ps(y_diff, y_diff);
+                distance = _mm256_add_ps(distance, _mm256_mul_ps(cb_diff, cb_diff));
+                distance = _mm256_add_ps(distance, _mm256_mul_ps(cr_diff, cr_diff));
+                __m256 closer = _mm256_cmp_ps(distance, best, _CMP_LT_OQ);
+                best = _mm256_blendv_ps(best, distance, closer);
+                best_index = _mm256_blendv_epi8(best_index, _mm256_set1_epi32(j), _mm256_castps_si256(closer));
+            }
+            _mm256_store_ps(min_distance, _mm256_sqrt_ps(best));
+            _mm256_store_si256((__m256i*)min_index, best_index);
+
+            size_t n = image->width - x < 8 ? image->width - x : 8;
+            __m128i narrowed = _mm_packus_epi32(_mm256_castsi256_si128(best_index), _mm256_extracti128_si256(best_index, 1));
+            narrowed = _mm_packus_epi16(narrowed, narrowed);
+            if (n == 8)
+            {
+                _mm_storel_epi64((__m128i*)(indexs + x), narrowed);
+            }
+            else
+            {
+                uint64_t bytes = (uint64_t)_mm_cvtsi128_si64(narrowed);
+                memcpy(indexs + x, &bytes, n);
+            }
+            for (size_t i = 0; i < n; i++)
+            {
+                int index = min_index[i];
+                error += min_distance[i];
+
+                centers->y_sum[index] += y_row[x + i];
+                centers->cb_sum[index] += (int8_t)cb_row[x + i];
+                centers->cr_sum[index] += (int8_t)cr_row[x + i];
+                centers->count[index]++;
+            }
+        }
+    }
+    return error;
+}
 
+#endif
@@ -5,9 +5,83 @@ extern "C" {
 #endif
 
 #include <stdbool.h>
+#include <stdint.h>
 #include "image.h"
 
+/**
+ * One-shot API. Every call allocates its workspace and draws its seed from rand().
+ * Encoders that run every frame should keep a k_means_ctx_t instead.
+ */
 int k_means_compression(const image_t* src, int k, color_palette_image_t* dst, bool use_dst_as_hint);
+/**
+ * Same contract as k_means_compression.
+ * Iterates on a weighted histogram of quantized colors, then does a single full resolution assignment.
+ */
+int k_means_histogram_compression(const image_t* src, int k, color_palette_image_t* dst, bool use_dst_as_hint);
+/**
+ * Same contract and same result as k_means_compression with the scalar kernels.
+ * Hamerly bounds skip the search over all centers for pixels that provably keep theirs.
+ */
+int k_means_hamerly_compression(const image_t* src, int k, color_palette_image_t* dst, bool use_dst_as_hint);
+
+/**
+ * Worker pool of the parallel engine.
+ * The calling thread works too, so n_threads counts it. n_threads <= 0 uses every online CPU.
+ * Deterministic pools keep partial sums per row stripe and reduce them in stripe order,
+ * so the result does not depend on the number of threads or on scheduling.
+ * Otherwise partial sums are kept per thread, which is slightly cheaper to reduce.
+ */
+typedef struct k_means_pool_s k_means_pool_t;
+
+k_means_pool_t* k_means_pool_new(int n_threads, bool deterministic);
+void k_means_pool_free(k_means_pool_t* pool);
+/**
+ * Same contract as k_means_compression.
+ * Every pass over the pixels is split into row stripes across the pool. Not reentrant per pool.
+ */
+int k_means_parallel_compression(k_means_pool_t* pool, const image_t* src, int k, color_palette_image_t* dst, bool use_dst_as_hint);
+
+typedef enum
+{
+    /** k_means_compression */
+    K_MEANS_ENGINE_PLAIN,
+    /** k_means_histogram_compression */
+    K_MEANS_ENGINE_HISTOGRAM,
+    /** k_means_hamerly_compression */
+    K_MEANS_ENGINE_HAMERLY,
+    /** k_means_parallel_compression */
+    K_MEANS_ENGINE_PARALLEL,
+    K_MEANS_ENGINE_COUNT,
+} k_means_engine_t;
+
+/**
+ * Everything one encoder needs to run k-means on width x height images: aligned center
+ * storage, the engine's scratch buffers and a random generator. All of it is allocated once.
+ * Contexts share no state, so each one may run on its own thread.
+ * The parallel engine borrows pool, which must outlive the context and must not run two contexts at once.
+ */
+typedef struct k_means_ctx_s k_means_ctx_t;
+
+/** pool is only used by K_MEANS_ENGINE_PARALLEL. k is at most COLOR_PALETTE_MAX_K. */
+k_means_ctx_t* k_means_ctx_new(k_means_engine_t engine, int k, size_t width, size_t height, k_means_pool_t* pool);
+void k_means_ctx_free(k_means_ctx_t* ctx);
+/** Seeds the generator of the initial and the re-seeded centers. New contexts all start with the same seed. */
+void k_means_ctx_seed(k_means_ctx_t* ctx, uint64_t seed);
+/**
+ * Same contract as k_means_compression.
+ * Returns -1 unless src and dst have the size and k of the context.
+ */
+int k_means_ctx_run(k_means_ctx_t* ctx, const image_t* src, color_palette_image_t* dst, bool use_dst_as_hint);
+/**
+ * k_means_ctx_run on a YCbCr planar image, without repacking it.
+ * Only the plain and histogram engines take planar images, the others return -1.
+ */
+int k_means_ctx_run_planar(k_means_ctx_t* ctx, const planar_image_t* src, color_palette_image_t* dst, bool use_dst_as_hint);
+/**
+ * k_means_ctx_run on a BGR image, converted into ycbcr on the way.
+ * The conversion is fused into the first pass over the image. bgr and ycbcr may be the same image.
+ */
+int k_means_ctx_run_bgr(k_means_ctx_t* ctx, const image_t* bgr, image_t* ycbcr, color_palette_image_t* dst, bool use_dst_as_hint);
 
 #ifdef __cplusplus
 }
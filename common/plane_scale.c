@@ -0,0 +1,111 @@
+#include "plane_scale.h"
+#include "cpu_dispatch.h"
+
+/** Source columns summed at a time. Wider than any box. */
+#define COLUMN_CHUNK (2048)
+
+static void column_sums(const uint8_t* src, size_t stride, int width, int rows, uint16_t* sums);
+
+/** First source sample of destination sample i */
+static inline int box_start(int i, int src_size, int dst_size)
+{
+    return (int)((int64_t)i * src_size / dst_size);
+}
+
+int plane_area_downscale(
+    const uint8_t* src, size_t src_stride, int src_width, int src_height,
+    uint8_t* dst, size_t dst_stride, int dst_width, int dst_height)
+{
+    if (dst_width <= 0 || dst_height <= 0
+        || src_width < dst_width || src_height < dst_height
+        || src_width > (int64_t)dst_width * PLANE_SCALE_MAX_RATIO
+        || src_height > (int64_t)dst_height * PLANE_SCALE_MAX_RATIO)
+    {
+        return -1;
+    }
+    uint16_t sums[COLUMN_CHUNK];
+    for (int dy = 0; dy < dst_height; dy++)
+    {
+        int y0 = box_start(dy, src_height, dst_height);
+        int rows = box_start(dy + 1, src_height, dst_height) - y0;
+        uint8_t* dst_row = dst + dy * dst_stride;
+        /** Vertical sums of as many whole boxes as fit the chunk, then the horizontal sums per box */
+        for (int dx = 0; dx < dst_width;)
+        {
+            int x0 = box_start(dx, src_width, dst_width);
+            int dx_end = dx + 1;
+            while (dx_end < dst_width && box_start(dx_end + 1, src_width, dst_width) - x0 <= COLUMN_CHUNK)
+            {
+                dx_end++;
+            }
+            column_sums(src + y0 * src_stride + x0, src_stride, box_start(dx_end, src_width, dst_width) - x0, rows, sums);
+            for (; dx < dx_end; dx++)
+            {
+                int begin = box_start(dx, src_width, dst_width) - x0;
+                int end = box_start(dx + 1, src_width, dst_width) - x0;
+                uint32_t sum = 0;
+                for (int x = begin; x < end; x++)
+                {
+                    sum += sums[x];
+                }
+                uint32_t area = (uint32_t)(end - begin) * rows;
+                dst_row[dx] = (uint8_t)((sum + area / 2) / area);
+            }
+        }
+    }
+    return 0;
+}
+
+/** Widening adds the compiler vectorizes for every target. Rows go in pairs to halve the sums traffic. */
+CPU_KERNEL_BODY void column_sums_body(const uint8_t* restrict src, size_t stride, int width, int rows, uint16_t* restrict sums)
+{
+    int r = rows % 2;
+    for (int x = 0; x < width; x++)
+    {
+        sums[x] = r ? src[x] : 0;
+    }
+    for (; r < rows; r += 2)
+    {
+        const uint8_t* row0 = src + r * stride;
+        const uint8_t* row1 = row0 + stride;
+        for (int x = 0; x < width; x++)
+        {
+            sums[x] += row0[x] + row1[x];
+        }
+    }
+}
+
+static void column_sums_scalar(const uint8_t* src, size_t stride, int width, int rows, uint16_t* sums)
+{
+    column_sums_body(src, stride, width, rows, sums);
+}
+
+#if CPU_DISPATCH_X86
+CPU_TARGET_AVX2 static void column_sums_avx2(const uint8_t* src, size_t stride, int width, int rows, uint16_t* sums)
+{
+    column_sums_body(src, stride, width, rows, sums);
+}
+
+CPU_TARGET_AVX512 static void column_sums_avx512(const uint8_t* src, size_t stride, int width, int rows, uint16_t* sums)
+{
+    column_sums_body(src, stride, width, rows, sums);
+}
+#endif
+
+static void column_sums(const uint8_t* src, size_t stride, int width, int rows, uint16_t* sums)
+{
+    switch (cpu_isa_get())
+    {
+#if CPU_DISPATCH_X86
+    case CPU_ISA_AVX512:
+        column_sums_avx512(src, stride, width, rows, sums);
+        return;
+    case CPU_ISA_AVX2:
+        column_sums_avx2(src, stride, width, rows, sums);
+        return;
+#endif
+    default:
+        column_sums_scalar(src, stride, width, rows, sums);
+        return;
+    }
+}
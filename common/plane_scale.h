@@ -0,0 +1,26 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+
+/** Boxes of up to this many source rows keep 16 bit column sums */
+#define PLANE_SCALE_MAX_RATIO (256)
+
+/**
+ * Area averaging downscale of an 8 bit plane, e.g. one plane of a decoded YUV frame.
+ * Every destination sample is the rounded mean of the source box it covers. Box edges are
+ * rounded down to whole source samples, so all boxes of an axis differ by at most one sample.
+ * The source must be at least as large as the destination on both axes and at most
+ * PLANE_SCALE_MAX_RATIO times larger. Returns -1 otherwise.
+ */
+int plane_area_downscale(
+    const uint8_t* src, size_t src_stride, int src_width, int src_height,
+    uint8_t* dst, size_t dst_stride, int dst_width, int dst_height);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,334 @@
+#include "tile_delta.h"
+#include <stdlib.h>
+#include <string.h>
+
+enum
+{
+    DECODER_HEADER,
+    DECODER_WINDOW_HEADER,
+    DECODER_PIXELS,
+    DECODER_LOST,
+};
+
+static void mark_dirty_tiles(tile_delta_encoder_t* encoder, const rgb565_image_t* frame);
+
+tile_delta_encoder_t* tile_delta_encoder_new(size_t width, size_t height, int tile_size)
+{
+    if (width == 0 || height == 0
+        || width > TILE_DELTA_MAX_DIMENSION || height > TILE_DELTA_MAX_DIMENSION
+        || tile_size <= 0)
+    {
+        return NULL;
+    }
+    tile_delta_encoder_t* encoder = malloc(sizeof(tile_delta_encoder_t));
+    if (!encoder)
+    {
+        return NULL;
+    }
+    memset(encoder, 0, sizeof(tile_delta_encoder_t));
+    encoder->width = width;
+    encoder->height = height;
+    encoder->tile_size = tile_size;
+    encoder->tiles_x = (width + tile_size - 1) / tile_size;
+    encoder->tiles_y = (height + tile_size - 1) / tile_size;
+    encoder->reference = rgb565_image_new(width * height);
+    encoder->dirty_tiles = malloc(encoder->tiles_x * encoder->tiles_y);
+    /** The worst case is every tile in a window of its own */
+    encoder->capacity = TILE_DELTA_HEADER_SIZE
+        + (size_t)encoder->tiles_x * encoder->tiles_y * TILE_DELTA_WINDOW_HEADER_SIZE
+        + width * height * sizeof(rgb565_pixel_t);
+    encoder->data = malloc(encoder->capacity);
+    if (!encoder->reference || !encoder->dirty_tiles || !encoder->data)
+    {
+        tile_delta_encoder_free(encoder);
+        return NULL;
+    }
+    return encoder;
+}
+
+void tile_delta_encoder_free(tile_delta_encoder_t* encoder)
+{
+    if (!encoder)
+    {
+        return;
+    }
+    rgb565_image_free(encoder->reference);
+    free(encoder->dirty_tiles);
+    free(encoder->data);
+    free(encoder);
+}
+
+void tile_delta_encoder_reset(tile_delta_encoder_t* encoder)
+{
+    if (encoder)
+    {
+        encoder->has_reference = false;
+    }
+}
+
+int tile_delta_encode(tile_delta_encoder_t* encoder, const rgb565_image_t* frame, const uint8_t** data, size_t* size)
+{
+    if (!encoder || !frame || !data || !size)
+    {
+        return -1;
+    }
+    if (frame->size != encoder->width * encoder->height)
+    {
+        return -1;
+    }
+    mark_dirty_tiles(encoder, frame);
+
+    const int tile_size = encoder->tile_size;
+    uint8_t* pos = encoder->data + TILE_DELTA_HEADER_SIZE;
+    uint8_t* last_window = NULL;
+    int n_windows = 0;
+    for (int ty = 0; ty < encoder->tiles_y; ty++)
+    {
+        size_t y = (size_t)ty * tile_size;
+        size_t h = encoder->height - y < (size_t)tile_size ? encoder->height - y : (size_t)tile_size;
+        const uint8_t* dirty = encoder->dirty_tiles + ty * encoder->tiles_x;
+        int tx = 0;
+        while (tx < encoder->tiles_x)
+        {
+            if (!dirty[tx])
+            {
+                tx++;
+                continue;
+            }
+            /** Adjacent dirty tiles in a tile row share one window */
+            int run_end = tx;
+            while (run_end < encoder->tiles_x && dirty[run_end])
+            {
+                run_end++;
+            }
+            size_t x = (size_t)tx * tile_size;
+            size_t x_end = (size_t)run_end * tile_size;
+            if (x_end > encoder->width)
+            {
+                x_end = encoder->width;
+            }
+            size_t w = x_end - x;
+            if (last_window
+                && last_window[0] == x
+                && last_window[2] == w
+                && (size_t)last_window[1] + last_window[3] == y
+                && last_window[3] + h <= TILE_DELTA_MAX_DIMENSION)
+            {
+                /** Same span as the window right before it. The rows just continue that window. */
+                last_window[3] += h;
+            }
+            else
+            {
+                last_window = pos;
+                pos[0] = (uint8_t)x;
+                pos[1] = (uint8_t)y;
+                pos[2] = (uint8_t)w;
+                pos[3] = (uint8_t)h;
+                pos += TILE_DELTA_WINDOW_HEADER_SIZE;
+                n_windows++;
+            }
+            for (size_t row = y; row < y + h; row++)
+            {
+                memcpy(pos, frame->pixels + row * encoder->width + x, w * sizeof(rgb565_pixel_t));
+                pos += w * sizeof(rgb565_pixel_t);
+            }
+            tx = run_end;
+        }
+    }
+
+    memcpy(encoder->reference->pixels, frame->pixels, frame->size * sizeof(rgb565_pixel_t));
+    encoder->has_reference = true;
+
+    if (n_windows == 0)
+    {
+        *data = encoder->data;
+        *size = 0;
+        return 0;
+    }
+    encoder->data[0] = TILE_DELTA_MAGIC & 0xFF;
+    encoder->data[1] = TILE_DELTA_MAGIC >> 8;
+    encoder->data[2] = n_windows & 0xFF;
+    encoder->data[3] = n_windows >> 8;
+    *data = encoder->data;
+    *size = pos - encoder->data;
+    return 0;
+}
+
+static void mark_dirty_tiles(tile_delta_encoder_t* encoder, const rgb565_image_t* frame)
+{
+    size_t n_tiles = (size_t)encoder->tiles_x * encoder->tiles_y;
+    if (!encoder->has_reference)
+    {
+        memset(encoder->dirty_tiles, 1, n_tiles);
+        return;
+    }
+    memset(encoder->dirty_tiles, 0, n_tiles);
+    const int tile_size = encoder->tile_size;
+    for (size_t y = 0; y < encoder->height; y++)
+    {
+        const rgb565_pixel_t* row = frame->pixels + y * encoder->width;
+        const rgb565_pixel_t* reference_row = encoder->reference->pixels + y * encoder->width;
+        /** Most rows of desktop content do not change at all */
+        if (memcmp(row, reference_row, encoder->width * sizeof(rgb565_pixel_t)) == 0)
+        {
+            continue;
+        }
+        uint8_t* dirty = encoder->dirty_tiles + (y / tile_size) * encoder->tiles_x;
+        for (int tx = 0; tx < encoder->tiles_x; tx++)
+        {
+            if (dirty[tx])
+            {
+                continue;
+            }
+            size_t x = (size_t)tx * tile_size;
+            size_t w = encoder->width - x < (size_t)tile_size ? encoder->width - x : (size_t)tile_size;
+            if (memcmp(row + x, reference_row + x, w * sizeof(rgb565_pixel_t)) != 0)
+            {
+                dirty[tx] = 1;
+            }
+        }
+    }
+}
+
+tile_delta_decoder_t* tile_delta_decoder_new(size_t width, size_t height)
+{
+    if (width == 0 || height == 0
+        || width > TILE_DELTA_MAX_DIMENSION || height > TILE_DELTA_MAX_DIMENSION)
+    {
+        return NULL;
+    }
+    tile_delta_decoder_t* decoder = malloc(sizeof(tile_delta_decoder_t));
+    if (!decoder)
+    {
+        return NULL;
+    }
+    memset(decoder, 0, sizeof(tile_delta_decoder_t));
+    decoder->width = width;
+    decoder->height = height;
+    decoder->frame = rgb565_image_new(width * height);
+    if (!decoder->frame)
+    {
+        free(decoder);
+        return NULL;
+    }
+    memset(decoder->frame->pixels, 0, width * height * sizeof(rgb565_pixel_t));
+    decoder->state = DECODER_HEADER;
+    return decoder;
+}
+
+void tile_delta_decoder_free(tile_delta_decoder_t* decoder)
+{
+    if (!decoder)
+    {
+        return;
+    }
+    rgb565_image_free(decoder->frame);
+    free(decoder);
+}
+
+void tile_delta_decoder_reset(tile_delta_decoder_t* decoder)
+{
+    if (!decoder)
+    {
+        return;
+    }
+    decoder->state = DECODER_HEADER;
+    decoder->header_len = 0;
+    decoder->has_pixel_low_byte = false;
+}
+
+int tile_delta_decoder_feed(tile_delta_decoder_t* decoder, const uint8_t* data, size_t size)
+{
+    if (!decoder || (!data && size != 0))
+    {
+        return -1;
+    }
+    for (size_t i = 0; i < size; i++)
+    {
+        uint8_t byte = data[i];
+        switch (decoder->state)
+        {
+        case DECODER_HEADER:
+        {
+            decoder->header[decoder->header_len++] = byte;
+            if (decoder->header_len < TILE_DELTA_HEADER_SIZE)
+            {
+                break;
+            }
+            decoder->header_len = 0;
+            int magic = decoder->header[0] | (decoder->header[1] << 8);
+            int n_windows = decoder->header[2] | (decoder->header[3] << 8);
+            if (magic != TILE_DELTA_MAGIC || n_windows == 0)
+            {
+                decoder->state = DECODER_LOST;
+                return -1;
+            }
+            decoder->windows_left = n_windows;
+            decoder->state = DECODER_WINDOW_HEADER;
+            break;
+        }
+        case DECODER_WINDOW_HEADER:
+        {
+            decoder->header[decoder->header_len++] = byte;
+            if (decoder->header_len < TILE_DELTA_WINDOW_HEADER_SIZE)
+            {
+                break;
+            }
+            decoder->header_len = 0;
+            int x = decoder->header[0];
+            int y = decoder->header[1];
+            int w = decoder->header[2];
+            int h = decoder->header[3];
+            /** The firmware must not let a window wrap around the screen */
+            if (w == 0 || h == 0 || x + w > (int)decoder->width || y + h > (int)decoder->height)
+            {
+                decoder->state = DECODER_LOST;
+                return -1;
+            }
+            decoder->window_x = x;
+            decoder->window_y = y;
+            decoder->window_w = w;
+            decoder->window_pixel = 0;
+            decoder->window_pixels = (size_t)w * h;
+            decoder->state = DECODER_PIXELS;
+            break;
+        }
+        case DECODER_PIXELS:
+        {
+            /** USB packets may split a pixel */
+            if (!decoder->has_pixel_low_byte)
+            {
+                decoder->pixel_low_byte = byte;
+                decoder->has_pixel_low_byte = true;
+                break;
+            }
+            decoder->has_pixel_low_byte = false;
+            uint16_t raw = decoder->pixel_low_byte | (byte << 8);
+            size_t x = decoder->window_x + decoder->window_pixel % decoder->window_w;
+            size_t y = decoder->window_y + decoder->window_pixel / decoder->window_w;
+            memcpy(decoder->frame->pixels + y * decoder->width + x, &raw, sizeof(raw));
+            decoder->window_pixel++;
+            decoder->pixels++;
+            if (decoder->window_pixel < decoder->window_pixels)
+            {
+                break;
+            }
+            decoder->windows++;
+            decoder->windows_left--;
+            if (decoder->windows_left == 0)
+            {
+                decoder->frames++;
+                decoder->state = DECODER_HEADER;
+            }
+            else
+            {
+                decoder->state = DECODER_WINDOW_HEADER;
+            }
+            break;
+        }
+        default:
+            return -1;
+        }
+    }
+    return 0;
+}
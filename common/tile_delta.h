@@ -0,0 +1,91 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "image.h"
+
+/**
+ * Dirty tile delta stream.
+ * The encoder compares each frame against the last one it emitted and only sends the changed tiles.
+ * A frame packet is laid out as (little endian):
+ *     uint16_t magic
+ *     uint16_t n_windows
+ *     n_windows * { uint8_t x, y, w, h; rgb565_pixel_t pixels[w * h]; }
+ * Pixels inside a window are row major, matching the LCD auto increment inside a CASET/RASET window.
+ * A frame without changes produces no packet at all.
+ */
+
+#define TILE_DELTA_MAGIC 0x5444
+#define TILE_DELTA_HEADER_SIZE 4
+#define TILE_DELTA_WINDOW_HEADER_SIZE 4
+/** Window coordinates are 8 bit */
+#define TILE_DELTA_MAX_DIMENSION 255
+
+typedef struct
+{
+    size_t width;
+    size_t height;
+    int tile_size;
+    int tiles_x;
+    int tiles_y;
+    /** What the device shows once every emitted packet arrived */
+    rgb565_image_t* reference;
+    bool has_reference;
+    /** One flag per tile of the current frame */
+    uint8_t* dirty_tiles;
+    uint8_t* data;
+    size_t capacity;
+} tile_delta_encoder_t;
+
+/** tile_size is usually 8 or 16 */
+tile_delta_encoder_t* tile_delta_encoder_new(size_t width, size_t height, int tile_size);
+void tile_delta_encoder_free(tile_delta_encoder_t* encoder);
+/** Forgets the reference. The next frame is sent in full. */
+void tile_delta_encoder_reset(tile_delta_encoder_t* encoder);
+/**
+ * Encodes frame against the reference and makes it the new reference.
+ * On success data points to the encoder's buffer, valid until the next call. size is 0 if nothing changed.
+ */
+int tile_delta_encode(tile_delta_encoder_t* encoder, const rgb565_image_t* frame, const uint8_t** data, size_t* size);
+
+/**
+ * Host model of the firmware decoder.
+ * The stream can be fed in pieces of any size, like USB packets.
+ */
+typedef struct
+{
+    size_t width;
+    size_t height;
+    rgb565_image_t* frame;
+    int state;
+    uint8_t header[TILE_DELTA_HEADER_SIZE];
+    int header_len;
+    int windows_left;
+    int window_x;
+    int window_y;
+    int window_w;
+    size_t window_pixel;
+    size_t window_pixels;
+    uint8_t pixel_low_byte;
+    bool has_pixel_low_byte;
+    /** Statistics */
+    size_t frames;
+    size_t windows;
+    size_t pixels;
+} tile_delta_decoder_t;
+
+tile_delta_decoder_t* tile_delta_decoder_new(size_t width, size_t height);
+void tile_delta_decoder_free(tile_delta_decoder_t* decoder);
+/** Drops any partial packet, like the firmware does when the port is reopened. The frame is kept. */
+void tile_delta_decoder_reset(tile_delta_decoder_t* decoder);
+/** Returns -1 on a malformed stream. The decoder then ignores everything until reset. */
+int tile_delta_decoder_feed(tile_delta_decoder_t* decoder, const uint8_t* data, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
@@ -10,6 +10,7 @@
  * microcontroller manufactured by Nanjing Qinheng Microelectronics.
  *******************************************************************************/
 
+#include <stddef.h>
 #include "systick.h"
 #include "ch32x035_usbfs_device.h"
 
@@ -65,10 +66,22 @@ static uint8_t UART_CONFIG[] = {
 static volatile uint8_t USBFS_Endp_Busy[DEF_UEP_NUM];
 
 
-/** Data hook */
+/** Data hook. A hook returns NULL when it has no buffer left, then OUT is NAKed until USBFS_Device_Resume_Rx. */
 extern uint8_t* cdc_hook_reset_rx_buffer();
 extern uint8_t* cdc_hook_on_data(int len);
 
+static void __attribute__((section(".ramcode"))) USBFS_Device_Set_Rx_Buffer(uint8_t* buffer)
+{
+    USBFSD->UEP2_CTRL_H &= ~USBFS_UEP_R_RES_MASK;
+    if (buffer == NULL)
+    {
+        USBFSD->UEP2_CTRL_H |= USBFS_UEP_R_RES_NAK;
+        return;
+    }
+    USBFSD->UEP2_DMA = (uint32_t)buffer;
+    USBFSD->UEP2_CTRL_H |= USBFS_UEP_R_RES_ACK;
+}
+
 /*********************************************************************
  * @fn      USBFS_Device_Endp_Init
  *
@@ -128,6 +141,18 @@ static void GPIO_USB_INIT(void)
     GPIO_Init(GPIOC, &GPIO_InitStructure);
 }
 
+/*********************************************************************
+ * @fn      USBFS_Device_Resume_Rx
+ *
+ * @brief   Accepts OUT data again after a data hook returned NULL.
+ *
+ * @return  none
+ */
+void __attribute__((section(".ramcode"))) USBFS_Device_Resume_Rx(uint8_t* buffer)
+{
+    USBFS_Device_Set_Rx_Buffer(buffer);
+}
+
 /*********************************************************************
  * @fn      USBFS_Device_Init
  *
@@ -453,9 +478,7 @@ void __attribute__((interrupt("WCH-Interrupt-fast"))) __attribute__((section(".r
                             UART_CONFIG[ 5 ] = USBFS_Buffer.EP0[ 5 ];
                             UART_CONFIG[ 6 ] = USBFS_Buffer.EP0[ 6 ];
                             /* restart usb receive  */
-                            USBFSD->UEP2_DMA = (uint32_t)cdc_hook_reset_rx_buffer();
-                            USBFSD->UEP2_CTRL_H &= ~USBFS_UEP_R_RES_MASK;
-                            USBFSD->UEP2_CTRL_H |= USBFS_UEP_R_RES_ACK;
+                            USBFS_Device_Set_Rx_Buffer(cdc_hook_reset_rx_buffer());
                         }
                     }
                     else
@@ -475,7 +498,7 @@ void __attribute__((interrupt("WCH-Interrupt-fast"))) __attribute__((section(".r
             case DEF_UEP2:
                 USBFSD->UEP2_CTRL_H ^= USBFS_UEP_R_TOG;
                 /** At this moment, the previous dma has finished */
-                USBFSD->UEP2_DMA = (uint32_t)cdc_hook_on_data(USBFSD->RX_LEN);
+                USBFS_Device_Set_Rx_Buffer(cdc_hook_on_data(USBFSD->RX_LEN));
                 break;
 
             default:
@@ -71,6 +71,7 @@ extern "C" {
 /* external functions */
 void USBFS_Device_Init( FunctionalState sta , PWR_VDD VDD_Voltage);
 uint8_t USBFS_Endp_DataUp(uint8_t endp, uint8_t *pbuf, uint16_t len, uint8_t mod);
+void USBFS_Device_Resume_Rx(uint8_t* buffer);
 
 #ifdef __cplusplus
 }
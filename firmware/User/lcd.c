@@ -1,5 +1,9 @@
 #include "lcd.h"
 
+/** Where the image starts in the controller's memory */
+#define LCD_COLUMN_OFFSET 1
+#define LCD_ROW_OFFSET 26
+
 static void lcd_init_screen(const lcd_t* lcd);
 
 void lcd_init(const lcd_t* lcd)
@@ -241,7 +245,7 @@ void __attribute__((section(".ramcode"))) lcd_draw_image(
 }
 #endif
 
-#if FRAME_COMPRESSION == FRAME_COMPRESSION_NONE
+#if FRAME_COMPRESSION == FRAME_COMPRESSION_NONE || FRAME_COMPRESSION == FRAME_COMPRESSION_TILE_DELTA
 void __attribute__((section(".ramcode"))) lcd_start_image_draw(const lcd_t* lcd)
 {
     gpio_reset(&lcd->ncs);
@@ -280,3 +284,36 @@ void __attribute__((section(".ramcode"))) lcd_end_image_draw(const lcd_t* lcd)
     gpio_set(&lcd->ncs);
 }
 #endif
+
+#if FRAME_COMPRESSION == FRAME_COMPRESSION_TILE_DELTA
+void __attribute__((section(".ramcode"))) lcd_start_window_draw(
+    const lcd_t* lcd, int x, int y, int w, int h)
+{
+    /** The previous draw may have left the data size at 16b */
+    lcd->spi->CTLR1 &= (uint16_t)~SPI_DataSize_16b;
+    int x_start = x + LCD_COLUMN_OFFSET;
+    int x_end = x_start + w - 1;
+    int y_start = y + LCD_ROW_OFFSET;
+    int y_end = y_start + h - 1;
+    uint8_t column[] = {x_start >> 8, x_start & 0xFF, x_end >> 8, x_end & 0xFF};
+    uint8_t row[] = {y_start >> 8, y_start & 0xFF, y_end >> 8, y_end & 0xFF};
+    /** Set column address */
+    send_command(lcd, 0x2A, column, sizeof(column));
+    /** Set row address */
+    send_command(lcd, 0x2B, row, sizeof(row));
+    lcd_start_image_draw(lcd);
+}
+
+void __attribute__((section(".ramcode"))) lcd_write_unaligned_image_data(
+    const lcd_t* lcd, const uint8_t* data, int data_len)
+{
+    for (int i = 0; i + 1 < data_len; i += 2)
+    {
+        uint16_t pixel = data[i] | (data[i + 1] << 8);
+        while (!(lcd->spi->STATR & SPI_I2S_FLAG_TXE))
+        {
+        }
+        lcd->spi->DATAR = pixel;
+    }
+}
+#endif
@@ -40,10 +40,16 @@ typedef struct
 
 void lcd_init(const lcd_t* lcd);
 
-#if FRAME_COMPRESSION == FRAME_COMPRESSION_NONE
+#if FRAME_COMPRESSION == FRAME_COMPRESSION_NONE || FRAME_COMPRESSION == FRAME_COMPRESSION_TILE_DELTA
 void lcd_start_image_draw(const lcd_t* lcd);
 void lcd_write_image_data(const lcd_t* lcd, const uint8_t* data, int data_len);
 void lcd_end_image_draw(const lcd_t* lcd);
+#endif
+#if FRAME_COMPRESSION == FRAME_COMPRESSION_TILE_DELTA
+/** Limits the following image data to a window. Coordinates are in image pixels. */
+void lcd_start_window_draw(const lcd_t* lcd, int x, int y, int w, int h);
+/** Same as lcd_write_image_data but data does not need to be 16 bit aligned */
+void lcd_write_unaligned_image_data(const lcd_t* lcd, const uint8_t* data, int data_len);
 #elif FRAME_COMPRESSION == FRAME_COMPRESSION_K_MEANS
 void lcd_draw_image(
     const lcd_t* lcd,
@@ -12,6 +12,7 @@
 
 #include "ch32x035_conf.h"
 #include <stdio.h>
+#include <string.h>
 #include <inttypes.h>
 #include <stdbool.h>
 #include <stdatomic.h>
@@ -24,6 +25,30 @@
 #define BUFFER_PACKET_COUNT (5 * 20)
 #elif FRAME_COMPRESSION == FRAME_COMPRESSION_K_MEANS
 #define BUFFER_PACKET_COUNT (((IMAGE_SIZE + 63) / 64))
+#elif FRAME_COMPRESSION == FRAME_COMPRESSION_TILE_DELTA
+#include "../../../common/tile_delta.h"
+/** USB packets waiting to be drawn. Must be a power of 2. */
+#define RX_SLOT_COUNT 64
+
+enum
+{
+    DELTA_HEADER,
+    DELTA_WINDOW_HEADER,
+    DELTA_PIXELS,
+    /** Bad stream. Ignore everything until the port is reopened. */
+    DELTA_LOST,
+};
+
+typedef struct
+{
+    int state;
+    uint8_t header[TILE_DELTA_HEADER_SIZE];
+    int header_len;
+    int windows_left;
+    int pixel_bytes_left;
+    uint8_t pixel_low_byte;
+    bool has_pixel_low_byte;
+} delta_parser_t;
 #endif
 
 static volatile atomic_bool image_ready = false;
@@ -40,10 +65,28 @@ static struct
     __attribute__((aligned(4))) uint8_t cdc_buffer[64 * BUFFER_PACKET_COUNT];
     int write_offset;
     color_t color_palette[COLOR_PALETTE_SIZE];
+#elif FRAME_COMPRESSION == FRAME_COMPRESSION_TILE_DELTA
+    __attribute__((aligned(4))) uint8_t rx_slots[RX_SLOT_COUNT][64];
+    volatile uint8_t rx_lens[RX_SLOT_COUNT];
+    /** Slots in [rx_tail, rx_head) hold data. The ISR owns rx_head, the main loop owns rx_tail. */
+    volatile atomic_uint rx_head;
+    volatile atomic_uint rx_tail;
+    /** Set when the port is reopened. Slots before rx_reset_head are stale. */
+    volatile atomic_bool rx_reset;
+    volatile atomic_uint rx_reset_head;
+    /** All slots are full. USB is NAKing until the main loop frees one. */
+    volatile atomic_bool rx_paused;
+    delta_parser_t parser;
 #endif
     lcd_t lcd;
 } app;
 
+#if FRAME_COMPRESSION == FRAME_COMPRESSION_TILE_DELTA
+static void delta_parse(const uint8_t* data, int len);
+static void delta_parser_reset();
+static void rx_release_slots(unsigned int tail);
+#endif
+
 /*********************************************************************
  * @fn      main
  *
@@ -74,7 +117,9 @@ int main(void)
     RCC_AHBPeriphClockCmd(RCC_AHBPeriph_USBFS, ENABLE);
 
     /* Usb Init */
+#if FRAME_COMPRESSION != FRAME_COMPRESSION_TILE_DELTA
     app.write_offset = 0;
+#endif
     USBFS_Device_Init( ENABLE , PWR_VDD_SupplyVoltage());
 
     /** LCD init */
@@ -92,6 +137,27 @@ int main(void)
     app.lcd.nrst.pin = GPIO_Pin_1;
     lcd_init(&app.lcd);
 
+#if FRAME_COMPRESSION == FRAME_COMPRESSION_TILE_DELTA
+    while(1)
+    {
+        if (app.rx_reset)
+        {
+            app.rx_reset = false;
+            delta_parser_reset();
+            rx_release_slots(app.rx_reset_head);
+        }
+        unsigned int tail = app.rx_tail;
+        /** Busy loop, same as the other modes */
+        if (tail == app.rx_head)
+        {
+            continue;
+        }
+        int slot = tail % RX_SLOT_COUNT;
+        /** Draws as the data arrives. No frame buffer needed. */
+        delta_parse(app.rx_slots[slot], app.rx_lens[slot]);
+        rx_release_slots(tail + 1);
+    }
+#else
     while(1)
     {
         /** Well, WFI does not work as expected. So busy loop it is. */
@@ -117,15 +183,29 @@ int main(void)
             app.color_palette);
 #endif
     }
+#endif
 }
 
 uint8_t* __attribute__((section(".ramcode"))) cdc_hook_reset_rx_buffer()
 {
+#if FRAME_COMPRESSION == FRAME_COMPRESSION_TILE_DELTA
+    unsigned int head = app.rx_head;
+    app.rx_reset_head = head;
+    app.rx_reset = true;
+    if (head - app.rx_tail == RX_SLOT_COUNT)
+    {
+        /** The main loop resumes once it dropped the stale slots */
+        app.rx_paused = true;
+        return NULL;
+    }
+    return app.rx_slots[head % RX_SLOT_COUNT];
+#else
     app.write_offset = 0;
 #if FRAME_COMPRESSION == FRAME_COMPRESSION_NONE
     app.cdc_buffer = app.buffer_A;
 #endif
     return app.cdc_buffer;
+#endif
 }
 
 
@@ -162,5 +242,135 @@ uint8_t* __attribute__((section(".ramcode"))) cdc_hook_on_data(int len)
         image_ready = true;
     }
     return app.cdc_buffer + app.write_offset;
+#elif FRAME_COMPRESSION == FRAME_COMPRESSION_TILE_DELTA
+    unsigned int head = app.rx_head;
+    app.rx_lens[head % RX_SLOT_COUNT] = len;
+    head++;
+    app.rx_head = head;
+    if (head - app.rx_tail == RX_SLOT_COUNT)
+    {
+        /** NAK the host instead of overwriting data that is not drawn yet */
+        app.rx_paused = true;
+        return NULL;
+    }
+    return app.rx_slots[head % RX_SLOT_COUNT];
 #endif
 }
+
+#if FRAME_COMPRESSION == FRAME_COMPRESSION_TILE_DELTA
+static void __attribute__((section(".ramcode"))) rx_release_slots(unsigned int tail)
+{
+    app.rx_tail = tail;
+    if (app.rx_paused)
+    {
+        /** No OUT interrupt can happen while paused. rx_head is stable. */
+        app.rx_paused = false;
+        USBFS_Device_Resume_Rx(app.rx_slots[app.rx_head % RX_SLOT_COUNT]);
+    }
+}
+
+static void delta_parser_reset()
+{
+    if (app.parser.state == DELTA_PIXELS)
+    {
+        lcd_end_image_draw(&app.lcd);
+    }
+    memset(&app.parser, 0, sizeof(app.parser));
+    app.parser.state = DELTA_HEADER;
+}
+
+/** See common/tile_delta.h for the stream format. The host decoder model there must stay in sync with this. */
+static void __attribute__((section(".ramcode"))) delta_parse(const uint8_t* data, int len)
+{
+    delta_parser_t* parser = &app.parser;
+    while (len > 0)
+    {
+        switch (parser->state)
+        {
+        case DELTA_HEADER:
+        case DELTA_WINDOW_HEADER:
+        {
+            /** Both headers are 4 bytes */
+            parser->header[parser->header_len++] = *data++;
+            len--;
+            if (parser->header_len < TILE_DELTA_HEADER_SIZE)
+            {
+                break;
+            }
+            parser->header_len = 0;
+            if (parser->state == DELTA_HEADER)
+            {
+                int magic = parser->header[0] | (parser->header[1] << 8);
+                int n_windows = parser->header[2] | (parser->header[3] << 8);
+                if (magic != TILE_DELTA_MAGIC || n_windows == 0)
+                {
+                    parser->state = DELTA_LOST;
+                    return;
+                }
+                parser->windows_left = n_windows;
+                parser->state = DELTA_WINDOW_HEADER;
+                break;
+            }
+            int x = parser->header[0];
+            int y = parser->header[1];
+            int w = parser->header[2];
+            int h = parser->header[3];
+            if (w == 0 || h == 0 || x + w > IMAGE_WIDTH || y + h > IMAGE_HEIGHT)
+            {
+                parser->state = DELTA_LOST;
+                return;
+            }
+            parser->pixel_bytes_left = w * h * sizeof(color_t);
+            lcd_start_window_draw(&app.lcd, x, y, w, h);
+            parser->state = DELTA_PIXELS;
+            break;
+        }
+        case DELTA_PIXELS:
+        {
+            if (parser->has_pixel_low_byte)
+            {
+                /** The host split this pixel between two packets */
+                uint8_t pixel[2] = {parser->pixel_low_byte, *data++};
+                len--;
+                lcd_write_unaligned_image_data(&app.lcd, pixel, sizeof(pixel));
+                parser->has_pixel_low_byte = false;
+                parser->pixel_bytes_left--;
+            }
+            else
+            {
+                int n = len < parser->pixel_bytes_left ? len : parser->pixel_bytes_left;
+                int even = n & ~1;
+                if ((uintptr_t)data & 1)
+                {
+                    lcd_write_unaligned_image_data(&app.lcd, data, even);
+                }
+                else
+                {
+                    lcd_write_image_data(&app.lcd, data, even);
+                }
+                data += even;
+                len -= even;
+                parser->pixel_bytes_left -= even;
+                if (n & 1)
+                {
+                    parser->pixel_low_byte = *data++;
+                    len--;
+                    parser->has_pixel_low_byte = true;
+                    parser->pixel_bytes_left--;
+                }
+            }
+            if (parser->pixel_bytes_left != 0)
+            {
+                break;
+            }
+            lcd_end_image_draw(&app.lcd);
+            parser->windows_left--;
+            parser->state = parser->windows_left == 0 ? DELTA_HEADER : DELTA_WINDOW_HEADER;
+            break;
+        }
+        default:
+            return;
+        }
+    }
+}
+#endif
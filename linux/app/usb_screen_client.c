@@ -1,14 +1,20 @@
 #include <stdlib.h>
+#include <stdbool.h>
 #include <string.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <libswscale/swscale.h>
-#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
 
 #include "../server/config.h"
-#include "../../common/image.h"
+#include "../server/frame_ring.h"
+#include "../server/frame_format.h"
+#include "../../common/plane_scale.h"
 
 #include "usb_screen_client.h"
 
@@ -20,11 +26,48 @@ typedef struct
     int frame_width;
     int frame_height;
     int mode;
-    AVFrame* resized_frame;
+    /** frame_format_t on the wire. YUV sources stay YUV, everything else is sent as BGR24. */
+    int wire_format;
+    /** Part of the source that is scaled. Smaller than the source when filling. */
+    int src_x;
+    int src_y;
+    int src_width;
+    int src_height;
+    /** Part of the screen it is scaled into. Smaller than the screen when fitting. */
+    int dst_x;
+    int dst_y;
+    int dst_width;
+    int dst_height;
+    /** Downscaling 4:2:0 to 4:2:0 averages the planes directly, NULL then. Everything else goes through sws. */
     struct SwsContext* sws_context;
-    image_t* image;
+    /**
+     * Without a ring, frames go out through the socket from the sender thread, latest frame wins.
+     * Each buffer holds a frame_header_t and its payload. The caller composes into compose,
+     * the newest finished frame waits in pending, and the sender thread owns sending.
+     */
+    frame_header_t* frames[3];
+    int compose;
+    int pending;
+    int sending;
+    /** All below are under lock */
+    bool has_pending;
+    /** The sender thread gave up on the socket */
+    bool send_failed;
+    bool stop;
+    bool sender_started;
+    pthread_t sender_thread;
+    pthread_mutex_t lock;
+    pthread_cond_t pending_cond;
+    frame_ring_t* ring;
+    /** Outgoing buffers whose borders are cleared, a bit per ring slot and then one per socket buffer */
+    uint32_t cleared_buffers;
+    /** The black the borders were cleared with. Differs between YCbCr ranges. */
+    uint8_t cleared_black;
 } usb_screen_client_impl_t;
 
+/** Bit of frames[0] in cleared_buffers, after the ring slots */
+#define SOCKET_BUFFER_BIT (FRAME_RING_MAX_SLOTS)
+
 static void usb_screen_client_close(usb_screen_client_t* base);
 static int get_resized_frame_dimensions(
     int src_width, int src_height,
@@ -32,6 +75,15 @@ static int get_resized_frame_dimensions(
     int mode,
     int* resized_width, int* resized_height);
 static int usb_screen_client_send_frame(usb_screen_client_t* self, const AVFrame* frame);
+static void* sender_main(void* ctx);
+static int send_all(int fd, const void* data, size_t size);
+static void crop_axis(int src_size, int dst_size, int resized_size, int align,
+    int* src_offset, int* src_crop, int* dst_offset, int* dst_crop);
+static int crop_source(const AVFrame* frame, int x, int y, const uint8_t* planes[4]);
+static uint16_t get_ycbcr_flags(const AVFrame* frame);
+static void clear_borders(
+    uint8_t* plane, int width, int height, int bytes_per_pixel,
+    int x, int y, int inner_width, int inner_height, uint8_t fill);
 
 usb_screen_client_t* usb_screen_client_connect(const usb_screen_client_option_t* option)
 {
@@ -51,6 +103,11 @@ do \
         
     memset(this, 0, sizeof(usb_screen_client_impl_t));
     this->fd = -1;
+    this->compose = 0;
+    this->pending = 1;
+    this->sending = 2;
+    pthread_mutex_init(&this->lock, NULL);
+    pthread_cond_init(&this->pending_cond, NULL);
     this->base.close = usb_screen_client_close;
     this->base.send_frame = usb_screen_client_send_frame;
 
@@ -62,26 +119,47 @@ do \
         &resized_width, &resized_height);
     CHECK_EXPR(rc == 0, "Failed to get resized frame dimensions");
 
-    this->resized_frame = av_frame_alloc();
-    CHECK_EXPR(this->resized_frame, "Failed to allocate resized frame");
-    
-    this->resized_frame->format = AV_PIX_FMT_RGB24;
-    this->resized_frame->width = resized_width;
-    this->resized_frame->height = resized_height;
-    rc = av_image_alloc(
-        this->resized_frame->data, this->resized_frame->linesize,
-        this->resized_frame->width, this->resized_frame->height,
-        this->resized_frame->format, 32);
-    CHECK_EXPR(rc >= 0, "Failed to allocate resized frame data");
-    
-    this->sws_context = sws_getContext(
-        option->frame_width, option->frame_height, option->frame_format,
-        this->resized_frame->width, this->resized_frame->height, this->resized_frame->format,
-        SWS_BICUBIC, NULL, NULL, NULL);
-    CHECK_EXPR(this->sws_context, "Failed to create sws context");
-
-    this->image = image_new(CONST_SCREEN_WIDTH, CONST_SCREEN_HEIGHT);
-    CHECK_EXPR(this->image, "Failed to allocate image");
+    /** Decoders mostly output YUV 4:2:0. Only scale it, the server converts it once. */
+    enum AVPixelFormat wire_pixel_format = AV_PIX_FMT_BGR24;
+    this->wire_format = FRAME_FORMAT_BGR24;
+    if (option->frame_format == AV_PIX_FMT_YUV420P || option->frame_format == AV_PIX_FMT_YUVJ420P)
+    {
+        wire_pixel_format = option->frame_format;
+        this->wire_format = FRAME_FORMAT_YCBCR420P;
+        /** Keep the chroma planes aligned with the screen */
+        resized_width = resized_width > 2 ? resized_width & ~1 : 2;
+        resized_height = resized_height > 2 ? resized_height & ~1 : 2;
+    }
+
+    /**
+     * The parts of the resized frame off the screen are never scaled. Filling crops the source instead,
+     * on its chroma grid. Fitting scales into the middle of the screen, on the wire format's chroma grid.
+     */
+    const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(option->frame_format);
+    CHECK_EXPR(desc, "Unknown pixel format");
+    int dst_align = this->wire_format == FRAME_FORMAT_YCBCR420P ? 2 : 1;
+    crop_axis(option->frame_width, CONST_SCREEN_WIDTH, resized_width, 1 << desc->log2_chroma_w,
+        &this->src_x, &this->src_width, &this->dst_x, &this->dst_width);
+    crop_axis(option->frame_height, CONST_SCREEN_HEIGHT, resized_height, 1 << desc->log2_chroma_h,
+        &this->src_y, &this->src_height, &this->dst_y, &this->dst_height);
+    this->dst_x &= ~(dst_align - 1);
+    this->dst_y &= ~(dst_align - 1);
+    CHECK_EXPR((this->src_x == 0 && this->src_y == 0)
+        || !(desc->flags & (AV_PIX_FMT_FLAG_BITSTREAM | AV_PIX_FMT_FLAG_HWACCEL)),
+        "Can not crop this pixel format");
+
+    bool area_scale = this->wire_format == FRAME_FORMAT_YCBCR420P
+        && this->src_width >= this->dst_width && this->src_height >= this->dst_height
+        && this->src_width <= this->dst_width * PLANE_SCALE_MAX_RATIO
+        && this->src_height <= this->dst_height * PLANE_SCALE_MAX_RATIO;
+    if (!area_scale)
+    {
+        this->sws_context = sws_getContext(
+            this->src_width, this->src_height, option->frame_format,
+            this->dst_width, this->dst_height, wire_pixel_format,
+            SWS_BICUBIC, NULL, NULL, NULL);
+        CHECK_EXPR(this->sws_context, "Failed to create sws context");
+    }
 
     this->fd = socket(AF_UNIX, SOCK_STREAM, 0);
     CHECK_EXPR(this->fd >= 0, "Failed to create socket");
@@ -96,6 +174,25 @@ do \
     rc = connect(this->fd, (struct sockaddr*)&addr, addr_len);
     CHECK_EXPR(rc >= 0, "Failed to connect to server");   
 
+    if (option->shm_slots > 0)
+    {
+        this->ring = frame_ring_create(option->shm_slots, CONST_FRAME_MAX_SIZE);
+        CHECK_EXPR(this->ring, "Failed to create frame ring");
+        rc = frame_ring_offer(this->ring, this->fd);
+        CHECK_EXPR(rc == 0, "Failed to offer frame ring");
+    }
+    else
+    {
+        for (int i = 0; i < 3; i++)
+        {
+            this->frames[i] = malloc(CONST_FRAME_MAX_SIZE);
+            CHECK_EXPR(this->frames[i], "Failed to allocate frame");
+        }
+        rc = pthread_create(&this->sender_thread, NULL, sender_main, this);
+        CHECK_EXPR(rc == 0, "Failed to start sender thread");
+        this->sender_started = true;
+    }
+
     return &this->base;
 error:
     usb_screen_client_close((usb_screen_client_t*)this);
@@ -110,17 +207,25 @@ static void usb_screen_client_close(usb_screen_client_t* base)
     usb_screen_client_impl_t* this = (usb_screen_client_impl_t*)base;
     if (!this)
         return;
+    if (this->sender_started)
+    {
+        /** The sender thread flushes the pending frame before it stops */
+        pthread_mutex_lock(&this->lock);
+        this->stop = true;
+        pthread_cond_signal(&this->pending_cond);
+        pthread_mutex_unlock(&this->lock);
+        pthread_join(this->sender_thread, NULL);
+    }
     if (this->fd >= 0)
         close(this->fd);
-    if (this->image)
-        image_free(this->image);
+    if (this->ring)
+        frame_ring_free(this->ring);
+    for (int i = 0; i < 3; i++)
+        free(this->frames[i]);
+    pthread_cond_destroy(&this->pending_cond);
+    pthread_mutex_destroy(&this->lock);
     if (this->sws_context)
         sws_freeContext(this->sws_context);
-    if (this->resized_frame)
-    {
-        av_freep(&this->resized_frame->data[0]);
-        av_frame_free(&this->resized_frame);
-    }
     free(this);
 }
 
@@ -171,43 +276,256 @@ static int usb_screen_client_send_frame(usb_screen_client_t* self, const AVFrame
     usb_screen_client_impl_t* this = (usb_screen_client_impl_t*)self;
     if (!this || !frame)
         return -1;
-    
-    int rc = sws_scale(
-        this->sws_context,
-        (const uint8_t* const*)frame->data,
-        frame->linesize,
-        0,
-        frame->height,
-        this->resized_frame->data,
-        this->resized_frame->linesize);
+
+    const uint8_t* src[4] = { NULL };
+    if (crop_source(frame, this->src_x, this->src_y, src) != 0)
+        return -1;
+
+    /** Scale straight into a free ring slot if there is one */
+    frame_header_t* header = this->frames[this->compose];
+    int buffer_bit = SOCKET_BUFFER_BIT + this->compose;
+    if (this->ring)
+    {
+        header = frame_ring_acquire_write(this->ring);
+        if (!header)
+        {
+            /** The server is behind. Drop this frame. */
+            return 0;
+        }
+        buffer_bit = ((uint8_t*)header - this->ring->slots) / this->ring->slot_stride;
+    }
+    frame_header_init(header, this->wire_format, CONST_SCREEN_WIDTH, CONST_SCREEN_HEIGHT);
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    header->timestamp_ns = (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+
+    /** Only the scaled part changes between frames. Borders are cleared the first time a buffer is used. */
+    uint8_t* payload = (uint8_t*)(header + 1);
+    uint8_t* dst[4] = { NULL };
+    int dst_linesize[4] = { 0 };
+    uint8_t black = 0;
+    if (this->wire_format == FRAME_FORMAT_YCBCR420P)
+    {
+        header->flags = get_ycbcr_flags(frame);
+        black = (header->flags & FRAME_FLAG_LIMITED_RANGE) ? 16 : 0;
+    }
+    if (black != this->cleared_black)
+    {
+        this->cleared_buffers = 0;
+        this->cleared_black = black;
+    }
+    bool clear = !(this->cleared_buffers & (1u << buffer_bit));
+    this->cleared_buffers |= 1u << buffer_bit;
+    if (this->wire_format == FRAME_FORMAT_YCBCR420P)
+    {
+        int chroma_width = (CONST_SCREEN_WIDTH + 1) / 2;
+        int chroma_height = (CONST_SCREEN_HEIGHT + 1) / 2;
+        uint8_t* cb = payload + CONST_SCREEN_WIDTH * CONST_SCREEN_HEIGHT;
+        uint8_t* cr = cb + chroma_width * chroma_height;
+        /** dst_x and dst_y are even, so chroma samples stay on luma pairs */
+        int chroma_x = this->dst_x / 2;
+        int chroma_y = this->dst_y / 2;
+        if (clear)
+        {
+            clear_borders(payload, CONST_SCREEN_WIDTH, CONST_SCREEN_HEIGHT, 1,
+                this->dst_x, this->dst_y, this->dst_width, this->dst_height, black);
+            clear_borders(cb, chroma_width, chroma_height, 1,
+                chroma_x, chroma_y, (this->dst_width + 1) / 2, (this->dst_height + 1) / 2, 128);
+            clear_borders(cr, chroma_width, chroma_height, 1,
+                chroma_x, chroma_y, (this->dst_width + 1) / 2, (this->dst_height + 1) / 2, 128);
+        }
+        dst[0] = payload + this->dst_y * CONST_SCREEN_WIDTH + this->dst_x;
+        dst[1] = cb + chroma_y * chroma_width + chroma_x;
+        dst[2] = cr + chroma_y * chroma_width + chroma_x;
+        dst_linesize[0] = CONST_SCREEN_WIDTH;
+        dst_linesize[1] = chroma_width;
+        dst_linesize[2] = chroma_width;
+    }
+    else
+    {
+        /** BGR24 is laid out like pixel_t */
+        if (clear)
+        {
+            clear_borders(payload, CONST_SCREEN_WIDTH, CONST_SCREEN_HEIGHT, 3,
+                this->dst_x, this->dst_y, this->dst_width, this->dst_height, 0);
+        }
+        dst[0] = payload + (this->dst_y * CONST_SCREEN_WIDTH + this->dst_x) * 3;
+        dst_linesize[0] = CONST_SCREEN_WIDTH * 3;
+    }
+
+    int rc = 0;
+    if (this->sws_context)
+    {
+        rc = sws_scale(
+            this->sws_context,
+            src,
+            frame->linesize,
+            0,
+            this->src_height,
+            dst,
+            dst_linesize);
+    }
+    else
+    {
+        /** A box filter is all a 10x downscale needs. Cheaper than bicubic and no colorspace round trip. */
+        for (int i = 0; i < 3 && rc == 0; i++)
+        {
+            if (frame->linesize[i] < 0)
+                return -1;
+            int shift = i == 0 ? 0 : 1;
+            rc = plane_area_downscale(
+                src[i], frame->linesize[i], (this->src_width + shift) >> shift, (this->src_height + shift) >> shift,
+                dst[i], dst_linesize[i], (this->dst_width + shift) >> shift, (this->dst_height + shift) >> shift);
+        }
+    }
     if (rc < 0)
         return -1;
 
-    memset(this->image->pixels, 0, this->image->width * this->image->height * sizeof(pixel_t));
-    int x_offset = (this->resized_frame->width - this->image->width) / 2;
-    int y_offset = (this->resized_frame->height - this->image->height) / 2;
-    for (int y = 0; y < this->resized_frame->height; y++)
+    if (this->ring)
+        return frame_ring_commit_write(this->ring);
+
+    /** Hand the frame to the sender thread. A frame it has not started on yet is dropped. */
+    pthread_mutex_lock(&this->lock);
+    int compose = this->compose;
+    this->compose = this->pending;
+    this->pending = compose;
+    this->has_pending = true;
+    bool send_failed = this->send_failed;
+    pthread_cond_signal(&this->pending_cond);
+    pthread_mutex_unlock(&this->lock);
+
+    return send_failed ? -1 : 0;
+}
+
+/** Sends the newest pending frame whenever the socket takes it, so the caller never blocks on the server */
+static void* sender_main(void* ctx)
+{
+    usb_screen_client_impl_t* this = (usb_screen_client_impl_t*)ctx;
+    pthread_mutex_lock(&this->lock);
+    for (;;)
     {
-        if (y < y_offset)
-            continue;
-        if (y >= y_offset + (int)this->image->height)
+        while (!this->stop && !this->has_pending)
+        {
+            pthread_cond_wait(&this->pending_cond, &this->lock);
+        }
+        if (!this->has_pending || this->send_failed)
+        {
             break;
-        for (int x = 0; x < this->resized_frame->width; x++)
+        }
+        int pending = this->pending;
+        this->pending = this->sending;
+        this->sending = pending;
+        this->has_pending = false;
+        pthread_mutex_unlock(&this->lock);
+
+        const frame_header_t* header = this->frames[this->sending];
+        int rc = send_all(this->fd, header, sizeof(frame_header_t) + header->payload_size);
+
+        pthread_mutex_lock(&this->lock);
+        if (rc != 0)
         {
-            if (x < x_offset)
+            /** A partial frame would desynchronize the stream. Nothing more can be sent. */
+            this->send_failed = true;
+        }
+    }
+    pthread_mutex_unlock(&this->lock);
+    return NULL;
+}
+
+/** Blocks until all of data is sent, resuming after partial sends */
+static int send_all(int fd, const void* data, size_t size)
+{
+    const uint8_t* bytes = (const uint8_t*)data;
+    while (size > 0)
+    {
+        ssize_t sent = send(fd, bytes, size, MSG_NOSIGNAL);
+        if (sent < 0)
+        {
+            if (errno == EINTR)
                 continue;
-            if (x >= x_offset + (int)this->image->width)
-                break;
-            int src_index = y * this->resized_frame->linesize[0] + x * 3;
-            int dst_index = (y - y_offset) * this->image->width + (x - x_offset);
-            this->image->pixels[dst_index].bgr.r = this->resized_frame->data[0][src_index];
-            this->image->pixels[dst_index].bgr.g = this->resized_frame->data[0][src_index + 1];
-            this->image->pixels[dst_index].bgr.b = this->resized_frame->data[0][src_index + 2];
+            return -1;
         }
+        bytes += sent;
+        size -= sent;
     }
+    return 0;
+}
 
-    if (send(this->fd, this->image->pixels, CONST_FB_SIZE, SOCK_NONBLOCK) < 0)
-        return -1;
+/**
+ * Splits one axis into the cropped source and the part of the screen it is scaled into.
+ * A resized size above the screen crops the source, a smaller one leaves borders.
+ */
+static void crop_axis(int src_size, int dst_size, int resized_size, int align,
+    int* src_offset, int* src_crop, int* dst_offset, int* dst_crop)
+{
+    if (resized_size > dst_size)
+    {
+        *src_crop = (int)((int64_t)src_size * dst_size / resized_size);
+        *src_crop = *src_crop > 0 ? *src_crop : 1;
+        *src_offset = (src_size - *src_crop) / 2 & ~(align - 1);
+        *dst_offset = 0;
+        *dst_crop = dst_size;
+    }
+    else
+    {
+        *src_offset = 0;
+        *src_crop = src_size;
+        *dst_offset = (dst_size - resized_size) / 2;
+        *dst_crop = resized_size;
+    }
+}
 
+/** Points planes at (x, y) of the frame, like av_frame_apply_cropping without touching the frame */
+static int crop_source(const AVFrame* frame, int x, int y, const uint8_t* planes[4])
+{
+    const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(frame->format);
+    if (!desc)
+        return -1;
+    for (int i = 0; i < 4 && frame->data[i]; i++)
+    {
+        planes[i] = frame->data[i];
+        if ((x == 0 && y == 0) || ((desc->flags & AV_PIX_FMT_FLAG_PAL) && i == 1))
+            continue;
+        int shift_x = (i == 1 || i == 2) ? desc->log2_chroma_w : 0;
+        int shift_y = (i == 1 || i == 2) ? desc->log2_chroma_h : 0;
+        const AVComponentDescriptor* comp = NULL;
+        for (int j = 0; j < desc->nb_components && !comp; j++)
+        {
+            if (desc->comp[j].plane == i)
+                comp = &desc->comp[j];
+        }
+        if (!comp)
+            return -1;
+        planes[i] += (ptrdiff_t)(y >> shift_y) * frame->linesize[i] + (x >> shift_x) * comp->step;
+    }
     return 0;
 }
+
+/** Untagged streams follow the usual convention, BT.601 below HD and BT.709 above */
+static uint16_t get_ycbcr_flags(const AVFrame* frame)
+{
+    uint16_t flags = 0;
+    if (frame->format != AV_PIX_FMT_YUVJ420P && frame->color_range != AVCOL_RANGE_JPEG)
+        flags |= FRAME_FLAG_LIMITED_RANGE;
+    if (frame->colorspace == AVCOL_SPC_BT470BG
+        || frame->colorspace == AVCOL_SPC_SMPTE170M
+        || (frame->colorspace == AVCOL_SPC_UNSPECIFIED && frame->height < 720))
+        flags |= FRAME_FLAG_BT601;
+    return flags;
+}
+
+/** Fills plane outside the inner_width x inner_height rectangle at (x, y) */
+static void clear_borders(
+    uint8_t* plane, int width, int height, int bytes_per_pixel,
+    int x, int y, int inner_width, int inner_height, uint8_t fill)
+{
+    size_t row_size = (size_t)width * bytes_per_pixel;
+    memset(plane, fill, (size_t)y * row_size);
+    for (int row = y; row < y + inner_height; row++)
+    {
+        uint8_t* line = plane + row * row_size;
+        memset(line, fill, (size_t)x * bytes_per_pixel);
+        memset(line + (size_t)(x + inner_width) * bytes_per_pixel, fill, (size_t)(width - x - inner_width) * bytes_per_pixel);
+    }
+    memset(plane + (y + inner_height) * row_size, fill, (size_t)(height - y - inner_height) * row_size);
+}
@@ -17,6 +17,11 @@ typedef struct
     int frame_height;
     enum AVPixelFormat frame_format;
     int mode;
+    /**
+     * 0: Send frames through the socket.
+     * >0: Hand frames to the server through a shared memory ring with this many slots.
+     */
+    int shm_slots;
 } usb_screen_client_option_t;
 
 typedef struct usb_screen_client_s usb_screen_client_t;
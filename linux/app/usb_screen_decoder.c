@@ -0,0 +1,108 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "../server/config.h"
+
+#include "usb_screen_decoder.h"
+
+static int get_lowres(const AVCodec* codec, int width, int height);
+static bool take_slot(usb_screen_decoder_t* decoder, int64_t pts);
+
+usb_screen_decoder_t* usb_screen_decoder_open(const AVStream* stream, const usb_screen_decoder_option_t* option)
+{
+
+#define CHECK_EXPR(expr, message) \
+do \
+{ \
+    if (!(expr)) \
+    { \
+        fprintf(stderr, "[%s] %s: %s\n", __func__, #expr, message); \
+        goto error; \
+    } \
+} while (0)
+
+    usb_screen_decoder_t* this = malloc(sizeof(usb_screen_decoder_t));
+    CHECK_EXPR(this, "Failed to allocate memory");
+    memset(this, 0, sizeof(usb_screen_decoder_t));
+    this->time_base = stream->time_base;
+    this->thumbnail = option->thumbnail;
+    for (int i = 0; i < USB_SCREEN_DECODER_KEPT_SLOTS; i++)
+        this->kept_slots[i] = AV_NOPTS_VALUE;
+
+    const AVCodec* codec = avcodec_find_decoder(stream->codecpar->codec_id);
+    CHECK_EXPR(codec, "Failed to find decoder");
+    this->context = avcodec_alloc_context3(codec);
+    CHECK_EXPR(this->context, "Failed to allocate decoder context");
+    int rc = avcodec_parameters_to_context(this->context, stream->codecpar);
+    CHECK_EXPR(rc >= 0, "Failed to copy decoder parameters");
+    this->context->pkt_timebase = stream->time_base;
+
+    this->context->thread_count = option->thread_count;
+    this->context->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+    if (option->thumbnail)
+    {
+        /** Blocking artifacts and skipped detail do not survive the downscale */
+        this->context->lowres = get_lowres(codec, stream->codecpar->width, stream->codecpar->height);
+        this->context->skip_loop_filter = AVDISCARD_ALL;
+        this->context->skip_idct = AVDISCARD_NONREF;
+        this->context->flags2 |= AV_CODEC_FLAG2_FAST;
+    }
+    rc = avcodec_open2(this->context, codec, NULL);
+    CHECK_EXPR(rc == 0, "Failed to open decoder");
+    return this;
+error:
+    usb_screen_decoder_close(this);
+    return NULL;
+
+#undef CHECK_EXPR
+
+}
+
+int usb_screen_decoder_send_packet(usb_screen_decoder_t* decoder, const AVPacket* packet, bool late)
+{
+    /** Only non-reference frames are skipped, everything else still decodes to keep the references intact */
+    bool keep = !late && (!decoder->thumbnail || take_slot(decoder, packet->pts));
+    decoder->context->skip_frame = keep ? AVDISCARD_DEFAULT : AVDISCARD_NONREF;
+    return avcodec_send_packet(decoder->context, packet);
+}
+
+void usb_screen_decoder_close(usb_screen_decoder_t* decoder)
+{
+    if (!decoder)
+        return;
+    avcodec_free_context(&decoder->context);
+    free(decoder);
+}
+
+/** The most a codec can scale down while the picture still covers the screen */
+static int get_lowres(const AVCodec* codec, int width, int height)
+{
+    int lowres = 0;
+    while (lowres < codec->max_lowres
+        && (width >> (lowres + 1)) >= CONST_SCREEN_WIDTH
+        && (height >> (lowres + 1)) >= CONST_SCREEN_HEIGHT)
+    {
+        lowres++;
+    }
+    return lowres;
+}
+
+/**
+ * The server keeps at most one frame per DEFAULT_FRAME_MIN_INTERVAL. Claims the slot pts falls into,
+ * false if a recent frame already has it. Packets come in decode order, so several slots are remembered.
+ */
+static bool take_slot(usb_screen_decoder_t* decoder, int64_t pts)
+{
+    if (pts == AV_NOPTS_VALUE)
+        return true;
+    int64_t slot = av_rescale_q(pts, decoder->time_base, (AVRational){ 1, 1000 }) / DEFAULT_FRAME_MIN_INTERVAL;
+    for (int i = 0; i < USB_SCREEN_DECODER_KEPT_SLOTS; i++)
+    {
+        if (decoder->kept_slots[i] == slot)
+            return false;
+    }
+    decoder->kept_slots[decoder->next_kept] = slot;
+    decoder->next_kept = (decoder->next_kept + 1) % USB_SCREEN_DECODER_KEPT_SLOTS;
+    return true;
+}
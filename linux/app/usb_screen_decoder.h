@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdbool.h>
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+
+typedef struct
+{
+    /**
+     * Decode only as much as a screen sized picture needs: the lowest lowres that still covers the screen,
+     * no loop filter, no IDCT on non-reference frames, and non-reference frames the server would drop
+     * are not decoded at all.
+     */
+    bool thumbnail;
+    /** Frame and slice threads. 1: No threading. 0: One per core. */
+    int thread_count;
+} usb_screen_decoder_option_t;
+
+/** Recently kept frames, in DEFAULT_FRAME_MIN_INTERVAL sized slots of presentation time */
+#define USB_SCREEN_DECODER_KEPT_SLOTS (8)
+
+typedef struct
+{
+    AVCodecContext* context;
+    AVRational time_base;
+    bool thumbnail;
+    /** A ring, next_kept is overwritten next */
+    int64_t kept_slots[USB_SCREEN_DECODER_KEPT_SLOTS];
+    int next_kept;
+} usb_screen_decoder_t;
+
+/** Frames come out of decoder->context with avcodec_receive_frame, in its width and height */
+usb_screen_decoder_t* usb_screen_decoder_open(const AVStream* stream, const usb_screen_decoder_option_t* option);
+/**
+ * avcodec_send_packet, after deciding whether a non-reference frame in it is worth decoding.
+ * late: The packet is due already and would be dropped once decoded. Skipped if it is not a reference.
+ */
+int usb_screen_decoder_send_packet(usb_screen_decoder_t* decoder, const AVPacket* packet, bool late);
+void usb_screen_decoder_close(usb_screen_decoder_t* decoder);
@@ -4,13 +4,43 @@
 #include <unistd.h>
 #include <string.h>
 #include <time.h>
+#include <errno.h>
+#include <stdbool.h>
 
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
 
 #include "usb_screen_client.h"
+#include "usb_screen_decoder.h"
 
-static uint64_t now_us();
+/** Drift beyond this in either direction is a discontinuity or a long stall. The clock restarts instead. */
+#define PACING_RESYNC_NS (1000000000ll)
+
+/** Maps presentation timestamps onto CLOCK_MONOTONIC, anchored at the first shown frame */
+typedef struct
+{
+    AVRational time_base;
+    /** A frame later than this is dropped */
+    int64_t frame_time_ns;
+    bool started;
+    int64_t start_pts;
+    int64_t start_ns;
+    int64_t last_pts;
+    /** Stats, reported on exit */
+    int n_shown;
+    int n_dropped;
+    int n_late_packets;
+    int n_resyncs;
+    int64_t drift_sum_ns;
+    int64_t drift_max_ns;
+} presentation_clock_t;
+
+static int64_t now_ns();
+static int64_t presentation_deadline(const presentation_clock_t* clock, int64_t pts);
+static bool presentation_is_late(const presentation_clock_t* clock, int64_t pts);
+static bool presentation_wait(presentation_clock_t* clock, int64_t pts);
+static void presentation_shown(presentation_clock_t* clock);
+static void presentation_report(const presentation_clock_t* clock);
 
 #define CHECK_EXPR(expr, message) \
 do { \
@@ -27,9 +57,14 @@ int main(int argc, char* const* argv)
     const char* input_file = NULL;
     const char* server_path = NULL;
     int mode = USB_SCREEN_MODE_STRETCH;
+    int shm_slots = 0;
+    usb_screen_decoder_option_t decoder_option;
+    memset(&decoder_option, 0, sizeof(decoder_option));
+    /** Single threaded unless asked, as libavcodec defaults to */
+    decoder_option.thread_count = 1;
 
     int opt = -1;
-    while ((opt = getopt(argc, argv, "s:i:m:")) != -1)
+    while ((opt = getopt(argc, argv, "s:i:m:r:t:T")) != -1)
     {
         switch (opt)
         {
@@ -42,13 +77,24 @@ int main(int argc, char* const* argv)
         case 'm':
             mode = atoi(optarg);
             break;
+        case 'r':
+            shm_slots = atoi(optarg);
+            break;
+        case 't':
+            decoder_option.thread_count = atoi(optarg);
+            break;
+        case 'T':
+            decoder_option.thumbnail = true;
+            break;
         default:
             break;
         }
     }
-    if (input_file == NULL || mode < 0 || mode >= USB_SCREEN_MODE_MAX)
+    if (input_file == NULL || mode < 0 || mode >= USB_SCREEN_MODE_MAX || shm_slots < 0 || decoder_option.thread_count < 0)
     {
-        fprintf(stderr, "Usage: %s -i <input file> [-s <server path>] [-m <mode>]\n", argv[0]);
+        fprintf(stderr, "Usage: %s -i <input file> [-s <server path>] [-m <mode>] [-r <shm ring slots>] [-t <decoder threads>] [-T]\n", argv[0]);
+        fprintf(stderr, "\t-t: Decoder threads, default 1, 0 for one per core\n");
+        fprintf(stderr, "\t-T: Thumbnail decode, only as much as the screen shows\n");
         fprintf(stderr, "\tModes:\n");
         fprintf(stderr, "\t\t0: Stretch\n");
         fprintf(stderr, "\t\t1: Fit\n");
@@ -73,41 +119,43 @@ int main(int argc, char* const* argv)
     }
     CHECK_EXPR(input_stream, "Failed to find video stream");
 
+    usb_screen_decoder_t* decoder = usb_screen_decoder_open(input_stream, &decoder_option);
+    CHECK_EXPR(decoder, "Failed to open decoder");
+    AVCodecContext* decoder_context = decoder->context;
+
+    /** Lowres decoding shrinks the frames */
     usb_screen_client_option_t client_option;
     memset(&client_option, 0, sizeof(client_option));
     client_option.server_path = server_path;
-    client_option.frame_width = input_stream->codecpar->width;
-    client_option.frame_height = input_stream->codecpar->height;
+    client_option.frame_width = decoder_context->width;
+    client_option.frame_height = decoder_context->height;
     client_option.frame_format = input_stream->codecpar->format;
     client_option.mode = mode;
+    client_option.shm_slots = shm_slots;
     usb_screen_client_t* client = usb_screen_client_connect(&client_option);
     CHECK_EXPR(client, "Failed to connect to server");
 
-    const AVCodec* decoder = avcodec_find_decoder(input_stream->codecpar->codec_id);
-    CHECK_EXPR(decoder, "Failed to find decoder");
-    AVCodecContext* decoder_context = avcodec_alloc_context3(decoder);
-    CHECK_EXPR(decoder_context, "Failed to allocate decoder context");
-    rc = avcodec_parameters_to_context(decoder_context, input_stream->codecpar);
-    CHECK_EXPR(rc == 0, "Failed to copy decoder parameters");
-    rc = avcodec_open2(decoder_context, decoder, NULL);
-    CHECK_EXPR(rc == 0, "Failed to open decoder");
-
     AVRational frame_rate = av_guess_frame_rate(format_context, input_stream, NULL);
     uint64_t frame_time_us = av_q2d(av_inv_q(frame_rate)) * 1000000;
     printf("Frame rate: %d/%d\n", frame_rate.num, frame_rate.den);
     printf("Frame time: %lu us\n", frame_time_us);
+    presentation_clock_t pacing;
+    memset(&pacing, 0, sizeof(pacing));
+    pacing.time_base = input_stream->time_base;
+    pacing.frame_time_ns = frame_time_us * 1000;
 
     AVFrame* frame = av_frame_alloc();
     CHECK_EXPR(frame, "Failed to allocate frame");
     AVPacket* packet = av_packet_alloc();
     CHECK_EXPR(packet, "Failed to allocate packet");
-    int n_frame = 0;
-    uint64_t last_frame_time = now_us();
     while(av_read_frame(format_context, packet) >= 0)
     {
         if (packet->stream_index == input_stream->index)
         {
-            rc = avcodec_send_packet(decoder_context, packet);
+            /** Behind the clock, non-reference frames are not even decoded */
+            bool late = presentation_is_late(&pacing, packet->pts);
+            pacing.n_late_packets += late;
+            rc = usb_screen_decoder_send_packet(decoder, packet, late);
             av_packet_unref(packet);
             CHECK_EXPR(rc == 0, "Failed to send packet");
             while((rc = avcodec_receive_frame(decoder_context, frame)) >= 0)
@@ -117,39 +165,107 @@ int main(int argc, char* const* argv)
                     break;
                 }
                 CHECK_EXPR(rc == 0, "Failed to receive frame");
+                /** Reference frames had to be decoded anyway. Late ones are not scaled or sent. */
+                int64_t pts = frame->best_effort_timestamp;
+                if (!presentation_wait(&pacing, pts))
+                {
+                    av_frame_unref(frame);
+                    continue;
+                }
                 rc = client->send_frame(client, frame);
                 CHECK_EXPR(rc == 0, "Failed to send frame");
-                n_frame++;
+                presentation_shown(&pacing);
                 av_frame_unref(frame);
-
-                /** @todo improve frame pacing */
-                uint64_t now = now_us();
-                if (last_frame_time == 0)
-                {
-                    last_frame_time = now;
-                }
-                if (now - last_frame_time < frame_time_us)
-                {
-                    usleep(frame_time_us - (now - last_frame_time));
-                }
-                now = now_us();
-                last_frame_time = now_us();
             }
         }
+        else
+        {
+            av_packet_unref(packet);
+        }
     }
+    presentation_report(&pacing);
     
     av_packet_free(&packet);
     av_frame_free(&frame);
-    avcodec_free_context(&decoder_context);
+    usb_screen_decoder_close(decoder);
     avformat_close_input(&format_context);
     client->close(client);
     return 0;
 }
 
-static uint64_t now_us()
+static int64_t now_ns()
 {
     struct timespec ts;
     clock_gettime(CLOCK_MONOTONIC, &ts);
-    return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    return ts.tv_sec * 1000000000ll + ts.tv_nsec;
+}
+
+/** When pts is due on CLOCK_MONOTONIC. The clock must be started. */
+static int64_t presentation_deadline(const presentation_clock_t* clock, int64_t pts)
+{
+    return clock->start_ns + av_rescale_q(pts - clock->start_pts, clock->time_base, (AVRational){ 1, 1000000000 });
+}
+
+/** Due more than a frame ago. Unknown timestamps and discontinuities are never late. */
+static bool presentation_is_late(const presentation_clock_t* clock, int64_t pts)
+{
+    if (!clock->started || pts == AV_NOPTS_VALUE)
+        return false;
+    int64_t behind = now_ns() - presentation_deadline(clock, pts);
+    return behind > clock->frame_time_ns && behind < PACING_RESYNC_NS;
+}
+
+/** Sleeps until pts is due. false if it is late and should be dropped. */
+static bool presentation_wait(presentation_clock_t* clock, int64_t pts)
+{
+    if (pts == AV_NOPTS_VALUE)
+    {
+        /** Assume it follows the last frame */
+        pts = clock->last_pts + av_rescale_q(clock->frame_time_ns, (AVRational){ 1, 1000000000 }, clock->time_base);
+    }
+    int64_t now = now_ns();
+    int64_t deadline = clock->started ? presentation_deadline(clock, pts) : now;
+    if (deadline - now > PACING_RESYNC_NS || now - deadline > PACING_RESYNC_NS || !clock->started)
+    {
+        clock->n_resyncs += clock->started;
+        clock->started = true;
+        clock->start_pts = pts;
+        clock->start_ns = now;
+        deadline = now;
+    }
+    if (now - deadline > clock->frame_time_ns)
+    {
+        clock->n_dropped++;
+        return false;
+    }
+    /** Absolute, so time spent decoding and sending does not add up */
+    struct timespec ts;
+    ts.tv_sec = deadline / 1000000000;
+    ts.tv_nsec = deadline % 1000000000;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+    {
+    }
+    clock->last_pts = pts;
+    return true;
+}
+
+/** Drift is how far behind its deadline a frame was handed to the server */
+static void presentation_shown(presentation_clock_t* clock)
+{
+    int64_t drift = now_ns() - presentation_deadline(clock, clock->last_pts);
+    clock->n_shown++;
+    clock->drift_sum_ns += drift;
+    clock->drift_max_ns = drift > clock->drift_max_ns ? drift : clock->drift_max_ns;
+}
+
+static void presentation_report(const presentation_clock_t* clock)
+{
+    printf("Frames shown: %d, dropped late: %d, late packets: %d, resyncs: %d\n",
+        clock->n_shown, clock->n_dropped, clock->n_late_packets, clock->n_resyncs);
+    if (clock->n_shown > 0)
+    {
+        printf("Drift: mean %.3f ms, max %.3f ms\n",
+            clock->drift_sum_ns / 1e6 / clock->n_shown, clock->drift_max_ns / 1e6);
+    }
 }
 
@@ -10,6 +10,7 @@
 #include <libavutil/avutil.h>
 
 #include "usb_screen_client.h"
+#include "usb_screen_decoder.h"
 
 #define CHECK_EXPR(expr, message) \
 do { \
@@ -28,8 +29,13 @@ int main(int argc, char* const* argv)
     int opt = -1;
     const char* server_path = NULL;
     int mode = USB_SCREEN_MODE_STRETCH;
+    int shm_slots = 0;
     int port = DEFAULT_LISTEN_PORT;
-    while ((opt = getopt(argc, argv, "s:m:l:")) != -1)
+    usb_screen_decoder_option_t decoder_option;
+    memset(&decoder_option, 0, sizeof(decoder_option));
+    /** Each frame thread delays the live stream by a frame, so threading is opt in */
+    decoder_option.thread_count = 1;
+    while ((opt = getopt(argc, argv, "s:m:l:r:t:T")) != -1)
     {
         switch (opt)
         {
@@ -39,17 +45,28 @@ int main(int argc, char* const* argv)
         case 'm':
             mode = atoi(optarg);
             break;
+        case 'r':
+            shm_slots = atoi(optarg);
+            break;
         case 'l':
             port = atoi(optarg);
             break;
+        case 't':
+            decoder_option.thread_count = atoi(optarg);
+            break;
+        case 'T':
+            decoder_option.thumbnail = true;
+            break;
         default:
             break;
         }
     }
-    if (mode < 0 || mode >= USB_SCREEN_MODE_MAX || port < 0 || port >= 65536)
+    if (mode < 0 || mode >= USB_SCREEN_MODE_MAX || port < 0 || port >= 65536 || shm_slots < 0 || decoder_option.thread_count < 0)
     {
         fprintf(stderr, "Invalid arguments\n");
-        fprintf(stderr, "Usage: %s [-s <server path>] [-m <mode>] [-l <listen port>]\n", argv[0]);
+        fprintf(stderr, "Usage: %s [-s <server path>] [-m <mode>] [-l <listen port>] [-r <shm ring slots>] [-t <decoder threads>] [-T]\n", argv[0]);
+        fprintf(stderr, "\t-t: Decoder threads, default 1, 0 for one per core\n");
+        fprintf(stderr, "\t-T: Thumbnail decode, only as much as the screen shows\n");
         fprintf(stderr, "\tModes:\n");
         fprintf(stderr, "\t\t0: Stretch\n");
         fprintf(stderr, "\t\t1: Fit\n");
@@ -85,25 +102,23 @@ int main(int argc, char* const* argv)
     CHECK_EXPR(stream, "Failed to find video stream");
     CHECK_EXPR(stream->codecpar->codec_id == AV_CODEC_ID_H264, "Only H264 is supported");
 
+    /** Create decoder */
+    usb_screen_decoder_t* decoder = usb_screen_decoder_open(stream, &decoder_option);
+    CHECK_EXPR(decoder, "Failed to open decoder");
+    AVCodecContext* codec_ctx = decoder->context;
+
     /** Connect to server */
     usb_screen_client_option_t client_option;
     memset(&client_option, 0, sizeof(client_option));
     client_option.server_path = server_path;
     client_option.frame_format = stream->codecpar->format;
-    client_option.frame_width = stream->codecpar->width;
-    client_option.frame_height = stream->codecpar->height;
+    client_option.frame_width = codec_ctx->width;
+    client_option.frame_height = codec_ctx->height;
     client_option.mode = mode;
+    client_option.shm_slots = shm_slots;
     usb_screen_client_t* client = usb_screen_client_connect(&client_option);
     CHECK_EXPR(client, "Failed to connect to server");
 
-    /** Create decoder */
-    const AVCodec* codec = avcodec_find_decoder(stream->codecpar->codec_id);
-    CHECK_EXPR(codec, "Failed to find decoder");
-    AVCodecContext* codec_ctx = avcodec_alloc_context3(codec);
-    CHECK_EXPR(codec_ctx, "Failed to allocate codec context");
-    avcodec_parameters_to_context(codec_ctx, stream->codecpar);
-    avcodec_open2(codec_ctx, codec, NULL);
-
     /** Create filter */
     AVBSFContext* bsf_ctx = NULL;
     const AVBitStreamFilter *filter = av_bsf_get_by_name("h264_mp4toannexb");
@@ -136,7 +151,8 @@ int main(int argc, char* const* argv)
             }
             CHECK_EXPR(rc == 0, "Failed to receive packet");
 
-            avcodec_send_packet(codec_ctx, packet);
+            /** Live input is not paced here, the client and the server drop what they can not take */
+            usb_screen_decoder_send_packet(decoder, packet, false);
             av_packet_unref(packet);
 
             while((rc = avcodec_receive_frame(codec_ctx, frame)) >= 0)
@@ -156,7 +172,7 @@ int main(int argc, char* const* argv)
     }
     av_packet_free(&packet);
     
-    avcodec_close(codec_ctx);
+    usb_screen_decoder_close(decoder);
     avformat_close_input(&fmt_ctx);
 
     return 0;
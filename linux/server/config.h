@@ -1,14 +1,26 @@
 #pragma once
 
 #include "../../common/image.h"
+#include "frame_format.h"
 
 /** These values should sync with the MCU firmware */
 #define CONST_SCREEN_WIDTH (160)
 #define CONST_SCREEN_HEIGHT (80)
 #define CONST_N_COLOR (32)
 #define CONST_FB_SIZE (CONST_SCREEN_WIDTH * CONST_SCREEN_HEIGHT * sizeof(pixel_t))
+/** A frame_header_t and the largest payload */
+#define CONST_FRAME_MAX_SIZE FRAME_MAX_SIZE(CONST_SCREEN_WIDTH, CONST_SCREEN_HEIGHT)
+/** k-means mode only. >0 runs the parallel engine on this many threads, 0 the single threaded histogram engine. */
+#define CONST_K_MEANS_THREADS (0)
+/** 8 or 16. Smaller tiles send fewer unchanged pixels but more window headers. */
+#define CONST_DELTA_TILE_SIZE (16)
 
 /** These are default values */
 #define DEFAULT_SOCK_PATH "@usb-screen-server"
-/** DO NOT set this too high. Set this to < 33 to better support  30fps video */
+/** Dumps the frame stats to whoever connects */
+#define DEFAULT_STATS_SOCK_PATH "@usb-screen-server-stats"
+/**
+ * Floor of the frame interval in ms. Slower encodes or device writes stretch it, see frame_scheduler.h.
+ * DO NOT set this too high. Set this to < 33 to better support  30fps video
+ */
 #define DEFAULT_FRAME_MIN_INTERVAL (30)
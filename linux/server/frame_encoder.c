@@ -0,0 +1,287 @@
+#include "frame_encoder.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdbool.h>
+
+#include "config.h"
+#include "../../common/k_means_compression.h"
+#include "../../common/color_conversion.h"
+#include "../../common/tile_delta.h"
+#include "../../common/frame_hash.h"
+
+#if FRAME_COMPRESSION == FRAME_COMPRESSION_K_MEANS
+_Static_assert(CONST_N_COLOR == FRAME_PALETTE_COLORS, "Palette frames must match the MCU palette");
+#endif
+
+static int encode_frame(frame_encoder_t* encoder, const void** data, size_t* size);
+#if FRAME_COMPRESSION == FRAME_COMPRESSION_K_MEANS
+static int compress_image(frame_encoder_t* encoder, const image_t* bgr);
+#endif
+
+struct frame_encoder_s
+{
+    frame_stats_t* stats;
+    /** Hash of the loaded frame, and of the last one that was encoded into a packet */
+    uint64_t frame_hash;
+    uint64_t encoded_hash;
+    bool encoded_valid;
+    /** The loaded frame equals the last encoded one */
+    bool duplicate;
+#if FRAME_COMPRESSION == FRAME_COMPRESSION_NONE
+    rgb565_image_t* rgb565_image;
+#elif FRAME_COMPRESSION == FRAME_COMPRESSION_K_MEANS
+    image_t* image;
+    color_palette_image_t* compressed_image;
+    packed_color_palette_image_t* packed_image;
+    k_means_pool_t* k_means_pool;
+    k_means_ctx_t* k_means;
+    bool first_frame;
+    /** The loaded frame was already packed by the client */
+    bool prepacked;
+    /** k-means already ran on the loaded frame, fused with its conversion */
+    bool compressed;
+#elif FRAME_COMPRESSION == FRAME_COMPRESSION_TILE_DELTA
+    rgb565_image_t* rgb565_image;
+    tile_delta_encoder_t* delta_encoder;
+#endif
+};
+
+frame_encoder_t* frame_encoder_new(frame_stats_t* stats)
+{
+    frame_encoder_t* encoder = malloc(sizeof(frame_encoder_t));
+    if (!encoder)
+    {
+        return NULL;
+    }
+    memset(encoder, 0, sizeof(frame_encoder_t));
+    encoder->stats = stats;
+#if FRAME_COMPRESSION == FRAME_COMPRESSION_NONE
+    encoder->rgb565_image = rgb565_image_new(CONST_SCREEN_WIDTH * CONST_SCREEN_HEIGHT);
+    if (!encoder->rgb565_image)
+    {
+        fprintf(stderr, "Failed to create rgb565 image\n");
+        goto error;
+    }
+#elif FRAME_COMPRESSION == FRAME_COMPRESSION_K_MEANS
+    encoder->first_frame = true;
+    encoder->image = image_new(CONST_SCREEN_WIDTH, CONST_SCREEN_HEIGHT);
+    if (!encoder->image)
+    {
+        fprintf(stderr, "Failed to create image\n");
+        goto error;
+    }
+    encoder->compressed_image = color_palette_image_new(CONST_N_COLOR, CONST_SCREEN_WIDTH, CONST_SCREEN_HEIGHT);
+    if (!encoder->compressed_image)
+    {
+        fprintf(stderr, "Failed to create compressed image\n");
+        goto error;
+    }
+    encoder->packed_image = packed_color_palette_image_new(CONST_N_COLOR, CONST_SCREEN_WIDTH, CONST_SCREEN_HEIGHT);
+    if (!encoder->packed_image)
+    {
+        fprintf(stderr, "Failed to create packed image\n");
+        goto error;
+    }
+#if CONST_K_MEANS_THREADS > 0
+    encoder->k_means_pool = k_means_pool_new(CONST_K_MEANS_THREADS, true);
+    if (!encoder->k_means_pool)
+    {
+        fprintf(stderr, "Failed to create k-means pool\n");
+        goto error;
+    }
+    encoder->k_means = k_means_ctx_new(K_MEANS_ENGINE_PARALLEL, CONST_N_COLOR, CONST_SCREEN_WIDTH, CONST_SCREEN_HEIGHT, encoder->k_means_pool);
+#else
+    encoder->k_means = k_means_ctx_new(K_MEANS_ENGINE_HISTOGRAM, CONST_N_COLOR, CONST_SCREEN_WIDTH, CONST_SCREEN_HEIGHT, NULL);
+#endif
+    if (!encoder->k_means)
+    {
+        fprintf(stderr, "Failed to create k-means context\n");
+        goto error;
+    }
+#elif FRAME_COMPRESSION == FRAME_COMPRESSION_TILE_DELTA
+    encoder->rgb565_image = rgb565_image_new(CONST_SCREEN_WIDTH * CONST_SCREEN_HEIGHT);
+    if (!encoder->rgb565_image)
+    {
+        fprintf(stderr, "Failed to create rgb565 image\n");
+        goto error;
+    }
+    encoder->delta_encoder = tile_delta_encoder_new(CONST_SCREEN_WIDTH, CONST_SCREEN_HEIGHT, CONST_DELTA_TILE_SIZE);
+    if (!encoder->delta_encoder)
+    {
+        fprintf(stderr, "Failed to create delta encoder\n");
+        goto error;
+    }
+#endif
+    return encoder;
+error:
+    frame_encoder_free(encoder);
+    return NULL;
+}
+
+void frame_encoder_free(frame_encoder_t* encoder)
+{
+    if (!encoder)
+    {
+        return;
+    }
+#if FRAME_COMPRESSION == FRAME_COMPRESSION_NONE
+    rgb565_image_free(encoder->rgb565_image);
+#elif FRAME_COMPRESSION == FRAME_COMPRESSION_K_MEANS
+    image_free(encoder->image);
+    color_palette_image_free(encoder->compressed_image);
+    packed_color_palette_image_free(encoder->packed_image);
+    k_means_ctx_free(encoder->k_means);
+    k_means_pool_free(encoder->k_means_pool);
+#elif FRAME_COMPRESSION == FRAME_COMPRESSION_TILE_DELTA
+    rgb565_image_free(encoder->rgb565_image);
+    tile_delta_encoder_free(encoder->delta_encoder);
+#endif
+    free(encoder);
+}
+
+int frame_encoder_load(frame_encoder_t* encoder, const frame_header_t* header, const void* payload)
+{
+    if (!encoder || !header || !payload)
+    {
+        return -1;
+    }
+    if (header->width != CONST_SCREEN_WIDTH || header->height != CONST_SCREEN_HEIGHT)
+    {
+        return -1;
+    }
+    /** The format and flags are part of the frame, the same bytes mean another image in another format */
+    encoder->frame_hash = frame_hash(payload, header->payload_size, (uint64_t)header->format << 16 | header->flags);
+    encoder->duplicate = encoder->encoded_valid && encoder->frame_hash == encoder->encoded_hash;
+    if (encoder->duplicate)
+    {
+        return 0;
+    }
+    uint64_t start = frame_stats_now_ns();
+#if FRAME_COMPRESSION == FRAME_COMPRESSION_NONE || FRAME_COMPRESSION == FRAME_COMPRESSION_TILE_DELTA
+    int rc = frame_to_rgb565(header, payload, encoder->rgb565_image);
+#elif FRAME_COMPRESSION == FRAME_COMPRESSION_K_MEANS
+    int rc = 0;
+    encoder->prepacked = header->format == FRAME_FORMAT_PALETTE;
+    encoder->compressed = false;
+    if (encoder->prepacked)
+    {
+        memcpy(encoder->packed_image->data, payload, encoder->packed_image->size);
+    }
+    else if (header->format == FRAME_FORMAT_BGR24)
+    {
+        /**
+         * The payload is gone once this returns, so k-means runs now and converts the frame
+         * within its first pass, instead of in a sweep of its own. Recorded as compress.
+         */
+        image_t bgr = *encoder->image;
+        bgr.pixels = (pixel_t*)payload;
+        bgr.color_space = COLOR_SPACE_BGR;
+        rc = compress_image(encoder, &bgr);
+        encoder->compressed = rc == 0;
+        return rc;
+    }
+    else
+    {
+        rc = frame_to_ycbcr(header, payload, encoder->image);
+    }
+#endif
+    frame_stats_record_since(encoder->stats, FRAME_STAGE_CONVERT, start);
+    return rc;
+}
+
+int frame_encoder_encode(frame_encoder_t* encoder, const void** data, size_t* size)
+{
+    if (!encoder || !data || !size)
+    {
+        return -1;
+    }
+    if (encoder->duplicate)
+    {
+        encoder->duplicate = false;
+        frame_stats_count(encoder->stats, FRAME_COUNTER_DUPLICATE, 1);
+        *data = NULL;
+        *size = 0;
+        return 0;
+    }
+    int rc = encode_frame(encoder, data, size);
+    if (rc == 0)
+    {
+        /** Taken as sent from here on. A loss resets the encoder, which forgets it again. */
+        encoder->encoded_hash = encoder->frame_hash;
+        encoder->encoded_valid = true;
+    }
+    return rc;
+}
+
+void frame_encoder_reset(frame_encoder_t* encoder)
+{
+    if (!encoder)
+    {
+        return;
+    }
+    encoder->encoded_valid = false;
+#if FRAME_COMPRESSION == FRAME_COMPRESSION_TILE_DELTA
+    tile_delta_encoder_reset(encoder->delta_encoder);
+#endif
+}
+
+/** Encodes the loaded frame, which is not a duplicate */
+static int encode_frame(frame_encoder_t* encoder, const void** data, size_t* size)
+{
+#if FRAME_COMPRESSION == FRAME_COMPRESSION_NONE
+    *data = encoder->rgb565_image->pixels;
+    *size = encoder->rgb565_image->size * sizeof(rgb565_pixel_t);
+#elif FRAME_COMPRESSION == FRAME_COMPRESSION_K_MEANS
+    if (encoder->prepacked)
+    {
+        *data = encoder->packed_image->data;
+        *size = encoder->packed_image->size;
+        return 0;
+    }
+    if (!encoder->compressed && compress_image(encoder, NULL) != 0)
+    {
+        return -1;
+    }
+    encoder->compressed = false;
+    uint64_t start = frame_stats_now_ns();
+    pixel_t color_palette[CONST_N_COLOR];
+    memcpy(color_palette, encoder->compressed_image->color_palettes, sizeof(color_palette));
+    palette_ycbcr_to_bgr(encoder->compressed_image, encoder->compressed_image);
+    pack_color_palette_image(encoder->compressed_image, encoder->packed_image);
+    memcpy(encoder->compressed_image->color_palettes, color_palette, sizeof(color_palette));
+    frame_stats_record_since(encoder->stats, FRAME_STAGE_PACK, start);
+    encoder->first_frame = false;
+    *data = encoder->packed_image->data;
+    *size = encoder->packed_image->size;
+#elif FRAME_COMPRESSION == FRAME_COMPRESSION_TILE_DELTA
+    const uint8_t* delta = NULL;
+    uint64_t start = frame_stats_now_ns();
+    if (tile_delta_encode(encoder->delta_encoder, encoder->rgb565_image, &delta, size) != 0)
+    {
+        return -1;
+    }
+    frame_stats_record_since(encoder->stats, FRAME_STAGE_COMPRESS, start);
+    *data = delta;
+#endif
+    return 0;
+}
+
+#if FRAME_COMPRESSION == FRAME_COMPRESSION_K_MEANS
+/** Compresses encoder->image, or bgr converted into it if bgr is set. This can be time consuming. */
+static int compress_image(frame_encoder_t* encoder, const image_t* bgr)
+{
+    uint64_t start = frame_stats_now_ns();
+    int iterations = bgr
+        ? k_means_ctx_run_bgr(encoder->k_means, bgr, encoder->image, encoder->compressed_image, !encoder->first_frame)
+        : k_means_ctx_run(encoder->k_means, encoder->image, encoder->compressed_image, !encoder->first_frame);
+    if (iterations < 0)
+    {
+        fprintf(stderr, "Failed to compress image\n");
+        return -1;
+    }
+    frame_stats_record_since(encoder->stats, FRAME_STAGE_COMPRESS, start);
+    frame_stats_record(encoder->stats, FRAME_STAGE_KMEANS_ITERATIONS, iterations);
+    return 0;
+}
+#endif
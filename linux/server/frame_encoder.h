@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stddef.h>
+#include "../../common/image.h"
+#include "../../common/config.h"
+#include "frame_stats.h"
+#include "frame_format.h"
+
+/**
+ * Packets depend on the previous packet. None may be dropped once encoded,
+ * and the encoder must be reset whenever one is lost on the way to the device.
+ */
+#define FRAME_ENCODER_IS_DIFFERENTIAL (FRAME_COMPRESSION == FRAME_COMPRESSION_TILE_DELTA)
+
+/**
+ * Turns frames into the byte stream the MCU expects.
+ * Not thread safe. Each encoder keeps its own state (e.g. the k-means hint).
+ */
+typedef struct frame_encoder_s frame_encoder_t;
+
+/** The convert, compress and pack stages are recorded into stats, which may be NULL */
+frame_encoder_t* frame_encoder_new(frame_stats_t* stats);
+void frame_encoder_free(frame_encoder_t* encoder);
+
+/**
+ * Converts a frame that passed frame_header_check into the encoder's own workspace.
+ * Stages the frame format makes unnecessary are skipped.
+ * A frame that hashes like the last encoded one is not converted at all and encodes to nothing.
+ * The k-means encoder compresses BGR24 frames right here, with the conversion fused into k-means.
+ * Neither header nor payload are referenced after this returns.
+ */
+int frame_encoder_load(frame_encoder_t* encoder, const frame_header_t* header, const void* payload);
+
+/**
+ * Encodes the loaded frame.
+ * On success data points to the encoder's output buffer, valid until the next call.
+ * size is 0 if there is nothing to send.
+ */
+int frame_encoder_encode(frame_encoder_t* encoder, const void** data, size_t* size);
+
+/** The next packet will not depend on anything sent before. The next frame is never taken for a duplicate. */
+void frame_encoder_reset(frame_encoder_t* encoder);
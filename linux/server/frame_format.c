@@ -0,0 +1,296 @@
+#include "frame_format.h"
+#include <string.h>
+#include <stdbool.h>
+#include <math.h>
+
+#include "../../common/color_conversion.h"
+
+/** YCbCr matrices are Q12 fixed point */
+#define MATRIX_SHIFT (12)
+
+typedef struct
+{
+    int32_t m[3][3];
+    int y_offset;
+} ycbcr_matrix_t;
+
+static void get_ycbcr_matrix(uint16_t flags, bool to_rgb, ycbcr_matrix_t* matrix);
+static int clamp_u8(int32_t value);
+static int clamp_s8(int32_t value);
+static void ycbcr_planes(const frame_header_t* header, const void* payload,
+    const uint8_t** y, const uint8_t** cb, const uint8_t** cr, int* chroma_shift);
+static void palette_to_rgb565(const frame_header_t* header, const void* payload, rgb565_pixel_t* dst);
+
+size_t frame_payload_size(int format, int width, int height)
+{
+    size_t n_pixels = (size_t)width * height;
+    switch (format)
+    {
+    case FRAME_FORMAT_BGR24:
+    case FRAME_FORMAT_YCBCR444P:
+        return n_pixels * 3;
+    case FRAME_FORMAT_RGB565:
+        return n_pixels * 2;
+    case FRAME_FORMAT_YCBCR420P:
+        return n_pixels + 2 * (size_t)((width + 1) / 2) * ((height + 1) / 2);
+    case FRAME_FORMAT_PALETTE:
+        return FRAME_PALETTE_COLORS * 2 + (n_pixels * FRAME_PALETTE_BITS + 7) / 8;
+    default:
+        return 0;
+    }
+}
+
+void frame_header_init(frame_header_t* header, int format, int width, int height)
+{
+    memset(header, 0, sizeof(frame_header_t));
+    header->magic = FRAME_HEADER_MAGIC;
+    header->version = FRAME_HEADER_VERSION;
+    header->header_size = sizeof(frame_header_t);
+    header->format = format;
+    header->width = width;
+    header->height = height;
+    header->payload_size = frame_payload_size(format, width, height);
+}
+
+int frame_header_check(const frame_header_t* header, int width, int height)
+{
+    if (header->magic != FRAME_HEADER_MAGIC
+        || header->version != FRAME_HEADER_VERSION
+        || header->header_size != sizeof(frame_header_t)
+        || header->format >= FRAME_FORMAT_COUNT
+        || (header->flags & ~FRAME_FLAG_MASK) != 0
+        || header->width != width
+        || header->height != height
+        || header->payload_size != frame_payload_size(header->format, width, height))
+    {
+        return -1;
+    }
+    return 0;
+}
+
+int frame_to_rgb565(const frame_header_t* header, const void* payload, rgb565_image_t* dst)
+{
+    size_t n_pixels = (size_t)header->width * header->height;
+    if (dst->size != n_pixels)
+    {
+        return -1;
+    }
+    switch (header->format)
+    {
+    case FRAME_FORMAT_BGR24:
+    {
+        image_t src = {
+            .pixels = (pixel_t*)payload,
+            .width = header->width,
+            .height = header->height,
+            .color_space = COLOR_SPACE_BGR,
+        };
+        return bgr_image_to_rgb565(&src, dst);
+    }
+    case FRAME_FORMAT_RGB565:
+        memcpy(dst->pixels, payload, n_pixels * sizeof(rgb565_pixel_t));
+        return 0;
+    case FRAME_FORMAT_YCBCR444P:
+    case FRAME_FORMAT_YCBCR420P:
+    {
+        ycbcr_matrix_t matrix;
+        get_ycbcr_matrix(header->flags, true, &matrix);
+        const uint8_t* y_plane;
+        const uint8_t* cb_plane;
+        const uint8_t* cr_plane;
+        int shift;
+        ycbcr_planes(header, payload, &y_plane, &cb_plane, &cr_plane, &shift);
+        int chroma_width = (header->width + shift) >> shift;
+        for (int y = 0; y < header->height; y++)
+        {
+            const uint8_t* cb_row = cb_plane + (y >> shift) * chroma_width;
+            const uint8_t* cr_row = cr_plane + (y >> shift) * chroma_width;
+            for (int x = 0; x < header->width; x++)
+            {
+                int32_t luma = y_plane[y * header->width + x] - matrix.y_offset;
+                int32_t cb = cb_row[x >> shift] - 128;
+                int32_t cr = cr_row[x >> shift] - 128;
+                int32_t round = 1 << (MATRIX_SHIFT - 1);
+                rgb565_pixel_t* pixel = &dst->pixels[y * header->width + x];
+                pixel->r = clamp_u8((matrix.m[0][0] * luma + matrix.m[0][1] * cb + matrix.m[0][2] * cr + round) >> MATRIX_SHIFT) >> 3;
+                pixel->g = clamp_u8((matrix.m[1][0] * luma + matrix.m[1][1] * cb + matrix.m[1][2] * cr + round) >> MATRIX_SHIFT) >> 2;
+                pixel->b = clamp_u8((matrix.m[2][0] * luma + matrix.m[2][1] * cb + matrix.m[2][2] * cr + round) >> MATRIX_SHIFT) >> 3;
+            }
+        }
+        return 0;
+    }
+    case FRAME_FORMAT_PALETTE:
+        palette_to_rgb565(header, payload, dst->pixels);
+        return 0;
+    default:
+        return -1;
+    }
+}
+
+int frame_to_ycbcr(const frame_header_t* header, const void* payload, image_t* dst)
+{
+    if (dst->width != header->width || dst->height != header->height)
+    {
+        return -1;
+    }
+    size_t n_pixels = (size_t)header->width * header->height;
+    switch (header->format)
+    {
+    case FRAME_FORMAT_BGR24:
+    {
+        image_t src = *dst;
+        src.pixels = (pixel_t*)payload;
+        src.color_space = COLOR_SPACE_BGR;
+        bgr_image_to_ycbcr(&src, dst);
+        return 0;
+    }
+    case FRAME_FORMAT_RGB565:
+    case FRAME_FORMAT_PALETTE:
+    {
+        /** Expand to BGR in place, then convert in place */
+        rgb565_pixel_t* rgb565 = (rgb565_pixel_t*)dst->pixels;
+        if (header->format == FRAME_FORMAT_RGB565)
+        {
+            memcpy(rgb565, payload, n_pixels * sizeof(rgb565_pixel_t));
+        }
+        else
+        {
+            palette_to_rgb565(header, payload, rgb565);
+        }
+        /** Backwards, so no pixel is overwritten before it is read */
+        for (size_t i = n_pixels; i-- > 0;)
+        {
+            rgb565_pixel_t pixel = rgb565[i];
+            dst->pixels[i].bgr.r = (pixel.r << 3) | (pixel.r >> 2);
+            dst->pixels[i].bgr.g = (pixel.g << 2) | (pixel.g >> 4);
+            dst->pixels[i].bgr.b = (pixel.b << 3) | (pixel.b >> 2);
+        }
+        bgr_image_to_ycbcr(dst, dst);
+        return 0;
+    }
+    case FRAME_FORMAT_YCBCR444P:
+    case FRAME_FORMAT_YCBCR420P:
+    {
+        ycbcr_matrix_t matrix;
+        get_ycbcr_matrix(header->flags, false, &matrix);
+        const uint8_t* y_plane;
+        const uint8_t* cb_plane;
+        const uint8_t* cr_plane;
+        int shift;
+        ycbcr_planes(header, payload, &y_plane, &cb_plane, &cr_plane, &shift);
+        int chroma_width = (header->width + shift) >> shift;
+        bool identity = header->flags == 0;
+        for (int y = 0; y < header->height; y++)
+        {
+            const uint8_t* cb_row = cb_plane + (y >> shift) * chroma_width;
+            const uint8_t* cr_row = cr_plane + (y >> shift) * chroma_width;
+            for (int x = 0; x < header->width; x++)
+            {
+                int32_t luma = y_plane[y * header->width + x] - matrix.y_offset;
+                int32_t cb = cb_row[x >> shift] - 128;
+                int32_t cr = cr_row[x >> shift] - 128;
+                ycbcr_pixel_t* pixel = &dst->pixels[y * header->width + x].ycbcr;
+                if (identity)
+                {
+                    /** Already the server's YCbCr. Only deinterleave. */
+                    pixel->y = luma;
+                    pixel->cb = cb;
+                    pixel->cr = cr;
+                    continue;
+                }
+                int32_t round = 1 << (MATRIX_SHIFT - 1);
+                pixel->y = clamp_u8((matrix.m[0][0] * luma + matrix.m[0][1] * cb + matrix.m[0][2] * cr + round) >> MATRIX_SHIFT);
+                pixel->cb = clamp_s8((matrix.m[1][0] * luma + matrix.m[1][1] * cb + matrix.m[1][2] * cr + round) >> MATRIX_SHIFT);
+                pixel->cr = clamp_s8((matrix.m[2][0] * luma + matrix.m[2][1] * cb + matrix.m[2][2] * cr + round) >> MATRIX_SHIFT);
+            }
+        }
+        dst->color_space = COLOR_SPACE_YCBCR;
+        return 0;
+    }
+    default:
+        return -1;
+    }
+}
+
+/**
+ * Maps (Y - y_offset, Cb - 128, Cr - 128) of the frame to 8 bit RGB,
+ * or to the server's YCbCr, which is BT.709 full range.
+ */
+static void get_ycbcr_matrix(uint16_t flags, bool to_rgb, ycbcr_matrix_t* matrix)
+{
+    double kr = (flags & FRAME_FLAG_BT601) ? 0.299 : 0.2126;
+    double kb = (flags & FRAME_FLAG_BT601) ? 0.114 : 0.0722;
+    double kg = 1.0 - kr - kb;
+    double y_scale = (flags & FRAME_FLAG_LIMITED_RANGE) ? 255.0 / 219.0 : 1.0;
+    double c_scale = (flags & FRAME_FLAG_LIMITED_RANGE) ? 255.0 / 224.0 : 1.0;
+    double rgb[3][3] = {
+        { y_scale, 0.0, 2.0 * (1.0 - kr) * c_scale },
+        { y_scale, -2.0 * kb * (1.0 - kb) / kg * c_scale, -2.0 * kr * (1.0 - kr) / kg * c_scale },
+        { y_scale, 2.0 * (1.0 - kb) * c_scale, 0.0 },
+    };
+    /** RGB to BT.709 YCbCr, same as color_conversion.c */
+    const double ycbcr[3][3] = {
+        { 0.2126, 0.7152, 0.0722 },
+        { -0.2126 / 1.8556, -0.7152 / 1.8556, (1.0 - 0.0722) / 1.8556 },
+        { (1.0 - 0.2126) / 1.5748, -0.7152 / 1.5748, -0.0722 / 1.5748 },
+    };
+    matrix->y_offset = (flags & FRAME_FLAG_LIMITED_RANGE) ? 16 : 0;
+    for (int i = 0; i < 3; i++)
+    {
+        for (int j = 0; j < 3; j++)
+        {
+            double value = rgb[i][j];
+            if (!to_rgb)
+            {
+                value = 0.0;
+                for (int k = 0; k < 3; k++)
+                {
+                    value += ycbcr[i][k] * rgb[k][j];
+                }
+            }
+            matrix->m[i][j] = (int32_t)lround(value * (1 << MATRIX_SHIFT));
+        }
+    }
+}
+
+static int clamp_u8(int32_t value)
+{
+    return value < 0 ? 0 : value > 255 ? 255 : value;
+}
+
+static int clamp_s8(int32_t value)
+{
+    return value < -128 ? -128 : value > 127 ? 127 : value;
+}
+
+static void ycbcr_planes(const frame_header_t* header, const void* payload,
+    const uint8_t** y, const uint8_t** cb, const uint8_t** cr, int* chroma_shift)
+{
+    *chroma_shift = header->format == FRAME_FORMAT_YCBCR420P ? 1 : 0;
+    size_t luma_size = (size_t)header->width * header->height;
+    size_t chroma_size = (size_t)((header->width + *chroma_shift) >> *chroma_shift)
+        * ((header->height + *chroma_shift) >> *chroma_shift);
+    *y = payload;
+    *cb = *y + luma_size;
+    *cr = *cb + chroma_size;
+}
+
+/** Same bit order as pack_color_palette_image */
+static void palette_to_rgb565(const frame_header_t* header, const void* payload, rgb565_pixel_t* dst)
+{
+    rgb565_pixel_t palette[FRAME_PALETTE_COLORS];
+    memcpy(palette, payload, sizeof(palette));
+    const uint8_t* indexes = (const uint8_t*)payload + sizeof(palette);
+    size_t n_pixels = (size_t)header->width * header->height;
+    size_t bit = 0;
+    for (size_t i = 0; i < n_pixels; i++, bit += FRAME_PALETTE_BITS)
+    {
+        /** An index spans at most two bytes */
+        uint32_t word = indexes[bit / 8];
+        if ((bit % 8) + FRAME_PALETTE_BITS > 8)
+        {
+            word |= (uint32_t)indexes[bit / 8 + 1] << 8;
+        }
+        dst[i] = palette[(word >> (bit % 8)) & (FRAME_PALETTE_COLORS - 1)];
+    }
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "../../common/image.h"
+
+/**
+ * Frame header of the server socket and the shared memory ring.
+ * Every frame is a frame_header_t immediately followed by payload_size bytes of payload.
+ * All fields are host endian, both ends are on the same machine.
+ *
+ * Clients that send frames without a header are still served. The first four bytes
+ * of a connection decide: FRAME_HEADER_MAGIC selects headers for the whole connection,
+ * anything else is taken as headerless BGR24 frames.
+ */
+
+#define FRAME_HEADER_MAGIC (0x46535355u)
+#define FRAME_HEADER_VERSION (1)
+
+typedef enum
+{
+    /** pixel_t in BGR, row major, no padding */
+    FRAME_FORMAT_BGR24,
+    /** rgb565_pixel_t, exactly what the MCU draws */
+    FRAME_FORMAT_RGB565,
+    /** Y, Cb and Cr planes, unsigned with chroma centered on 128 */
+    FRAME_FORMAT_YCBCR444P,
+    /** Same with (width + 1) / 2 x (height + 1) / 2 chroma planes */
+    FRAME_FORMAT_YCBCR420P,
+    /**
+     * FRAME_PALETTE_COLORS rgb565 colors, then FRAME_PALETTE_BITS bit indexes packed LSB first.
+     * The k-means packet of the MCU. A k-means server sends it untouched.
+     */
+    FRAME_FORMAT_PALETTE,
+    FRAME_FORMAT_COUNT,
+} frame_format_t;
+
+/** YCbCr formats only. The default is BT.709 full range, the server's own YCbCr. */
+#define FRAME_FLAG_LIMITED_RANGE (1u << 0)
+#define FRAME_FLAG_BT601 (1u << 1)
+#define FRAME_FLAG_MASK (FRAME_FLAG_LIMITED_RANGE | FRAME_FLAG_BT601)
+
+#define FRAME_PALETTE_COLORS (32)
+#define FRAME_PALETTE_BITS (5)
+
+typedef struct
+{
+    uint32_t magic;
+    uint16_t version;
+    /** sizeof(frame_header_t). Lets later versions grow the header. */
+    uint16_t header_size;
+    /** frame_format_t */
+    uint16_t format;
+    uint16_t flags;
+    uint16_t width;
+    uint16_t height;
+    uint32_t payload_size;
+    uint32_t reserved;
+    /** Producer's CLOCK_MONOTONIC time of the frame in ns, 0 if unknown */
+    uint64_t timestamp_ns;
+} frame_header_t;
+
+/** BGR24 and YCbCr 4:4:4 are the largest payloads */
+#define FRAME_MAX_SIZE(width, height) (sizeof(frame_header_t) + (size_t)(width) * (height) * 3)
+
+/** Returns 0 for unknown formats */
+size_t frame_payload_size(int format, int width, int height);
+/** Fills in a header for a frame of the given format with its payload size. Timestamp and flags are 0. */
+void frame_header_init(frame_header_t* header, int format, int width, int height);
+/** Returns -1 unless the header describes a well formed width x height frame */
+int frame_header_check(const frame_header_t* header, int width, int height);
+
+static inline const void* frame_payload(const frame_header_t* header)
+{
+    return header + 1;
+}
+
+/**
+ * Converts a checked frame into what the encoders work on.
+ * Only the conversions the format needs are done, e.g. an RGB565 frame is copied as is.
+ * Returns -1 if the sizes do not match.
+ */
+int frame_to_rgb565(const frame_header_t* header, const void* payload, rgb565_image_t* dst);
+int frame_to_ycbcr(const frame_header_t* header, const void* payload, image_t* dst);
@@ -0,0 +1,387 @@
+#include "frame_pipeline.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "frame_encoder.h"
+#include "frame_scheduler.h"
+#include "config.h"
+
+/** Set in middle when it holds a frame the encoder has not taken yet */
+#define TRIPLE_BUFFER_DIRTY (4)
+#define TRIPLE_BUFFER_INDEX_MASK (3)
+
+struct frame_pipeline_s
+{
+    tev_handle_t* tev;
+    usb_screen_t* screen;
+    frame_stats_t* stats;
+    frame_encoder_t* encoder;
+    /** Encode deadlines. Under the lock, fed by both threads. */
+    frame_scheduler_t* scheduler;
+    /** Triple buffer between the event loop (back) and the encoder (front) */
+    frame_header_t* frames[3];
+    /** When each frame was published. Travels with the buffer index. */
+    uint64_t arrival_ns[3];
+    int back;
+    int front;
+    _Atomic int middle;
+    /** Double buffer between the encoder (pending) and the event loop (writing) */
+    uint8_t* pending_packet;
+    size_t pending_size;
+    uint64_t pending_arrival_ns;
+    uint8_t* writing_packet;
+    size_t packet_capacity;
+    /** The writing packet is queued on the device. Event loop only. */
+    bool writing_in_flight;
+    uint64_t writing_arrival_ns;
+    uint64_t writing_start_ns;
+    /** Wakes the event loop when a packet is pending */
+    int packet_event;
+    /** A packet was lost on the way to the device. The encoder must start over. */
+    bool reset_encoder;
+    pthread_mutex_t lock;
+    pthread_cond_t frame_cond;
+    bool stop;
+    bool encoder_started;
+    pthread_t encoder_thread;
+};
+
+static void* encoder_main(void* ctx);
+static void on_packet_ready(void* ctx);
+static void on_screen_drained(void* ctx, int status);
+static void write_pending_packet(frame_pipeline_t* this);
+static void on_packet_written(frame_pipeline_t* this);
+static void on_packet_lost(frame_pipeline_t* this);
+static bool can_encode(frame_pipeline_t* this);
+static void timespec_from_ns(struct timespec* ts, uint64_t ns);
+
+frame_pipeline_t* frame_pipeline_new(tev_handle_t* tev, usb_screen_t* screen, int min_interval_ms, frame_stats_t* stats)
+{
+    if (!tev || !screen)
+    {
+        return NULL;
+    }
+    frame_pipeline_t* pipeline = malloc(sizeof(frame_pipeline_t));
+    if (!pipeline)
+    {
+        return NULL;
+    }
+    memset(pipeline, 0, sizeof(frame_pipeline_t));
+    pipeline->tev = tev;
+    pipeline->screen = screen;
+    pipeline->packet_event = -1;
+    pipeline->stats = stats;
+    pipeline->back = 0;
+    atomic_init(&pipeline->middle, 1);
+    pipeline->front = 2;
+    pthread_mutex_init(&pipeline->lock, NULL);
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    /** Pacing deadlines are on the monotonic clock */
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&pipeline->frame_cond, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+
+    for (int i = 0; i < 3; i++)
+    {
+        pipeline->frames[i] = malloc(CONST_FRAME_MAX_SIZE);
+        if (!pipeline->frames[i])
+        {
+            goto error;
+        }
+    }
+    pipeline->encoder = frame_encoder_new(stats);
+    pipeline->scheduler = frame_scheduler_new((uint64_t)min_interval_ms * 1000000);
+    if (!pipeline->encoder || !pipeline->scheduler)
+    {
+        goto error;
+    }
+    /** No encoding is larger than the raw frame */
+    pipeline->packet_capacity = CONST_FB_SIZE;
+    pipeline->pending_packet = malloc(pipeline->packet_capacity);
+    pipeline->writing_packet = malloc(pipeline->packet_capacity);
+    if (!pipeline->pending_packet || !pipeline->writing_packet)
+    {
+        goto error;
+    }
+    pipeline->packet_event = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (pipeline->packet_event == -1)
+    {
+        goto error;
+    }
+    tev_set_read_handler(tev, pipeline->packet_event, on_packet_ready, pipeline);
+    screen->set_drain_handler(screen, on_screen_drained, pipeline);
+
+    if (pthread_create(&pipeline->encoder_thread, NULL, encoder_main, pipeline) != 0)
+    {
+        goto error;
+    }
+    pipeline->encoder_started = true;
+    return pipeline;
+error:
+    frame_pipeline_free(pipeline);
+    return NULL;
+}
+
+void frame_pipeline_free(frame_pipeline_t* pipeline)
+{
+    if (!pipeline)
+    {
+        return;
+    }
+    pthread_mutex_lock(&pipeline->lock);
+    pipeline->stop = true;
+    pthread_cond_broadcast(&pipeline->frame_cond);
+    pthread_mutex_unlock(&pipeline->lock);
+    if (pipeline->encoder_started)
+    {
+        pthread_join(pipeline->encoder_thread, NULL);
+    }
+    if (pipeline->packet_event != -1)
+    {
+        tev_set_read_handler(pipeline->tev, pipeline->packet_event, NULL, NULL);
+        close(pipeline->packet_event);
+    }
+    pipeline->screen->set_drain_handler(pipeline->screen, NULL, NULL);
+    for (int i = 0; i < 3; i++)
+    {
+        free(pipeline->frames[i]);
+    }
+    frame_encoder_free(pipeline->encoder);
+    frame_scheduler_free(pipeline->scheduler);
+    free(pipeline->pending_packet);
+    free(pipeline->writing_packet);
+    pthread_cond_destroy(&pipeline->frame_cond);
+    pthread_mutex_destroy(&pipeline->lock);
+    free(pipeline);
+}
+
+frame_header_t* frame_pipeline_back_buffer(frame_pipeline_t* pipeline)
+{
+    return pipeline->frames[pipeline->back];
+}
+
+void frame_pipeline_publish(frame_pipeline_t* pipeline)
+{
+    pipeline->arrival_ns[pipeline->back] = frame_stats_now_ns();
+    /** If the encoder did not take the previous frame, it is recycled as the new back buffer */
+    int previous = atomic_exchange(&pipeline->middle, pipeline->back | TRIPLE_BUFFER_DIRTY);
+    if (previous & TRIPLE_BUFFER_DIRTY)
+    {
+        frame_stats_count(pipeline->stats, FRAME_COUNTER_DROPPED, 1);
+    }
+    pipeline->back = previous & TRIPLE_BUFFER_INDEX_MASK;
+    pthread_mutex_lock(&pipeline->lock);
+    pthread_cond_signal(&pipeline->frame_cond);
+    pthread_mutex_unlock(&pipeline->lock);
+}
+
+static void* encoder_main(void* ctx)
+{
+    frame_pipeline_t* this = (frame_pipeline_t*)ctx;
+    struct timespec deadline;
+
+    pthread_mutex_lock(&this->lock);
+    for (;;)
+    {
+        while (!this->stop && !can_encode(this))
+        {
+            pthread_cond_wait(&this->frame_cond, &this->lock);
+        }
+        /**
+         * Wait for the scheduler's deadline. Newer frames keep replacing the middle buffer meanwhile,
+         * and finished writes move the deadline, so it is looked up again on every wake.
+         */
+        while (!this->stop)
+        {
+            uint64_t deadline_ns = frame_scheduler_deadline(this->scheduler);
+            if (deadline_ns <= frame_stats_now_ns())
+            {
+                break;
+            }
+            timespec_from_ns(&deadline, deadline_ns);
+            pthread_cond_timedwait(&this->frame_cond, &this->lock, &deadline);
+        }
+        if (this->stop)
+        {
+            break;
+        }
+        bool reset_encoder = this->reset_encoder;
+        this->reset_encoder = false;
+        pthread_mutex_unlock(&this->lock);
+
+        if (reset_encoder)
+        {
+            frame_encoder_reset(this->encoder);
+        }
+        uint64_t start_ns = frame_stats_now_ns();
+        this->front = atomic_exchange(&this->middle, this->front) & TRIPLE_BUFFER_INDEX_MASK;
+        uint64_t arrival_ns = this->arrival_ns[this->front];
+        frame_stats_record_since(this->stats, FRAME_STAGE_INGEST, arrival_ns);
+        const void* data = NULL;
+        size_t size = 0;
+        const frame_header_t* frame = this->frames[this->front];
+        int rc = frame_encoder_load(this->encoder, frame, frame_payload(frame));
+        if (rc == 0)
+        {
+            rc = frame_encoder_encode(this->encoder, &data, &size);
+        }
+
+        uint64_t end_ns = frame_stats_now_ns();
+        pthread_mutex_lock(&this->lock);
+        /** Duplicates and failures did no encode work, they must not pace the next frame */
+        if (rc == 0 && size != 0)
+        {
+            frame_scheduler_encoded(this->scheduler, start_ns, end_ns);
+        }
+        /** A loss while encoding may have taken this packet's reference with it */
+        if (rc == 0 && size != 0 && size <= this->packet_capacity && !this->reset_encoder)
+        {
+            /** Replaces the pending packet if the device did not take it in time. Never happens to differential packets. */
+            if (this->pending_size != 0)
+            {
+                frame_stats_count(this->stats, FRAME_COUNTER_DROPPED, 1);
+            }
+            memcpy(this->pending_packet, data, size);
+            this->pending_size = size;
+            this->pending_arrival_ns = arrival_ns;
+            uint64_t value = 1;
+            /** Can not fail short of overflowing the counter */
+            (void)!write(this->packet_event, &value, sizeof(value));
+        }
+        else if (rc == 0 && size == 0)
+        {
+            frame_stats_count(this->stats, FRAME_COUNTER_SKIPPED, 1);
+        }
+        else
+        {
+            frame_stats_count(this->stats, FRAME_COUNTER_DROPPED, 1);
+        }
+    }
+    pthread_mutex_unlock(&this->lock);
+    return NULL;
+}
+
+static void on_packet_ready(void* ctx)
+{
+    frame_pipeline_t* this = (frame_pipeline_t*)ctx;
+    uint64_t value = 0;
+    if (read(this->packet_event, &value, sizeof(value)) != sizeof(value))
+    {
+        return;
+    }
+    write_pending_packet(this);
+}
+
+static void on_screen_drained(void* ctx, int status)
+{
+    frame_pipeline_t* this = (frame_pipeline_t*)ctx;
+    if (this->writing_in_flight && status == 0)
+    {
+        on_packet_written(this);
+    }
+    if (status != 0)
+    {
+        this->writing_in_flight = false;
+        frame_stats_count(this->stats, FRAME_COUNTER_LOST, 1);
+        on_packet_lost(this);
+    }
+    write_pending_packet(this);
+}
+
+static void write_pending_packet(frame_pipeline_t* this)
+{
+    if (this->screen->is_busy(this->screen))
+    {
+        /** Retried on drain. The encoder may replace the packet meanwhile. */
+        return;
+    }
+    pthread_mutex_lock(&this->lock);
+    if (this->pending_size == 0)
+    {
+        pthread_mutex_unlock(&this->lock);
+        return;
+    }
+    uint8_t* packet = this->pending_packet;
+    this->pending_packet = this->writing_packet;
+    this->writing_packet = packet;
+    size_t size = this->pending_size;
+    this->pending_size = 0;
+    this->writing_arrival_ns = this->pending_arrival_ns;
+    this->writing_start_ns = frame_stats_now_ns();
+    frame_scheduler_write_started(this->scheduler, this->writing_start_ns);
+    /** A differential encoder waits for this, any encoder for the new deadline */
+    pthread_cond_signal(&this->frame_cond);
+    pthread_mutex_unlock(&this->lock);
+
+    if (this->screen->write(this->screen, packet, size) != 0)
+    {
+        frame_stats_count(this->stats, FRAME_COUNTER_LOST, 1);
+        on_packet_lost(this);
+        return;
+    }
+    this->writing_in_flight = true;
+    if (!this->screen->is_busy(this->screen))
+    {
+        /** Went out in one go, there will be no drain for it */
+        on_packet_written(this);
+    }
+}
+
+static void on_packet_written(frame_pipeline_t* this)
+{
+    this->writing_in_flight = false;
+    pthread_mutex_lock(&this->lock);
+    frame_scheduler_write_done(this->scheduler, frame_stats_now_ns(), true);
+    /** The device is free, the deadline may have moved up */
+    pthread_cond_signal(&this->frame_cond);
+    pthread_mutex_unlock(&this->lock);
+    frame_stats_record_since(this->stats, FRAME_STAGE_WRITE, this->writing_start_ns);
+    frame_stats_record_since(this->stats, FRAME_STAGE_TOTAL, this->writing_arrival_ns);
+    frame_stats_count(this->stats, FRAME_COUNTER_WRITTEN, 1);
+}
+
+static void on_packet_lost(frame_pipeline_t* this)
+{
+    pthread_mutex_lock(&this->lock);
+    frame_scheduler_write_done(this->scheduler, frame_stats_now_ns(), false);
+    this->reset_encoder = true;
+    /** Anything already encoded may depend on the lost packet */
+    if (this->pending_size != 0)
+    {
+        frame_stats_count(this->stats, FRAME_COUNTER_DROPPED, 1);
+    }
+    this->pending_size = 0;
+    pthread_cond_signal(&this->frame_cond);
+    pthread_mutex_unlock(&this->lock);
+}
+
+/** Call with the lock held */
+static bool can_encode(frame_pipeline_t* this)
+{
+    if (!(atomic_load(&this->middle) & TRIPLE_BUFFER_DIRTY))
+    {
+        return false;
+    }
+#if FRAME_ENCODER_IS_DIFFERENTIAL
+    /** Differential packets can not replace each other. Wait for the event loop to take the last one. */
+    if (this->pending_size != 0)
+    {
+        return false;
+    }
+#endif
+    return true;
+}
+
+static void timespec_from_ns(struct timespec* ts, uint64_t ns)
+{
+    ts->tv_sec = ns / 1000000000;
+    ts->tv_nsec = ns % 1000000000;
+}
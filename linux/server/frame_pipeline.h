@@ -0,0 +1,29 @@
+#pragma once
+
+#include "tev/tev.h"
+#include "usb_screen.h"
+#include "frame_stats.h"
+#include "frame_format.h"
+
+/**
+ * Pipelined frame processing.
+ * The event loop only ingests frames into a latest-frame-wins triple buffer.
+ * An encoder thread compresses the newest frame and hands the result back to the event loop,
+ * which queues it on the device whenever the device is not busy.
+ * Encodes are timed by a frame_scheduler_t to finish as the device frees up, min_interval_ms apart at least.
+ * Frames superseded at either hand-off are dropped.
+ */
+typedef struct frame_pipeline_s frame_pipeline_t;
+
+/** Takes over the screen's drain handler. Stage timings and drops are recorded into stats, which may be NULL. */
+frame_pipeline_t* frame_pipeline_new(tev_handle_t* tev, usb_screen_t* screen, int min_interval_ms, frame_stats_t* stats);
+/** Stops and joins the encoder. Event loop only. The screen is not closed. */
+void frame_pipeline_free(frame_pipeline_t* pipeline);
+
+/**
+ * Producer side, event loop only. Write a checked frame header and its payload into the back buffer,
+ * which holds CONST_FRAME_MAX_SIZE bytes, then publish it.
+ * The ingest latency of the frame starts at publish.
+ */
+frame_header_t* frame_pipeline_back_buffer(frame_pipeline_t* pipeline);
+void frame_pipeline_publish(frame_pipeline_t* pipeline);
@@ -0,0 +1,256 @@
+#define _GNU_SOURCE
+
+#include "frame_ring.h"
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#define FRAME_RING_SEALS (F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL)
+
+static size_t get_map_size(uint32_t n_slots, uint32_t slot_stride);
+static int map_ring(frame_ring_t* ring, size_t map_size);
+
+frame_ring_t* frame_ring_create(uint32_t n_slots, uint32_t slot_size)
+{
+    if (n_slots == 0 || n_slots > FRAME_RING_MAX_SLOTS || slot_size == 0)
+    {
+        return NULL;
+    }
+    frame_ring_t* ring = malloc(sizeof(frame_ring_t));
+    if (!ring)
+    {
+        return NULL;
+    }
+    memset(ring, 0, sizeof(frame_ring_t));
+    ring->memfd = -1;
+    ring->eventfd = -1;
+    ring->version = FRAME_RING_VERSION;
+    ring->n_slots = n_slots;
+    ring->slot_size = slot_size;
+    ring->slot_stride = (slot_size + FRAME_RING_ALIGN - 1) & ~(FRAME_RING_ALIGN - 1);
+
+    ring->memfd = memfd_create("usb-screen-frame-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (ring->memfd == -1)
+    {
+        goto error;
+    }
+    /** A new memfd is zero filled. So are all the slots. */
+    size_t map_size = get_map_size(ring->n_slots, ring->slot_stride);
+    if (ftruncate(ring->memfd, map_size) != 0)
+    {
+        goto error;
+    }
+    /** The server maps this. Make sure we can not pull the pages from under it. */
+    if (fcntl(ring->memfd, F_ADD_SEALS, FRAME_RING_SEALS) != 0)
+    {
+        goto error;
+    }
+    ring->eventfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (ring->eventfd == -1)
+    {
+        goto error;
+    }
+    if (map_ring(ring, map_size) != 0)
+    {
+        goto error;
+    }
+    ring->header->magic = FRAME_RING_MAGIC;
+    ring->header->version = ring->version;
+    ring->header->n_slots = ring->n_slots;
+    ring->header->slot_size = ring->slot_size;
+    ring->header->slot_stride = ring->slot_stride;
+    atomic_store_explicit(&ring->header->write_seq, 0, memory_order_relaxed);
+    atomic_store_explicit(&ring->header->read_seq, 0, memory_order_release);
+    return ring;
+error:
+    frame_ring_free(ring);
+    return NULL;
+}
+
+int frame_ring_offer(const frame_ring_t* ring, int sock)
+{
+    if (!ring)
+    {
+        return -1;
+    }
+    frame_ring_hello_t hello = {
+        .magic = FRAME_RING_MAGIC,
+        .version = ring->version,
+    };
+    struct iovec iov = {
+        .iov_base = &hello,
+        .iov_len = sizeof(hello),
+    };
+    union
+    {
+        char buffer[CMSG_SPACE(2 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = sizeof(control.buffer);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(2 * sizeof(int));
+    int fds[2] = {ring->memfd, ring->eventfd};
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    if (sendmsg(sock, &msg, MSG_NOSIGNAL) != sizeof(hello))
+    {
+        return -1;
+    }
+    return 0;
+}
+
+void* frame_ring_acquire_write(frame_ring_t* ring)
+{
+    uint32_t write_seq = atomic_load_explicit(&ring->header->write_seq, memory_order_relaxed);
+    uint32_t read_seq = atomic_load_explicit(&ring->header->read_seq, memory_order_acquire);
+    if (write_seq - read_seq >= ring->n_slots)
+    {
+        /** The server still owns every slot */
+        return NULL;
+    }
+    return ring->slots + (size_t)(write_seq % ring->n_slots) * ring->slot_stride;
+}
+
+int frame_ring_commit_write(frame_ring_t* ring)
+{
+    uint32_t write_seq = atomic_load_explicit(&ring->header->write_seq, memory_order_relaxed);
+    atomic_store_explicit(&ring->header->write_seq, write_seq + 1, memory_order_release);
+    uint64_t value = 1;
+    if (write(ring->eventfd, &value, sizeof(value)) != sizeof(value))
+    {
+        return -1;
+    }
+    return 0;
+}
+
+frame_ring_t* frame_ring_attach(int memfd, int eventfd, uint32_t version, uint32_t slot_size)
+{
+    frame_ring_t* ring = malloc(sizeof(frame_ring_t));
+    if (!ring)
+    {
+        return NULL;
+    }
+    memset(ring, 0, sizeof(frame_ring_t));
+    ring->memfd = -1;
+    ring->eventfd = -1;
+
+    /** The size must not change after we map it */
+    int seals = fcntl(memfd, F_GET_SEALS);
+    if (seals == -1 || (seals & FRAME_RING_SEALS) != FRAME_RING_SEALS)
+    {
+        goto error;
+    }
+    struct stat st;
+    if (fstat(memfd, &st) != 0 || (size_t)st.st_size < sizeof(frame_ring_header_t))
+    {
+        goto error;
+    }
+    frame_ring_header_t header;
+    if (pread(memfd, &header, sizeof(header), 0) != sizeof(header))
+    {
+        goto error;
+    }
+    if (header.magic != FRAME_RING_MAGIC
+        || header.version != version
+        || header.n_slots == 0
+        || header.n_slots > FRAME_RING_MAX_SLOTS
+        || header.slot_size != slot_size
+        || header.slot_stride < header.slot_size
+        || header.slot_stride % FRAME_RING_ALIGN != 0)
+    {
+        goto error;
+    }
+    size_t map_size = get_map_size(header.n_slots, header.slot_stride);
+    if ((size_t)st.st_size < map_size)
+    {
+        goto error;
+    }
+    ring->version = header.version;
+    ring->n_slots = header.n_slots;
+    ring->slot_size = header.slot_size;
+    ring->slot_stride = header.slot_stride;
+    ring->memfd = memfd;
+    ring->eventfd = eventfd;
+    if (map_ring(ring, map_size) != 0)
+    {
+        ring->memfd = -1;
+        ring->eventfd = -1;
+        goto error;
+    }
+    return ring;
+error:
+    frame_ring_free(ring);
+    return NULL;
+}
+
+const void* frame_ring_acquire_latest(frame_ring_t* ring, uint32_t* seq)
+{
+    uint32_t write_seq = atomic_load_explicit(&ring->header->write_seq, memory_order_acquire);
+    uint32_t read_seq = atomic_load_explicit(&ring->header->read_seq, memory_order_relaxed);
+    if (write_seq == read_seq)
+    {
+        return NULL;
+    }
+    /**
+     * Skip everything older than the latest frame.
+     * A misbehaving client can only corrupt its own pixels, the index is always in range.
+     */
+    *seq = write_seq - 1;
+    return ring->slots + (size_t)(*seq % ring->n_slots) * ring->slot_stride;
+}
+
+void frame_ring_release(frame_ring_t* ring, uint32_t seq)
+{
+    atomic_store_explicit(&ring->header->read_seq, seq + 1, memory_order_release);
+}
+
+void frame_ring_free(frame_ring_t* ring)
+{
+    if (!ring)
+    {
+        return;
+    }
+    if (ring->header)
+    {
+        munmap(ring->header, ring->map_size);
+    }
+    if (ring->memfd != -1)
+    {
+        close(ring->memfd);
+    }
+    if (ring->eventfd != -1)
+    {
+        close(ring->eventfd);
+    }
+    free(ring);
+}
+
+static size_t get_map_size(uint32_t n_slots, uint32_t slot_stride)
+{
+    return sizeof(frame_ring_header_t) + (size_t)n_slots * slot_stride;
+}
+
+static int map_ring(frame_ring_t* ring, size_t map_size)
+{
+    void* map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, ring->memfd, 0);
+    if (map == MAP_FAILED)
+    {
+        return -1;
+    }
+    ring->header = (frame_ring_header_t*)map;
+    ring->slots = (uint8_t*)map + sizeof(frame_ring_header_t);
+    ring->map_size = map_size;
+    return 0;
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+/**
+ * Shared memory frame ring.
+ * The client creates a sealed memfd holding a header followed by n_slots frame slots,
+ * plus an eventfd used as a doorbell. Both fds are passed to the server over the
+ * stream socket with SCM_RIGHTS, together with a frame_ring_hello_t.
+ * The client is the only producer and the server is the only consumer.
+ * Slots in [read_seq, write_seq) belong to the server, the rest to the client.
+ * The server always reads the newest slot in place and releases everything up to it.
+ */
+
+#define FRAME_RING_MAGIC (0x52465355u)
+/** Every slot holds a frame_header_t followed by its payload */
+#define FRAME_RING_VERSION (2)
+/** Every slot holds a headerless BGR24 frame. Still accepted by the server. */
+#define FRAME_RING_VERSION_BGR24 (1)
+#define FRAME_RING_MAX_SLOTS (16)
+#define FRAME_RING_ALIGN (64)
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t n_slots;
+    uint32_t slot_size;
+    uint32_t slot_stride;
+    /** Only written by the producer. Keep the two counters on separate cache lines. */
+    _Alignas(FRAME_RING_ALIGN) _Atomic uint32_t write_seq;
+    /** Only written by the consumer */
+    _Alignas(FRAME_RING_ALIGN) _Atomic uint32_t read_seq;
+} frame_ring_header_t;
+
+/** Sent along with the fds. Keeps the handshake distinguishable from frame data. */
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+} frame_ring_hello_t;
+
+typedef struct
+{
+    int memfd;
+    int eventfd;
+    frame_ring_header_t* header;
+    uint8_t* slots;
+    size_t map_size;
+    /** Local copies. The shared header is never trusted after attaching. */
+    uint32_t version;
+    uint32_t n_slots;
+    uint32_t slot_size;
+    uint32_t slot_stride;
+} frame_ring_t;
+
+/** Producer side */
+frame_ring_t* frame_ring_create(uint32_t n_slots, uint32_t slot_size);
+int frame_ring_offer(const frame_ring_t* ring, int sock);
+void* frame_ring_acquire_write(frame_ring_t* ring);
+int frame_ring_commit_write(frame_ring_t* ring);
+
+/** Consumer side. Takes ownership of the fds on success. The ring must be of the version the hello announced. */
+frame_ring_t* frame_ring_attach(int memfd, int eventfd, uint32_t version, uint32_t slot_size);
+const void* frame_ring_acquire_latest(frame_ring_t* ring, uint32_t* seq);
+void frame_ring_release(frame_ring_t* ring, uint32_t seq);
+
+void frame_ring_free(frame_ring_t* ring);
@@ -0,0 +1,96 @@
+#include "frame_scheduler.h"
+#include <stdlib.h>
+#include <string.h>
+
+/** Each new sample weighs 1 / 2^EWMA_SHIFT */
+#define EWMA_SHIFT (3)
+
+struct frame_scheduler_s
+{
+    uint64_t min_interval_ns;
+    /** Moving averages, 0 until the first sample */
+    uint64_t encode_ns;
+    uint64_t drain_ns;
+    /** Start of the last encode, 0 before the first one */
+    uint64_t last_encode_ns;
+    /** Start of the write the device is busy with, 0 while it is idle */
+    uint64_t write_start_ns;
+};
+
+static void ewma_update(uint64_t* average, uint64_t sample);
+
+frame_scheduler_t* frame_scheduler_new(uint64_t min_interval_ns)
+{
+    frame_scheduler_t* scheduler = malloc(sizeof(frame_scheduler_t));
+    if (!scheduler)
+    {
+        return NULL;
+    }
+    memset(scheduler, 0, sizeof(frame_scheduler_t));
+    scheduler->min_interval_ns = min_interval_ns;
+    return scheduler;
+}
+
+void frame_scheduler_free(frame_scheduler_t* scheduler)
+{
+    free(scheduler);
+}
+
+void frame_scheduler_encoded(frame_scheduler_t* scheduler, uint64_t start_ns, uint64_t end_ns)
+{
+    scheduler->last_encode_ns = start_ns;
+    ewma_update(&scheduler->encode_ns, end_ns > start_ns ? end_ns - start_ns : 0);
+}
+
+void frame_scheduler_write_started(frame_scheduler_t* scheduler, uint64_t now_ns)
+{
+    scheduler->write_start_ns = now_ns;
+}
+
+void frame_scheduler_write_done(frame_scheduler_t* scheduler, uint64_t now_ns, bool ok)
+{
+    if (ok && scheduler->write_start_ns != 0)
+    {
+        ewma_update(&scheduler->drain_ns, now_ns > scheduler->write_start_ns ? now_ns - scheduler->write_start_ns : 0);
+    }
+    scheduler->write_start_ns = 0;
+}
+
+uint64_t frame_scheduler_interval(const frame_scheduler_t* scheduler)
+{
+    uint64_t interval = scheduler->min_interval_ns;
+    interval = scheduler->encode_ns > interval ? scheduler->encode_ns : interval;
+    interval = scheduler->drain_ns > interval ? scheduler->drain_ns : interval;
+    return interval;
+}
+
+uint64_t frame_scheduler_deadline(const frame_scheduler_t* scheduler)
+{
+    uint64_t deadline = scheduler->last_encode_ns == 0 ? 0 : scheduler->last_encode_ns + frame_scheduler_interval(scheduler);
+    if (scheduler->write_start_ns != 0)
+    {
+        /** Done encoding when the device is expected to be free */
+        uint64_t free_ns = scheduler->write_start_ns + scheduler->drain_ns;
+        uint64_t start_ns = free_ns > scheduler->encode_ns ? free_ns - scheduler->encode_ns : 0;
+        deadline = start_ns > deadline ? start_ns : deadline;
+    }
+    return deadline;
+}
+
+/** The first sample is taken as is */
+static void ewma_update(uint64_t* average, uint64_t sample)
+{
+    if (*average == 0)
+    {
+        *average = sample;
+        return;
+    }
+    if (sample > *average)
+    {
+        *average += (sample - *average) >> EWMA_SHIFT;
+    }
+    else
+    {
+        *average -= (*average - sample) >> EWMA_SHIFT;
+    }
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * Decides when the next frame gets encoded.
+ * Encode and drain times are tracked as moving averages. While the device is busy, the next
+ * encode is due when the device is expected to be free minus the expected encode time, so the
+ * newest frame is encoded at the last moment and written as soon as the device takes it.
+ * Encodes never start closer together than the target interval: the slowest of the minimal
+ * interval, the encode time and the drain time.
+ * All times are CLOCK_MONOTONIC ns, like frame_stats_now_ns. Not thread safe.
+ */
+typedef struct frame_scheduler_s frame_scheduler_t;
+
+frame_scheduler_t* frame_scheduler_new(uint64_t min_interval_ns);
+void frame_scheduler_free(frame_scheduler_t* scheduler);
+
+void frame_scheduler_encoded(frame_scheduler_t* scheduler, uint64_t start_ns, uint64_t end_ns);
+void frame_scheduler_write_started(frame_scheduler_t* scheduler, uint64_t now_ns);
+/** ok is false if the write was lost with the device. Its drain time is not learned then. */
+void frame_scheduler_write_done(frame_scheduler_t* scheduler, uint64_t now_ns, bool ok);
+
+uint64_t frame_scheduler_interval(const frame_scheduler_t* scheduler);
+/** When the next encode should start. May be in the past, then it is due right away. */
+uint64_t frame_scheduler_deadline(const frame_scheduler_t* scheduler);
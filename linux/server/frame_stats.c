@@ -0,0 +1,264 @@
+#include "frame_stats.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <time.h>
+
+/** 16 linear sub-buckets per power of two. Values below 16 get a bucket each. */
+#define SUB_BUCKET_BITS (4)
+#define SUB_BUCKETS (1 << SUB_BUCKET_BITS)
+#define N_BUCKETS ((64 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS)
+#define FPS_WINDOW_NS (1000000000ull)
+
+typedef struct
+{
+    _Atomic uint64_t count;
+    _Atomic uint64_t sum;
+    _Atomic uint64_t max;
+    _Atomic uint64_t buckets[N_BUCKETS];
+} histogram_t;
+
+struct frame_stats_s
+{
+    uint64_t start_ns;
+    histogram_t stages[FRAME_STAGE_COUNT];
+    _Atomic uint64_t counters[FRAME_COUNTER_COUNT];
+    /** Written frames in the current window. Only touched by the writing thread. */
+    uint64_t window_start_ns;
+    uint64_t window_frames;
+    /** Result of the last full window, in millihertz */
+    _Atomic uint64_t fps_milli;
+    _Atomic uint64_t fps_updated_ns;
+};
+
+typedef struct
+{
+    char* buffer;
+    size_t size;
+    size_t len;
+} text_t;
+
+static const char* stage_names[FRAME_STAGE_COUNT] = {
+    [FRAME_STAGE_INGEST] = "ingest",
+    [FRAME_STAGE_CONVERT] = "convert",
+    [FRAME_STAGE_COMPRESS] = "compress",
+    [FRAME_STAGE_PACK] = "pack",
+    [FRAME_STAGE_WRITE] = "write",
+    [FRAME_STAGE_TOTAL] = "total",
+    [FRAME_STAGE_KMEANS_ITERATIONS] = "kmeans_iterations",
+};
+
+static const char* counter_names[FRAME_COUNTER_COUNT] = {
+    [FRAME_COUNTER_RECEIVED] = "frames_received",
+    [FRAME_COUNTER_DROPPED] = "frames_dropped",
+    [FRAME_COUNTER_SKIPPED] = "frames_skipped",
+    [FRAME_COUNTER_DUPLICATE] = "frames_duplicate",
+    [FRAME_COUNTER_WRITTEN] = "frames_written",
+    [FRAME_COUNTER_LOST] = "packets_lost",
+};
+
+static int bucket_index(uint64_t value);
+static uint64_t bucket_upper_bound(int index);
+static uint64_t histogram_percentile(const histogram_t* histogram, uint64_t count, uint64_t max, double percentile);
+static void text_append(text_t* text, const char* format, ...) __attribute__((format(printf, 2, 3)));
+
+frame_stats_t* frame_stats_new()
+{
+    frame_stats_t* stats = malloc(sizeof(frame_stats_t));
+    if (!stats)
+    {
+        return NULL;
+    }
+    memset(stats, 0, sizeof(frame_stats_t));
+    stats->start_ns = frame_stats_now_ns();
+    stats->window_start_ns = stats->start_ns;
+    return stats;
+}
+
+void frame_stats_free(frame_stats_t* stats)
+{
+    free(stats);
+}
+
+uint64_t frame_stats_now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void frame_stats_record(frame_stats_t* stats, frame_stage_t stage, uint64_t value)
+{
+    if (!stats || stage < 0 || stage >= FRAME_STAGE_COUNT)
+    {
+        return;
+    }
+    histogram_t* histogram = &stats->stages[stage];
+    atomic_fetch_add_explicit(&histogram->buckets[bucket_index(value)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->sum, value, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->count, 1, memory_order_relaxed);
+    uint64_t max = atomic_load_explicit(&histogram->max, memory_order_relaxed);
+    while (value > max
+        && !atomic_compare_exchange_weak_explicit(&histogram->max, &max, value, memory_order_relaxed, memory_order_relaxed))
+    {
+    }
+}
+
+void frame_stats_record_since(frame_stats_t* stats, frame_stage_t stage, uint64_t start_ns)
+{
+    if (!stats)
+    {
+        return;
+    }
+    uint64_t now = frame_stats_now_ns();
+    frame_stats_record(stats, stage, now > start_ns ? now - start_ns : 0);
+}
+
+void frame_stats_count(frame_stats_t* stats, frame_counter_t counter, uint64_t n)
+{
+    if (!stats || counter < 0 || counter >= FRAME_COUNTER_COUNT)
+    {
+        return;
+    }
+    atomic_fetch_add_explicit(&stats->counters[counter], n, memory_order_relaxed);
+    if (counter != FRAME_COUNTER_WRITTEN)
+    {
+        return;
+    }
+    uint64_t now = frame_stats_now_ns();
+    stats->window_frames += n;
+    if (now - stats->window_start_ns >= FPS_WINDOW_NS)
+    {
+        atomic_store_explicit(&stats->fps_milli,
+            stats->window_frames * 1000ull * 1000000000ull / (now - stats->window_start_ns), memory_order_relaxed);
+        atomic_store_explicit(&stats->fps_updated_ns, now, memory_order_relaxed);
+        stats->window_start_ns = now;
+        stats->window_frames = 0;
+    }
+}
+
+size_t frame_stats_format(frame_stats_t* stats, char* buffer, size_t size)
+{
+    text_t text = { buffer, size, 0 };
+    if (size > 0)
+    {
+        buffer[0] = '\0';
+    }
+    if (!stats)
+    {
+        return 0;
+    }
+    uint64_t now = frame_stats_now_ns();
+    text_append(&text, "uptime_s %.3f\n", (now - stats->start_ns) / 1e9);
+    /** No frame for a whole window means the stream stopped */
+    uint64_t fps_milli = atomic_load_explicit(&stats->fps_milli, memory_order_relaxed);
+    if (now - atomic_load_explicit(&stats->fps_updated_ns, memory_order_relaxed) > 2 * FPS_WINDOW_NS)
+    {
+        fps_milli = 0;
+    }
+    text_append(&text, "fps %.3f\n", fps_milli / 1000.0);
+    for (int i = 0; i < FRAME_COUNTER_COUNT; i++)
+    {
+        text_append(&text, "counter %s %llu\n", counter_names[i],
+            (unsigned long long)atomic_load_explicit(&stats->counters[i], memory_order_relaxed));
+    }
+
+    for (int i = 0; i < FRAME_STAGE_COUNT; i++)
+    {
+        const histogram_t* histogram = &stats->stages[i];
+        /** Iterations are counts, everything else is ns printed as us */
+        double scale = i == FRAME_STAGE_KMEANS_ITERATIONS ? 1.0 : 1e-3;
+        /** Concurrent recording may skew a snapshot by a few samples. Buckets are the reference. */
+        uint64_t count = 0;
+        for (int b = 0; b < N_BUCKETS; b++)
+        {
+            count += atomic_load_explicit(&histogram->buckets[b], memory_order_relaxed);
+        }
+        uint64_t sum = atomic_load_explicit(&histogram->sum, memory_order_relaxed);
+        uint64_t max = atomic_load_explicit(&histogram->max, memory_order_relaxed);
+        text_append(&text, "stage %s count %llu mean %.3f p50 %.3f p90 %.3f p99 %.3f p999 %.3f max %.3f\n",
+            stage_names[i], (unsigned long long)count,
+            count ? (double)sum / count * scale : 0.0,
+            histogram_percentile(histogram, count, max, 50.0) * scale,
+            histogram_percentile(histogram, count, max, 90.0) * scale,
+            histogram_percentile(histogram, count, max, 99.0) * scale,
+            histogram_percentile(histogram, count, max, 99.9) * scale,
+            max * scale);
+    }
+    for (int i = 0; i < FRAME_STAGE_COUNT; i++)
+    {
+        double scale = i == FRAME_STAGE_KMEANS_ITERATIONS ? 1.0 : 1e-3;
+        for (int b = 0; b < N_BUCKETS; b++)
+        {
+            uint64_t n = atomic_load_explicit(&stats->stages[i].buckets[b], memory_order_relaxed);
+            if (n != 0)
+            {
+                text_append(&text, "bucket %s %.3f %llu\n", stage_names[i], bucket_upper_bound(b) * scale, (unsigned long long)n);
+            }
+        }
+    }
+    return text.len;
+}
+
+static int bucket_index(uint64_t value)
+{
+    if (value < SUB_BUCKETS)
+    {
+        return (int)value;
+    }
+    int msb = 63 - __builtin_clzll(value);
+    int shift = msb - SUB_BUCKET_BITS;
+    return (shift + 1) * SUB_BUCKETS + (int)((value >> shift) & (SUB_BUCKETS - 1));
+}
+
+/** Largest value that falls in the bucket */
+static uint64_t bucket_upper_bound(int index)
+{
+    if (index < SUB_BUCKETS)
+    {
+        return index;
+    }
+    int shift = index / SUB_BUCKETS - 1;
+    uint64_t sub = index % SUB_BUCKETS;
+    return ((SUB_BUCKETS + sub + 1) << shift) - 1;
+}
+
+static uint64_t histogram_percentile(const histogram_t* histogram, uint64_t count, uint64_t max, double percentile)
+{
+    if (count == 0)
+    {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(percentile / 100.0 * count + 0.999999);
+    if (rank < 1)
+    {
+        rank = 1;
+    }
+    uint64_t seen = 0;
+    for (int b = 0; b < N_BUCKETS; b++)
+    {
+        seen += atomic_load_explicit(&histogram->buckets[b], memory_order_relaxed);
+        if (seen >= rank)
+        {
+            uint64_t value = bucket_upper_bound(b);
+            return value < max ? value : max;
+        }
+    }
+    return max;
+}
+
+static void text_append(text_t* text, const char* format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    size_t left = text->len < text->size ? text->size - text->len : 0;
+    int n = vsnprintf(left ? text->buffer + text->len : NULL, left, format, args);
+    va_end(args);
+    if (n > 0)
+    {
+        text->len += n;
+    }
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * Per stage latency histograms and frame counters.
+ * Recording is lock free and may happen on any thread. Histograms are log-linear,
+ * 16 buckets per power of two, so every quantile is within ~6% of the true value.
+ *
+ * frame_stats_format writes one record per line, fields separated by spaces:
+ *     uptime_s <seconds>
+ *     fps <frames written per second, over the last second>
+ *     counter <name> <value>
+ *     stage <name> count <n> mean <v> p50 <v> p90 <v> p99 <v> p999 <v> max <v>
+ *     bucket <name> <upper bound> <count>
+ * Stage values are microseconds, except kmeans_iterations. Only non-empty buckets are listed.
+ */
+
+typedef enum
+{
+    /** Frame fully received, until its encoding starts. Pacing and a busy device show up here. */
+    FRAME_STAGE_INGEST,
+    /** BGR to YCbCr or RGB565 */
+    FRAME_STAGE_CONVERT,
+    /** k-means or tile delta */
+    FRAME_STAGE_COMPRESS,
+    /** Palette conversion and bit packing */
+    FRAME_STAGE_PACK,
+    /** usb_screen write, until the queue drained to the device */
+    FRAME_STAGE_WRITE,
+    /** Frame fully received, until its bytes left for the device */
+    FRAME_STAGE_TOTAL,
+    FRAME_STAGE_KMEANS_ITERATIONS,
+    FRAME_STAGE_COUNT,
+} frame_stage_t;
+
+typedef enum
+{
+    FRAME_COUNTER_RECEIVED,
+    /** Replaced by a newer frame before it was sent */
+    FRAME_COUNTER_DROPPED,
+    /** Encoded to nothing, e.g. unchanged */
+    FRAME_COUNTER_SKIPPED,
+    /** Skipped because it equals the last encoded frame, counted in skipped as well */
+    FRAME_COUNTER_DUPLICATE,
+    FRAME_COUNTER_WRITTEN,
+    /** Failed writes and packets dropped with the device */
+    FRAME_COUNTER_LOST,
+    FRAME_COUNTER_COUNT,
+} frame_counter_t;
+
+typedef struct frame_stats_s frame_stats_t;
+
+frame_stats_t* frame_stats_new();
+void frame_stats_free(frame_stats_t* stats);
+
+uint64_t frame_stats_now_ns();
+
+/** stats may be NULL. Times are in ns. */
+void frame_stats_record(frame_stats_t* stats, frame_stage_t stage, uint64_t value);
+/** Records now - start_ns */
+void frame_stats_record_since(frame_stats_t* stats, frame_stage_t stage, uint64_t start_ns);
+/** FRAME_COUNTER_WRITTEN must only be counted from one thread, it also drives the fps window */
+void frame_stats_count(frame_stats_t* stats, frame_counter_t counter, uint64_t n);
+
+/**
+ * Writes the text snapshot into buffer, always NUL terminated.
+ * Returns the full length like snprintf, which may be larger than size.
+ */
+size_t frame_stats_format(frame_stats_t* stats, char* buffer, size_t size);
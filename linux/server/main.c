@@ -8,50 +8,99 @@
 #include <sys/types.h>
 #include <stdio.h>
 #include <errno.h>
+#include <stdbool.h>
 #include <time.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/timerfd.h>
 
 #include "usb_screen.h"
+#include "frame_ring.h"
+#include "frame_encoder.h"
+#include "frame_pipeline.h"
+#include "frame_stats.h"
+#include "frame_scheduler.h"
 #include "config.h"
 #include "tev/tev.h"
 #include "tev/map.h"
-#include "../../common/k_means_compression.h"
 #include "../../common/image.h"
-#include "../../common/color_conversion.h"
-#include "../../common/config.h"
+
+typedef enum
+{
+    /** Nothing received yet */
+    CLIENT_PROTOCOL_UNKNOWN,
+    /** Headerless BGR24 frames */
+    CLIENT_PROTOCOL_RAW,
+    CLIENT_PROTOCOL_HEADER,
+} client_protocol_t;
 
 typedef struct
 {
     int fd;
-    uint8_t buffer[CONST_FB_SIZE];
+    client_protocol_t protocol;
+    /** A frame_header_t and its payload. Raw frames are received behind a header made up for them. */
+    _Alignas(frame_header_t) uint8_t buffer[CONST_FRAME_MAX_SIZE];
     size_t read_len;
+    /** Only set if the client negotiated the shared memory ingest */
+    frame_ring_t* ring;
 } client_t;
 
 typedef struct
 {
     int fd;
+    int stats_fd;
     map_handle_t clients;
     usb_screen_t* screen;
     tev_handle_t* tev;
-    tev_timeout_handle_t frame_sync;
-    uint64_t last_frame_time_ms;
-    image_t* image;
-#if FRAME_COMPRESSION == FRAME_COMPRESSION_NONE
-    rgb565_image_t* rgb565_image;
-#elif FRAME_COMPRESSION == FRAME_COMPRESSION_K_MEANS
-    color_palette_image_t* compressed_image;
-    packed_color_palette_image_t* packed_image;
-#endif
-    bool first_frame;
+    frame_scheduler_t* scheduler;
+    /** timerfd armed with the scheduler's absolute deadline for the waiting frame */
+    int timer_fd;
+    bool timer_armed;
+    /** The newest frame, followed by its payload */
+    frame_header_t* frame;
+    /** The newest frame lives in this client's ring instead of frame */
+    client_t* ring_source;
+    /** A received frame has not been processed yet. A newer one replaces it. */
+    bool frame_waiting;
+    uint64_t frame_arrival_ns;
+    /**
+     * Encoded while the device was still busy, written as soon as it drains.
+     * Points into the encoder, which is not used again before the packet is written.
+     */
+    const void* held_data;
+    size_t held_size;
+    uint64_t held_arrival_ns;
+    /** The last written frame is still queued on the device */
+    bool write_in_flight;
+    uint64_t write_arrival_ns;
+    uint64_t write_start_ns;
+    frame_stats_t* stats;
+    frame_encoder_t* encoder;
+    /** Only set in pipelined mode. Frames bypass frame and encoder then. */
+    frame_pipeline_t* pipeline;
 } app_t;
 
 static app_t app;
 
 static void on_client_connection(void* );
+static void on_stats_connection(void* );
 static void on_client_data(void* ctx);
-static void process_frame(void* );
-static uint64_t now_ms();
+static void on_client_doorbell(void* ctx);
+static void on_frame_received(uint64_t n_frames);
+static void on_frame_loaded(const frame_header_t* header, const void* payload);
+static void on_frame_ready();
+static void on_frame_timer(void* );
+static void on_frame_written();
+static void on_screen_drained(void* , int status);
+static void write_held_packet();
+static void set_frame_timer(uint64_t deadline_ns);
+static int client_attach_ring(client_t* client, const struct msghdr* msg, size_t data_len);
+static size_t client_frame_len(const client_t* client);
+static const void* ring_slot_frame(const frame_ring_t* ring, const void* slot, frame_header_t* header);
+static void frame_copy(frame_header_t* dst, const frame_header_t* header, const void* payload);
+static void client_remove(client_t* client);
+static void process_frame();
+static int listen_unix(const char* path);
 static client_t* client_new(int fd);
 static void client_free(void* data, void* );
 
@@ -60,123 +109,139 @@ int main(int argc, char* const* argv)
     /** parse args */
     const char* device = NULL;
     const char* sock_path = DEFAULT_SOCK_PATH;
+    const char* stats_sock_path = DEFAULT_STATS_SOCK_PATH;
+    bool pipelined = false;
 
     int opt = -1;
-    while ((opt = getopt(argc, argv, "l:d:")) != -1)
+    while ((opt = getopt(argc, argv, "l:s:d:p")) != -1)
     {
         switch (opt)
         {
         case 'l':
             sock_path = optarg;
             break;
+        case 's':
+            stats_sock_path = optarg;
+            break;
         case 'd':
             device = optarg;
             break;
+        case 'p':
+            pipelined = true;
+            break;
         default:
             break;
         }
     }
     if (device == NULL)
     {
-        fprintf(stderr, "Usage: %s -d <device> [-l <listen path>]\n", argv[0]);
+        fprintf(stderr, "Usage: %s -d <device> [-l <listen path>] [-s <stats path>] [-p]\n", argv[0]);
+        fprintf(stderr, "\t-s: Serves the frame stats as text, default %s\n", DEFAULT_STATS_SOCK_PATH);
+        fprintf(stderr, "\t-p: Encode and write frames on dedicated threads\n");
         return 1;
     }
 
     memset(&app, 0, sizeof(app_t));
-    app.first_frame = true;
     app.clients = map_create();
     if (!app.clients)
     {
         fprintf(stderr, "Failed to create map\n");
         return 1;
     }
-    app.image = image_new(CONST_SCREEN_WIDTH, CONST_SCREEN_HEIGHT);
-    if (!app.image)
+    app.frame = malloc(CONST_FRAME_MAX_SIZE);
+    if (!app.frame)
     {
-        fprintf(stderr, "Failed to create image\n");
+        fprintf(stderr, "Failed to create frame buffer\n");
         return 1;
     }
+    /** Fails frame_header_check until a frame is copied in */
+    memset(app.frame, 0, sizeof(frame_header_t));
 
-#if FRAME_COMPRESSION == FRAME_COMPRESSION_NONE
-    app.rgb565_image = rgb565_image_new(CONST_SCREEN_WIDTH * CONST_SCREEN_HEIGHT);
-    if (!app.rgb565_image)
+    app.stats = frame_stats_new();
+    if (!app.stats)
     {
-        fprintf(stderr, "Failed to create rgb565 image\n");
+        fprintf(stderr, "Failed to create stats\n");
         return 1;
     }
-#elif FRAME_COMPRESSION == FRAME_COMPRESSION_K_MEANS
-    app.compressed_image = color_palette_image_new(CONST_N_COLOR, CONST_SCREEN_WIDTH, CONST_SCREEN_HEIGHT);
-    if (!app.compressed_image)
+
+    app.scheduler = frame_scheduler_new(DEFAULT_FRAME_MIN_INTERVAL * 1000000ull);
+    if (!app.scheduler)
     {
-        fprintf(stderr, "Failed to create compressed image\n");
+        fprintf(stderr, "Failed to create scheduler\n");
         return 1;
     }
-    app.packed_image = packed_color_palette_image_new(CONST_N_COLOR, CONST_SCREEN_WIDTH, CONST_SCREEN_HEIGHT);
-    if (!app.packed_image)
+    app.timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (app.timer_fd == -1)
     {
-        fprintf(stderr, "Failed to create packed image\n");
+        perror("timerfd_create");
         return 1;
     }
-#endif
 
-    app.fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    app.fd = listen_unix(sock_path);
     if (app.fd == -1)
     {
-        perror("socket");
         return 1;
     }
-
-    struct sockaddr_un addr;
-    memset(&addr, 0, sizeof(addr));
-    addr.sun_family = AF_UNIX;
-    strncpy(addr.sun_path, sock_path, sizeof(addr.sun_path) - 1);
-    size_t addr_len = offsetof(struct sockaddr_un, sun_path) + strlen(addr.sun_path);
-    if (addr.sun_path[0] == '@')
+    app.stats_fd = listen_unix(stats_sock_path);
+    if (app.stats_fd == -1)
     {
-        addr.sun_path[0] = '\0';
-    }
-    if (bind(app.fd, (struct sockaddr*)&addr, addr_len) != 0)
-    {
-        perror("bind");
         return 1;
     }
-    if (listen(app.fd, 5) != 0)
+
+    /** Event loop */
+    app.tev = tev_create_ctx();
+    if (app.tev == NULL)
     {
-        perror("listen");
+        fprintf(stderr, "Failed to create the event loop\n");
         return 1;
     }
 
     /** Open the device */
-    app.screen = usb_screen_open(device);
+    app.screen = usb_screen_open(app.tev, device);
     if (app.screen == NULL)
     {
         fprintf(stderr, "Failed to open the device\n");
         return 1;
     }
 
-    /** Event loop */
-    app.tev = tev_create_ctx();
-    if (app.tev == NULL)
+    if (pipelined)
     {
-        fprintf(stderr, "Failed to create the event loop\n");
-        return 1;
+        app.pipeline = frame_pipeline_new(app.tev, app.screen, DEFAULT_FRAME_MIN_INTERVAL, app.stats);
+        if (app.pipeline == NULL)
+        {
+            fprintf(stderr, "Failed to create the frame pipeline\n");
+            return 1;
+        }
+    }
+    else
+    {
+        /** Encodes on the event loop. The pipeline has an encoder of its own. */
+        app.encoder = frame_encoder_new(app.stats);
+        if (!app.encoder)
+        {
+            fprintf(stderr, "Failed to create encoder\n");
+            return 1;
+        }
+        app.screen->set_drain_handler(app.screen, on_screen_drained, NULL);
+        tev_set_read_handler(app.tev, app.timer_fd, on_frame_timer, NULL);
     }
 
     tev_set_read_handler(app.tev, app.fd, on_client_connection, NULL);
+    tev_set_read_handler(app.tev, app.stats_fd, on_stats_connection, NULL);
 
     tev_main_loop(app.tev);
 
-    tev_free_ctx(app.tev);
-
     close(app.fd);
+    close(app.stats_fd);
+    close(app.timer_fd);
+    /** Both unregister from the event loop */
+    frame_pipeline_free(app.pipeline);
     app.screen->close(app.screen);
-    image_free(app.image);
-#if FRAME_COMPRESSION == FRAME_COMPRESSION_NONE
-    rgb565_image_free(app.rgb565_image);
-#elif FRAME_COMPRESSION == FRAME_COMPRESSION_K_MEANS
-    color_palette_image_free(app.compressed_image);
-    packed_color_palette_image_free(app.packed_image);
-#endif
+    tev_free_ctx(app.tev);
+    free(app.frame);
+    frame_encoder_free(app.encoder);
+    frame_scheduler_free(app.scheduler);
+    frame_stats_free(app.stats);
     map_delete(app.clients, NULL, NULL);
 
     /* code */
@@ -185,8 +250,9 @@ int main(int argc, char* const* argv)
 
 static void app_exit()
 {
-    tev_clear_timeout(app.tev, app.frame_sync);
+    tev_set_read_handler(app.tev, app.timer_fd, NULL, NULL);
     tev_set_read_handler(app.tev, app.fd, NULL, NULL);
+    tev_set_read_handler(app.tev, app.stats_fd, NULL, NULL);
     map_entry_t entry;
     map_forEach(app.clients, entry)
     {
@@ -195,6 +261,8 @@ static void app_exit()
         close(client->fd);
     }
     map_clear(app.clients, client_free, NULL);
+    frame_pipeline_free(app.pipeline);
+    app.pipeline = NULL;
 }
 
 static void on_client_connection(void* )
@@ -216,94 +284,465 @@ static void on_client_connection(void* )
     map_add(app.clients, &client_fd, sizeof(client_fd), client);
 }
 
+static void on_stats_connection(void* )
+{
+    int client_fd = accept4(app.stats_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (client_fd == -1)
+    {
+        return;
+    }
+    /** One snapshot per connection. It is small enough for the socket buffer. */
+    char* text = NULL;
+    size_t size = 16 * 1024;
+    for (;;)
+    {
+        char* buffer = realloc(text, size);
+        if (buffer == NULL)
+        {
+            break;
+        }
+        text = buffer;
+        size_t len = frame_stats_format(app.stats, text, size);
+        if (len < size)
+        {
+            (void)!send(client_fd, text, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+            break;
+        }
+        size = len + 1;
+    }
+    free(text);
+    close(client_fd);
+}
+
 static void on_client_data(void* ctx)
 {
     client_t* client = (client_t*)ctx;
-    int read_len = (int)recv(client->fd, client->buffer + client->read_len, sizeof(client->buffer) - client->read_len, SOCK_NONBLOCK);
+    size_t offset = client->protocol == CLIENT_PROTOCOL_RAW ? sizeof(frame_header_t) : 0;
+    struct iovec iov = {
+        .iov_base = client->buffer + offset + client->read_len,
+        .iov_len = client_frame_len(client) - client->read_len,
+    };
+    union
+    {
+        char buffer[CMSG_SPACE(2 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = sizeof(control.buffer);
+    int read_len = (int)recvmsg(client->fd, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
     if (read_len == -1)
     {
         if (errno == EAGAIN || errno == EWOULDBLOCK)
         {
             return;
         }
-        tev_set_read_handler(app.tev, client->fd, NULL, NULL);
-        close(client->fd);
-        map_remove(app.clients, &client->fd, sizeof(client->fd));
-        client_free(client, NULL);
+        client_remove(client);
+        return;
+    }
+    if (msg.msg_controllen > 0)
+    {
+        /** Only the shared memory handshake carries fds */
+        if (client_attach_ring(client, &msg, read_len) != 0)
+        {
+            client_remove(client);
+        }
         return;
     }
     if (read_len == 0)
     {
         /** EOF */
-        tev_set_read_handler(app.tev, client->fd, NULL, NULL);
-        close(client->fd);
-        map_remove(app.clients, &client->fd, sizeof(client->fd));
-        client_free(client, NULL);
+        client_remove(client);
         return;
     }
     client->read_len += read_len;
-    if (client->read_len == sizeof(client->buffer))
+    if (client->protocol == CLIENT_PROTOCOL_UNKNOWN && client->read_len >= sizeof(uint32_t))
     {
-        /** Frame is ready */
-        memcpy(app.image->pixels, client->buffer, sizeof(client->buffer));
-        client->read_len = 0;
-        uint64_t now = now_ms();
-        if (now - app.last_frame_time_ms < DEFAULT_FRAME_MIN_INTERVAL && app.frame_sync == NULL)
+        uint32_t magic;
+        memcpy(&magic, client->buffer, sizeof(magic));
+        if (magic == FRAME_HEADER_MAGIC)
+        {
+            client->protocol = CLIENT_PROTOCOL_HEADER;
+        }
+        else
+        {
+            client->protocol = CLIENT_PROTOCOL_RAW;
+            memmove(client->buffer + sizeof(frame_header_t), client->buffer, client->read_len);
+        }
+    }
+    frame_header_t* header = (frame_header_t*)client->buffer;
+    if (client->protocol == CLIENT_PROTOCOL_HEADER
+        && client->read_len == sizeof(frame_header_t)
+        && frame_header_check(header, CONST_SCREEN_WIDTH, CONST_SCREEN_HEIGHT) != 0)
+    {
+        fprintf(stderr, "Invalid frame header, closing the client\n");
+        client_remove(client);
+        return;
+    }
+    if (client->protocol == CLIENT_PROTOCOL_UNKNOWN || client->read_len != client_frame_len(client))
+    {
+        return;
+    }
+    /** Frame is ready */
+    client->read_len = 0;
+    if (client->protocol == CLIENT_PROTOCOL_RAW)
+    {
+        frame_header_init(header, FRAME_FORMAT_BGR24, CONST_SCREEN_WIDTH, CONST_SCREEN_HEIGHT);
+    }
+    on_frame_received(1);
+    on_frame_loaded(header, frame_payload(header));
+}
+
+static void on_client_doorbell(void* ctx)
+{
+    client_t* client = (client_t*)ctx;
+    uint64_t value = 0;
+    if (read(client->ring->eventfd, &value, sizeof(value)) != sizeof(value))
+    {
+        return;
+    }
+    on_frame_received(value);
+    if (app.pipeline)
+    {
+        /** The encoder runs asynchronously. Take a copy so the slot can be released right away. */
+        uint32_t seq = 0;
+        const void* slot = frame_ring_acquire_latest(client->ring, &seq);
+        if (slot == NULL)
         {
-            /** Wait for the next frame */
-            app.frame_sync = tev_set_timeout(
-                app.tev, 
-                process_frame, NULL, 
-                DEFAULT_FRAME_MIN_INTERVAL - (now - app.last_frame_time_ms));
             return;
         }
-        else if(app.frame_sync == NULL)
+        frame_header_t header;
+        const void* payload = ring_slot_frame(client->ring, slot, &header);
+        if (payload == NULL)
         {
-            process_frame(NULL);
+            frame_ring_release(client->ring, seq);
+            frame_stats_count(app.stats, FRAME_COUNTER_DROPPED, 1);
+            return;
         }
-        /** else: There is a pending timer. Do nothing */
+        frame_copy(frame_pipeline_back_buffer(app.pipeline), &header, payload);
+        frame_ring_release(client->ring, seq);
+        frame_pipeline_publish(app.pipeline);
+        return;
+    }
+    /** The frame is read in place when it gets processed */
+    app.ring_source = client;
+    on_frame_ready();
+}
+
+/** Only the newest frame is kept. Pipelined mode counts its own replaced frames. */
+static void on_frame_received(uint64_t n_frames)
+{
+    if (n_frames == 0)
+    {
+        return;
+    }
+    frame_stats_count(app.stats, FRAME_COUNTER_RECEIVED, n_frames);
+    uint64_t dropped = n_frames - 1;
+    if (!app.pipeline)
+    {
+        if (app.frame_waiting)
+        {
+            dropped++;
+        }
+        app.frame_waiting = true;
+        app.frame_arrival_ns = frame_stats_now_ns();
+    }
+    if (dropped != 0)
+    {
+        frame_stats_count(app.stats, FRAME_COUNTER_DROPPED, dropped);
+    }
+}
+
+/** Takes a copy of a checked frame */
+static void on_frame_loaded(const frame_header_t* header, const void* payload)
+{
+    if (app.pipeline)
+    {
+        frame_copy(frame_pipeline_back_buffer(app.pipeline), header, payload);
+        frame_pipeline_publish(app.pipeline);
+        return;
     }
+    frame_copy(app.frame, header, payload);
+    app.ring_source = NULL;
+    on_frame_ready();
 }
 
-static void process_frame(void* )
+/** Encodes the waiting frame at the scheduler's deadline, right away if that has passed */
+static void on_frame_ready()
 {
-    if (app.frame_sync != NULL)
+    if (!app.frame_waiting || app.held_size != 0)
+    {
+        /** The held packet goes first. The next frame is scheduled once it is written. */
+        return;
+    }
+    uint64_t deadline = frame_scheduler_deadline(app.scheduler);
+    if (deadline > frame_stats_now_ns())
     {
-        /** This is redundant */
-        tev_clear_timeout(app.tev, app.frame_sync);
-        app.frame_sync = NULL;
+        /** A newer frame replaces the waiting one meanwhile. Drains move the deadline. */
+        set_frame_timer(deadline);
+        return;
     }
+    process_frame();
+}
 
-    app.last_frame_time_ms = now_ms();
-#if FRAME_COMPRESSION == FRAME_COMPRESSION_NONE
-    bgr_image_to_rgb565(app.image, app.rgb565_image);
-    /** DO not care if this fails */
-    app.screen->write(app.screen, app.rgb565_image->pixels, app.rgb565_image->size * sizeof(rgb565_pixel_t));
-#elif FRAME_COMPRESSION == FRAME_COMPRESSION_K_MEANS
-    bgr_image_to_ycbcr(app.image, app.image);
-    /** compress image, this can be time consuming */
-    if (k_means_compression(app.image, CONST_N_COLOR, app.compressed_image, !app.first_frame) < 0)
+static void on_frame_timer(void* )
+{
+    uint64_t expirations = 0;
+    if (read(app.timer_fd, &expirations, sizeof(expirations)) != sizeof(expirations))
     {
-        fprintf(stderr, "Failed to compress image\n");
         return;
     }
-    pixel_t color_palette[CONST_N_COLOR];
-    memcpy(color_palette, app.compressed_image->color_palettes, sizeof(color_palette));
-    palette_ycbcr_to_bgr(app.compressed_image, app.compressed_image);
-    pack_color_palette_image(app.compressed_image, app.packed_image);
-    memcpy(app.compressed_image->color_palettes, color_palette, sizeof(color_palette));
-    /** DO not care if this fails */
-    app.screen->write(app.screen, app.packed_image->data, app.packed_image->size);
+    app.timer_armed = false;
+    on_frame_ready();
+}
+
+static void on_screen_drained(void* , int status)
+{
+    if (app.write_in_flight)
+    {
+        if (status == 0)
+        {
+            on_frame_written();
+        }
+        else
+        {
+            app.write_in_flight = false;
+            frame_scheduler_write_done(app.scheduler, frame_stats_now_ns(), false);
+            frame_stats_count(app.stats, FRAME_COUNTER_LOST, 1);
+        }
+    }
+    if (status != 0)
+    {
+        /** The device lost a packet. Do not build on it. */
+        frame_encoder_reset(app.encoder);
+#if FRAME_ENCODER_IS_DIFFERENTIAL
+        if (app.held_size != 0)
+        {
+            app.held_size = 0;
+            frame_stats_count(app.stats, FRAME_COUNTER_DROPPED, 1);
+        }
 #endif
+    }
+    write_held_packet();
+    on_frame_ready();
+}
 
-    app.first_frame = false;
+static int client_attach_ring(client_t* client, const struct msghdr* msg, size_t data_len)
+{
+    int fds[2] = {-1, -1};
+    int n_fds = 0;
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR((struct msghdr*)msg, cmsg))
+    {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+        {
+            continue;
+        }
+        int n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (int i = 0; i < n; i++)
+        {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            if (n_fds < 2)
+            {
+                fds[n_fds] = fd;
+            }
+            else
+            {
+                close(fd);
+            }
+            n_fds++;
+        }
+    }
+    frame_ring_hello_t hello;
+    memset(&hello, 0, sizeof(hello));
+    memcpy(&hello, client->buffer + client->read_len, data_len < sizeof(hello) ? data_len : sizeof(hello));
+    if (n_fds != 2
+        || (msg->msg_flags & MSG_CTRUNC)
+        || client->ring != NULL
+        || client->protocol != CLIENT_PROTOCOL_UNKNOWN
+        || client->read_len != 0
+        || data_len != sizeof(hello)
+        || hello.magic != FRAME_RING_MAGIC
+        || (hello.version != FRAME_RING_VERSION && hello.version != FRAME_RING_VERSION_BGR24))
+    {
+        goto error;
+    }
+    client->ring = frame_ring_attach(fds[0], fds[1], hello.version,
+        hello.version == FRAME_RING_VERSION_BGR24 ? CONST_FB_SIZE : CONST_FRAME_MAX_SIZE);
+    if (client->ring == NULL)
+    {
+        goto error;
+    }
+    tev_set_read_handler(app.tev, client->ring->eventfd, on_client_doorbell, client);
+    return 0;
+error:
+    if (fds[0] != -1)
+        close(fds[0]);
+    if (fds[1] != -1)
+        close(fds[1]);
+    return -1;
+}
+
+static void client_remove(client_t* client)
+{
+    tev_set_read_handler(app.tev, client->fd, NULL, NULL);
+    close(client->fd);
+    map_remove(app.clients, &client->fd, sizeof(client->fd));
+    client_free(client, NULL);
 }
 
-static uint64_t now_ms()
+static void process_frame()
 {
-    struct timespec ts;
-    clock_gettime(CLOCK_MONOTONIC, &ts);
-    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    set_frame_timer(0);
+    app.frame_waiting = false;
+    uint64_t arrival_ns = app.frame_arrival_ns;
+    frame_stats_record_since(app.stats, FRAME_STAGE_INGEST, arrival_ns);
+
+    /** Read shared memory frames in place. Otherwise the frame was copied into app.frame. */
+    const frame_header_t* header = app.frame;
+    const void* payload = frame_payload(app.frame);
+    frame_header_t ring_header;
+    uint32_t ring_seq = 0;
+    frame_ring_t* ring = app.ring_source ? app.ring_source->ring : NULL;
+    app.ring_source = NULL;
+    if (ring)
+    {
+        const void* slot = frame_ring_acquire_latest(ring, &ring_seq);
+        if (slot == NULL)
+        {
+            return;
+        }
+        header = &ring_header;
+        payload = ring_slot_frame(ring, slot, &ring_header);
+        if (payload == NULL)
+        {
+            frame_ring_release(ring, ring_seq);
+            frame_stats_count(app.stats, FRAME_COUNTER_DROPPED, 1);
+            return;
+        }
+    }
+    else if (frame_header_check(app.frame, CONST_SCREEN_WIDTH, CONST_SCREEN_HEIGHT) != 0)
+    {
+        return;
+    }
+
+    uint64_t start = frame_stats_now_ns();
+    int rc = frame_encoder_load(app.encoder, header, payload);
+    if (ring)
+    {
+        frame_ring_release(ring, ring_seq);
+    }
+    if (rc != 0)
+    {
+        return;
+    }
+    const void* data = NULL;
+    size_t size = 0;
+    rc = frame_encoder_encode(app.encoder, &data, &size);
+    if (rc != 0)
+    {
+        return;
+    }
+    if (size == 0)
+    {
+        frame_stats_count(app.stats, FRAME_COUNTER_SKIPPED, 1);
+        return;
+    }
+    /** Duplicates and failures did no encode work, they must not pace the next frame */
+    frame_scheduler_encoded(app.scheduler, start, frame_stats_now_ns());
+    /** The device may still be busy with the last packet. It is written the moment it drains. */
+    app.held_data = data;
+    app.held_size = size;
+    app.held_arrival_ns = arrival_ns;
+    write_held_packet();
+}
+
+/** Retried on drain while the device is busy */
+static void write_held_packet()
+{
+    if (app.held_size == 0 || app.screen->is_busy(app.screen))
+    {
+        return;
+    }
+    size_t size = app.held_size;
+    app.held_size = 0;
+    app.write_arrival_ns = app.held_arrival_ns;
+    app.write_start_ns = frame_stats_now_ns();
+    frame_scheduler_write_started(app.scheduler, app.write_start_ns);
+    if (app.screen->write(app.screen, app.held_data, size) != 0)
+    {
+        frame_scheduler_write_done(app.scheduler, frame_stats_now_ns(), false);
+        frame_stats_count(app.stats, FRAME_COUNTER_LOST, 1);
+        frame_encoder_reset(app.encoder);
+        return;
+    }
+    app.write_in_flight = true;
+    if (!app.screen->is_busy(app.screen))
+    {
+        /** Went out in one go, there will be no drain for it */
+        on_frame_written();
+    }
+}
+
+/** Absolute CLOCK_MONOTONIC deadline in ns, 0 disarms */
+static void set_frame_timer(uint64_t deadline_ns)
+{
+    if (deadline_ns == 0 && !app.timer_armed)
+    {
+        return;
+    }
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    spec.it_value.tv_sec = deadline_ns / 1000000000ull;
+    spec.it_value.tv_nsec = deadline_ns % 1000000000ull;
+    timerfd_settime(app.timer_fd, TFD_TIMER_ABSTIME, &spec, NULL);
+    app.timer_armed = deadline_ns != 0;
+}
+
+static void on_frame_written()
+{
+    app.write_in_flight = false;
+    frame_scheduler_write_done(app.scheduler, frame_stats_now_ns(), true);
+    frame_stats_record_since(app.stats, FRAME_STAGE_WRITE, app.write_start_ns);
+    frame_stats_record_since(app.stats, FRAME_STAGE_TOTAL, app.write_arrival_ns);
+    frame_stats_count(app.stats, FRAME_COUNTER_WRITTEN, 1);
+}
+
+/** A leading '@' selects the abstract namespace */
+static int listen_unix(const char* path)
+{
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+    {
+        perror("socket");
+        return -1;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    size_t addr_len = offsetof(struct sockaddr_un, sun_path) + strlen(addr.sun_path);
+    if (addr.sun_path[0] == '@')
+    {
+        addr.sun_path[0] = '\0';
+    }
+    if (bind(fd, (struct sockaddr*)&addr, addr_len) != 0)
+    {
+        perror("bind");
+        close(fd);
+        return -1;
+    }
+    if (listen(fd, 5) != 0)
+    {
+        perror("listen");
+        close(fd);
+        return -1;
+    }
+    return fd;
 }
 
 static client_t* client_new(int fd)
@@ -315,11 +754,72 @@ static client_t* client_new(int fd)
     }
     client->read_len = 0;
     client->fd = fd;
+    client->protocol = CLIENT_PROTOCOL_UNKNOWN;
+    client->ring = NULL;
     return client;
 }
 
+/** Bytes of the current frame, header included, as far as they are known */
+static size_t client_frame_len(const client_t* client)
+{
+    switch (client->protocol)
+    {
+    case CLIENT_PROTOCOL_RAW:
+        return CONST_FB_SIZE;
+    case CLIENT_PROTOCOL_HEADER:
+        if (client->read_len < sizeof(frame_header_t))
+        {
+            return sizeof(frame_header_t);
+        }
+        return sizeof(frame_header_t) + ((const frame_header_t*)client->buffer)->payload_size;
+    default:
+        /** Enough to tell the protocols apart. Also holds the ring handshake. */
+        return sizeof(frame_header_t);
+    }
+}
+
+/** Returns the payload of a ring slot along with a checked copy of its header, or NULL */
+static const void* ring_slot_frame(const frame_ring_t* ring, const void* slot, frame_header_t* header)
+{
+    if (ring->version == FRAME_RING_VERSION_BGR24)
+    {
+        frame_header_init(header, FRAME_FORMAT_BGR24, CONST_SCREEN_WIDTH, CONST_SCREEN_HEIGHT);
+        return slot;
+    }
+    /** The client may still write to the slot. Only the copy is trusted. */
+    memcpy(header, slot, sizeof(frame_header_t));
+    if (frame_header_check(header, CONST_SCREEN_WIDTH, CONST_SCREEN_HEIGHT) != 0)
+    {
+        return NULL;
+    }
+    return (const frame_header_t*)slot + 1;
+}
+
+/** dst must hold CONST_FRAME_MAX_SIZE bytes */
+static void frame_copy(frame_header_t* dst, const frame_header_t* header, const void* payload)
+{
+    *dst = *header;
+    memcpy(dst + 1, payload, header->payload_size);
+}
+
 static void client_free(void* data, void* )
 {
     client_t* client = (client_t*)data;
+    if (app.ring_source == client)
+    {
+        /** Its waiting frame is gone with the ring. app.frame is older than it. */
+        app.ring_source = NULL;
+        if (app.frame_waiting)
+        {
+            app.frame_waiting = false;
+            set_frame_timer(0);
+            frame_stats_count(app.stats, FRAME_COUNTER_DROPPED, 1);
+        }
+    }
+    if (client->ring)
+    {
+        tev_set_read_handler(app.tev, client->ring->eventfd, NULL, NULL);
+        frame_ring_free(client->ring);
+    }
     free(client);
 }
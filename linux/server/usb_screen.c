@@ -5,20 +5,37 @@
 #include <fcntl.h>
 #include <termios.h>
 #include <stdio.h>
+#include <errno.h>
 
 typedef struct
 {
     usb_screen_t base;
+    tev_handle_t* tev;
     int fd;
     char* device_path;
+    uint8_t* queue;
+    size_t queue_head;
+    size_t queue_len;
+    bool write_handler_set;
+    void(*drain_handler)(void* ctx, int status);
+    void* drain_ctx;
 } usb_screen_impl_t;
 
 static void usb_screen_close(usb_screen_t* base);
 static int usb_screen_write(usb_screen_t* base, const void* data, size_t size);
+static bool usb_screen_is_busy(usb_screen_t* base);
+static void usb_screen_set_drain_handler(usb_screen_t* base, void(*handler)(void* ctx, int status), void* ctx);
+static void on_device_writable(void* ctx);
+static int flush_queue(usb_screen_impl_t* this);
+static void close_device(usb_screen_impl_t* this);
 static void try_open_device(usb_screen_impl_t* this);
 
-usb_screen_t* usb_screen_open(const char* device)
+usb_screen_t* usb_screen_open(tev_handle_t* tev, const char* device)
 {
+    if (tev == NULL || device == NULL)
+    {
+        return NULL;
+    }
     usb_screen_impl_t* screen = malloc(sizeof(usb_screen_impl_t));
     if (screen == NULL)
     {
@@ -27,6 +44,9 @@ usb_screen_t* usb_screen_open(const char* device)
     memset(screen, 0, sizeof(usb_screen_impl_t));
     screen->base.close = usb_screen_close;
     screen->base.write = usb_screen_write;
+    screen->base.is_busy = usb_screen_is_busy;
+    screen->base.set_drain_handler = usb_screen_set_drain_handler;
+    screen->tev = tev;
     screen->fd = -1;
     screen->device_path = strdup(device);
     if (screen->device_path == NULL)
@@ -34,6 +54,13 @@ usb_screen_t* usb_screen_open(const char* device)
         free(screen);
         return NULL;
     }
+    screen->queue = malloc(USB_SCREEN_QUEUE_SIZE);
+    if (screen->queue == NULL)
+    {
+        free(screen->device_path);
+        free(screen);
+        return NULL;
+    }
     /** Try to open the device */
     try_open_device(screen);
 
@@ -47,16 +74,13 @@ static void usb_screen_close(usb_screen_t* base)
         return;
     }
     usb_screen_impl_t* this = (usb_screen_impl_t*)base;
-    if (this->fd != -1)
-    {
-        close(this->fd);
-        this->fd = -1;
-    }
+    close_device(this);
     if (this->device_path)
     {
         free(this->device_path);
         this->device_path = NULL;
     }
+    free(this->queue);
     free(this);
 }
 
@@ -75,23 +99,118 @@ static int usb_screen_write(usb_screen_t* base, const void* data, size_t size)
     {
         return -1;
     }
-    /**
-     * @todo Use non-blocking write.
-     * Need to handle incomplete writes with non-blocking write.
-     */
-    ssize_t write_len = write(this->fd, data, size);
-    if (write_len == -1)
+    if (size > USB_SCREEN_QUEUE_SIZE - this->queue_len)
     {
-        close(this->fd);
-        this->fd = -1;
         return -1;
     }
+    if (this->queue_head + this->queue_len + size > USB_SCREEN_QUEUE_SIZE)
+    {
+        memmove(this->queue, this->queue + this->queue_head, this->queue_len);
+        this->queue_head = 0;
+    }
+    memcpy(this->queue + this->queue_head + this->queue_len, data, size);
+    this->queue_len += size;
+    if (this->write_handler_set)
+    {
+        /** Already waiting for the device */
+        return 0;
+    }
+    if (flush_queue(this) != 0)
+    {
+        return -1;
+    }
+    if (this->queue_len != 0)
+    {
+        tev_set_write_handler(this->tev, this->fd, on_device_writable, this);
+        this->write_handler_set = true;
+    }
+    return 0;
+}
+
+static bool usb_screen_is_busy(usb_screen_t* base)
+{
+    usb_screen_impl_t* this = (usb_screen_impl_t*)base;
+    return this->queue_len != 0;
+}
+
+static void usb_screen_set_drain_handler(usb_screen_t* base, void(*handler)(void* ctx, int status), void* ctx)
+{
+    usb_screen_impl_t* this = (usb_screen_impl_t*)base;
+    this->drain_handler = handler;
+    this->drain_ctx = ctx;
+}
+
+static void on_device_writable(void* ctx)
+{
+    usb_screen_impl_t* this = (usb_screen_impl_t*)ctx;
+    if (flush_queue(this) != 0)
+    {
+        /** The queue was dropped with the device. Let the owner move on. */
+        if (this->drain_handler)
+        {
+            this->drain_handler(this->drain_ctx, -1);
+        }
+        return;
+    }
+    if (this->queue_len != 0)
+    {
+        return;
+    }
+    tev_set_write_handler(this->tev, this->fd, NULL, NULL);
+    this->write_handler_set = false;
+    if (this->drain_handler)
+    {
+        this->drain_handler(this->drain_ctx, 0);
+    }
+}
+
+/** Writes as much as the device takes right now */
+static int flush_queue(usb_screen_impl_t* this)
+{
+    while (this->queue_len != 0)
+    {
+        ssize_t write_len = write(this->fd, this->queue + this->queue_head, this->queue_len);
+        if (write_len == -1)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return 0;
+            }
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            close_device(this);
+            return -1;
+        }
+        this->queue_head += write_len;
+        this->queue_len -= write_len;
+    }
+    this->queue_head = 0;
     return 0;
 }
 
+static void close_device(usb_screen_impl_t* this)
+{
+    if (this->fd == -1)
+    {
+        return;
+    }
+    if (this->write_handler_set)
+    {
+        tev_set_write_handler(this->tev, this->fd, NULL, NULL);
+        this->write_handler_set = false;
+    }
+    close(this->fd);
+    this->fd = -1;
+    /** A partial frame is useless after reopening the device */
+    this->queue_head = 0;
+    this->queue_len = 0;
+}
+
 static void try_open_device(usb_screen_impl_t* this)
 {
-    int flags = O_RDWR | O_NOCTTY;
+    int flags = O_RDWR | O_NOCTTY | O_NONBLOCK;
     this->fd = open(this->device_path, flags);
     if (this->fd < 0)
     {
@@ -110,5 +229,3 @@ static void try_open_device(usb_screen_impl_t* this)
     tty.c_cflag |= CLOCAL | CREAD;
     tcsetattr(this->fd, TCSANOW, &tty);
 }
-
-
@@ -1,13 +1,29 @@
 #pragma once
 
 #include <stddef.h>
+#include <stdbool.h>
+#include "tev/tev.h"
+
+/** Large enough for any single encoded frame */
+#define USB_SCREEN_QUEUE_SIZE (64 * 1024)
 
 typedef struct usb_screen_s usb_screen_t;
 
 struct usb_screen_s
 {
     void(*close)(usb_screen_t* self);
+    /**
+     * Queues data and starts sending it without blocking.
+     * Fails without queuing anything if the device is gone or the queue has no room.
+     */
     int(*write)(usb_screen_t* self, const void* data, size_t size);
+    /** True while queued bytes are waiting for the device. New frames should be dropped or deferred. */
+    bool(*is_busy)(usb_screen_t* self);
+    /**
+     * handler is called from the event loop every time the queue drains.
+     * status is -1 if queued data was dropped along with the device, 0 otherwise.
+     */
+    void(*set_drain_handler)(usb_screen_t* self, void(*handler)(void* ctx, int status), void* ctx);
 };
 
-usb_screen_t* usb_screen_open(const char* device);
+usb_screen_t* usb_screen_open(tev_handle_t* tev, const char* device);
@@ -0,0 +1,629 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <math.h>
+#include <unistd.h>
+#include "../../common/color_conversion.h"
+#include "../../common/k_means_compression.h"
+#include "../../common/bmp.h"
+#include "../../common/image.h"
+#include "../../common/cpu_dispatch.h"
+#include "../../common/frame_hash.h"
+#include "../../common/plane_scale.h"
+#include "cpu_cycle_counter.h"
+
+/**
+ * Kernel microbenchmarks.
+ * Every kernel runs for every image size and every ISA level the CPU has.
+ * A summary goes to stdout and the full results go to a JSON file.
+ * usage: bench_kernels [-s WxH]... [-i scalar|avx2|avx512]... [-k name] [-n samples] [-t seconds] [-j threads] [-o file]
+ * -j sizes the pool of k_means_parallel_compression, 0 for every CPU.
+ */
+
+#define MAX_SIZES 16
+#define DEFAULT_MIN_SAMPLES 9
+#define DEFAULT_MIN_SECONDS 0.2
+#define MAX_SAMPLES 1000
+#define WARMUP_CALLS 2
+/** Short kernels are timed in batches of calls, so the timer overhead does not show */
+#define MIN_BATCH_SECONDS 100e-6
+#define KMEANS_SEED 1
+
+static const int k_values[] = { 8, 16, 32, 64 };
+
+typedef struct
+{
+    size_t width;
+    size_t height;
+} bench_size_t;
+
+typedef struct
+{
+    image_t* bgr;
+    image_t* ycbcr;
+    image_t* dst;
+    color_palette_image_t* palette;
+    /** Palette of an earlier run, restored before each hinted run */
+    color_palette_image_t* hint;
+    packed_color_palette_image_t* packed;
+    rgb565_image_t* rgb565;
+    planar_image_t* planar_bgr;
+    planar_image_t* planar_ycbcr;
+    planar_image_t* planar_dst;
+    k_means_pool_t* pool;
+    /** Plain engine, for the planar and the fused kernels */
+    k_means_ctx_t* ctx;
+    int k;
+    bool use_hint;
+    int iterations;
+    /** Keeps the hash from being optimized away */
+    uint64_t hash;
+} bench_data_t;
+
+typedef struct
+{
+    const char* name;
+    bool sweep_k;
+    bool sweep_hint;
+    /** Untimed, runs before every call. Calls of a kernel with prepare are not batched. */
+    void (*prepare)(bench_data_t* data);
+    void (*run)(bench_data_t* data);
+} bench_kernel_t;
+
+typedef struct
+{
+    double median;
+    double p10;
+    double p90;
+    double p99;
+    double min;
+} bench_stats_t;
+
+static void run_bgr_to_ycbcr(bench_data_t* data);
+static void run_ycbcr_to_bgr(bench_data_t* data);
+static void prepare_k_means(bench_data_t* data);
+static void run_k_means(bench_data_t* data);
+static void run_k_means_parallel(bench_data_t* data);
+static void run_k_means_hamerly(bench_data_t* data);
+static void run_planar_bgr_to_ycbcr(bench_data_t* data);
+static void run_planar_ycbcr_to_bgr(bench_data_t* data);
+static void prepare_k_means_ctx(bench_data_t* data);
+static void run_k_means_planar(bench_data_t* data);
+static void run_convert_then_k_means(bench_data_t* data);
+static void run_k_means_bgr(bench_data_t* data);
+static void run_pack(bench_data_t* data);
+static void run_bgr_to_rgb565(bench_data_t* data);
+static void run_bgr_to_rgb565_dither(bench_data_t* data);
+static void run_frame_hash(bench_data_t* data);
+static void run_plane_area_downscale(bench_data_t* data);
+
+static const bench_kernel_t kernels[] = {
+    { "bgr_image_to_ycbcr", false, false, NULL, run_bgr_to_ycbcr },
+    { "ycbcr_image_to_bgr", false, false, NULL, run_ycbcr_to_bgr },
+    { "k_means_compression", true, true, prepare_k_means, run_k_means },
+    { "k_means_parallel_compression", true, true, prepare_k_means, run_k_means_parallel },
+    { "k_means_hamerly_compression", true, true, prepare_k_means, run_k_means_hamerly },
+    { "planar_bgr_to_ycbcr", false, false, NULL, run_planar_bgr_to_ycbcr },
+    { "planar_ycbcr_to_bgr", false, false, NULL, run_planar_ycbcr_to_bgr },
+    { "k_means_ctx_run_planar", true, true, prepare_k_means_ctx, run_k_means_planar },
+    { "convert_then_k_means_ctx_run", true, true, prepare_k_means_ctx, run_convert_then_k_means },
+    { "k_means_ctx_run_bgr", true, true, prepare_k_means_ctx, run_k_means_bgr },
+    { "pack_color_palette_image", true, false, NULL, run_pack },
+    { "bgr_image_to_rgb565", false, false, NULL, run_bgr_to_rgb565 },
+    { "bgr_image_to_rgb565_dither", false, false, NULL, run_bgr_to_rgb565_dither },
+    { "frame_hash", false, false, NULL, run_frame_hash },
+    { "plane_area_downscale", false, false, NULL, run_plane_area_downscale },
+};
+
+typedef struct
+{
+    int cpu_counter;
+    int min_samples;
+    double min_seconds;
+    double* ns_samples;
+    double* cycle_samples;
+    FILE* json;
+    bool first_result;
+} bench_t;
+
+static image_t* tile_image(const image_t* src, size_t width, size_t height);
+static int bench_data_init(bench_data_t* data, const image_t* source, size_t width, size_t height, int k);
+static void bench_data_release(bench_data_t* data);
+static int bench_case(bench_t* bench, const bench_kernel_t* kernel, bench_data_t* data, cpu_isa_t isa);
+static void compute_stats(double* samples, int n, bench_stats_t* stats);
+static void write_stats(FILE* file, const char* name, const bench_stats_t* stats);
+static double now_seconds();
+static int parse_size(const char* text, bench_size_t* size);
+
+int main(int argc, char const *argv[])
+{
+    bench_size_t sizes[MAX_SIZES];
+    int n_sizes = 0;
+    bool isa_enabled[CPU_ISA_COUNT] = { false };
+    bool isa_selected = false;
+    const char* kernel_filter = NULL;
+    const char* json_path = "../../output/bench_kernels.json";
+    int n_threads = 0;
+    bench_t bench;
+    memset(&bench, 0, sizeof(bench));
+    bench.min_samples = DEFAULT_MIN_SAMPLES;
+    bench.min_seconds = DEFAULT_MIN_SECONDS;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (i + 1 >= argc)
+        {
+            fprintf(stderr, "missing value for %s\n", argv[i]);
+            return 1;
+        }
+        const char* value = argv[++i];
+        if (strcmp(argv[i - 1], "-s") == 0 && n_sizes < MAX_SIZES)
+        {
+            if (parse_size(value, &sizes[n_sizes]) != 0)
+            {
+                fprintf(stderr, "bad size %s\n", value);
+                return 1;
+            }
+            n_sizes++;
+        }
+        else if (strcmp(argv[i - 1], "-i") == 0)
+        {
+            int isa = cpu_isa_from_name(value);
+            if (isa < 0)
+            {
+                fprintf(stderr, "unknown ISA level %s\n", value);
+                return 1;
+            }
+            isa_enabled[isa] = true;
+            isa_selected = true;
+        }
+        else if (strcmp(argv[i - 1], "-k") == 0)
+        {
+            kernel_filter = value;
+        }
+        else if (strcmp(argv[i - 1], "-n") == 0)
+        {
+            bench.min_samples = atoi(value);
+        }
+        else if (strcmp(argv[i - 1], "-t") == 0)
+        {
+            bench.min_seconds = atof(value);
+        }
+        else if (strcmp(argv[i - 1], "-j") == 0)
+        {
+            n_threads = atoi(value);
+        }
+        else if (strcmp(argv[i - 1], "-o") == 0)
+        {
+            json_path = value;
+        }
+        else
+        {
+            fprintf(stderr, "unknown option %s\n", argv[i - 1]);
+            return 1;
+        }
+    }
+    if (bench.min_samples < 1 || bench.min_samples > MAX_SAMPLES)
+    {
+        bench.min_samples = DEFAULT_MIN_SAMPLES;
+    }
+    if (n_sizes == 0)
+    {
+        /** The LCD, then a few multiples of it */
+        sizes[n_sizes++] = (bench_size_t){ 160, 80 };
+        sizes[n_sizes++] = (bench_size_t){ 320, 160 };
+        sizes[n_sizes++] = (bench_size_t){ 640, 320 };
+    }
+    cpu_isa_t detected = cpu_isa_detect();
+    for (int isa = 0; isa < CPU_ISA_COUNT; isa++)
+    {
+        if (!isa_selected)
+        {
+            isa_enabled[isa] = true;
+        }
+        if (isa > (int)detected)
+        {
+            isa_enabled[isa] = false;
+        }
+    }
+
+    image_t* source = load_24bit_bmp("../../resource/desktop.bmp");
+    if (!source)
+    {
+        return 1;
+    }
+    /** Deterministic, so its iteration counts match the serial engine's */
+    k_means_pool_t* pool = k_means_pool_new(n_threads, true);
+    if (!pool)
+    {
+        return 1;
+    }
+    bench.json = fopen(json_path, "w");
+    if (!bench.json)
+    {
+        fprintf(stderr, "cannot open %s\n", json_path);
+        return 1;
+    }
+    bench.ns_samples = malloc(MAX_SAMPLES * sizeof(double));
+    bench.cycle_samples = malloc(MAX_SAMPLES * sizeof(double));
+    if (!bench.ns_samples || !bench.cycle_samples)
+    {
+        return 1;
+    }
+    bench.cpu_counter = cpu_cycle_counter_open();
+    bench.first_result = true;
+    if (bench.cpu_counter < 0)
+    {
+        printf("perf cycle counter unavailable, reporting ns only\n");
+    }
+    fprintf(bench.json, "{\n  \"detected_isa\": \"%s\",\n  \"cycle_counter\": %s,\n  \"results\": [",
+        cpu_isa_name(detected), bench.cpu_counter >= 0 ? "true" : "false");
+    printf("%-28s %-7s %-9s %-3s %-5s %10s %10s %10s\n",
+        "kernel", "isa", "size", "k", "hint", "ns/px p50", "ns/px p90", "cyc/px p50");
+
+    int rc = 0;
+    for (int s = 0; s < n_sizes && rc == 0; s++)
+    {
+        for (size_t n = 0; n < sizeof(kernels) / sizeof(kernels[0]) && rc == 0; n++)
+        {
+            const bench_kernel_t* kernel = &kernels[n];
+            if (kernel_filter && !strstr(kernel->name, kernel_filter))
+            {
+                continue;
+            }
+            int n_k = kernel->sweep_k ? (int)(sizeof(k_values) / sizeof(k_values[0])) : 1;
+            for (int ki = 0; ki < n_k && rc == 0; ki++)
+            {
+                bench_data_t data;
+                if (bench_data_init(&data, source, sizes[s].width, sizes[s].height, kernel->sweep_k ? k_values[ki] : 32) != 0)
+                {
+                    fprintf(stderr, "out of memory\n");
+                    rc = 1;
+                    break;
+                }
+                data.pool = pool;
+                for (int hint = 0; hint <= (kernel->sweep_hint ? 1 : 0) && rc == 0; hint++)
+                {
+                    data.use_hint = hint;
+                    for (int isa = 0; isa < CPU_ISA_COUNT && rc == 0; isa++)
+                    {
+                        if (isa_enabled[isa])
+                        {
+                            rc = bench_case(&bench, kernel, &data, (cpu_isa_t)isa);
+                        }
+                    }
+                }
+                bench_data_release(&data);
+            }
+        }
+    }
+    fprintf(bench.json, "\n  ]\n}\n");
+    fclose(bench.json);
+    if (rc == 0)
+    {
+        printf("results written to %s\n", json_path);
+    }
+
+    free(bench.ns_samples);
+    free(bench.cycle_samples);
+    if (bench.cpu_counter >= 0)
+    {
+        close(bench.cpu_counter);
+    }
+    image_free(source);
+    k_means_pool_free(pool);
+    return rc;
+}
+
+static void run_bgr_to_ycbcr(bench_data_t* data)
+{
+    bgr_image_to_ycbcr(data->bgr, data->dst);
+}
+
+static void run_ycbcr_to_bgr(bench_data_t* data)
+{
+    ycbcr_image_to_bgr(data->ycbcr, data->dst);
+}
+
+static void prepare_k_means(bench_data_t* data)
+{
+    /** Same starting centers every call, so the iteration count is stable */
+    srand(KMEANS_SEED);
+    if (data->use_hint)
+    {
+        memcpy(data->palette->color_palettes, data->hint->color_palettes, data->k * sizeof(pixel_t));
+    }
+}
+
+static void run_k_means(bench_data_t* data)
+{
+    data->iterations = k_means_compression(data->ycbcr, data->k, data->palette, data->use_hint);
+}
+
+static void run_k_means_parallel(bench_data_t* data)
+{
+    data->iterations = k_means_parallel_compression(data->pool, data->ycbcr, data->k, data->palette, data->use_hint);
+}
+
+static void run_k_means_hamerly(bench_data_t* data)
+{
+    data->iterations = k_means_hamerly_compression(data->ycbcr, data->k, data->palette, data->use_hint);
+}
+
+static void run_planar_bgr_to_ycbcr(bench_data_t* data)
+{
+    planar_bgr_to_ycbcr(data->planar_bgr, data->planar_dst);
+}
+
+static void run_planar_ycbcr_to_bgr(bench_data_t* data)
+{
+    planar_ycbcr_to_bgr(data->planar_ycbcr, data->planar_dst);
+}
+
+static void prepare_k_means_ctx(bench_data_t* data)
+{
+    prepare_k_means(data);
+    k_means_ctx_seed(data->ctx, KMEANS_SEED);
+}
+
+static void run_k_means_planar(bench_data_t* data)
+{
+    data->iterations = k_means_ctx_run_planar(data->ctx, data->planar_ycbcr, data->palette, data->use_hint);
+}
+
+static void run_convert_then_k_means(bench_data_t* data)
+{
+    bgr_image_to_ycbcr(data->bgr, data->dst);
+    data->iterations = k_means_ctx_run(data->ctx, data->dst, data->palette, data->use_hint);
+}
+
+static void run_k_means_bgr(bench_data_t* data)
+{
+    data->iterations = k_means_ctx_run_bgr(data->ctx, data->bgr, data->dst, data->palette, data->use_hint);
+}
+
+static void run_pack(bench_data_t* data)
+{
+    pack_color_palette_image(data->hint, data->packed);
+}
+
+static void run_bgr_to_rgb565(bench_data_t* data)
+{
+    bgr_image_to_rgb565(data->bgr, data->rgb565);
+}
+
+static void run_bgr_to_rgb565_dither(bench_data_t* data)
+{
+    bgr_image_to_rgb565_ex(data->bgr, data->rgb565, RGB565_DITHER);
+}
+
+static void run_frame_hash(bench_data_t* data)
+{
+    data->hash += frame_hash(data->bgr->pixels, data->bgr->width * data->bgr->height * sizeof(pixel_t), 0);
+}
+
+/** The first width x height bytes as a luma plane, down to the screen like the client does */
+static void run_plane_area_downscale(bench_data_t* data)
+{
+    int width = data->bgr->width, height = data->bgr->height;
+    int dst_width = width < 160 ? width : 160;
+    int dst_height = height < 80 ? height : 80;
+    plane_area_downscale((const uint8_t*)data->bgr->pixels, width, width, height,
+        (uint8_t*)data->dst->pixels, dst_width, dst_width, dst_height);
+}
+
+/** Runs one kernel at one ISA level, then prints and records its stats */
+static int bench_case(bench_t* bench, const bench_kernel_t* kernel, bench_data_t* data, cpu_isa_t isa)
+{
+    cpu_isa_force(isa);
+    size_t n_pixels = data->bgr->width * data->bgr->height;
+
+    int batch = 1;
+    double warmup_start = now_seconds();
+    for (int i = 0; i < WARMUP_CALLS; i++)
+    {
+        if (kernel->prepare)
+        {
+            kernel->prepare(data);
+        }
+        kernel->run(data);
+    }
+    double call_seconds = (now_seconds() - warmup_start) / WARMUP_CALLS;
+    if (!kernel->prepare && call_seconds < MIN_BATCH_SECONDS)
+    {
+        batch = (int)(MIN_BATCH_SECONDS / (call_seconds > 1e-9 ? call_seconds : 1e-9)) + 1;
+    }
+
+    int n_samples = 0;
+    double iterations = 0;
+    double bench_start = now_seconds();
+    while (n_samples < MAX_SAMPLES
+        && (n_samples < bench->min_samples || now_seconds() - bench_start < bench->min_seconds))
+    {
+        if (kernel->prepare)
+        {
+            kernel->prepare(data);
+        }
+        cpu_cycle_counter_reset(bench->cpu_counter);
+        double start = now_seconds();
+        for (int i = 0; i < batch; i++)
+        {
+            kernel->run(data);
+        }
+        double elapsed = now_seconds() - start;
+        long long cycles = bench->cpu_counter >= 0 ? cpu_cycle_counter_get_result(bench->cpu_counter) : -1;
+        bench->ns_samples[n_samples] = elapsed * 1e9 / ((double)batch * n_pixels);
+        bench->cycle_samples[n_samples] = (double)cycles / ((double)batch * n_pixels);
+        iterations += data->iterations;
+        n_samples++;
+    }
+    iterations /= n_samples;
+
+    bench_stats_t ns_stats;
+    bench_stats_t cycle_stats;
+    compute_stats(bench->ns_samples, n_samples, &ns_stats);
+    compute_stats(bench->cycle_samples, n_samples, &cycle_stats);
+    bool has_cycles = bench->cpu_counter >= 0 && cycle_stats.min >= 0;
+
+    char size_text[32];
+    char k_text[8] = "-";
+    char cycles_text[16] = "-";
+    snprintf(size_text, sizeof(size_text), "%zux%zu", data->bgr->width, data->bgr->height);
+    if (kernel->sweep_k)
+    {
+        snprintf(k_text, sizeof(k_text), "%d", data->k);
+    }
+    if (has_cycles)
+    {
+        snprintf(cycles_text, sizeof(cycles_text), "%.2f", cycle_stats.median);
+    }
+    printf("%-28s %-7s %-9s %-3s %-5s %10.3f %10.3f %10s\n",
+        kernel->name, cpu_isa_name(isa), size_text, k_text,
+        !kernel->sweep_hint ? "-" : data->use_hint ? "yes" : "no",
+        ns_stats.median, ns_stats.p90, cycles_text);
+
+    fprintf(bench->json, "%s\n    {\"kernel\": \"%s\", \"isa\": \"%s\", \"width\": %zu, \"height\": %zu, ",
+        bench->first_result ? "" : ",", kernel->name, cpu_isa_name(isa), data->bgr->width, data->bgr->height);
+    bench->first_result = false;
+    if (kernel->sweep_k)
+    {
+        fprintf(bench->json, "\"k\": %d, ", data->k);
+    }
+    if (kernel->sweep_hint)
+    {
+        fprintf(bench->json, "\"hint\": %s, \"iterations\": %.2f, ", data->use_hint ? "true" : "false", iterations);
+    }
+    fprintf(bench->json, "\"samples\": %d, \"batch\": %d, ", n_samples, batch);
+    write_stats(bench->json, "ns_per_pixel", &ns_stats);
+    fprintf(bench->json, ", ");
+    write_stats(bench->json, "cycles_per_pixel", has_cycles ? &cycle_stats : NULL);
+    fprintf(bench->json, "}");
+    return 0;
+}
+
+static int compare_doubles(const void* a, const void* b)
+{
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+/** Nearest rank percentiles */
+static double percentile(const double* sorted, int n, double p)
+{
+    int rank = (int)ceil(p / 100.0 * n);
+    if (rank < 1)
+    {
+        rank = 1;
+    }
+    return sorted[rank - 1];
+}
+
+static void compute_stats(double* samples, int n, bench_stats_t* stats)
+{
+    qsort(samples, n, sizeof(double), compare_doubles);
+    stats->min = samples[0];
+    stats->p10 = percentile(samples, n, 10);
+    stats->median = percentile(samples, n, 50);
+    stats->p90 = percentile(samples, n, 90);
+    stats->p99 = percentile(samples, n, 99);
+}
+
+static void write_stats(FILE* file, const char* name, const bench_stats_t* stats)
+{
+    if (!stats)
+    {
+        fprintf(file, "\"%s\": null", name);
+        return;
+    }
+    fprintf(file, "\"%s\": {\"min\": %.4f, \"p10\": %.4f, \"median\": %.4f, \"p90\": %.4f, \"p99\": %.4f}",
+        name, stats->min, stats->p10, stats->median, stats->p90, stats->p99);
+}
+
+/** Repeats the source image to fill the requested size, so larger sizes keep the desktop content */
+static image_t* tile_image(const image_t* src, size_t width, size_t height)
+{
+    image_t* image = image_new(width, height);
+    if (!image)
+    {
+        return NULL;
+    }
+    for (size_t y = 0; y < height; y++)
+    {
+        for (size_t x = 0; x < width; x++)
+        {
+            image->pixels[y * width + x] = src->pixels[(y % src->height) * src->width + x % src->width];
+        }
+    }
+    image->color_space = src->color_space;
+    return image;
+}
+
+static int bench_data_init(bench_data_t* data, const image_t* source, size_t width, size_t height, int k)
+{
+    memset(data, 0, sizeof(bench_data_t));
+    data->k = k;
+    data->bgr = tile_image(source, width, height);
+    data->ycbcr = image_new(width, height);
+    data->dst = image_new(width, height);
+    data->palette = color_palette_image_new(k, width, height);
+    data->hint = color_palette_image_new(k, width, height);
+    data->packed = packed_color_palette_image_new(k, width, height);
+    data->rgb565 = rgb565_image_new(width * height);
+    data->planar_bgr = planar_image_new(width, height);
+    data->planar_ycbcr = planar_image_new(width, height);
+    data->planar_dst = planar_image_new(width, height);
+    data->ctx = k_means_ctx_new(K_MEANS_ENGINE_PLAIN, k, width, height, NULL);
+    if (!data->bgr || !data->ycbcr || !data->dst || !data->palette
+        || !data->hint || !data->packed || !data->rgb565
+        || !data->planar_bgr || !data->planar_ycbcr || !data->planar_dst || !data->ctx)
+    {
+        bench_data_release(data);
+        return -1;
+    }
+    bgr_image_to_ycbcr(data->bgr, data->ycbcr);
+    image_to_planar(data->bgr, data->planar_bgr);
+    image_to_planar(data->ycbcr, data->planar_ycbcr);
+    /** A converged palette, used as the k-means hint and as the image to pack */
+    srand(KMEANS_SEED);
+    k_means_compression(data->ycbcr, k, data->hint, false);
+    return 0;
+}
+
+static void bench_data_release(bench_data_t* data)
+{
+    image_free(data->bgr);
+    image_free(data->ycbcr);
+    image_free(data->dst);
+    color_palette_image_free(data->palette);
+    color_palette_image_free(data->hint);
+    packed_color_palette_image_free(data->packed);
+    rgb565_image_free(data->rgb565);
+    planar_image_free(data->planar_bgr);
+    planar_image_free(data->planar_ycbcr);
+    planar_image_free(data->planar_dst);
+    k_means_ctx_free(data->ctx);
+    memset(data, 0, sizeof(bench_data_t));
+}
+
+static double now_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int parse_size(const char* text, bench_size_t* size)
+{
+    unsigned long width = 0;
+    unsigned long height = 0;
+    if (sscanf(text, "%lux%lu", &width, &height) != 2 || width == 0 || height == 0)
+    {
+        return -1;
+    }
+    size->width = width;
+    size->height = height;
+    return 0;
+}
@@ -0,0 +1,702 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <termios.h>
+#include "../../common/config.h"
+#include "../../common/bmp.h"
+#include "../../common/image.h"
+#include "../../common/tile_delta.h"
+
+/**
+ * Host model of the CH32X035 board, for running usb-screen-server without hardware.
+ * It creates a pty pair and treats the slave as the CDC port.
+ * Bytes are taken from the master at USB full speed rate, in 64 byte packets,
+ * and handed to the same buffer logic as firmware/User/main.c. The main loop decodes
+ * them like lcd.c into an emulated panel, and is kept busy for as long as the SPI
+ * transfer would take. A slow main loop backs up into the pty, so the server sees
+ * the same back pressure as with the board.
+ * The port being reopened stands in for SET_LINE_CODING, which resets the receive state.
+ *
+ * usage: mcu_emulator [-m raw|kmeans|delta] [-t seconds] [-p packets per ms] [-s spi hz]
+ *                     [-n file for the pty name] [-o dump dir] [-e dump every n frames] [-l timing csv]
+ */
+
+#define LCD_WIDTH 160
+#define LCD_HEIGHT 80
+#define USB_PACKET_SIZE 64
+/** Full speed bulk, at most 19 packets per 1 ms frame */
+#define DEFAULT_PACKETS_PER_MS 19
+/** SYSCLK 48 MHz with SPI prescaler 2 */
+#define DEFAULT_SPI_HZ 24000000
+#define TICK_US 1000
+
+/** Sizes from firmware/User/main.c and lcd.h */
+#define RAW_BUFFER_SIZE (USB_PACKET_SIZE * 5 * 20)
+#define RAW_IMAGE_SIZE (LCD_WIDTH * LCD_HEIGHT * 2)
+#define KMEANS_PIXEL_BITS 5
+#define KMEANS_PALETTE_SIZE 32
+#define KMEANS_IMAGE_SIZE ((LCD_HEIGHT * LCD_WIDTH * KMEANS_PIXEL_BITS + 7) / 8 + KMEANS_PALETTE_SIZE * 2)
+#define KMEANS_BUFFER_SIZE (USB_PACKET_SIZE * ((KMEANS_IMAGE_SIZE + 63) / 64))
+#define DELTA_SLOT_COUNT 64
+/** RAMWR */
+#define DRAW_COMMAND_BYTES 1
+/** CASET and RASET with 4 parameter bytes each, then RAMWR */
+#define WINDOW_COMMAND_BYTES (2 * 5 + DRAW_COMMAND_BYTES)
+
+typedef struct
+{
+    int mode;
+    /** One 16 bit and one 8 bit SPI word */
+    double pixel_us;
+    double byte_us;
+
+    /** The panel. Points into the decoder in delta mode. */
+    rgb565_image_t* lcd;
+    rgb565_image_t* lcd_buffer;
+    int window_x;
+    int window_y;
+    int window_w;
+    int window_h;
+    int cursor;
+
+    /** Time of the latest USB event. Work it made available can not start earlier. */
+    double now_us;
+    double busy_until_us;
+    double draw_start_us;
+    /** Main loop time spent on the frame being drawn */
+    double frame_draw_us;
+
+    /** FRAME_COMPRESSION_NONE */
+    uint8_t raw_buffers[2][RAW_BUFFER_SIZE];
+    int raw_cdc_buffer;
+    int raw_drawing_buffer;
+    int image_bytes_written;
+
+    /** FRAME_COMPRESSION_K_MEANS */
+    uint8_t kmeans_buffer[KMEANS_BUFFER_SIZE];
+    uint16_t palette[KMEANS_PALETTE_SIZE];
+
+    /** Both of the above */
+    int write_offset;
+    bool image_ready;
+
+    /** FRAME_COMPRESSION_TILE_DELTA */
+    uint8_t rx_slots[DELTA_SLOT_COUNT][USB_PACKET_SIZE];
+    int rx_lens[DELTA_SLOT_COUNT];
+    unsigned int rx_head;
+    unsigned int rx_tail;
+    tile_delta_decoder_t* decoder;
+
+    /** Results */
+    uint64_t usb_bytes;
+    uint64_t usb_packets;
+    uint64_t nak_packets;
+    uint64_t frame_bytes;
+    uint64_t frames;
+    double first_frame_us;
+    double last_frame_us;
+    double draw_us_total;
+    double draw_us_max;
+    double interval_us_max;
+    /** The firmware would have drawn data that was being overwritten */
+    uint64_t tears;
+    /** Data the firmware would have skipped or written out of bounds */
+    uint64_t overflows;
+    uint64_t stream_errors;
+    uint64_t port_resets;
+
+    FILE* timing_log;
+    const char* dump_dir;
+    int dump_every;
+} mcu_t;
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int signal);
+static int mcu_init(mcu_t* mcu, int mode, int spi_hz);
+static void mcu_release(mcu_t* mcu);
+static bool mcu_is_nak(const mcu_t* mcu);
+static void mcu_receive(mcu_t* mcu, const uint8_t* data, int len, double t);
+static void mcu_reset_port(mcu_t* mcu);
+static void mcu_run_until(mcu_t* mcu, double t);
+static bool mcu_step(mcu_t* mcu, double start);
+static void on_frame_drawn(mcu_t* mcu, double t);
+static void lcd_start_window(mcu_t* mcu, int x, int y, int w, int h);
+static void lcd_write_pixel(mcu_t* mcu, uint16_t pixel);
+static void dump_frame(mcu_t* mcu);
+static void print_summary(const mcu_t* mcu, double elapsed_us);
+static int open_pty(char* name, size_t name_size);
+static int parse_mode(const char* text);
+static double now_us();
+
+int main(int argc, char* const* argv)
+{
+    int mode = FRAME_COMPRESSION;
+    double duration_s = 0;
+    int packets_per_ms = DEFAULT_PACKETS_PER_MS;
+    int spi_hz = DEFAULT_SPI_HZ;
+    const char* name_file = NULL;
+    const char* dump_dir = NULL;
+    int dump_every = 1;
+    const char* timing_path = NULL;
+
+    int opt = -1;
+    while ((opt = getopt(argc, argv, "m:t:p:s:n:o:e:l:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'm':
+            mode = parse_mode(optarg);
+            break;
+        case 't':
+            duration_s = atof(optarg);
+            break;
+        case 'p':
+            packets_per_ms = atoi(optarg);
+            break;
+        case 's':
+            spi_hz = atoi(optarg);
+            break;
+        case 'n':
+            name_file = optarg;
+            break;
+        case 'o':
+            dump_dir = optarg;
+            break;
+        case 'e':
+            dump_every = atoi(optarg);
+            break;
+        case 'l':
+            timing_path = optarg;
+            break;
+        default:
+            mode = -1;
+            break;
+        }
+    }
+    if (mode < 0 || packets_per_ms <= 0 || spi_hz <= 0 || dump_every <= 0)
+    {
+        fprintf(stderr, "Usage: %s [-m raw|kmeans|delta] [-t seconds] [-p packets per ms] [-s spi hz]\n", argv[0]);
+        fprintf(stderr, "\t[-n pty name file] [-o frame dump dir] [-e dump every n frames] [-l timing csv]\n");
+        return 1;
+    }
+
+    static mcu_t mcu;
+    if (mcu_init(&mcu, mode, spi_hz) != 0)
+    {
+        fprintf(stderr, "Failed to create the emulator\n");
+        return 1;
+    }
+    mcu.dump_dir = dump_dir;
+    mcu.dump_every = dump_every;
+    if (timing_path)
+    {
+        mcu.timing_log = fopen(timing_path, "w");
+        if (!mcu.timing_log)
+        {
+            perror("timing log");
+            return 1;
+        }
+        fprintf(mcu.timing_log, "frame,done_ms,draw_us,usb_bytes\n");
+    }
+
+    char pty_name[128];
+    int master = open_pty(pty_name, sizeof(pty_name));
+    if (master == -1)
+    {
+        return 1;
+    }
+    printf("%s\n", pty_name);
+    fflush(stdout);
+    if (name_file)
+    {
+        FILE* file = fopen(name_file, "w");
+        if (!file)
+        {
+            perror("name file");
+            return 1;
+        }
+        fprintf(file, "%s\n", pty_name);
+        fclose(file);
+    }
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    uint8_t packet[USB_PACKET_SIZE];
+    int packet_len = 0;
+    bool port_open = false;
+    double start = now_us();
+    struct timespec next_tick;
+    clock_gettime(CLOCK_MONOTONIC, &next_tick);
+    uint64_t tick = 0;
+    while (!stop && (duration_s <= 0 || tick * TICK_US < duration_s * 1e6))
+    {
+        double tick_start = (double)tick * TICK_US;
+        bool got_data = false;
+        for (int i = 0; i < packets_per_ms; i++)
+        {
+            double t = tick_start + (double)i * TICK_US / packets_per_ms;
+            mcu_run_until(&mcu, t);
+            /** Only take from the pty what this packet can carry */
+            if (packet_len < USB_PACKET_SIZE)
+            {
+                ssize_t n = read(master, packet + packet_len, USB_PACKET_SIZE - packet_len);
+                if (n > 0)
+                {
+                    if (!port_open)
+                    {
+                        port_open = true;
+                        mcu_reset_port(&mcu);
+                    }
+                    packet_len += n;
+                    got_data = true;
+                }
+                else if (n == -1 && errno == EIO)
+                {
+                    /** No one has the slave open. Whatever was in flight is gone. */
+                    port_open = false;
+                    packet_len = 0;
+                }
+            }
+            /** A short packet ends a transfer. Wait a tick in case more is coming. */
+            if (packet_len == 0 || (packet_len < USB_PACKET_SIZE && got_data))
+            {
+                break;
+            }
+            if (mcu_is_nak(&mcu))
+            {
+                mcu.nak_packets++;
+                break;
+            }
+            mcu_receive(&mcu, packet, packet_len, t);
+            packet_len = 0;
+        }
+        mcu_run_until(&mcu, tick_start + TICK_US);
+
+        tick++;
+        next_tick.tv_nsec += TICK_US * 1000;
+        if (next_tick.tv_nsec >= 1000000000)
+        {
+            next_tick.tv_sec++;
+            next_tick.tv_nsec -= 1000000000;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next_tick, NULL);
+    }
+
+    print_summary(&mcu, now_us() - start);
+    close(master);
+    if (mcu.timing_log)
+    {
+        fclose(mcu.timing_log);
+    }
+    mcu_release(&mcu);
+    return 0;
+}
+
+static void on_signal(int signal)
+{
+    stop = 1;
+}
+
+static int mcu_init(mcu_t* mcu, int mode, int spi_hz)
+{
+    memset(mcu, 0, sizeof(mcu_t));
+    mcu->mode = mode;
+    mcu->pixel_us = 16e6 / spi_hz;
+    mcu->byte_us = 8e6 / spi_hz;
+    mcu->raw_drawing_buffer = -1;
+    if (mode == FRAME_COMPRESSION_TILE_DELTA)
+    {
+        mcu->decoder = tile_delta_decoder_new(LCD_WIDTH, LCD_HEIGHT);
+        if (!mcu->decoder)
+        {
+            return -1;
+        }
+        mcu->lcd = mcu->decoder->frame;
+        return 0;
+    }
+    mcu->lcd_buffer = rgb565_image_new(LCD_WIDTH * LCD_HEIGHT);
+    if (!mcu->lcd_buffer)
+    {
+        return -1;
+    }
+    memset(mcu->lcd_buffer->pixels, 0, LCD_WIDTH * LCD_HEIGHT * sizeof(rgb565_pixel_t));
+    mcu->lcd = mcu->lcd_buffer;
+    /** lcd_init_screen leaves the window on the whole panel */
+    lcd_start_window(mcu, 0, 0, LCD_WIDTH, LCD_HEIGHT);
+    return 0;
+}
+
+static void mcu_release(mcu_t* mcu)
+{
+    rgb565_image_free(mcu->lcd_buffer);
+    tile_delta_decoder_free(mcu->decoder);
+}
+
+/** Only the delta firmware has flow control. The others overwrite data that was not drawn yet. */
+static bool mcu_is_nak(const mcu_t* mcu)
+{
+    return mcu->mode == FRAME_COMPRESSION_TILE_DELTA && mcu->rx_head - mcu->rx_tail == DELTA_SLOT_COUNT;
+}
+
+/** cdc_hook_on_data */
+static void mcu_receive(mcu_t* mcu, const uint8_t* data, int len, double t)
+{
+    mcu->now_us = t;
+    mcu->usb_bytes += len;
+    mcu->usb_packets++;
+    mcu->frame_bytes += len;
+    bool drawing = mcu->busy_until_us > t;
+    switch (mcu->mode)
+    {
+    case FRAME_COMPRESSION_NONE:
+    {
+        int n = len;
+        if (mcu->write_offset + n > RAW_BUFFER_SIZE)
+        {
+            /** A short packet earlier. The firmware runs past the buffer here. */
+            n = RAW_BUFFER_SIZE - mcu->write_offset;
+            mcu->overflows++;
+        }
+        memcpy(mcu->raw_buffers[mcu->raw_cdc_buffer] + mcu->write_offset, data, n);
+        mcu->write_offset += len;
+        if (mcu->write_offset >= RAW_BUFFER_SIZE)
+        {
+            if (mcu->image_ready)
+            {
+                /** The main loop never saw the previous buffer */
+                mcu->overflows++;
+            }
+            mcu->raw_cdc_buffer ^= 1;
+            mcu->write_offset = 0;
+            mcu->image_ready = true;
+            if (drawing && mcu->raw_cdc_buffer == mcu->raw_drawing_buffer)
+            {
+                /** The next packets land in the buffer being sent to the panel */
+                mcu->tears++;
+            }
+        }
+        break;
+    }
+    case FRAME_COMPRESSION_K_MEANS:
+    {
+        if (drawing)
+        {
+            /** lcd_draw_image reads the indexes while USB keeps writing to the same buffer */
+            double progress = (t - mcu->draw_start_us) / (mcu->busy_until_us - mcu->draw_start_us);
+            int read_offset = KMEANS_PALETTE_SIZE * 2 + (int)(progress * (KMEANS_IMAGE_SIZE - KMEANS_PALETTE_SIZE * 2));
+            if (mcu->write_offset + len > read_offset)
+            {
+                mcu->tears++;
+            }
+        }
+        int n = len;
+        if (mcu->write_offset + n > KMEANS_BUFFER_SIZE)
+        {
+            n = KMEANS_BUFFER_SIZE - mcu->write_offset;
+            mcu->overflows++;
+        }
+        memcpy(mcu->kmeans_buffer + mcu->write_offset, data, n);
+        mcu->write_offset += n;
+        if (mcu->write_offset >= KMEANS_IMAGE_SIZE)
+        {
+            memcpy(mcu->palette, mcu->kmeans_buffer, sizeof(mcu->palette));
+            if (mcu->write_offset > KMEANS_IMAGE_SIZE)
+            {
+                memmove(mcu->kmeans_buffer, mcu->kmeans_buffer + KMEANS_IMAGE_SIZE, mcu->write_offset - KMEANS_IMAGE_SIZE);
+            }
+            mcu->write_offset -= KMEANS_IMAGE_SIZE;
+            if (mcu->image_ready)
+            {
+                mcu->overflows++;
+            }
+            mcu->image_ready = true;
+        }
+        break;
+    }
+    case FRAME_COMPRESSION_TILE_DELTA:
+    {
+        int slot = mcu->rx_head % DELTA_SLOT_COUNT;
+        memcpy(mcu->rx_slots[slot], data, len);
+        mcu->rx_lens[slot] = len;
+        mcu->rx_head++;
+        break;
+    }
+    }
+}
+
+/** cdc_hook_reset_rx_buffer */
+static void mcu_reset_port(mcu_t* mcu)
+{
+    mcu->port_resets++;
+    mcu->write_offset = 0;
+    /** image_bytes_written survives, like in the firmware */
+    mcu->raw_cdc_buffer = 0;
+    if (mcu->mode == FRAME_COMPRESSION_TILE_DELTA)
+    {
+        mcu->rx_tail = mcu->rx_head;
+        tile_delta_decoder_reset(mcu->decoder);
+    }
+}
+
+/** The main loop, until t */
+static void mcu_run_until(mcu_t* mcu, double t)
+{
+    for (;;)
+    {
+        double start = mcu->busy_until_us > mcu->now_us ? mcu->busy_until_us : mcu->now_us;
+        if (start > t || !mcu_step(mcu, start))
+        {
+            return;
+        }
+    }
+}
+
+/**
+ * One pass of the firmware main loop, starting at start.
+ * The panel is updated at once, the main loop is busy until the SPI transfer would be done.
+ * Returns false if there was nothing to do.
+ */
+static bool mcu_step(mcu_t* mcu, double start)
+{
+    double cost = 0;
+    bool frame_done = false;
+    switch (mcu->mode)
+    {
+    case FRAME_COMPRESSION_NONE:
+    {
+        if (!mcu->image_ready)
+        {
+            return false;
+        }
+        mcu->image_ready = false;
+        mcu->raw_drawing_buffer = mcu->raw_cdc_buffer ^ 1;
+        if (mcu->image_bytes_written == 0)
+        {
+            lcd_start_window(mcu, mcu->window_x, mcu->window_y, mcu->window_w, mcu->window_h);
+            cost += DRAW_COMMAND_BYTES * mcu->byte_us;
+        }
+        const uint8_t* buffer = mcu->raw_buffers[mcu->raw_drawing_buffer];
+        for (int i = 0; i + 1 < RAW_BUFFER_SIZE; i += 2)
+        {
+            lcd_write_pixel(mcu, buffer[i] | (buffer[i + 1] << 8));
+        }
+        cost += RAW_BUFFER_SIZE / 2 * mcu->pixel_us;
+        mcu->image_bytes_written += RAW_BUFFER_SIZE;
+        if (mcu->image_bytes_written == RAW_IMAGE_SIZE)
+        {
+            mcu->image_bytes_written = 0;
+            frame_done = true;
+        }
+        break;
+    }
+    case FRAME_COMPRESSION_K_MEANS:
+    {
+        if (!mcu->image_ready)
+        {
+            return false;
+        }
+        mcu->image_ready = false;
+        lcd_start_window(mcu, mcu->window_x, mcu->window_y, mcu->window_w, mcu->window_h);
+        /** Same bit order as lcd_draw_image */
+        const uint8_t* indexes = mcu->kmeans_buffer + sizeof(mcu->palette);
+        size_t bit = 0;
+        for (int i = 0; i < LCD_WIDTH * LCD_HEIGHT; i++)
+        {
+            uint32_t index = 0;
+            for (int b = 0; b < KMEANS_PIXEL_BITS; b++, bit++)
+            {
+                index |= ((indexes[bit / 8] >> (bit % 8)) & 1) << b;
+            }
+            lcd_write_pixel(mcu, mcu->palette[index]);
+        }
+        cost = DRAW_COMMAND_BYTES * mcu->byte_us + LCD_WIDTH * LCD_HEIGHT * mcu->pixel_us;
+        frame_done = true;
+        break;
+    }
+    case FRAME_COMPRESSION_TILE_DELTA:
+    {
+        if (mcu->rx_tail == mcu->rx_head)
+        {
+            return false;
+        }
+        int slot = mcu->rx_tail % DELTA_SLOT_COUNT;
+        size_t frames = mcu->decoder->frames;
+        size_t windows = mcu->decoder->windows;
+        size_t pixels = mcu->decoder->pixels;
+        if (tile_delta_decoder_feed(mcu->decoder, mcu->rx_slots[slot], mcu->rx_lens[slot]) != 0)
+        {
+            /** The firmware ignores everything until the port is reopened */
+            mcu->stream_errors++;
+        }
+        /** Window headers also come before the first pixel of a window */
+        cost = (mcu->decoder->windows - windows) * WINDOW_COMMAND_BYTES * mcu->byte_us
+            + (mcu->decoder->pixels - pixels) * mcu->pixel_us;
+        frame_done = mcu->decoder->frames != frames;
+        /** rx_release_slots. A NAKed host resumes with the next packet slot. */
+        mcu->rx_tail++;
+        break;
+    }
+    default:
+        return false;
+    }
+    mcu->draw_start_us = start;
+    mcu->busy_until_us = start + cost;
+    mcu->frame_draw_us += cost;
+    if (frame_done)
+    {
+        on_frame_drawn(mcu, mcu->busy_until_us);
+    }
+    return true;
+}
+
+static void on_frame_drawn(mcu_t* mcu, double t)
+{
+    if (mcu->frames == 0)
+    {
+        mcu->first_frame_us = t;
+    }
+    else if (t - mcu->last_frame_us > mcu->interval_us_max)
+    {
+        mcu->interval_us_max = t - mcu->last_frame_us;
+    }
+    mcu->draw_us_total += mcu->frame_draw_us;
+    if (mcu->frame_draw_us > mcu->draw_us_max)
+    {
+        mcu->draw_us_max = mcu->frame_draw_us;
+    }
+    if (mcu->timing_log)
+    {
+        fprintf(mcu->timing_log, "%llu,%.3f,%.1f,%llu\n",
+            (unsigned long long)mcu->frames, t / 1000.0, mcu->frame_draw_us, (unsigned long long)mcu->frame_bytes);
+    }
+    if (mcu->dump_dir && mcu->frames % mcu->dump_every == 0)
+    {
+        dump_frame(mcu);
+    }
+    mcu->frames++;
+    mcu->last_frame_us = t;
+    mcu->frame_draw_us = 0;
+    mcu->frame_bytes = 0;
+}
+
+/** CASET, RASET and RAMWR. The cursor restarts at the window origin. */
+static void lcd_start_window(mcu_t* mcu, int x, int y, int w, int h)
+{
+    mcu->window_x = x;
+    mcu->window_y = y;
+    mcu->window_w = w;
+    mcu->window_h = h;
+    mcu->cursor = 0;
+}
+
+/** The panel wraps around inside the window */
+static void lcd_write_pixel(mcu_t* mcu, uint16_t pixel)
+{
+    int x = mcu->window_x + mcu->cursor % mcu->window_w;
+    int y = mcu->window_y + (mcu->cursor / mcu->window_w) % mcu->window_h;
+    memcpy(&mcu->lcd->pixels[y * LCD_WIDTH + x], &pixel, sizeof(pixel));
+    mcu->cursor = (mcu->cursor + 1) % (mcu->window_w * mcu->window_h);
+}
+
+static void dump_frame(mcu_t* mcu)
+{
+    image_t* image = image_new(LCD_WIDTH, LCD_HEIGHT);
+    if (!image)
+    {
+        return;
+    }
+    for (int i = 0; i < LCD_WIDTH * LCD_HEIGHT; i++)
+    {
+        rgb565_pixel_t pixel = mcu->lcd->pixels[i];
+        image->pixels[i].bgr.r = (pixel.r << 3) | (pixel.r >> 2);
+        image->pixels[i].bgr.g = (pixel.g << 2) | (pixel.g >> 4);
+        image->pixels[i].bgr.b = (pixel.b << 3) | (pixel.b >> 2);
+    }
+    char path[512];
+    snprintf(path, sizeof(path), "%s/frame_%05llu.bmp", mcu->dump_dir, (unsigned long long)mcu->frames);
+    dump_image_to_bmp(path, image);
+    image_free(image);
+}
+
+static void print_summary(const mcu_t* mcu, double elapsed_us)
+{
+    static const char* mode_names[] = { "raw", "kmeans", "delta" };
+    double span_us = mcu->last_frame_us - mcu->first_frame_us;
+    printf("mode %s\n", mode_names[mcu->mode]);
+    printf("duration_s %.3f\n", elapsed_us / 1e6);
+    printf("usb_bytes %llu\n", (unsigned long long)mcu->usb_bytes);
+    printf("usb_packets %llu\n", (unsigned long long)mcu->usb_packets);
+    printf("usb_kbps %.1f\n", mcu->usb_bytes * 8 / (elapsed_us / 1e6) / 1000);
+    printf("nak_packets %llu\n", (unsigned long long)mcu->nak_packets);
+    printf("frames %llu\n", (unsigned long long)mcu->frames);
+    printf("fps %.2f\n", mcu->frames > 1 ? (mcu->frames - 1) / (span_us / 1e6) : 0.0);
+    printf("draw_us_mean %.1f\n", mcu->frames ? mcu->draw_us_total / mcu->frames : 0.0);
+    printf("draw_us_max %.1f\n", mcu->draw_us_max);
+    printf("frame_interval_us_max %.1f\n", mcu->interval_us_max);
+    printf("tears %llu\n", (unsigned long long)mcu->tears);
+    printf("overflows %llu\n", (unsigned long long)mcu->overflows);
+    printf("stream_errors %llu\n", (unsigned long long)mcu->stream_errors);
+    printf("port_resets %llu\n", (unsigned long long)mcu->port_resets);
+}
+
+/** Returns the master. The slave is left closed so the server opening it can be noticed. */
+static int open_pty(char* name, size_t name_size)
+{
+    int master = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    if (master == -1 || grantpt(master) != 0 || unlockpt(master) != 0
+        || ptsname_r(master, name, name_size) != 0)
+    {
+        perror("pty");
+        return -1;
+    }
+    /** Raw from the start, in case the server does not set it */
+    int slave = open(name, O_RDWR | O_NOCTTY);
+    if (slave == -1)
+    {
+        perror("pty slave");
+        return -1;
+    }
+    struct termios tty;
+    if (tcgetattr(slave, &tty) == 0)
+    {
+        cfmakeraw(&tty);
+        tcsetattr(slave, TCSANOW, &tty);
+    }
+    close(slave);
+    return master;
+}
+
+static int parse_mode(const char* text)
+{
+    if (strcmp(text, "raw") == 0)
+    {
+        return FRAME_COMPRESSION_NONE;
+    }
+    if (strcmp(text, "kmeans") == 0)
+    {
+        return FRAME_COMPRESSION_K_MEANS;
+    }
+    if (strcmp(text, "delta") == 0)
+    {
+        return FRAME_COMPRESSION_TILE_DELTA;
+    }
+    return -1;
+}
+
+static double now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
@@ -1,16 +1,43 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <math.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
 #include "../../common/color_conversion.h"
 #include "../../common/k_means_compression.h"
 #include "../../common/bmp.h"
+#include "../../common/cpu_dispatch.h"
+#include "../../common/frame_hash.h"
 #include "../../common/image.h"
+#include "../../common/plane_scale.h"
 #include "cpu_cycle_counter.h"
 
 #define COLOR_PALETTE_SIZE 32
+/** The histogram engine quantizes colors, it may be this much worse than the plain engine */
+#define HISTOGRAM_ERROR_MARGIN 0.15
 
 static int seed_random();
 static int save_data_to_file(const char* filename, const void* data, size_t size);
+static double mean_error(const image_t* image, const color_palette_image_t* compressed);
+static int check_parallel_engine(const image_t* image);
+static int check_hamerly_engine(const image_t* image);
+static int check_contexts(const image_t* image);
+static int check_planar(const image_t* image);
+static int check_fused_conversion(const image_t* image);
+static int check_packing();
+static int check_rgb565();
+static int check_frame_hash();
+static int check_plane_scale();
+
+typedef struct
+{
+    k_means_ctx_t* ctx;
+    const image_t* image;
+    color_palette_image_t* result;
+    int iterations;
+} context_run_t;
 
 int main(int argc, char const *argv[])
 {
@@ -58,10 +85,79 @@ int main(int argc, char const *argv[])
         printf("cycles per (pixel * iteration): %f\n", (double)cycles / (iterations * original->width * original->height));
     }
 
+    double plain_error = mean_error(original, compressed);
+    printf("mean error: %f\n\n", plain_error);
+
     paint_color_palette_image(compressed, dst);
     ycbcr_image_to_bgr(dst, dst);
     dump_image_to_bmp("../../output/desktop.bmp", dst);
 
+    /** Same image through the histogram engine */
+    color_palette_image_t* histogram_compressed = color_palette_image_new(COLOR_PALETTE_SIZE, original->width, original->height);
+    if (!histogram_compressed)
+    {
+        return 1;
+    }
+    if (cpu_counter >= 0)
+    {
+        cpu_cycle_counter_reset(cpu_counter);
+    }
+    iterations = k_means_histogram_compression(original, COLOR_PALETTE_SIZE, histogram_compressed, false);
+    if (cpu_counter >= 0)
+    {
+        long long cycles = cpu_cycle_counter_get_result(cpu_counter);
+        printf("Histogram k-means compression took %d iterations and %lld cycles\n", iterations, cycles);
+        printf("cycles per pixel: %f\n", (double)cycles / (original->width * original->height));
+    }
+    double histogram_error = mean_error(original, histogram_compressed);
+    printf("mean error: %f\n\n", histogram_error);
+    if (iterations < 0 || histogram_error > plain_error * (1 + HISTOGRAM_ERROR_MARGIN))
+    {
+        fprintf(stderr, "Histogram k-means failed or is too far off k_means_compression\n");
+        return 1;
+    }
+    paint_color_palette_image(histogram_compressed, dst);
+    ycbcr_image_to_bgr(dst, dst);
+    dump_image_to_bmp("../../output/desktop_histogram.bmp", dst);
+    color_palette_image_free(histogram_compressed);
+
+    if (check_parallel_engine(original) != 0)
+    {
+        return 1;
+    }
+    if (check_hamerly_engine(original) != 0)
+    {
+        return 1;
+    }
+    if (check_contexts(original) != 0)
+    {
+        return 1;
+    }
+    if (check_planar(original) != 0)
+    {
+        return 1;
+    }
+    if (check_fused_conversion(original) != 0)
+    {
+        return 1;
+    }
+    if (check_packing() != 0)
+    {
+        return 1;
+    }
+    if (check_rgb565() != 0)
+    {
+        return 1;
+    }
+    if (check_frame_hash() != 0)
+    {
+        return 1;
+    }
+    if (check_plane_scale() != 0)
+    {
+        return 1;
+    }
+
     /** compress again with compressed as hint. */
     k_means_compression(original, COLOR_PALETTE_SIZE, compressed, true);
     paint_color_palette_image(compressed, dst);
@@ -120,3 +216,597 @@ static int save_data_to_file(const char* filename, const void* data, size_t size
     return 0;
 }
 
+/** A deterministic pool must give the same palette and indexes with one thread and with several */
+static int check_parallel_engine(const image_t* image)
+{
+    unsigned int seed = rand();
+    k_means_pool_t* pools[2] = { k_means_pool_new(1, true), k_means_pool_new(4, true) };
+    color_palette_image_t* results[2] = {
+        color_palette_image_new(COLOR_PALETTE_SIZE, image->width, image->height),
+        color_palette_image_new(COLOR_PALETTE_SIZE, image->width, image->height),
+    };
+    int rc = -1;
+    if (!pools[0] || !pools[1] || !results[0] || !results[1])
+    {
+        goto out;
+    }
+    int iterations[2];
+    for (int i = 0; i < 2; i++)
+    {
+        srand(seed);
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        iterations[i] = k_means_parallel_compression(pools[i], image, COLOR_PALETTE_SIZE, results[i], false);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        printf("Parallel k-means compression (%s) took %d iterations and %.3f ms\n",
+            i == 0 ? "1 thread" : "4 threads", iterations[i],
+            (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
+    }
+    size_t n_pixels = image->width * image->height;
+    if (iterations[0] < 0
+        || iterations[0] != iterations[1]
+        || memcmp(results[0]->color_palettes, results[1]->color_palettes, COLOR_PALETTE_SIZE * sizeof(pixel_t)) != 0
+        || memcmp(results[0]->pixel_indexs, results[1]->pixel_indexs, n_pixels * sizeof(uint8_t)) != 0)
+    {
+        fprintf(stderr, "Parallel k-means depends on the number of threads\n");
+        goto out;
+    }
+    printf("mean error: %f\n\n", mean_error(image, results[0]));
+    rc = 0;
+out:
+    k_means_pool_free(pools[0]);
+    k_means_pool_free(pools[1]);
+    color_palette_image_free(results[0]);
+    color_palette_image_free(results[1]);
+    return rc;
+}
+
+/**
+ * The bounds must not change the result.
+ * The fast16/32 kernels break ties toward the last center, so both engines run scalar.
+ */
+static int check_hamerly_engine(const image_t* image)
+{
+    unsigned int seed = rand();
+    color_palette_image_t* results[2] = {
+        color_palette_image_new(COLOR_PALETTE_SIZE, image->width, image->height),
+        color_palette_image_new(COLOR_PALETTE_SIZE, image->width, image->height),
+    };
+    int rc = -1;
+    cpu_isa_t isa = cpu_isa_get();
+    if (!results[0] || !results[1])
+    {
+        goto out;
+    }
+    cpu_isa_force(CPU_ISA_SCALAR);
+    int iterations[2];
+    for (int i = 0; i < 2; i++)
+    {
+        srand(seed);
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        iterations[i] = i == 0
+            ? k_means_compression(image, COLOR_PALETTE_SIZE, results[i], false)
+            : k_means_hamerly_compression(image, COLOR_PALETTE_SIZE, results[i], false);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        printf("%s k-means compression (scalar) took %d iterations and %.3f ms\n",
+            i == 0 ? "Plain" : "Hamerly", iterations[i],
+            (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
+    }
+    size_t n_pixels = image->width * image->height;
+    if (iterations[0] < 0
+        || iterations[0] != iterations[1]
+        || memcmp(results[0]->color_palettes, results[1]->color_palettes, COLOR_PALETTE_SIZE * sizeof(pixel_t)) != 0
+        || memcmp(results[0]->pixel_indexs, results[1]->pixel_indexs, n_pixels * sizeof(uint8_t)) != 0)
+    {
+        fprintf(stderr, "Hamerly k-means differs from k_means_compression\n");
+        goto out;
+    }
+    printf("mean error: %f\n\n", mean_error(image, results[1]));
+    rc = 0;
+out:
+    cpu_isa_force(isa);
+    color_palette_image_free(results[0]);
+    color_palette_image_free(results[1]);
+    return rc;
+}
+
+static void* run_context(void* arg)
+{
+    context_run_t* run = (context_run_t*)arg;
+    run->iterations = k_means_ctx_run(run->ctx, run->image, run->result, false);
+    return NULL;
+}
+
+/** Contexts with the same seed give the same result, also when they run at the same time */
+static int check_contexts(const image_t* image)
+{
+    context_run_t runs[3];
+    memset(runs, 0, sizeof(runs));
+    int rc = -1;
+    for (int i = 0; i < 3; i++)
+    {
+        runs[i].image = image;
+        runs[i].ctx = k_means_ctx_new(K_MEANS_ENGINE_PLAIN, COLOR_PALETTE_SIZE, image->width, image->height, NULL);
+        runs[i].result = color_palette_image_new(COLOR_PALETTE_SIZE, image->width, image->height);
+        if (!runs[i].ctx || !runs[i].result)
+        {
+            goto out;
+        }
+        k_means_ctx_seed(runs[i].ctx, 42);
+    }
+    /** The first one alone is the reference */
+    run_context(&runs[0]);
+    pthread_t threads[2];
+    int n_threads = 0;
+    while (n_threads < 2 && pthread_create(&threads[n_threads], NULL, run_context, &runs[n_threads + 1]) == 0)
+    {
+        n_threads++;
+    }
+    /** The contexts are freed below, whatever was started must be done with them */
+    for (int i = 0; i < n_threads; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    if (n_threads != 2)
+    {
+        goto out;
+    }
+    size_t n_pixels = image->width * image->height;
+    for (int i = 1; i < 3; i++)
+    {
+        if (runs[0].iterations < 0
+            || runs[i].iterations != runs[0].iterations
+            || memcmp(runs[i].result->color_palettes, runs[0].result->color_palettes, COLOR_PALETTE_SIZE * sizeof(pixel_t)) != 0
+            || memcmp(runs[i].result->pixel_indexs, runs[0].result->pixel_indexs, n_pixels * sizeof(uint8_t)) != 0)
+        {
+            fprintf(stderr, "Concurrent k-means contexts disagree\n");
+            goto out;
+        }
+    }
+    printf("Concurrent k-means contexts took %d iterations\n", runs[0].iterations);
+    printf("mean error: %f\n\n", mean_error(image, runs[0].result));
+    rc = 0;
+out:
+    for (int i = 0; i < 3; i++)
+    {
+        k_means_ctx_free(runs[i].ctx);
+        color_palette_image_free(runs[i].result);
+    }
+    return rc;
+}
+
+/** Largest difference between a planar and a packed image, -1 if their sizes differ */
+static int planar_difference(const planar_image_t* planar, const image_t* packed)
+{
+    image_t* unpacked = image_new(planar->width, planar->height);
+    if (!unpacked || planar_to_image(planar, unpacked) != 0 || packed->width != planar->width || packed->height != planar->height)
+    {
+        image_free(unpacked);
+        return -1;
+    }
+    int max = 0;
+    for (size_t i = 0; i < packed->width * packed->height * sizeof(pixel_t); i++)
+    {
+        int diff = abs((int)((const uint8_t*)unpacked->pixels)[i] - (int)((const uint8_t*)packed->pixels)[i]);
+        max = diff > max ? diff : max;
+    }
+    image_free(unpacked);
+    return max;
+}
+
+/**
+ * The planar kernels against the packed ones.
+ * Conversions may round halves differently and differ by one. k-means and paint must match exactly.
+ */
+static int check_planar(const image_t* image)
+{
+    size_t n_pixels = image->width * image->height;
+    planar_image_t* planar = planar_image_new(image->width, image->height);
+    image_t* packed = image_new(image->width, image->height);
+    color_palette_image_t* results[2] = {
+        color_palette_image_new(COLOR_PALETTE_SIZE, image->width, image->height),
+        color_palette_image_new(COLOR_PALETTE_SIZE, image->width, image->height),
+    };
+    k_means_ctx_t* ctx = k_means_ctx_new(K_MEANS_ENGINE_PLAIN, COLOR_PALETTE_SIZE, image->width, image->height, NULL);
+    int rc = -1;
+    cpu_isa_t isa = cpu_isa_get();
+    if (!planar || !packed || !results[0] || !results[1] || !ctx || image_to_planar(image, planar) != 0)
+    {
+        goto out;
+    }
+    memcpy(packed->pixels, image->pixels, n_pixels * sizeof(pixel_t));
+    ycbcr_image_to_bgr(packed, packed);
+    planar_ycbcr_to_bgr(planar, planar);
+    int diff_bgr = planar_difference(planar, packed);
+    bgr_image_to_ycbcr(packed, packed);
+    planar_bgr_to_ycbcr(planar, planar);
+    int diff_ycbcr = planar_difference(planar, packed);
+    if (diff_bgr < 0 || diff_bgr > 1 || diff_ycbcr < 0 || diff_ycbcr > 1)
+    {
+        fprintf(stderr, "Planar color conversion differs by %d and %d\n", diff_bgr, diff_ycbcr);
+        goto out;
+    }
+
+    /** Scalar on both sides, the packed fast kernels break ties differently */
+    image_to_planar(image, planar);
+    cpu_isa_force(CPU_ISA_SCALAR);
+    int iterations[2];
+    k_means_ctx_seed(ctx, 42);
+    iterations[0] = k_means_ctx_run(ctx, image, results[0], false);
+    k_means_ctx_seed(ctx, 42);
+    iterations[1] = k_means_ctx_run_planar(ctx, planar, results[1], false);
+    if (iterations[0] < 0
+        || iterations[0] != iterations[1]
+        || memcmp(results[0]->color_palettes, results[1]->color_palettes, COLOR_PALETTE_SIZE * sizeof(pixel_t)) != 0
+        || memcmp(results[0]->pixel_indexs, results[1]->pixel_indexs, n_pixels * sizeof(uint8_t)) != 0)
+    {
+        fprintf(stderr, "Planar k-means differs from packed k-means\n");
+        goto out;
+    }
+    cpu_isa_force(isa);
+    /** The vector kernels only have to converge to something as good */
+    k_means_ctx_seed(ctx, 42);
+    int vector_iterations = k_means_ctx_run_planar(ctx, planar, results[1], false);
+    if (vector_iterations < 0)
+    {
+        goto out;
+    }
+    printf("Planar k-means took %d iterations\n", vector_iterations);
+    printf("mean error: %f\n\n", mean_error(image, results[1]));
+
+    paint_color_palette_image(results[0], packed);
+    if (paint_color_palette_planar(results[0], planar) != 0 || planar_difference(planar, packed) != 0)
+    {
+        fprintf(stderr, "Planar paint differs from packed paint\n");
+        goto out;
+    }
+    rc = 0;
+out:
+    cpu_isa_force(isa);
+    k_means_ctx_free(ctx);
+    color_palette_image_free(results[0]);
+    color_palette_image_free(results[1]);
+    image_free(packed);
+    planar_image_free(planar);
+    return rc;
+}
+
+/**
+ * k_means_ctx_run_bgr must convert exactly like bgr_image_to_ycbcr and cluster like k_means_ctx_run.
+ * The plain engine sums the error per block, so only the engines with the same summation order are compared.
+ */
+static int check_fused_conversion(const image_t* image)
+{
+    static const k_means_engine_t engines[] = { K_MEANS_ENGINE_HISTOGRAM, K_MEANS_ENGINE_PARALLEL, K_MEANS_ENGINE_PLAIN };
+    static const char* names[] = { "histogram", "parallel", "plain" };
+    size_t n_pixels = image->width * image->height;
+    k_means_pool_t* pool = k_means_pool_new(2, true);
+    image_t* bgr = image_new(image->width, image->height);
+    image_t* converted[2] = { image_new(image->width, image->height), image_new(image->width, image->height) };
+    color_palette_image_t* results[2] = {
+        color_palette_image_new(COLOR_PALETTE_SIZE, image->width, image->height),
+        color_palette_image_new(COLOR_PALETTE_SIZE, image->width, image->height),
+    };
+    k_means_ctx_t* ctx = NULL;
+    int rc = -1;
+    if (!pool || !bgr || !converted[0] || !converted[1] || !results[0] || !results[1])
+    {
+        goto out;
+    }
+    ycbcr_image_to_bgr(image, bgr);
+    bgr_image_to_ycbcr(bgr, converted[0]);
+    for (size_t e = 0; e < sizeof(engines) / sizeof(engines[0]); e++)
+    {
+        ctx = k_means_ctx_new(engines[e], COLOR_PALETTE_SIZE, image->width, image->height, pool);
+        if (!ctx)
+        {
+            goto out;
+        }
+        int iterations[2];
+        k_means_ctx_seed(ctx, 42);
+        iterations[0] = k_means_ctx_run(ctx, converted[0], results[0], false);
+        k_means_ctx_seed(ctx, 42);
+        memset(converted[1]->pixels, 0, n_pixels * sizeof(pixel_t));
+        iterations[1] = k_means_ctx_run_bgr(ctx, bgr, converted[1], results[1], false);
+        if (iterations[0] < 0 || iterations[1] < 0
+            || memcmp(converted[0]->pixels, converted[1]->pixels, n_pixels * sizeof(pixel_t)) != 0)
+        {
+            fprintf(stderr, "Fused %s k-means converted differently\n", names[e]);
+            goto out;
+        }
+        if (engines[e] != K_MEANS_ENGINE_PLAIN
+            && (iterations[0] != iterations[1]
+            || memcmp(results[0]->color_palettes, results[1]->color_palettes, COLOR_PALETTE_SIZE * sizeof(pixel_t)) != 0
+            || memcmp(results[0]->pixel_indexs, results[1]->pixel_indexs, n_pixels * sizeof(uint8_t)) != 0))
+        {
+            fprintf(stderr, "Fused %s k-means differs from k_means_ctx_run\n", names[e]);
+            goto out;
+        }
+        printf("Fused %s k-means took %d iterations, mean error: %f\n", names[e], iterations[1], mean_error(converted[1], results[1]));
+        k_means_ctx_free(ctx);
+        ctx = NULL;
+    }
+    printf("\n");
+    rc = 0;
+out:
+    k_means_ctx_free(ctx);
+    k_means_pool_free(pool);
+    image_free(bgr);
+    image_free(converted[0]);
+    image_free(converted[1]);
+    color_palette_image_free(results[0]);
+    color_palette_image_free(results[1]);
+    return rc;
+}
+
+/** Every packer against a plain bit loop, LSB first like lcd_draw_image reads them, for widths 1 to 8 */
+static int check_packing()
+{
+    static const int ks[] = { 2, 3, 4, 5, 8, 9, 16, 17, 32, 33, 64, 65, 128, 129, 255, 256 };
+    static const size_t sizes[][2] = { { 160, 80 }, { 13, 7 }, { 3, 1 } };
+    cpu_isa_t isa = cpu_isa_get();
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+    {
+        for (size_t i = 0; i < sizeof(ks) / sizeof(ks[0]); i++)
+        {
+            int k = ks[i];
+            size_t width = sizes[s][0], height = sizes[s][1];
+            color_palette_image_t* palette = color_palette_image_new(k, width, height);
+            packed_color_palette_image_t* packed = packed_color_palette_image_new(k, width, height);
+            uint8_t* expected = calloc(1, packed ? packed->size : 1);
+            bool ok = palette && packed && expected;
+            if (ok)
+            {
+                memset(palette->color_palettes, 0, k * sizeof(pixel_t));
+                int bits = 0;
+                for (int n = k - 1; n != 0; n >>= 1)
+                {
+                    bits++;
+                }
+                size_t bit = 0;
+                for (size_t p = 0; p < width * height; p++)
+                {
+                    palette->pixel_indexs[p] = rand() % k;
+                    for (int b = 0; b < bits; b++, bit++)
+                    {
+                        expected[k * 2 + bit / 8] |= ((palette->pixel_indexs[p] >> b) & 1) << (bit % 8);
+                    }
+                }
+                for (int level = 0; level < CPU_ISA_COUNT && ok; level++)
+                {
+                    cpu_isa_force((cpu_isa_t)level);
+                    memset(packed->data, 0xA5, packed->size);
+                    ok = pack_color_palette_image(palette, packed) == 0
+                        && memcmp(packed->data, expected, packed->size) == 0;
+                }
+                if (k < COLOR_PALETTE_MAX_K)
+                {
+                    palette->pixel_indexs[width * height - 1] = k;
+                    ok = ok && pack_color_palette_image(palette, packed) != 0;
+                }
+            }
+            cpu_isa_force(isa);
+            color_palette_image_free(palette);
+            packed_color_palette_image_free(packed);
+            free(expected);
+            if (!ok)
+            {
+                fprintf(stderr, "Packing %zux%zu with k %d is wrong\n", width, height, k);
+                return -1;
+            }
+        }
+    }
+    printf("Packing matches the bit loop at every level\n\n");
+    return 0;
+}
+
+static int check_rgb565()
+{
+    static const size_t sizes[][2] = { { 160, 80 }, { 13, 7 }, { 37, 5 }, { 65, 2 }, { 3, 1 } };
+    static const int bayer[4][4] = {
+        { 0, 8, 2, 10 },
+        { 12, 4, 14, 6 },
+        { 3, 11, 1, 9 },
+        { 15, 7, 13, 5 },
+    };
+    cpu_isa_t isa = cpu_isa_get();
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+    {
+        size_t width = sizes[s][0], height = sizes[s][1];
+        image_t* image = image_new(width, height);
+        rgb565_image_t* result = rgb565_image_new(width * height);
+        uint16_t* expected = malloc(width * height * sizeof(uint16_t));
+        bool ok = image && result && expected;
+        for (size_t p = 0; ok && p < width * height; p++)
+        {
+            /** Plenty of saturated channels for the dither to clip */
+            image->pixels[p].bgr.b = rand() % 4 == 0 ? 255 : rand() % 256;
+            image->pixels[p].bgr.g = rand() % 4 == 0 ? 254 : rand() % 256;
+            image->pixels[p].bgr.r = rand() % 256;
+        }
+        for (unsigned flags = 0; ok && flags <= (RGB565_DITHER | RGB565_BIG_ENDIAN); flags++)
+        {
+            for (size_t y = 0; y < height; y++)
+            {
+                for (size_t x = 0; x < width; x++)
+                {
+                    const bgr_pixel_t* pixel = &image->pixels[y * width + x].bgr;
+                    int d = flags & RGB565_DITHER ? bayer[y % 4][x % 4] : 0;
+                    int r = pixel->r + d / 2, g = pixel->g + d / 4, b = pixel->b + d / 2;
+                    rgb565_pixel_t color = {
+                        .b = (b > 255 ? 255 : b) >> 3,
+                        .g = (g > 255 ? 255 : g) >> 2,
+                        .r = (r > 255 ? 255 : r) >> 3,
+                    };
+                    uint16_t value;
+                    memcpy(&value, &color, sizeof(value));
+                    expected[y * width + x] = flags & RGB565_BIG_ENDIAN ? (uint16_t)(value << 8 | value >> 8) : value;
+                }
+            }
+            for (int level = 0; level < CPU_ISA_COUNT && ok; level++)
+            {
+                cpu_isa_force((cpu_isa_t)level);
+                memset(result->pixels, 0xA5, width * height * sizeof(rgb565_pixel_t));
+                ok = bgr_image_to_rgb565_ex(image, result, flags) == 0
+                    && memcmp(result->pixels, expected, width * height * sizeof(uint16_t)) == 0;
+                if (!ok)
+                {
+                    fprintf(stderr, "RGB565 %zux%zu with flags %u is wrong at level %d\n", width, height, flags, level);
+                }
+            }
+        }
+        cpu_isa_force(isa);
+        image_free(image);
+        rgb565_image_free(result);
+        free(expected);
+        if (!ok)
+        {
+            return -1;
+        }
+    }
+    printf("RGB565 conversion matches the per pixel fields at every level\n\n");
+    return 0;
+}
+
+/** Every level agrees, and every size, seed and single bit flip changes the hash */
+static int check_frame_hash()
+{
+    static const size_t sizes[] = { 0, 1, 63, 64, 65, 1023, 1024, 1025, 160 * 80 * 3 };
+    const size_t max_size = 160 * 80 * 3;
+    uint8_t* data = malloc(max_size);
+    if (!data)
+    {
+        return -1;
+    }
+    for (size_t i = 0; i < max_size; i++)
+    {
+        data[i] = rand();
+    }
+    cpu_isa_t isa = cpu_isa_get();
+    bool ok = true;
+    uint64_t previous = 0;
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]) && ok; s++)
+    {
+        size_t size = sizes[s];
+        cpu_isa_force(CPU_ISA_SCALAR);
+        uint64_t expected = frame_hash(data, size, 0);
+        ok = (s == 0 || expected != previous) && frame_hash(data, size, 1) != expected;
+        previous = expected;
+        for (int level = 0; level < CPU_ISA_COUNT && ok; level++)
+        {
+            cpu_isa_force((cpu_isa_t)level);
+            ok = frame_hash(data, size, 0) == expected;
+            for (int flip = 0; flip < 8 && ok && size != 0; flip++)
+            {
+                size_t bit = (size_t)rand() % (size * 8);
+                data[bit / 8] ^= 1u << (bit % 8);
+                ok = frame_hash(data, size, 0) != expected;
+                data[bit / 8] ^= 1u << (bit % 8);
+            }
+        }
+        if (!ok)
+        {
+            fprintf(stderr, "Frame hash of %zu bytes is wrong\n", size);
+        }
+    }
+    cpu_isa_force(isa);
+    free(data);
+    if (!ok)
+    {
+        return -1;
+    }
+    printf("Frame hash matches at every level and changes with every bit\n\n");
+    return 0;
+}
+
+/** Every level matches the mean of each box, computed sample by sample */
+static int check_plane_scale()
+{
+    static const int sizes[][4] = {
+        { 1920, 1080, 160, 80 }, { 960, 540, 80, 40 }, { 161, 81, 160, 80 }, { 160, 80, 160, 80 },
+        { 1700, 30, 7, 3 }, { 512, 3, 2, 1 }, { 256, 256, 1, 1 },
+    };
+    static const int invalid[][4] = { { 159, 80, 160, 80 }, { 257, 1, 1, 1 }, { 16, 16, 0, 1 } };
+    const int stride_pad = 5;
+    cpu_isa_t isa = cpu_isa_get();
+    bool ok = true;
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]) && ok; s++)
+    {
+        int src_width = sizes[s][0], src_height = sizes[s][1], dst_width = sizes[s][2], dst_height = sizes[s][3];
+        size_t src_stride = src_width + stride_pad;
+        uint8_t* src = malloc(src_stride * src_height);
+        uint8_t* expected = malloc((size_t)dst_width * dst_height);
+        uint8_t* result = malloc((size_t)dst_width * dst_height);
+        ok = src && expected && result;
+        for (size_t i = 0; ok && i < src_stride * src_height; i++)
+        {
+            /** Mostly extremes, so the sums come close to overflowing */
+            src[i] = rand() % 2 ? 255 : rand();
+        }
+        for (int dy = 0; ok && dy < dst_height; dy++)
+        {
+            int y0 = (int)((int64_t)dy * src_height / dst_height), y1 = (int)((int64_t)(dy + 1) * src_height / dst_height);
+            for (int dx = 0; dx < dst_width; dx++)
+            {
+                int x0 = (int)((int64_t)dx * src_width / dst_width), x1 = (int)((int64_t)(dx + 1) * src_width / dst_width);
+                uint64_t sum = 0;
+                for (int y = y0; y < y1; y++)
+                {
+                    for (int x = x0; x < x1; x++)
+                    {
+                        sum += src[y * src_stride + x];
+                    }
+                }
+                uint64_t area = (uint64_t)(x1 - x0) * (y1 - y0);
+                expected[dy * dst_width + dx] = (sum + area / 2) / area;
+            }
+        }
+        for (int level = 0; level < CPU_ISA_COUNT && ok; level++)
+        {
+            cpu_isa_force((cpu_isa_t)level);
+            memset(result, 0xA5, (size_t)dst_width * dst_height);
+            ok = plane_area_downscale(src, src_stride, src_width, src_height, result, dst_width, dst_width, dst_height) == 0
+                && memcmp(result, expected, (size_t)dst_width * dst_height) == 0;
+            if (!ok)
+            {
+                fprintf(stderr, "Area downscale %dx%d to %dx%d is wrong at level %d\n", src_width, src_height, dst_width, dst_height, level);
+            }
+        }
+        free(src);
+        free(expected);
+        free(result);
+    }
+    cpu_isa_force(isa);
+    uint8_t sample = 0;
+    for (size_t s = 0; s < sizeof(invalid) / sizeof(invalid[0]) && ok; s++)
+    {
+        ok = plane_area_downscale(&sample, invalid[s][0], invalid[s][0], invalid[s][1], &sample, 1, invalid[s][2], invalid[s][3]) == -1;
+        if (!ok)
+        {
+            fprintf(stderr, "Area downscale %dx%d to %dx%d is not rejected\n", invalid[s][0], invalid[s][1], invalid[s][2], invalid[s][3]);
+        }
+    }
+    if (!ok)
+    {
+        return -1;
+    }
+    printf("Area downscale matches the box means at every level\n\n");
+    return 0;
+}
+
+/** Average distance between each pixel and its palette color */
+static double mean_error(const image_t* image, const color_palette_image_t* compressed)
+{
+    double error = 0;
+    for (size_t i = 0; i < image->width * image->height; i++)
+    {
+        const ycbcr_pixel_t* pixel = &image->pixels[i].ycbcr;
+        const ycbcr_pixel_t* color = &compressed->color_palettes[compressed->pixel_indexs[i]].ycbcr;
+        double y_diff = (double)pixel->y - color->y;
+        double cb_diff = (double)pixel->cb - color->cb;
+        double cr_diff = (double)pixel->cr - color->cr;
+        error += sqrt(y_diff * y_diff + cb_diff * cb_diff + cr_diff * cr_diff);
+    }
+    return error / (image->width * image->height);
+}
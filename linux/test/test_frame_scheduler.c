@@ -0,0 +1,64 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "../server/frame_scheduler.h"
+
+#define MS(x) ((uint64_t)(x) * 1000000ull)
+
+static int expect_deadline(const frame_scheduler_t* scheduler, uint64_t expected, const char* step);
+
+int main(int argc, char const *argv[])
+{
+    frame_scheduler_t* scheduler = frame_scheduler_new(MS(10));
+    if (!scheduler)
+    {
+        return 1;
+    }
+    int rc = 0;
+
+    /** Nothing encoded yet, due right away */
+    rc |= expect_deadline(scheduler, 0, "initial");
+
+    /** The first sample is taken as is: encode 4ms, interval is the minimal one */
+    frame_scheduler_encoded(scheduler, MS(1), MS(5));
+    rc |= expect_deadline(scheduler, MS(1) + MS(10), "first encode");
+
+    /** A drain slower than the minimal interval becomes the interval */
+    frame_scheduler_write_started(scheduler, MS(6));
+    frame_scheduler_write_done(scheduler, MS(30), true);
+    rc |= expect_deadline(scheduler, MS(1) + MS(24), "first drain");
+
+    /** While busy, the encode finishes when the device is expected to be free: 40 + 24 - 4 */
+    frame_scheduler_write_started(scheduler, MS(40));
+    rc |= expect_deadline(scheduler, MS(60), "busy device");
+
+    /** A lost write does not teach the drain time */
+    frame_scheduler_write_done(scheduler, MS(100), false);
+    rc |= expect_deadline(scheduler, MS(1) + MS(24), "lost write");
+
+    /** Later samples weigh 1/8: 4 + (12 - 4) / 8 = 5ms. Busy again: 110 + 24 - 5 */
+    frame_scheduler_encoded(scheduler, MS(100), MS(112));
+    rc |= expect_deadline(scheduler, MS(100) + MS(24), "second encode");
+    frame_scheduler_write_started(scheduler, MS(110));
+    rc |= expect_deadline(scheduler, MS(129), "encode average");
+
+    frame_scheduler_free(scheduler);
+    if (rc != 0)
+    {
+        printf("FAILED\n");
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}
+
+static int expect_deadline(const frame_scheduler_t* scheduler, uint64_t expected, const char* step)
+{
+    uint64_t deadline = frame_scheduler_deadline(scheduler);
+    if (deadline != expected)
+    {
+        printf("%s: deadline %llu ns, expected %llu ns\n", step, (unsigned long long)deadline, (unsigned long long)expected);
+        return -1;
+    }
+    return 0;
+}
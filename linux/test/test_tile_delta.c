@@ -0,0 +1,188 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "../../common/bmp.h"
+#include "../../common/image.h"
+#include "../../common/tile_delta.h"
+
+#define N_MOVING_FRAMES 60
+
+typedef struct
+{
+    tile_delta_encoder_t* encoder;
+    tile_delta_decoder_t* decoder;
+    rgb565_image_t* frame;
+    size_t packets;
+    size_t bytes;
+} session_t;
+
+static int run_tile_size(const image_t* background, int tile_size);
+static int send_frame(session_t* session, const image_t* image, bool lost);
+static void fill_rect(image_t* image, size_t x, size_t y, size_t w, size_t h, uint8_t shade);
+
+int main(int argc, char const *argv[])
+{
+    /** Reproducible USB packet splits */
+    srand(1);
+
+    image_t* background = load_24bit_bmp("../../resource/desktop.bmp");
+    if (!background)
+    {
+        return 1;
+    }
+    int rc = run_tile_size(background, 16);
+    if (rc == 0)
+    {
+        rc = run_tile_size(background, 8);
+    }
+    image_free(background);
+    if (rc != 0)
+    {
+        printf("FAILED\n");
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}
+
+static int run_tile_size(const image_t* background, int tile_size)
+{
+    size_t raw_size = background->width * background->height * sizeof(rgb565_pixel_t);
+    session_t session;
+    memset(&session, 0, sizeof(session));
+    session.encoder = tile_delta_encoder_new(background->width, background->height, tile_size);
+    session.decoder = tile_delta_decoder_new(background->width, background->height);
+    session.frame = rgb565_image_new(background->width * background->height);
+    image_t* image = image_new(background->width, background->height);
+    if (!session.encoder || !session.decoder || !session.frame || !image)
+    {
+        return -1;
+    }
+    memcpy(image->pixels, background->pixels, image->width * image->height * sizeof(pixel_t));
+    int rc = -1;
+    printf("Tile size %d\n", tile_size);
+
+    /** The first frame is sent in full */
+    if (send_frame(&session, image, false) != 0)
+    {
+        goto done;
+    }
+    printf("\tfull frame: %zu bytes (raw %zu)\n", session.bytes, raw_size);
+
+    /** Nothing changed, nothing sent */
+    size_t packets = session.packets;
+    if (send_frame(&session, image, false) != 0 || session.packets != packets)
+    {
+        printf("\tunchanged frame produced a packet\n");
+        goto done;
+    }
+
+    /** A small widget moving over a static desktop */
+    session.bytes = 0;
+    session.packets = 0;
+    for (int i = 0; i < N_MOVING_FRAMES; i++)
+    {
+        memcpy(image->pixels, background->pixels, image->width * image->height * sizeof(pixel_t));
+        fill_rect(image, (i * 3) % (image->width - 12), 30 + i % 7, 12, 9, (uint8_t)(i * 4));
+        /** A clock in the corner ticking every few frames */
+        fill_rect(image, image->width - 20, 2, 18, 7, (uint8_t)((i / 10) * 40));
+        if (send_frame(&session, image, false) != 0)
+        {
+            goto done;
+        }
+    }
+    printf("\tmoving widget: %.1f bytes/frame, %.1fx smaller than raw\n",
+        (double)session.bytes / N_MOVING_FRAMES,
+        (double)raw_size * N_MOVING_FRAMES / session.bytes);
+
+    /** A lost packet. Both sides start over, like after the device reopens. */
+    fill_rect(image, 5, 5, 40, 20, 0x80);
+    if (send_frame(&session, image, true) != 0)
+    {
+        goto done;
+    }
+    tile_delta_decoder_reset(session.decoder);
+    tile_delta_encoder_reset(session.encoder);
+    fill_rect(image, 60, 50, 10, 10, 0x20);
+    session.bytes = 0;
+    if (send_frame(&session, image, false) != 0)
+    {
+        goto done;
+    }
+    if (session.bytes < raw_size)
+    {
+        printf("\tframe after reset was not sent in full\n");
+        goto done;
+    }
+    printf("\tdecoded %zu frames, %zu windows, %zu pixels\n",
+        session.decoder->frames, session.decoder->windows, session.decoder->pixels);
+    rc = 0;
+done:
+    image_free(image);
+    rgb565_image_free(session.frame);
+    tile_delta_decoder_free(session.decoder);
+    tile_delta_encoder_free(session.encoder);
+    return rc;
+}
+
+/** Encodes image, feeds it to the decoder in random sized pieces unless lost, then checks the decoded frame */
+static int send_frame(session_t* session, const image_t* image, bool lost)
+{
+    if (bgr_image_to_rgb565(image, session->frame) != 0)
+    {
+        return -1;
+    }
+    const uint8_t* data = NULL;
+    size_t size = 0;
+    if (tile_delta_encode(session->encoder, session->frame, &data, &size) != 0)
+    {
+        printf("\tencode failed\n");
+        return -1;
+    }
+    if (size != 0)
+    {
+        session->packets++;
+        session->bytes += size;
+    }
+    if (lost)
+    {
+        return 0;
+    }
+    size_t offset = 0;
+    while (offset < size)
+    {
+        /** Not always even, so pixels get split between USB packets */
+        size_t piece = 1 + rand() % 97;
+        if (piece > size - offset)
+        {
+            piece = size - offset;
+        }
+        if (tile_delta_decoder_feed(session->decoder, data + offset, piece) != 0)
+        {
+            printf("\tdecoder rejected the stream at byte %zu\n", offset);
+            return -1;
+        }
+        offset += piece;
+    }
+    if (memcmp(session->decoder->frame->pixels, session->frame->pixels, session->frame->size * sizeof(rgb565_pixel_t)) != 0)
+    {
+        printf("\tdecoded frame does not match\n");
+        return -1;
+    }
+    return 0;
+}
+
+static void fill_rect(image_t* image, size_t x, size_t y, size_t w, size_t h, uint8_t shade)
+{
+    for (size_t row = y; row < y + h && row < image->height; row++)
+    {
+        for (size_t col = x; col < x + w && col < image->width; col++)
+        {
+            pixel_t* pixel = &image->pixels[row * image->width + col];
+            pixel->bgr.b = shade;
+            pixel->bgr.g = 255 - shade;
+            pixel->bgr.r = shade ^ 0x5A;
+        }
+    }
+}